@@ -0,0 +1,357 @@
+#include "AsyncExits.h"
+
+#include <string.h>
+
+#include <chrono>
+#include <thread>
+
+#include "MachineClock.h"
+
+// Yields before a waiting processor thread goes to sleep, as most completions
+// come back within microseconds
+static const int SPIN_ROUNDS = 64;
+
+void Doorbell::Wait(UINT32 seen, UINT64 deadline)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	sleeping = true;
+	while (rings.load() == seen) {
+		UINT64 now = MachineClock::Now();
+		if (now >= deadline) {
+			break;
+		}
+		condition.wait_for(lock, std::chrono::nanoseconds(deadline - now));
+	}
+	sleeping = false;
+}
+
+AsyncExits::AsyncExits(unsigned int* params)
+	: pUnalignedBuffer(std::make_unique<unsigned char[]>(2 * RING_BYTES + 4096)),
+	requests(Buffer(), ENTRIES), responses(Buffer() + RING_BYTES, ENTRIES),
+	params(params), aborted(false)
+{
+}
+
+void AsyncExits::Push(const AsyncExit& request)
+{
+	requestCounter++;
+	while (!requests.TryPush(request)) {
+		// Keep taking commands so the JS side can't block on a full response ring
+		UINT32 seen = processorBell.Sample();
+		AsyncExit e;
+		while (responses.TryPop(e)) {
+			commands.push_back(e);
+		}
+		if (aborted) {
+			return;
+		}
+		processorBell.Wait(seen, MachineClock::Now() + 1000000);
+	}
+	jsBell.Ring();
+}
+
+AsyncExit AsyncExits::WaitForCompletion()
+{
+	waitCounter++;
+	AsyncExit e;
+	for (int round = 0; ; round++) {
+		UINT32 seen = processorBell.Sample();
+		while (responses.TryPop(e)) {
+			if (e.type == AsyncCompletion) {
+				return e;
+			}
+			commands.push_back(e);
+		}
+		if (aborted) {
+			// Like a device that isn't there
+			memset(&e, 0xFF, sizeof(e));
+			return e;
+		}
+		if (round < SPIN_ROUNDS) {
+			std::this_thread::yield();
+		}
+		else {
+			processorBell.Wait(seen, MachineClock::Now() + 1000000);
+		}
+	}
+}
+
+bool AsyncExits::PopCommand(AsyncExit& command)
+{
+	if (!commands.empty()) {
+		command = commands.front();
+		commands.pop_front();
+		return true;
+	}
+	while (responses.TryPop(command)) {
+		if (command.type != AsyncCompletion) {
+			return true;
+		}
+		// A completion nobody waits for is left over from an aborted request
+	}
+	return false;
+}
+
+void AsyncExits::WaitForCommand(UINT64 deadline, const std::function<bool()>& ready)
+{
+	UINT32 seen = processorBell.Sample();
+	if (!commands.empty() || !responses.Empty() || aborted || (ready && ready())) {
+		return;
+	}
+	processorBell.Wait(seen, deadline);
+}
+
+void AsyncExits::PostCommand(const AsyncExit& command)
+{
+	while (!responses.TryPush(command)) {
+		if (aborted) {
+			return;
+		}
+		processorBell.Ring();
+		std::this_thread::yield();
+	}
+	processorBell.Ring();
+}
+
+/** Requests the processor thread waits for */
+static bool Waits(UINT32 type)
+{
+	return type == AsyncPortRead || type == AsyncPortString || type == AsyncMemoryRead || type == AsyncCpuid ||
+		type == AsyncMsr;
+}
+
+/** Calls the device model for a request and fills in its completion */
+void AsyncExits::Dispatch(PostedWrites& target, unsigned int* jsParams, const AsyncExit& request,
+	AsyncExit& completion)
+{
+	memset(&completion, 0x0, sizeof(completion));
+	completion.type = AsyncCompletion;
+
+	switch (request.type) {
+	case AsyncPortWrite:
+		if (target.IsPosted((UINT16)request.value[0])) {
+			target.Post((UINT16)request.value[0], (UINT8)request.value[1], request.value[2]);
+			break;
+		}
+		jsParams[0] = request.value[0];
+		jsParams[1] = request.value[1];
+		jsParams[2] = 1;
+		jsParams[3] = request.value[2];
+		target.PortIo();
+		break;
+	case AsyncPortRead:
+		jsParams[0] = request.value[0];
+		jsParams[1] = request.value[1];
+		jsParams[2] = 0;
+		target.PortIo();
+		completion.value[0] = jsParams[0];
+		break;
+	case AsyncPortString:
+		jsParams[0] = request.value[0];
+		jsParams[1] = request.value[1];
+		jsParams[2] = request.value[2];
+		jsParams[3] = (unsigned int)request.address;
+		jsParams[4] = request.value[3];
+		target.PortIoString();
+		break;
+	case AsyncMemoryRead:
+		jsParams[0] = (unsigned int)request.address;
+		target.MemoryRead(request.value[0] & 0xFF, request.value[0] >> 8);
+		if ((request.value[0] & 0xFF) > 4) {
+			memcpy(completion.value, jsParams + DeviceModel::WIDE_DATA_SLOT, request.value[0] & 0xFF);
+		}
+		else {
+			completion.value[0] = jsParams[0];
+		}
+		break;
+	case AsyncMemoryWrite:
+		jsParams[0] = (unsigned int)request.address;
+		if ((request.value[0] & 0xFF) > 4) {
+			memcpy(jsParams + DeviceModel::WIDE_DATA_SLOT, request.value + 1, request.value[0] & 0xFF);
+		}
+		else {
+			jsParams[1] = request.value[1];
+		}
+		target.MemoryWrite(request.value[0] & 0xFF, request.value[0] >> 8);
+		break;
+	case AsyncCpuid:
+		target.Cpuid(request.value, completion.value);
+		break;
+	case AsyncIrqLine:
+		target.Irq(request.value[0], request.value[1] != 0);
+		break;
+	case AsyncMsr: {
+		unsigned long long value = (unsigned long long)request.value[3] << 32 | request.value[2];
+		completion.value[2] = target.Msr(request.value[0], request.value[1] != 0, &value) ? 1 : 0;
+		completion.value[0] = (UINT32)value;
+		completion.value[1] = (UINT32)(value >> 32);
+		break;
+	}
+	}
+}
+
+unsigned int AsyncExits::Service(PostedWrites& target, unsigned int* jsParams, UINT64 deadline)
+{
+	unsigned int count = 0;
+	bool inBatch = false;
+	while (!aborted) {
+		UINT32 seen = jsBell.Sample();
+		AsyncExit request;
+		if (!requests.TryPop(request)) {
+			if (inBatch) {
+				target.Flush();
+				inBatch = false;
+			}
+			if (MachineClock::Now() >= deadline) {
+				break;
+			}
+			jsBell.Wait(seen, deadline);
+			continue;
+		}
+		if (!inBatch) {
+			batchCounter++;
+			inBatch = true;
+		}
+		count++;
+		processorBell.Ring();  // There's room in the request ring again
+
+		AsyncExit completion;
+		try {
+			Dispatch(target, jsParams, request, completion);
+		}
+		catch (...) {
+			// Don't leave the processor waiting for an answer that never comes
+			if (Waits(request.type)) {
+				memset(completion.value, 0xFF, sizeof(completion.value));
+				PostCommand(completion);
+			}
+			throw;
+		}
+		if (Waits(request.type)) {
+			// The processor is stopped until it has the answer, so don't hold back earlier posted writes
+			target.Flush();
+			PostCommand(completion);
+		}
+	}
+	if (inBatch) {
+		target.Flush();
+	}
+	return count;
+}
+
+void AsyncExits::Abort()
+{
+	aborted = true;
+	processorBell.Ring();
+	jsBell.Ring();
+}
+
+void AsyncExits::Reset()
+{
+	requests.Clear();
+	responses.Clear();
+	commands.clear();
+	aborted = false;
+}
+
+void AsyncExits::PortIo()
+{
+	AsyncExit e;
+	memset(&e, 0x0, sizeof(e));
+	e.value[0] = params[0];
+	e.value[1] = params[1];
+	if (params[2]) {
+		e.type = AsyncPortWrite;
+		e.value[2] = params[3];
+		Push(e);
+		return;
+	}
+	e.type = AsyncPortRead;
+	Push(e);
+	params[0] = WaitForCompletion().value[0];
+}
+
+void AsyncExits::PortIoString()
+{
+	AsyncExit e;
+	memset(&e, 0x0, sizeof(e));
+	e.type = AsyncPortString;
+	e.value[0] = params[0];
+	e.value[1] = params[1];
+	e.value[2] = params[2];
+	e.value[3] = params[4];
+	e.address = params[3];
+	Push(e);
+	WaitForCompletion();  // The guest may use (or reuse) the buffer right after the instruction
+}
+
+void AsyncExits::MemoryRead(unsigned int size, unsigned int handler)
+{
+	AsyncExit e;
+	memset(&e, 0x0, sizeof(e));
+	e.type = AsyncMemoryRead;
+	e.value[0] = size | handler << 8;
+	e.address = params[0];
+	Push(e);
+	AsyncExit c = WaitForCompletion();
+	if (size > 4) {
+		memcpy(params + WIDE_DATA_SLOT, c.value, size);
+	}
+	else {
+		params[0] = c.value[0];
+	}
+}
+
+void AsyncExits::MemoryWrite(unsigned int size, unsigned int handler)
+{
+	AsyncExit e;
+	memset(&e, 0x0, sizeof(e));
+	e.type = AsyncMemoryWrite;
+	e.value[0] = size | handler << 8;
+	if (size > 4) {
+		memcpy(e.value + 1, params + WIDE_DATA_SLOT, size);
+	}
+	else {
+		e.value[1] = params[1];
+	}
+	e.address = params[0];
+	Push(e);
+}
+
+void AsyncExits::Cpuid(const unsigned int in[4], unsigned int out[4])
+{
+	AsyncExit e;
+	memset(&e, 0x0, sizeof(e));
+	e.type = AsyncCpuid;
+	memcpy(e.value, in, 4 * sizeof(unsigned int));
+	Push(e);
+	AsyncExit c = WaitForCompletion();
+	memcpy(out, c.value, 4 * sizeof(unsigned int));
+}
+
+void AsyncExits::Irq(unsigned int line, bool level)
+{
+	AsyncExit e;
+	memset(&e, 0x0, sizeof(e));
+	e.type = AsyncIrqLine;
+	e.value[0] = line;
+	e.value[1] = level ? 1 : 0;
+	Push(e);
+}
+
+bool AsyncExits::Msr(unsigned int index, bool write, unsigned long long* value)
+{
+	AsyncExit e;
+	memset(&e, 0x0, sizeof(e));
+	e.type = AsyncMsr;
+	e.value[0] = index;
+	e.value[1] = write ? 1 : 0;
+	e.value[2] = (UINT32)*value;
+	e.value[3] = (UINT32)(*value >> 32);
+	Push(e);
+	AsyncExit c = WaitForCompletion();
+	if (!write) {
+		*value = (unsigned long long)c.value[1] << 32 | c.value[0];
+	}
+	return c.value[2] != 0;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "Counter.h"
+#include "DeviceModel.h"
+#include "PostedWrites.h"
+#include "SpscRing.h"
+#include "WinHvCompat.h"
+
+enum AsyncExitType {
+	// Requests, processor thread to JS thread
+	AsyncPortRead = 1,     // value: [0] port, [1] size
+	AsyncPortWrite,        // value: [0] port, [1] size, [2] data
+	AsyncPortString,       // value: [0] port, [1] size, [2] direction, [3] count; address: GPA
+	AsyncMemoryRead,       // value: [0] size | handler << 8; address: GPA (or offset, see DeviceModel.h)
+	AsyncMemoryWrite,      // value: [0] size | handler << 8, [1-4] data; address: GPA (or offset)
+	AsyncCpuid,            // value: [0-3] EAX, EBX, ECX, EDX
+	AsyncIrqLine,          // value: [0] line, [1] level
+	AsyncMsr,              // value: [0] index, [1] write, [2] low, [3] high; completion: [0] low, [1] high, [2] handled
+
+	// Responses, JS thread to processor thread
+	AsyncCompletion = 16,  // value: results of the request being waited for (data, up to 16 bytes, or CPUID's four)
+	AsyncInject,           // value: [0] vector, [1] priority, [2] level
+	AsyncSetIrq,           // value: [0] line, [1] level
+	AsyncSetA20            // value: [0] enabled
+};
+
+/** Entry of both rings, as seen by JS in the "exitring" ArrayBuffer */
+struct AsyncExit {
+	UINT32 type;
+	UINT32 value[5];
+	UINT64 address;
+};
+
+/**
+ * Lets a thread sleep until another one has news for it, without the other
+ * side taking a lock unless somebody is actually sleeping.
+ */
+class Doorbell {
+private:
+	std::atomic<UINT32> rings;
+	std::atomic<bool> sleeping;
+	std::mutex mutex;
+	std::condition_variable condition;
+
+public:
+	Doorbell() : rings(0), sleeping(false) {}
+
+	/** Taken before checking for work, then passed to Wait() */
+	UINT32 Sample() const { return rings.load(); }
+
+	void Ring()
+	{
+		rings++;
+		if (sleeping) {
+			std::lock_guard<std::mutex> lock(mutex);
+			condition.notify_all();
+		}
+	}
+
+	/** Sleeps until the bell rang after Sample() returned seen, or up to the deadline (MachineClock time) */
+	void Wait(UINT32 seen, UINT64 deadline);
+};
+
+/**
+ * Device calls of a machine whose boot processor runs on a thread of its own
+ * (see CMachine::start), so guest execution and the JS devices overlap.
+ *
+ * On the processor thread this is the DeviceModel: every call becomes a
+ * request in a lock-free ring. Writes and IRQ line changes don't wait; reads,
+ * string I/O, CPUID and MSRs wait for their completion. The JS thread drains
+ * the requests in batches with Service(), which calls the real device model,
+ * and answers through a second ring. That ring also carries interrupts from
+ * JS to the processor thread. Both rings are FIFO, so the devices see the
+ * accesses in guest order and a read never overtakes a write.
+ *
+ * Buffer layout: the request ring, then the response ring at RING_BYTES (see
+ * SpscRing.h).
+ */
+class AsyncExits : public DeviceModel {
+public:
+	static const UINT32 ENTRIES = 256;
+	static const size_t RING_BYTES = SpscRing<AsyncExit>::HEADER_BYTES + ENTRIES * sizeof(AsyncExit);
+
+private:
+	std::unique_ptr<unsigned char[]> pUnalignedBuffer;
+	SpscRing<AsyncExit> requests;
+	SpscRing<AsyncExit> responses;
+
+	unsigned int* params;  // Parameter buffer the machine fills on the processor thread
+	std::deque<AsyncExit> commands;  // Commands that came in while waiting for a completion
+
+	Doorbell processorBell;  // Rung by the JS thread and Wake()
+	Doorbell jsBell;         // Rung by the processor thread
+	std::atomic<bool> aborted;
+
+	unsigned char* Buffer() { return (unsigned char*)(((unsigned long long)pUnalignedBuffer.get() + 4095) & ~4095ULL); }
+
+	void Push(const AsyncExit& request);
+	AsyncExit WaitForCompletion();
+	void Dispatch(PostedWrites& target, unsigned int* jsParams, const AsyncExit& request, AsyncExit& completion);
+
+public:
+	Counter requestCounter;
+	Counter waitCounter;   // Requests the processor waited for
+	Counter batchCounter;  // Service() rounds that found requests
+
+	AsyncExits(unsigned int* params);
+
+	unsigned char* GetBuffer() { return Buffer(); }
+	size_t GetBufferSize() { return 2 * RING_BYTES; }
+
+	// Processor thread:
+
+	/** Takes the next command (AsyncInject, AsyncSetIrq) from the JS thread */
+	bool PopCommand(AsyncExit& command);
+
+	/**
+	 * Sleeps until a command arrives, Wake() is called or the deadline
+	 * (MachineClock time). ready tells if there's other work, it's checked
+	 * after taking the doorbell so a Wake() in between isn't lost
+	 */
+	void WaitForCommand(UINT64 deadline, const std::function<bool()>& ready = nullptr);
+
+	// Any thread:
+
+	/** Wakes WaitForCommand, e.g. for an application processor's exit */
+	void Wake() { processorBell.Ring(); }
+
+	// JS thread:
+
+	/** Sends a command to the processor thread */
+	void PostCommand(const AsyncExit& command);
+
+	/**
+	 * Hands the waiting requests to target until the deadline (MachineClock
+	 * time), with jsParams as the parameter buffer. Posted port writes are
+	 * collected and flushed once per batch. Returns the number of requests
+	 */
+	unsigned int Service(PostedWrites& target, unsigned int* jsParams, UINT64 deadline);
+
+	/** Makes waiting calls on both sides return, e.g. when the processor thread failed */
+	void Abort();
+
+	/** Empties the rings for the next start. Only while the processor thread isn't running */
+	void Reset();
+
+	// DeviceModel methods, on the processor thread:
+	void PortIo() override;
+	void PortIoString() override;
+	void PortWrites(unsigned int count) override {}
+	void MemoryRead(unsigned int size, unsigned int handler) override;
+	void MemoryWrite(unsigned int size, unsigned int handler) override;
+	void Cpuid(const unsigned int in[4], unsigned int out[4]) override;
+	void Irq(unsigned int line, bool level) override;
+	bool Msr(unsigned int index, bool write, unsigned long long* value) override;
+};
@@ -1,5 +1,16 @@
 #include "CMachine.h"
 
+static const char* COUNTER_NAMES[MACHINE_COUNTERS] = {
+	"run_loop_counter", "io_counter", "irq_counter", "mem_counter", "inthandle_counter", "mmio_fast_counter",
+	"stringio_counter", "posted_counter", "irq_coalesced_counter", "ap_exit_counter", "mmio_handler_counter",
+	"mmio_wide_counter", "cpuid_native_counter", "msr_native_counter", "msr_unknown_counter", "trace_counter",
+	"a20_counter", "preempt_counter", "async_request_counter", "async_wait_counter", "async_batch_counter"
+};
+
+const char* CMachine::CounterName(unsigned int counter)
+{
+	return counter < MACHINE_COUNTERS ? COUNTER_NAMES[counter] : "";
+}
 
 HRESULT IoPortCallback(VOID* Context, WHV_EMULATOR_IO_ACCESS_INFO* IoAccess) {
 	CMachine* pMachine = (CMachine*)Context;
@@ -50,37 +61,3 @@ HRESULT TranslateRange(
 	return pMachine->HandleTranslateRange(GvaPage, TranslateFlags, TranslationResult, GpaPage);
 }
 
-void StopperFunction(HANDLE partitionHandle, semaphore* sem)
-{
-	while (1) {
-		sem->wait();
-		/*		if (latchirq != -1) {
-					WHV_INTERRUPT_CONTROL ctrl;
-					memset(&ctrl, 0x0, sizeof(ctrl));
-					ctrl.Type = WHvX64InterruptTypeFixed;
-					ctrl.Vector = latchirq;
-					ctrl.DestinationMode = WHvX64InterruptDestinationModePhysical;
-					ctrl.TriggerMode = WHvX64InterruptTriggerModeLevel;
-					ctrl.Destination = 0;
-					HRESULT hr = WHvRequestInterrupt(
-						partitionHandle, &ctrl, sizeof(ctrl));
-					if (hr != S_OK) {
-						MessageBox(NULL, L"ERROR", L"ERROR", MB_OK);
-						//MessageBox(NULL, L"IRQError", L"IRQError", MB_OK);
-						//throw std::exception("Error raising IRQ");
-						continue;
-					}
-					else {
-						MessageBox(NULL, L"OK", L"OK", MB_OK);
-					}
-				} */
-		Sleep(1);
-		for (int i = 0; i < 3; i++) {
-			HRESULT hr = WHvCancelRunVirtualProcessor(partitionHandle, 0x0, 0);
-			if (hr == S_OK) {
-				break;
-			}
-			Sleep(1);
-		}
-	}
-}
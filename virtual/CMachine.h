@@ -1,142 +1,218 @@
 #pragma once
 
-#include <windows.h>
-#include <WinHvEmulation.h>
-#include <WinHvPlatform.h>
+#include <string.h>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <stdexcept>
+#include <string>
 #include <vector>
 #include <chrono>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
-#include "include/cef_app.h"
-#include "include/cef_base.h"
-#include "include/base/cef_lock.h"
-
-
-class semaphore
-{
-private:
-	std::mutex mutex_;
-	std::condition_variable condition_;
-	unsigned long count_ = 0; // Initialized as locked.
-
-public:
-	void notify() {
-		std::lock_guard<decltype(mutex_)> lock(mutex_);
-		count_ = 1;
-		condition_.notify_one();
-	}
-
-	void wait() {
-		std::unique_lock<decltype(mutex_)> lock(mutex_);
-		while (!count_) // Handle spurious wake-ups.
-			condition_.wait(lock);
-		count_ = 0;
-	}
+#include "AsyncExits.h"
+#include "Checkpoint.h"
+#include "Counter.h"
+#include "CpuidTable.h"
+#include "DeviceModel.h"
+#include "ExitStats.h"
+#include "ExitTrace.h"
+#include "GpaRegistry.h"
+#include "GuestMemory.h"
+#include "HvBackend.h"
+#include "IrqQueue.h"
+#include "MachineClock.h"
+#include "MmioDecoder.h"
+#include "NativeDevices.h"
+#include "PostedWrites.h"
+#include "PreemptionTimer.h"
+#include "RegisterCache.h"
+#include "Snapshot.h"
+#include "VirtualProcessor.h"
+
+
+
+
+/** The machine's counters, in the order of the buffer they're published in (see CMachine::PublishCounters) */
+enum MachineCounter {
+	CounterRunLoop,
+	CounterIo,
+	CounterIrq,
+	CounterMem,
+	CounterIntHandle,
+	CounterMmioFast,
+	CounterStringIo,
+	CounterPosted,
+	CounterIrqCoalesced,
+	CounterApExit,
+	CounterMmioHandler,
+	CounterMmioWide,
+	CounterCpuidNative,
+	CounterMsrNative,
+	CounterMsrUnknown,
+	CounterTrace,
+	CounterA20,
+	CounterPreempt,
+	CounterAsyncRequest,
+	CounterAsyncWait,
+	CounterAsyncBatch,
+	MACHINE_COUNTERS
 };
 
-void StopperFunction(HANDLE partitionHandle, semaphore* sem);
-
-
-HRESULT GetVirtualRegisters(VOID* Context,
-	const WHV_REGISTER_NAME* RegisterNames,
-	unsigned int RegisterCount,
-	WHV_REGISTER_VALUE* RegisterValues);
-
-HRESULT IoPortCallback(VOID* Context, WHV_EMULATOR_IO_ACCESS_INFO* IoAccess);
-
-HRESULT SetVirtualRegisters(VOID* Context,
-	const WHV_REGISTER_NAME* RegisterNames,
-	UINT32 RegisterCount,
-	const WHV_REGISTER_VALUE* RegisterValues);
-
-HRESULT MemoryCallback(VOID* Context,
-	WHV_EMULATOR_MEMORY_ACCESS_INFO* MemoryAccess);
-
-HRESULT TranslateRange(
-	VOID* Context,
-	WHV_GUEST_VIRTUAL_ADDRESS GvaPage,
-	WHV_TRANSLATE_GVA_FLAGS TranslateFlags,
-	WHV_TRANSLATE_GVA_RESULT_CODE* TranslationResult,
-	WHV_GUEST_PHYSICAL_ADDRESS*
-	GpaPage  // NOTE: This pointer _must_ be 4K page aligned
-);
-
-class CMachine : public CefBaseRefCounted {
+/**
+ * The accelerated machine: guest memory, the virtual processors (the
+ * bootstrap processor and, for an SMP guest, the application processors on
+ * threads of their own) and the exit dispatch loop. Hypervisor calls go
+ * through an HvBackend and device accesses go to a DeviceModel, so the
+ * machine itself has no dependency on either the Hypervisor Platform or V8.
+ */
+class CMachine {
 private:
-	std::unique_ptr<unsigned char[]> pUnalignedMemory;
+	std::unique_ptr<GuestMemory> ram;
 	std::unique_ptr<unsigned char[]> pUnalignedParamBuffer;
-
+	unsigned int* jsParambuf;  // Parameter buffer of JS, the posted write queue is the page after it
+	unsigned int* parambuf;  // Parameter buffer the device calls are made with: JS's, or a private one after start()
 
 	unsigned char* pMemory;
 
 	size_t m_sz;
-	WHV_EMULATOR_HANDLE emulatorHandle;
-	HANDLE partitionHandle;
-	CefRefPtr<CefV8Value> jsobj;
-	std::thread stopperThread;
-
-	int entry_counter = 0;
-	int run_loop_counter = 0;
-	int io_counter = 0;
-	int irq_counter = 0;
-	int mem_counter = 0;
-	int inthandle_counter = 0;
-
-	semaphore sem;
-
-	CefRefPtr<CefV8Value> mw1, mw2, mw4, mr1, mr2, mr4, jscpu;
-	unsigned int* parambuf;
+	std::unique_ptr<HvBackend> backend;
+
+	// Virtual processors, the bootstrap processor first. It runs in run() on the
+	// caller's thread, or on processorThread after start(); the application
+	// processors have threads of their own. All register accesses go through
+	// their register caches
+	std::vector<std::unique_ptr<VirtualProcessor>> processors;
+	VirtualProcessor* current;  // Processor whose exit is being handled
+	std::mutex smpMutex;
+	std::condition_variable smpCondition;
+	std::atomic<UINT32> smpRequests;  // Application processor exits waiting for the device thread
+	bool smpStopping = false;
+	UINT32 smpWakeups = 0;  // Changed to send halted application processors back into the guest
+	std::string smpError;
+
+	PostedWrites posted;
+	ExitStats stats;
+	ExitTrace trace;
+	TraceDeviceModel traced;  // In front of the posted write queue, or the exit ring after start()
+	TimedDeviceModel timed;   // In front of traced
+	DeviceModel* devices;  // All device calls go through the timing, tracing and the posted write queue or exit ring
+	NativeDevices native;
+	PreemptionTimer timer;
+	IrqQueue irqs;
+
+	// Boot processor on its own thread (start() to stop())
+	AsyncExits exits;
+	bool started = false;
+	std::thread processorThread;
+	std::atomic<bool> processorStopping;
+	std::atomic<bool> processorExited;
+	std::atomic<unsigned int> processorFlags;  // run() result of the last slice
+	UINT64 sliceNs = DEFAULT_SLICE_NS;
+	std::string processorError;
+
+	WHV_MAP_GPA_RANGE_FLAGS ramFlags;
+	GpaRegistry regions;  // What's mapped where, see remap()
+	bool a20 = true;  // A20 gate, changed on the processor thread after start()
+	Counter a20Counter;
+	Counter mmioHandlerCounter;  // MMIO accesses that went to a region's own handler
+	Counter mmioWideCounter;     // 8 and 16 byte MMIO accesses done in one device call
+	std::vector<UINT8> wideSizes;  // By handler: the wide sizes (8 | 16) it takes, see SetWideMemory
+
+	CpuidTable cpuid;
+	Counter cpuidNativeCounter;  // CPUID exits answered from the table, on any processor
+	Counter msrNativeCounter;   // MSR exits answered without the devices
+	Counter msrUnknownCounter;  // MSR exits nobody handled
+
+	MmioDecodeCache mmioCache;
+
+	// Checkpoint chain
+	bool checkpointChainStarted = false;
+	UINT64 checkpointSequence = 0;
+	UINT64 checkpointChainId = 0;
+	std::vector<std::atomic<UINT64>> hostDirty;  // RAM pages written by the host side since the last checkpoint (both threads after start())
+	std::mutex dirtyMutex;  // Write protected dirty regions, faults come from the processor thread after start()
+	std::thread checkpointWriter;
+	std::string checkpointError;
+
+	double counterBuffer[MACHINE_COUNTERS] = {};  // See PublishCounters()
+
+	// Snapshots
+	std::string startSnapshot;  // The snapshot the machine was started from, if any
+	bool snapshotMapped = false;  // RAM is mapped from startSnapshot
+	std::vector<unsigned char> restoredState;  // JS state of startSnapshot
+	std::vector<std::unique_ptr<unsigned char[]>> snapshotStateBuffers;  // The last is current, JS may hold the others
+	size_t snapshotStateCapacity = 0;
+	size_t snapshotStateSize = 0;
 
 
 public:
+	// Read by JS while the processor thread counts after start()
+	Counter entry_counter;
+	Counter run_loop_counter;
+	Counter io_counter;
+	Counter irq_counter;
+	Counter mem_counter;
+	Counter inthandle_counter;
+	Counter stringio_counter;
+	Counter mmio_fast_counter;
+
 	virtual ~CMachine()
 	{
-		// TODO
-		MessageBox(NULL, L"Destructing", L"Destruction", MB_OK);
+		if (started) {
+			// Nobody is left to answer device calls, so they get what an absent device returns
+			processorStopping = true;
+			exits.Abort();
+			timer.Kick();
+			processorThread.join();
+		}
+		StopProcessors();
+		if (checkpointWriter.joinable()) {
+			checkpointWriter.join();
+		}
 	}
-	CMachine(size_t sz, CefRefPtr<CefV8Value> cpu, CefRefPtr<CefV8Value> mw1, CefRefPtr<CefV8Value> mw2, CefRefPtr<CefV8Value> mw4, CefRefPtr<CefV8Value> mr1, CefRefPtr<CefV8Value> mr2, CefRefPtr<CefV8Value> mr4)
-		: mr1(mr1), mr2(mr2), mr4(mr4), mw1(mw1), mw2(mw2), mw4(mw4), jscpu(cpu)
+	/**
+	 * Creates the machine with the given number of virtual processors (SMP if
+	 * more than one), with RAM in large pages if the host allows it. Given a
+	 * snapshot (see snapshot()), the machine starts where it was taken
+	 */
+	CMachine(size_t sz, std::unique_ptr<HvBackend> pBackend, DeviceModel* pDevices, UINT32 processorCount = 1,
+		bool largePages = false, const std::string& snapshotPath = std::string())
+		: pUnalignedParamBuffer(std::make_unique<unsigned char[]>(4 * 4096)),
+		jsParambuf((unsigned int*)(((unsigned long long)pUnalignedParamBuffer.get() + 4096) & 0xFFFFFFFFFFFFF000)),
+		parambuf(jsParambuf), backend(std::move(pBackend)), smpRequests(0),
+		posted(pDevices, (unsigned char*)jsParambuf + 4096, 4096), traced(&posted, &trace, &parambuf),
+		timed(&traced, &stats), devices(&timed), native(&posted),
+		timer(backend.get()), exits((unsigned int*)((unsigned char*)jsParambuf + 2 * 4096)),
+		processorStopping(false), processorExited(false), processorFlags(0)
 	{
-		// Initialize the instruction emulator and callbacks
-		WHV_EMULATOR_CALLBACKS callbacks;
-		memset(&callbacks, 0x0, sizeof(callbacks));
-		callbacks.Size = sizeof(callbacks);
-		callbacks.WHvEmulatorGetVirtualProcessorRegisters = &GetVirtualRegisters;
-		callbacks.WHvEmulatorIoPortCallback = &IoPortCallback;
-		callbacks.WHvEmulatorMemoryCallback = &MemoryCallback;
-		callbacks.WHvEmulatorSetVirtualProcessorRegisters = &SetVirtualRegisters;
-		callbacks.WHvEmulatorTranslateGvaPage = &TranslateRange;
-
-		HRESULT hr = WHvEmulatorCreateEmulator(&callbacks, &emulatorHandle);
-		if (hr != S_OK) {
-			throw std::exception("Couldn't create emulator!");
+		if (processorCount == 0) {
+			throw std::runtime_error("At least one processor is needed");
 		}
-
-		hr = WHvCreatePartition(&partitionHandle);
-		if (hr != S_OK) {
-			throw std::exception("Couldn't create partition!");
+		for (UINT32 i = 0; i < processorCount; i++) {
+			processors.push_back(std::make_unique<VirtualProcessor>(backend.get(), i));
 		}
-		stopperThread = std::thread(&StopperFunction, partitionHandle, &sem);
+		current = processors[0].get();
 
-
-		DWORD procCnt = 1;
-		hr = WHvSetPartitionProperty(partitionHandle, WHvPartitionPropertyCodeProcessorCount,
+		DWORD procCnt = processorCount;
+		HRESULT hr = backend->SetPartitionProperty(WHvPartitionPropertyCodeProcessorCount,
 			&procCnt, sizeof(procCnt));
 		if (hr != S_OK) {
-			throw std::exception("Couldn't set property count");
+			throw std::runtime_error("Couldn't set property count");
 		}
 
-		WHV_X64_LOCAL_APIC_EMULATION_MODE mode = WHvX64LocalApicEmulationModeNone;
-		hr = WHvSetPartitionProperty(partitionHandle, WHvPartitionPropertyCodeLocalApicEmulationMode,
+		// SMP guests need local APICs to send IPIs, which the hypervisor emulates
+		WHV_X64_LOCAL_APIC_EMULATION_MODE mode = processorCount > 1 ?
+			WHvX64LocalApicEmulationModeXApic : WHvX64LocalApicEmulationModeNone;
+		hr = backend->SetPartitionProperty(WHvPartitionPropertyCodeLocalApicEmulationMode,
 			&mode, sizeof(mode));
 		if (hr != S_OK) {
-			throw std::exception("Couldn't set property count");
+			throw std::runtime_error("Couldn't set property count");
 		}
 
 		UINT32 exitList[19];
@@ -147,59 +223,78 @@ public:
 			exitList[exitListCnt++] = 0x80000000 + i;
 		}
 
-		hr = WHvSetPartitionProperty(partitionHandle, WHvPartitionPropertyCodeCpuidExitList,
+		hr = backend->SetPartitionProperty(WHvPartitionPropertyCodeCpuidExitList,
 			exitList, exitListCnt * sizeof(UINT32));
 		if (hr != S_OK) {
-			throw std::exception("Couldn't set CPUID exit list");
+			throw std::runtime_error("Couldn't set CPUID exit list");
 		}
 
 		WHV_PARTITION_PROPERTY prop;
 		memset(&prop, 0, sizeof(prop));
 		prop.ExtendedVmExits.X64MsrExit = 1;
 		prop.ExtendedVmExits.X64CpuidExit = 1;
-		hr = WHvSetPartitionProperty(
-			partitionHandle,
+		prop.ExtendedVmExits.X64ApicInitSipiExitTrap = processorCount > 1 ? 1 : 0;  // Bring-up is done here
+		hr = backend->SetPartitionProperty(
 			WHvPartitionPropertyCodeExtendedVmExits,
 			&prop,
 			sizeof(WHV_PARTITION_PROPERTY));
 
 		if (hr != S_OK) {
-			throw std::exception("Couldn't set CPUID exit list");
+			throw std::runtime_error("Couldn't set CPUID exit list");
 		}
 
-		hr = WHvSetupPartition(partitionHandle);
+		hr = backend->SetupPartition();
 		if (hr != S_OK) {
-			throw std::exception("Couldn't setup partition!");
+			throw std::runtime_error("Couldn't setup partition!");
 		}
 
-		pUnalignedParamBuffer = std::make_unique<unsigned char[]>(8192);
-		parambuf = (unsigned int*)(((unsigned long long)pUnalignedParamBuffer.get() + 4096) & 0xFFFFFFFFFFFFF000);
-
 		m_sz = sz;
-		pUnalignedMemory = std::make_unique<unsigned char[]>(sz + 4096);
-		pMemory = (unsigned char*)(((unsigned long long)pUnalignedMemory.get() + 4096) & 0xFFFFFFFFFFFFF000);
+		ram = std::make_unique<GuestMemory>(sz, largePages);
 
-		hr = memmap(pMemory, sz, 1, 0);  // A20 gate on per default for now (TODO)
-		if (hr != S_OK) {
-			throw std::exception("Couldn't map memory!");
+		// RAM of a snapshot goes in before it's mapped into the guest, the rest at the end
+		Snapshot snapshot;
+		if (!snapshotPath.empty()) {
+			if (processorCount > 1) {
+				throw std::runtime_error("Snapshots only hold one processor");
+			}
+			snapshot = Snapshot::Read(snapshotPath);
+			snapshotMapped = snapshot.LoadMemory(snapshotPath, *ram);
+			startSnapshot = snapshotPath;
 		}
+		pMemory = ram->Get();
 
-		hr = WHvCreateVirtualProcessor(partitionHandle, 0, 0);
+		hostDirty = std::vector<std::atomic<UINT64>>((sz / Checkpoint::PAGE_BYTES + 63) / 64);
+
+		// RAM is dirty tracked for incremental checkpoints where the hypervisor supports it
+		ramFlags = WHvMapGpaRangeFlagRead | WHvMapGpaRangeFlagWrite |
+			WHvMapGpaRangeFlagExecute | WHvMapGpaRangeFlagTrackDirtyPages;
+		hr = memmap(pMemory, sz, 1, 0);  // A20 gate on per default, see seta20()
+		if (hr != S_OK) {
+			backend->UnmapGpaRange(0, sz);
+			ramFlags = WHvMapGpaRangeFlagRead | WHvMapGpaRangeFlagWrite |
+				WHvMapGpaRangeFlagExecute;
+			hr = memmap(pMemory, sz, 1, 0);
+		}
 		if (hr != S_OK) {
-			throw std::exception("Couldn't create virtual proc!");
+			throw std::runtime_error("Couldn't map memory!");
 		}
+		regions.Set(0, sz, GpaRam);
 
-		DWORD biossize = 131072;
-		DWORD biosOffset = 0x100000 - biossize;
-		unsigned int topBios = (unsigned int)(-((int)biossize));
+		for (UINT32 i = 0; i < processorCount; i++) {
+			hr = backend->CreateVirtualProcessor(i);
+			if (hr != S_OK) {
+				throw std::runtime_error("Couldn't create virtual proc!");
+			}
+		}
 
 		// Create BIOS shadow mapping
-		hr = WHvMapGpaRange(partitionHandle, pMemory + biosOffset, topBios, 0x100000,
+		hr = backend->MapGpaRange(pMemory + 0x100000 - BIOS_SHADOW_BYTES, BIOS_SHADOW_GPA, 0x100000,
 			WHvMapGpaRangeFlagRead | WHvMapGpaRangeFlagWrite |
 			WHvMapGpaRangeFlagExecute);
 		if (hr != S_OK) {
-			throw std::exception("Error, couldn't map BIOS!");
+			throw std::runtime_error("Error, couldn't map BIOS!");
 		}
+		regions.Set(BIOS_SHADOW_GPA, BIOS_SHADOW_GPA + 0x100000, GpaRom);
 
 		WHV_REGISTER_NAME names[13] = {
 			WHvX64RegisterCr0,    WHvX64RegisterRip,  WHvX64RegisterCs,
@@ -208,13 +303,9 @@ public:
 			WHvX64RegisterGdtr,   WHvX64RegisterLdtr, WHvX64RegisterIdtr,
 			WHvX64RegisterTr };
 		WHV_REGISTER_VALUE oldvalues[13];
-		hr = WHvGetVirtualProcessorRegisters(partitionHandle, 0, names, 13, oldvalues);
+		hr = Registers().Get(names, 13, oldvalues);
 		if (hr != S_OK) {
-			throw std::exception("Error, couldn't load BIOS!");
-		}
-
-		for (int i = 0; i < 13; i++) {
-			printf("Old value for %d = %llx\n", i, oldvalues[i].Reg64);
+			throw std::runtime_error("Error, couldn't load BIOS!");
 		}
 
 		WHV_REGISTER_VALUE values[15];
@@ -255,49 +346,71 @@ public:
 
 
 		// Note it is deliberately we don't include the last one (Apic ID) because we don't want to write to it!
-		printf("Difference between originals and what we are setting...\n");
-		for (int i = 0; i < 13; i++) {
-			if (values[i].Reg64 != oldvalues[i].Reg64) {
-				printf("New value for %d %llx %llx\n", i, values[i].Reg64,
-					oldvalues[i].Reg64);
-			}
+		hr = Registers().Set(names, 13, values);
+		if (hr != S_OK) {
+			throw std::runtime_error("Error, couldn't set virtual registers!");
+		}
+		if (!startSnapshot.empty()) {
+			RestoreSnapshot(snapshot);
 		}
 
-		hr = WHvSetVirtualProcessorRegisters(partitionHandle, 0, names, 13, values);
-		if (hr != S_OK) {
-			throw std::exception("Error, couldn't set virtual registers!");
+		for (UINT32 i = 1; i < processorCount; i++) {
+			processors[i]->thread = std::thread(&CMachine::RunProcessor, this, processors[i].get());
 		}
 	}
 
-	CefRefPtr<CefV8Value> run() {
-		entry_counter++;
+	/** The top of the BIOS in RAM, also mapped below 4 GB where the processor starts */
+	static const UINT64 BIOS_SHADOW_BYTES = 131072;
+	static const UINT64 BIOS_SHADOW_GPA = 0x100000000ULL - BIOS_SHADOW_BYTES;
+
+	/** End of the guest physical address space (52-bit addresses) */
+	static const UINT64 MAX_GPA = 1ULL << 52;
 
-		std::chrono::time_point<std::chrono::system_clock> now =
-			std::chrono::system_clock::now();
+	/** Most bytes one INS/OUTS exit transfers, so a huge REP count doesn't hold up the device thread */
+	static const UINT64 MAX_STRING_IO_BYTES = 65536;
 
-		auto duration = now.time_since_epoch();
-		auto millis_start = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+	/** Time slice of run() without a deadline */
+	static const UINT64 DEFAULT_SLICE_NS = 2000000;
+
+	unsigned int run() {
+		return run(MachineClock::Now() + DEFAULT_SLICE_NS);
+	}
+
+	/**
+	 * Runs the machine until the deadline (MachineClock time), typically the
+	 * next timer event of the JS side, or until it halts. Returns RFLAGS
+	 * augmented with the pending (bit 22, an interrupt is waiting for delivery)
+	 * and halted (bit 23) flags
+	 */
+	unsigned int run(UINT64 deadline) {
+		entry_counter++;
 
+		VirtualProcessor& bsp = *processors[0];
 		unsigned int halted = 0; // Indicates if machine is halted 
 		unsigned int dontbreak = 0; // Indicates if we can't break out now even if we reach the time slice (need to finish interrupt delivery)
+		WHV_VP_EXIT_CONTEXT lastState; // Processor state of the last exit
+		bool haveState = false;
+		UINT64 sliceStart = stats.Now();
+		UINT64 guestTime = 0;
 
 		while (true) {
 			run_loop_counter++;
 
-			now =
-				std::chrono::system_clock::now();
+			ServiceProcessors();
+			if (started) {
+				ServiceCommands();
+			}
+
+			UINT64 nextEvent = native.Service();
+			if (HasInterrupt()) {
+				InjectInterrupt(haveState ? &lastState : nullptr);
+			}
 
 			if (dontbreak == 0) {
-				duration = now.time_since_epoch();
-				auto millis_end = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
-				auto diff = (millis_end - millis_start);
-				if (diff > 2) {
+				if (MachineClock::Now() >= deadline) {
 					break;
 				}
 			}
-			else {
-				dontbreak = 0;
-			}
 
 
 
@@ -305,70 +418,47 @@ public:
 			WHV_RUN_VP_EXIT_CONTEXT ctx;
 			memset(&ctx, 0x0, sizeof(ctx));
 
-			sem.notify();
-			HRESULT hr = WHvRunVirtualProcessor(partitionHandle, 0x0, &ctx, sizeof(ctx));
+			HRESULT hr = bsp.registers.Flush();
 			if (hr != S_OK) {
-				throw std::exception("Error running virtual processor");
+				throw std::runtime_error("Error setting virtual registers");
 			}
 
-
-
-
-			if (ctx.ExitReason == WHvRunVpExitReasonX64IoPortAccess) {
-				WHV_EMULATOR_STATUS status;
-				hr = WHvEmulatorTryIoEmulation(emulatorHandle, (VOID*)this, &ctx.VpContext,
-					&ctx.IoPortAccess, &status);
-				if (hr != S_OK) {
-					throw std::exception("I/O emulation gave error");
-				}
-				if (!status.EmulationSuccessful) {
-					throw std::exception("I/O emulation not successful");
-				}
+			// Leave the guest at the deadline, or earlier for a native timer IRQ
+			if (!timer.Arm(nextEvent != 0 && nextEvent < deadline ? nextEvent : deadline)) {
+				continue;  // Kicked on the way in, service what the kick was for first
 			}
-			else if (ctx.ExitReason == WHvRunVpExitReasonMemoryAccess) {
-				WHV_EMULATOR_STATUS status;
-				hr = WHvEmulatorTryMmioEmulation(emulatorHandle, (VOID*)this, &ctx.VpContext, &ctx.MemoryAccess, &status);
-				if (hr != S_OK) {
-					throw std::exception("MMIO emulation gave error");
-				}
-				if (!status.EmulationSuccessful) {
-					throw std::exception("MMIO emulation not successful");
-				}
-
+			dontbreak = 0;
+			bool timing = stats.IsEnabled() || trace.IsRecording();
+			UINT64 entered = timing ? MachineClock::Now() : 0;
+			hr = backend->RunVirtualProcessor(0x0, &ctx);
+			UINT64 exited = timing ? MachineClock::Now() : 0;
+			timer.Disarm();
+			bsp.registers.OnExit(ctx);
+			bsp.exitCounter++;
+			lastState = ctx.VpContext;
+			haveState = true;
+			if (hr != S_OK) {
+				throw std::runtime_error("Error running virtual processor");
 			}
-			else if (ctx.ExitReason == WHvRunVpExitReasonX64Cpuid) {
-				// Simulation of CPUID by passing to the JS side
 
-				CefV8ValueList list;
-				list.push_back(CefV8Value::CreateUInt(ctx.CpuidAccess.Rax));
-				list.push_back(CefV8Value::CreateUInt(ctx.CpuidAccess.Rbx));
-				list.push_back(CefV8Value::CreateUInt(ctx.CpuidAccess.Rcx));
-				list.push_back(CefV8Value::CreateUInt(ctx.CpuidAccess.Rdx));
-				CefRefPtr<CefV8Value> cb = jsobj->GetValue("cpuid");
-				CefRefPtr<CefV8Value> retval = cb->ExecuteFunction(jsobj, list);
 
-				CefRefPtr<CefV8Value> retval1 = retval->GetValue(0);
-				CefRefPtr<CefV8Value> retval2 = retval->GetValue(1);
-				CefRefPtr<CefV8Value> retval3 = retval->GetValue(2);
-				CefRefPtr<CefV8Value> retval4 = retval->GetValue(3);
 
-				WHV_REGISTER_VALUE values[5];
-				values[0].Reg64 = retval1->GetUIntValue();
-				values[1].Reg64 = retval2->GetUIntValue();
-				values[2].Reg64 = retval3->GetUIntValue();
-				values[3].Reg64 = retval4->GetUIntValue();
 
-				UINT64 rip = ctx.VpContext.Rip;
-				rip += ctx.VpContext.InstructionLength;
-
-				values[4].Reg64 = rip;
-				WHV_REGISTER_NAME names[5] = { WHvX64RegisterRax, WHvX64RegisterRbx, WHvX64RegisterRcx, WHvX64RegisterRdx, WHvX64RegisterRip };
-
-
-				hr = WHvSetVirtualProcessorRegisters(partitionHandle, 0x0, names, 5, values);
-				if (hr != S_OK) {
-					throw std::exception("Error setting virtual registers");
+			UINT64 deviceStart = stats.deviceNs;
+			bool handled = HandleExit(ctx);
+			if (timing) {
+				UINT64 handleTime = MachineClock::Now() - exited;
+				if (stats.IsEnabled()) {
+					guestTime += exited - entered;
+					stats.RecordExit(ctx, exited - entered, handleTime, stats.deviceNs - deviceStart);
 				}
+				if (trace.IsRecording()) {
+					TraceExit(ctx, exited - entered, handleTime);
+				}
+			}
+
+			if (handled) {
+				continue;
 			}
 			else if (ctx.ExitReason == WHvRunVpExitReasonX64InterruptWindow) {
 				dontbreak = 1;
@@ -378,11 +468,15 @@ public:
 				continue;
 			}
 			else if (ctx.ExitReason == WHvRunVpExitReasonX64Halt) {
+				FlushPosted();
+				if (processors.size() > 1 && WakeHaltedProcessors() && WaitHalted(deadline)) {
+					continue;
+				}
 				halted = 1;
 				break;
 			}
 			else {
-				throw std::exception("Unknown exit reaosn");
+				throw std::runtime_error("Unknown exit reaosn");
 				/*
 				WHV_REGISTER_NAME nn[4] = {
 				WHvX64RegisterRip, WHvRegisterPendingInterruption, WHvX64RegisterDeliverabilityNotifications, WHvX64RegisterRflags };
@@ -391,21 +485,28 @@ public:
 				WHvGetVirtualProcessorRegisters(partitionHandle, 0, nn, 4, vv);
 				MessageBox(NULL, L"Error - uknown exit reasoin", L"Error", MB_OK); */
 
-				//throw std::exception("Unknown reason 2"); 
+				//throw std::runtime_error("Unknown reason 2"); 
 			}
 		}
 
 		// OK, about to exit - update the state of the JS side
+		timer.Stop();
+		FlushPosted();
+		if (sliceStart != 0) {
+			stats.RecordSlice(MachineClock::Now() - sliceStart, guestTime);
+		}
+
 		WHV_REGISTER_NAME nn[4] = {
 		WHvX64RegisterRip, WHvRegisterPendingInterruption, WHvX64RegisterDeliverabilityNotifications, WHvX64RegisterRflags };
 		WHV_REGISTER_VALUE vv[4];
 
-		HRESULT hr = WHvGetVirtualProcessorRegisters(partitionHandle, 0, nn, 4, vv);
+		HRESULT hr = Registers().Get(nn, 4, vv);
 		if (hr != S_OK) {
-			throw std::exception("Couldn't get register status");
+			throw std::runtime_error("Couldn't get register status");
 		}
 
-		unsigned int pending = (vv[1].PendingInterruption.InterruptionPending ? 1 : 0) | (vv[2].DeliverabilityNotifications.InterruptNotification ? 1 : 0);
+		unsigned int pending = (vv[1].PendingInterruption.InterruptionPending ? 1 : 0) | (vv[2].DeliverabilityNotifications.InterruptNotification ? 1 : 0) |
+			(irqs.Empty() ? 0 : 1);
 
 		unsigned int mask = (1 << 22) | (1 << 23);
 		mask = ~mask;
@@ -418,300 +519,1895 @@ public:
 				}
 			} */
 
-		jsobj->SetValue(L"run_loop_counter", CefV8Value::CreateUInt(run_loop_counter), V8_PROPERTY_ATTRIBUTE_NONE);
-		jsobj->SetValue(L"io_counter", CefV8Value::CreateUInt(io_counter), V8_PROPERTY_ATTRIBUTE_NONE);
-		jsobj->SetValue(L"irq_counter", CefV8Value::CreateUInt(irq_counter), V8_PROPERTY_ATTRIBUTE_NONE);
-		jsobj->SetValue(L"mem_counter", CefV8Value::CreateUInt(mem_counter), V8_PROPERTY_ATTRIBUTE_NONE);
-		jsobj->SetValue(L"inthandle_counter", CefV8Value::CreateUInt(inthandle_counter), V8_PROPERTY_ATTRIBUTE_NONE);
-		return CefV8Value::CreateUInt(val);
+		return val;
 	}
 
-
-	/** Called to inject an IRQ */
-	void irq(unsigned int irq)
+	/**
+	 * Runs the boot processor on a thread of its own from now on, in slices of
+	 * the given length, so the guest keeps running while JS emulates devices.
+	 * Device calls then go through the exit ring (see AsyncExits.h) and are
+	 * answered by service(); interrupts from irq() and SetIrq() are sent
+	 * through it too. Application processors are unaffected, their exits now
+	 * go to the processor thread instead of run()
+	 */
+	void start(UINT64 slice = DEFAULT_SLICE_NS)
 	{
-		irq_counter++;
-		WHV_REGISTER_NAME nn[5] = {
-	   WHvRegisterPendingInterruption, WHvX64RegisterDeliverabilityNotifications, WHvX64RegisterRflags,  WHvRegisterInterruptState, WHvRegisterPendingInterruption };
-		WHV_REGISTER_VALUE vv[5];
+		if (started) {
+			throw std::runtime_error("Machine is already started");
+		}
+		FlushPosted();
+		exits.Reset();
+		sliceNs = slice;
+		processorStopping = false;
+		processorExited = false;
+		processorError.clear();
+
+		parambuf = (unsigned int*)((unsigned char*)jsParambuf + 2 * 4096);
+		traced.SetTarget(&exits);
+		native.SetDeviceModel(&exits);
+		started = true;
+		processorThread = std::thread(&CMachine::RunStarted, this);
+	}
 
-		HRESULT hr = WHvGetVirtualProcessorRegisters(partitionHandle, 0, nn, 5, vv);
-		if (hr != S_OK) {
-			throw std::exception("Error raising IRQ");
+	/** Takes the boot processor back to run(), answering its device calls until it has left its thread */
+	void stop()
+	{
+		if (!started) {
+			return;
+		}
+		processorStopping = true;
+		timer.Kick();
+		exits.Wake();
+		while (!processorExited) {
+			exits.Service(posted, jsParambuf, MachineClock::Now() + 1000000);
 		}
+		processorThread.join();
+
+		started = false;
+		parambuf = jsParambuf;
+		traced.SetTarget(&posted);
+		native.SetDeviceModel(&posted);
+		ServiceCommands();  // Interrupts sent after the thread's last look
+		if (!processorError.empty()) {
+			std::string error = processorError;
+			processorError.clear();
+			throw std::runtime_error(error);
+		}
+	}
 
-		unsigned int pending = (vv[0].PendingInterruption.InterruptionPending ? 1 : 0) | (vv[1].DeliverabilityNotifications.InterruptNotification ? 1 : 0);
-		if (pending) {
-			throw std::exception("New interrupt while interrupt pending");
+	/**
+	 * Answers the device calls of the processor thread until the deadline
+	 * (MachineClock time). Returns the result of the processor's last slice,
+	 * in the format of run()
+	 */
+	unsigned int service(UINT64 deadline)
+	{
+		if (!started) {
+			throw std::runtime_error("Machine isn't started");
 		}
-		if (!((vv[2].Reg64 >> 9) & 1)) {
-			throw std::exception(
-				"IRQ delivery without interrupts enabled (shouldn't "
-				"happen)");
+		exits.Service(posted, jsParambuf, deadline);
+		if (processorExited) {
+			stop();  // Failed, reports the error
 		}
+		return processorFlags;
+	}
 
+	bool IsStarted() { return started; }
 
+	void RequireStopped()
+	{
+		if (started) {
+			throw std::runtime_error("Not possible while the machine is started");
+		}
+	}
 
-		// Set the interrupt registers
-		WHV_X64_PENDING_INTERRUPTION_REGISTER new_int;
-		memset(&new_int, 0x0, sizeof(new_int));
-		new_int.InterruptionType = WHvX64PendingInterrupt;
-		new_int.InterruptionPending = 1;
-		new_int.InterruptionVector = irq;
+	/** Requests made through the exit ring, and how many of them the processor waited for */
+	unsigned long long GetAsyncRequestCounter() { return exits.requestCounter; }
+	unsigned long long GetAsyncWaitCounter() { return exits.waitCounter; }
+	unsigned long long GetAsyncBatchCounter() { return exits.batchCounter; }
 
-		WHV_REGISTER_NAME names[2] = {
-		   WHvRegisterPendingInterruption, WHvX64RegisterDeliverabilityNotifications };
-		WHV_REGISTER_VALUE values[2];
-		memset(&values[0], 0x0, sizeof(values));
-		values[0].PendingInterruption = new_int;
-		values[1].DeliverabilityNotifications.InterruptNotification = 1;
+	unsigned char* GetExitRing() { return exits.GetBuffer(); }
+	size_t GetExitRingSize() { return exits.GetBufferSize(); }
 
-		hr = WHvSetVirtualProcessorRegisters(partitionHandle, 0, names, 2, values);
-		if (hr != S_OK) {
-			throw std::exception("Error raising IRQ");
+	/** The processor thread's loop between start() and stop() */
+	void RunStarted()
+	{
+		try {
+			while (!processorStopping) {
+				unsigned int flags = run(MachineClock::Now() + sliceNs);
+				processorFlags = flags;
+				if ((flags >> 23) & 1) {
+					WaitHalted(MachineClock::Now() + sliceNs);
+				}
+			}
+		}
+		catch (std::exception& ex) {
+			processorError = ex.what();
+			exits.Abort();
 		}
+		processorExited = true;
 	}
 
-	unsigned char* getMemory() { return pMemory; }
-
-	HRESULT HandleIO(WHV_EMULATOR_IO_ACCESS_INFO * IoAccess)
+	/**
+	 * Sleeps while the boot processor is halted, handling the exits of the
+	 * application processors as they come in. Returns true once an interrupt
+	 * is waiting for the boot processor, false at the deadline (MachineClock
+	 * time) or when the processor thread is stopped
+	 */
+	bool WaitHalted(UINT64 deadline)
 	{
-		io_counter++;
-		//CefRefPtr<> ret;
-		CefString exception;
-		CefV8ValueList list;
-		parambuf[0] = IoAccess->Port;
-		parambuf[1] = IoAccess->AccessSize;
-		parambuf[2] = IoAccess->Direction;
-		if (IoAccess->Direction) { // This is a write
-			parambuf[3] = IoAccess->Data;
-		}
+		while (true) {
+			ServiceProcessors();
+			if (started) {
+				ServiceCommands();
+			}
+			UINT64 nextEvent = native.Service();
+			if (HasInterrupt()) {
+				return true;
+			}
+			UINT64 now = MachineClock::Now();
+			if (now >= deadline || (started && processorStopping)) {
+				return false;
+			}
 
-		CefRefPtr<CefV8Value> retval;
+			// Until a native timer is due, JS sends a command or an application processor exits
+			UINT64 until = nextEvent != 0 && nextEvent < deadline ? nextEvent : deadline;
+			if (started) {
+				exits.WaitForCommand(until, [&] { return smpRequests != 0; });
+			}
+			else {
+				std::unique_lock<std::mutex> lock(smpMutex);
+				smpCondition.wait_for(lock, std::chrono::nanoseconds(until > now ? until - now : 0),
+					[&] { return smpRequests != 0 || smpStopping; });
+			}
+		}
+	}
 
-		CefRefPtr<CefV8Value> cb = getIOCallback();
-		retval = cb->ExecuteFunction(jsobj, list);
+	/** Applies the interrupts JS sent through the exit ring */
+	void ServiceCommands()
+	{
+		AsyncExit command;
+		while (exits.PopCommand(command)) {
+			if (command.type == AsyncInject) {
+				irq_counter++;
+				irqs.Push((UINT8)command.value[0], (UINT8)command.value[1], command.value[2] != 0);
+			}
+			else if (command.type == AsyncSetIrq) {
+				native.SetIrq(command.value[0], command.value[1] != 0);
+			}
+			else if (command.type == AsyncSetA20) {
+				SetA20(command.value[0] != 0);
+			}
+		}
+	}
 
-		if (!IoAccess->Direction) {
-			// This is a read
-			IoAccess->Data = parambuf[0];
+	/** Hands the posted writes to JS. After start() the exit ring keeps them in order instead */
+	void FlushPosted()
+	{
+		if (!started) {
+			posted.Flush();
 		}
-		return S_OK;
 	}
 
 
+	/** Registers of the processor whose exit is being handled */
+	RegisterCache& Registers() { return current->registers; }
 
-	void InternalHandle(WHV_EMULATOR_MEMORY_ACCESS_INFO * MemoryAccess) {
-		if (MemoryAccess->Direction) { // This is a write
-			if (MemoryAccess->AccessSize == 1) {
-				pMemory[MemoryAccess->GpaAddress] = *((unsigned char*)MemoryAccess->Data);
+	/**
+	 * Handles the exits that need the devices (port I/O, MMIO, CPUID, MSRs) and
+	 * the INIT/SIPI traps, for the processor in current. Returns false for other exits
+	 */
+	bool HandleExit(WHV_RUN_VP_EXIT_CONTEXT& ctx)
+	{
+		HRESULT hr;
+		if (ctx.ExitReason == WHvRunVpExitReasonX64IoPortAccess) {
+			if (!ctx.IoPortAccess.AccessInfo.StringOp) {
+				HandleSimpleIO(ctx);
+				return true;
 			}
-			else if (MemoryAccess->AccessSize == 2) {
-				*((unsigned short*)(pMemory + MemoryAccess->GpaAddress)) = *((unsigned short*)MemoryAccess->Data);
+			if (HandleStringIO(ctx)) {
+				return true;
 			}
-			else if (MemoryAccess->AccessSize == 4) {
-				*((unsigned int*)(pMemory + MemoryAccess->GpaAddress)) = *((unsigned int*)MemoryAccess->Data);
+			WHV_EMULATOR_STATUS status;
+			hr = backend->EmulatorTryIoEmulation((VOID*)this, &ctx.VpContext,
+				&ctx.IoPortAccess, &status);
+			if (hr != S_OK) {
+				throw std::runtime_error("I/O emulation gave error");
 			}
+			if (!status.EmulationSuccessful) {
+				throw std::runtime_error("I/O emulation not successful");
+			}
+			return true;
 		}
-		else {
-			if (MemoryAccess->AccessSize == 1) {
-				*((unsigned char*)MemoryAccess->Data) = pMemory[MemoryAccess->GpaAddress];
+		else if (ctx.ExitReason == WHvRunVpExitReasonMemoryAccess) {
+			if (HandleDirtyFault(ctx.MemoryAccess)) {
+				return true;
 			}
-			else if (MemoryAccess->AccessSize == 2) {
-				*((unsigned short*)MemoryAccess->Data) = *((unsigned short*)(pMemory + MemoryAccess->GpaAddress));
+			if (HandleMmioFast(ctx)) {
+				return true;
 			}
-			else if (MemoryAccess->AccessSize == 4) {
-				*((unsigned int*)MemoryAccess->Data) = *((unsigned int*)(pMemory + MemoryAccess->GpaAddress));
+			WHV_EMULATOR_STATUS status;
+			hr = backend->EmulatorTryMmioEmulation((VOID*)this, &ctx.VpContext, &ctx.MemoryAccess, &status);
+			if (hr != S_OK) {
+				throw std::runtime_error("MMIO emulation gave error");
+			}
+			if (!status.EmulationSuccessful) {
+				throw std::runtime_error("MMIO emulation not successful");
 			}
+			return true;
 		}
-	}
+		else if (ctx.ExitReason == WHvRunVpExitReasonX64Cpuid) {
+			// From the native table if possible, otherwise simulated by the JS side
+			unsigned int in[4] = { (unsigned int)ctx.CpuidAccess.Rax, (unsigned int)ctx.CpuidAccess.Rbx,
+				(unsigned int)ctx.CpuidAccess.Rcx, (unsigned int)ctx.CpuidAccess.Rdx };
+			unsigned int out[4];
+			if (cpuid.Lookup(in[0], in[2], out)) {
+				cpuidNativeCounter++;
+			}
+			else {
+				devices->Cpuid(in, out);
+			}
 
-	CefRefPtr<CefV8Value> ioCallback;
+			WHV_REGISTER_VALUE values[5];
+			values[0].Reg64 = out[0];
+			values[1].Reg64 = out[1];
+			values[2].Reg64 = out[2];
+			values[3].Reg64 = out[3];
 
-	CefRefPtr<CefV8Value> getIOCallback()
-	{
-		if (ioCallback.get() == NULL) {
-			ioCallback = jsobj->GetValue("iocallback");
+			UINT64 rip = ctx.VpContext.Rip;
+			rip += ctx.VpContext.InstructionLength;
+
+			values[4].Reg64 = rip;
+			WHV_REGISTER_NAME names[5] = { WHvX64RegisterRax, WHvX64RegisterRbx, WHvX64RegisterRcx, WHvX64RegisterRdx, WHvX64RegisterRip };
+
+			hr = Registers().Set(names, 5, values);
+			if (hr != S_OK) {
+				throw std::runtime_error("Error setting virtual registers");
+			}
+			return true;
+		}
+		else if (ctx.ExitReason == WHvRunVpExitReasonX64ApicInitSipiTrap) {
+			HandleInitSipi(ctx.ApicInitSipi.ApicIcr);
+			return true;
 		}
-		return ioCallback;
+		else if (ctx.ExitReason == WHvRunVpExitReasonX64MsrAccess) {
+			HandleMsr(ctx);
+			return true;
+		}
+		return false;
 	}
 
-	CefV8ValueList empty_arg_list;
-
-	HRESULT HandleMemory(WHV_EMULATOR_MEMORY_ACCESS_INFO * MemoryAccess)
+	/** Adds a handled exit to the trace, with the registers CPUID and RDMSR returned */
+	void TraceExit(const WHV_RUN_VP_EXIT_CONTEXT& ctx, UINT64 hypervisorTime, UINT64 handleTime)
 	{
-		mem_counter++;
-
+		UINT64 result[4];
+		bool hasResult = ctx.ExitReason == WHvRunVpExitReasonX64Cpuid ||
+			(ctx.ExitReason == WHvRunVpExitReasonX64MsrAccess && !ctx.MsrAccess.AccessInfo.IsWrite);
+		if (hasResult) {
+			WHV_REGISTER_NAME names[4] = { WHvX64RegisterRax, WHvX64RegisterRbx, WHvX64RegisterRcx, WHvX64RegisterRdx };
+			WHV_REGISTER_VALUE values[4];
+			HRESULT hr = Registers().Get(names, 4, values);
+			if (hr != S_OK) {
+				throw std::runtime_error("Error getting virtual registers");
+			}
+			for (int i = 0; i < 4; i++) {
+				result[i] = values[i].Reg64;
+			}
+		}
+		trace.AddExit(ctx, hypervisorTime, handleTime, hasResult ? result : nullptr);
+	}
 
-		if (MemoryAccess->AccessSize == 8) {
-			if (MemoryAccess->Direction) {
-				unsigned char data[8];
-				memcpy(data, MemoryAccess->Data, 8);
-				MemoryAccess->AccessSize = 4;
-				HRESULT hr = HandleMemory(MemoryAccess);
-				if (hr != S_OK) {
-					throw std::exception("Error");
-				}
-				memcpy(MemoryAccess->Data, data + 4, 4);
-				MemoryAccess->GpaAddress += 4;
-				hr = HandleMemory(MemoryAccess);
-				if (hr != S_OK) {
-					throw std::exception("Error");
+	/**
+	 * RDMSR/WRMSR: through the hypervisor register for the MSRs it keeps, from
+	 * the processor's MSR store, or else by the devices. MSRs nobody knows
+	 * read as 0 and ignore writes
+	 */
+	void HandleMsr(const WHV_RUN_VP_EXIT_CONTEXT& ctx)
+	{
+		const WHV_X64_MSR_ACCESS_CONTEXT& msr = ctx.MsrAccess;
+		bool write = msr.AccessInfo.IsWrite != 0;
+		UINT64 value = write ? (msr.Rdx << 32 | (msr.Rax & 0xFFFFFFFF)) : 0;
+		MsrStore& store = current->msrs;
+		WHV_REGISTER_NAME name;
+		HRESULT hr;
+
+		if (MsrStore::RegisterOf(msr.MsrNumber, &name)) {
+			msrNativeCounter++;
+			WHV_REGISTER_VALUE reg;
+			if (write) {
+				if (!MsrStore::IsReadOnly(msr.MsrNumber)) {
+					memset(&reg, 0x0, sizeof(reg));
+					reg.Reg64 = value;
+					hr = Registers().Set(&name, 1, &reg);
+					if (hr != S_OK) {
+						throw std::runtime_error("Error setting virtual registers");
+					}
 				}
-				MemoryAccess->GpaAddress -= 4;
-				MemoryAccess->AccessSize = 8;
-				memcpy(MemoryAccess->Data, data, 8);
-				return S_OK;
 			}
 			else {
-				// Read
-				unsigned char data[8];
-				MemoryAccess->AccessSize = 4;
-				HRESULT hr = HandleMemory(MemoryAccess);
-				if (hr != S_OK) {
-					throw std::exception("Error");
-				}
-
-				memcpy(data, MemoryAccess->Data, 4);
-				MemoryAccess->GpaAddress += 4;
-				hr = HandleMemory(MemoryAccess);
+				hr = Registers().Get(&name, 1, &reg);
 				if (hr != S_OK) {
-					throw std::exception("Error");
+					throw std::runtime_error("Error getting virtual registers");
 				}
-				memcpy(data + 4, MemoryAccess->Data, 4);
-				memcpy(MemoryAccess->Data, data, 8);
-				MemoryAccess->GpaAddress -= 4;
-				MemoryAccess->AccessSize = 8;
-				return S_OK;
+				value = reg.Reg64;
 			}
 		}
-
-
-		CefString exception;
-		unsigned int* p = (unsigned int*)parambuf;
-		p[0] = MemoryAccess->GpaAddress;
-
-		if (MemoryAccess->Direction) {
-			// Write
-			switch (MemoryAccess->AccessSize) {
-			case 1:
-				p[1] = *((unsigned char*)MemoryAccess->Data);
-				mw1->ExecuteFunction(jscpu, empty_arg_list);
-				break;
-			case 2:
-				p[1] = *((unsigned short*)MemoryAccess->Data);
-				mw2->ExecuteFunction(jscpu, empty_arg_list);
-				break;
-			case 4:
-				p[1] = *((unsigned int*)MemoryAccess->Data);
-				mw4->ExecuteFunction(jscpu, empty_arg_list);
-				break;
+		else if (store.Contains(msr.MsrNumber)) {
+			msrNativeCounter++;
+			if (write) {
+				store.Set(msr.MsrNumber, value);
+			}
+			else {
+				store.Get(msr.MsrNumber, &value);
 			}
 		}
 		else {
-			// Read
-			switch (MemoryAccess->AccessSize) {
-			case 1:
-				mr1->ExecuteFunction(jscpu, empty_arg_list);
-				*((unsigned char*)MemoryAccess->Data) = (unsigned char)p[0];
-				break;
-			case 2:
-				mr2->ExecuteFunction(jscpu, empty_arg_list);
-				*((unsigned short*)MemoryAccess->Data) = (unsigned short)p[0];
-				break;
-			case 4:
-				mr4->ExecuteFunction(jscpu, empty_arg_list);
-				*((unsigned int*)MemoryAccess->Data) = (unsigned int)p[0];
-				break;
+			unsigned long long v = value;
+			if (!devices->Msr(msr.MsrNumber, write, &v)) {
+				msrUnknownCounter++;
+				v = 0;
 			}
+			value = v;
 		}
-		return S_OK;
-	}
-
-
-
-	HRESULT HandleSetRegisters(const WHV_REGISTER_NAME * RegisterNames,
-		UINT32 RegisterCount,
-		const WHV_REGISTER_VALUE * RegisterValues) {
-		return WHvSetVirtualProcessorRegisters(partitionHandle, 0, RegisterNames,
-			RegisterCount, RegisterValues);
-	}
 
-	HRESULT HandleGetRegisters(const WHV_REGISTER_NAME * RegisterNames,
-		UINT32 RegisterCount,
-		WHV_REGISTER_VALUE * RegisterValues) {
-		return WHvGetVirtualProcessorRegisters(partitionHandle, 0, RegisterNames,
-			RegisterCount, RegisterValues);
+		WHV_REGISTER_NAME names[3] = { WHvX64RegisterRip, WHvX64RegisterRax, WHvX64RegisterRdx };
+		WHV_REGISTER_VALUE values[3];
+		values[0].Reg64 = ctx.VpContext.Rip + ctx.VpContext.InstructionLength;
+		values[1].Reg64 = value & 0xFFFFFFFF;
+		values[2].Reg64 = value >> 32;
+		hr = Registers().Set(names, write ? 1 : 3, values);
+		if (hr != S_OK) {
+			throw std::runtime_error("Error setting virtual registers");
+		}
 	}
 
-	HRESULT HandleTranslateRange(WHV_GUEST_VIRTUAL_ADDRESS GvaPage,
-		WHV_TRANSLATE_GVA_FLAGS TranslateFlags,
-		WHV_TRANSLATE_GVA_RESULT_CODE * TranslationResult,
-		WHV_GUEST_PHYSICAL_ADDRESS * GpaPage)
+	/** Gives an MSR without a hypervisor register a value on all processors, see MsrStore.h */
+	void setmsr(UINT32 index, UINT64 value)
 	{
-		//WHvTranslateGva
-		WHV_TRANSLATE_GVA_RESULT res;
-		HRESULT hr = WHvTranslateGva(partitionHandle, 0x0, GvaPage, TranslateFlags, &res, GpaPage);
-		*TranslationResult = (WHV_TRANSLATE_GVA_RESULT_CODE)res.ResultCode;
-		return hr;
+		RequireStopped();
+		WHV_REGISTER_NAME name;
+		if (MsrStore::RegisterOf(index, &name)) {
+			throw std::runtime_error("MSR is kept by the hypervisor");
+		}
+		for (auto& vp : processors) {
+			vp->msrs.Set(index, value);
+		}
 	}
 
-	class UnmapEntry
+	/** Delivers an INIT or startup IPI sent by the processor in current */
+	void HandleInitSipi(UINT64 icr)
 	{
-	public:
-		size_t m_addr, m_sz;
+		UINT32 deliveryMode = (icr >> 8) & 7;
+		bool logical = ((icr >> 11) & 1) != 0;
+		UINT32 shorthand = (icr >> 18) & 3;
+		UINT32 destination = (UINT32)(icr >> 56);
+		if (deliveryMode != 5 && deliveryMode != 6) {
+			return;  // Only INIT and SIPI are trapped
+		}
 
-		UnmapEntry(size_t addr, size_t sz) : m_addr(addr), m_sz(sz) {
+		std::lock_guard<std::mutex> lock(smpMutex);
+		for (auto& vp : processors) {
+			bool target;
+			switch (shorthand) {
+			case 1:  // Self
+				target = vp.get() == current;
+				break;
+			case 2:  // All including self
+				target = true;
+				break;
+			case 3:  // All excluding self
+				target = vp.get() != current;
+				break;
+			default:  // APIC IDs are the processor indexes, logical destinations are flat model masks
+				target = logical ? (vp->index < 8 && ((destination >> vp->index) & 1)) : vp->index == destination;
+				break;
+			}
+			if (!target || vp->index == 0) {
+				continue;  // The bootstrap processor is reset by the JS side, not by IPIs
+			}
 
+			if (deliveryMode == 5) {
+				if (vp->state == VpRunning) {
+					vp->initPending = true;
+					backend->CancelRunVirtualProcessor(vp->index);
+				}
+			}
+			else if (vp->state == VpWaitForSipi && !vp->initPending) {
+				// Start in real mode at vector * 4096
+				UINT32 vector = icr & 0xFF;
+				WHV_REGISTER_NAME names[2] = { WHvX64RegisterCs, WHvX64RegisterRip };
+				WHV_REGISTER_VALUE values[2];
+				memset(values, 0x0, sizeof(values));
+				values[0].Segment.Selector = (UINT16)(vector << 8);
+				values[0].Segment.Base = vector << 12;
+				values[0].Segment.Limit = 0xFFFF;
+				values[0].Segment.Attributes = 0x9B;
+				HRESULT hr = vp->registers.Set(names, 2, values);
+				if (hr != S_OK) {
+					throw std::runtime_error("Couldn't start application processor");
+				}
+				vp->state = VpRunning;
+			}
 		}
-	};
-
-	std::vector<UnmapEntry> unmaps;
+		smpCondition.notify_all();
+	}
 
-	template<typename ... Args>
-	std::wstring string_format(const std::wstring & format, Args ... args)
+	/** Run loop of an application processor, on its own thread */
+	void RunProcessor(VirtualProcessor* vp)
 	{
-		size_t size = _snwprintf(nullptr, 0, format.c_str(), args ...) + 1; // Extra space for '\0'
-		std::unique_ptr<WCHAR[]> buf(new WCHAR[size]);
-		_snwprintf(buf.get(), size, format.c_str(), args ...);
-		return std::wstring(buf.get(), buf.get() + size - 1); // We don't want the '\0' inside
-	}
+		std::unique_lock<std::mutex> lock(smpMutex);
+		while (true) {
+			smpCondition.wait(lock, [&] { return smpStopping || (vp->state == VpRunning && !vp->exitPending); });
+			if (smpStopping) {
+				break;
+			}
+			if (vp->initPending) {
+				vp->initPending = false;
+				vp->state = VpWaitForSipi;
+				continue;
+			}
+			lock.unlock();
+
+			WHV_RUN_VP_EXIT_CONTEXT& ctx = vp->exit;
+			HRESULT hr = vp->registers.Flush();
+			if (hr == S_OK) {
+				hr = backend->RunVirtualProcessor(vp->index, &ctx);
+			}
+			if (hr == S_OK) {
+				vp->registers.OnExit(ctx);
+			}
+
+			lock.lock();
+			vp->exitCounter++;
+			if (hr != S_OK) {
+				vp->state = VpStopped;
+				smpError = "Error running application processor";
+				continue;
+			}
+			if (ctx.ExitReason == WHvRunVpExitReasonCanceled ||
+				ctx.ExitReason == WHvRunVpExitReasonX64InterruptWindow) {
+				continue;
+			}
+			if (ctx.ExitReason == WHvRunVpExitReasonX64Halt) {
+				// Sleeps until an INIT, stopping or the boot processor halting (see
+				// WakeHaltedProcessors) wakes it. Fixed IPIs are delivered by the
+				// hypervisor's APIC on the next entry without an exit here, so it
+				// goes back in after a time slice at the latest
+				UINT32 seen = smpWakeups;
+				smpCondition.wait_for(lock, std::chrono::nanoseconds(DEFAULT_SLICE_NS),
+					[&] { return smpStopping || vp->initPending || smpWakeups != seen; });
+				continue;
+			}
 
+			// Everything else is handled on the device thread: kick it out of the
+			// guest, or wake it if its processor is halted (see WaitHalted)
+			vp->exitPending = true;
+			smpRequests++;
+			smpCondition.notify_all();
+			lock.unlock();
+			backend->CancelRunVirtualProcessor(0);
+			exits.Wake();
+			lock.lock();
+		}
+		vp->exited = true;
+	}
 
-	void unmap(size_t addr, size_t sz)
+	/**
+	 * Sends the halted application processors back into the guest, to take the
+	 * IPIs the boot processor sent before it halted. Returns true if any
+	 * application processor is running
+	 */
+	bool WakeHaltedProcessors()
 	{
-		unmaps.push_back(UnmapEntry(addr, sz));
-		HRESULT hr = WHvUnmapGpaRange(partitionHandle, addr, sz);
-		if (hr != S_OK) {
-			throw std::exception("Couldn't unmap");
+		std::lock_guard<std::mutex> lock(smpMutex);
+		smpWakeups++;
+		smpCondition.notify_all();
+		for (size_t i = 1; i < processors.size(); i++) {
+			if (processors[i]->state == VpRunning) {
+				return true;
+			}
 		}
+		return false;
 	}
 
-	HRESULT memmap(unsigned char* mem,
-		size_t amount,
+	/** Handles the exits application processors have queued for the device thread */
+	void ServiceProcessors()
+	{
+		if (smpRequests == 0) {
+			return;
+		}
+		std::unique_lock<std::mutex> lock(smpMutex);
+		if (!smpError.empty()) {
+			throw std::runtime_error(smpError);
+		}
+		for (size_t i = 1; i < processors.size(); i++) {
+			VirtualProcessor* vp = processors[i].get();
+			if (!vp->exitPending) {
+				continue;
+			}
+			lock.unlock();
+
+			// The processor waits for exitPending to clear, so its state is ours meanwhile
+			bool handled = false;
+			std::string error;
+			current = vp;
+			try {
+				handled = HandleExit(vp->exit);
+			}
+			catch (std::exception& ex) {
+				error = ex.what();
+			}
+			current = processors[0].get();
+
+			lock.lock();
+			vp->exitPending = false;
+			smpRequests--;
+			if (!handled) {
+				vp->state = VpStopped;
+				smpCondition.notify_all();
+				throw std::runtime_error(error.empty() ? "Unknown exit reason on application processor" : error);
+			}
+		}
+		smpCondition.notify_all();
+	}
+
+	/** Stops the application processor threads */
+	void StopProcessors()
+	{
+		{
+			std::lock_guard<std::mutex> lock(smpMutex);
+			smpStopping = true;
+			smpCondition.notify_all();
+		}
+		for (size_t i = 1; i < processors.size(); i++) {
+			VirtualProcessor* vp = processors[i].get();
+			while (!vp->exited) {
+				backend->CancelRunVirtualProcessor(vp->index);
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			vp->thread.join();
+		}
+	}
+
+	UINT32 GetProcessorCount() { return (UINT32)processors.size(); }
+
+	/** Exits of the application processors */
+	unsigned long long GetApExitCounter()
+	{
+		std::lock_guard<std::mutex> lock(smpMutex);
+		unsigned long long n = 0;
+		for (size_t i = 1; i < processors.size(); i++) {
+			n += processors[i]->exitCounter;
+		}
+		return n;
+	}
+
+	/**
+	 * Queues an interrupt (vector) for injection. Can be called at any time, the
+	 * interrupt is delivered inside run() as soon as the guest can take it
+	 */
+	void irq(unsigned int irq, unsigned int priority = 0, bool level = false)
+	{
+		if (started) {
+			AsyncExit command;
+			memset(&command, 0x0, sizeof(command));
+			command.type = AsyncInject;
+			command.value[0] = irq;
+			command.value[1] = priority;
+			command.value[2] = level ? 1 : 0;
+			exits.PostCommand(command);
+			timer.Kick();
+			return;
+		}
+		irq_counter++;
+		irqs.Push((UINT8)irq, (UINT8)priority, level);
+	}
+
+	bool HasInterrupt() { return !irqs.Empty() || native.HasInterrupt(); }
+
+	/**
+	 * Injects the next queued (or native PIC) interrupt if the guest can take it
+	 * now, otherwise requests an interrupt window exit so it's retried when it
+	 * can. The interruptibility is taken from the last exit when there is one,
+	 * so the common case costs a single register write.
+	 */
+	void InjectInterrupt(const WHV_VP_EXIT_CONTEXT* state)
+	{
+		bool pending, enabled, shadow;
+		if (state != nullptr) {
+			pending = state->ExecutionState.InterruptionPending != 0;
+			enabled = ((state->Rflags >> 9) & 1) != 0;
+			shadow = state->ExecutionState.InterruptShadow != 0;
+		}
+		else {
+			WHV_REGISTER_NAME nn[3] = {
+				WHvRegisterPendingInterruption, WHvX64RegisterRflags, WHvRegisterInterruptState };
+			WHV_REGISTER_VALUE vv[3];
+
+			HRESULT hr = Registers().Get(nn, 3, vv);
+			if (hr != S_OK) {
+				throw std::runtime_error("Error raising IRQ");
+			}
+			pending = vv[0].PendingInterruption.InterruptionPending != 0;
+			enabled = ((vv[1].Reg64 >> 9) & 1) != 0;
+			shadow = vv[2].InterruptState.InterruptShadow != 0;
+		}
+		if (pending) {
+			return;
+		}
+
+		WHV_REGISTER_NAME name;
+		WHV_REGISTER_VALUE value;
+		memset(&value, 0x0, sizeof(value));
+		if (enabled && !shadow) {
+			FlushPosted();
+			inthandle_counter++;
+			name = WHvRegisterPendingInterruption;
+			value.PendingInterruption.InterruptionType = WHvX64PendingInterrupt;
+			value.PendingInterruption.InterruptionPending = 1;
+			value.PendingInterruption.InterruptionVector = irqs.Empty() ? native.AcknowledgeInterrupt() : irqs.Pop();
+			if (trace.IsRecording()) {
+				trace.AddInject(value.PendingInterruption.InterruptionVector);
+			}
+		}
+		else {
+			name = WHvX64RegisterDeliverabilityNotifications;
+			value.DeliverabilityNotifications.InterruptNotification = 1;
+		}
+
+		HRESULT hr = Registers().Set(&name, 1, &value);
+		if (hr != S_OK) {
+			throw std::runtime_error("Error raising IRQ");
+		}
+	}
+
+	/** Selects the native devices (NativeDeviceId mask) */
+	void SetNativeDevices(unsigned int mask)
+	{
+		RequireStopped();
+		native.SetEnabled(mask);
+	}
+
+	/** Changes an IRQ line level on the native PIC (or the JS one if it isn't native) */
+	void SetIrq(unsigned int line, bool level)
+	{
+		if (started) {
+			AsyncExit command;
+			memset(&command, 0x0, sizeof(command));
+			command.type = AsyncSetIrq;
+			command.value[0] = line;
+			command.value[1] = level ? 1 : 0;
+			exits.PostCommand(command);
+			timer.Kick();
+			return;
+		}
+		native.SetIrq(line, level);
+	}
+
+	/** Selects whether writes to a port range are posted (queued) instead of synchronous */
+	void SetPostedPorts(unsigned int first, unsigned int count, bool enable) { posted.SetPosted(first, count, enable); }
+	unsigned long long GetPostedCounter() { return posted.postedCounter; }
+
+	/** Number of edge triggered interrupts merged with one already queued */
+	unsigned long long GetIrqCoalescedCounter() { return irqs.coalescedCounter; }
+
+	/** Number of times the preemption timer took the virtual processor out of the guest */
+	unsigned long long GetPreemptCounter() { return timer.cancelCounter; }
+
+	unsigned char* GetDeviceState() { return native.GetStateBuffer(); }
+	size_t GetDeviceStateSize() { return native.GetStateSize(); }
+
+	unsigned char* getMemory() { return pMemory; }
+
+	/** True if guest RAM is in large pages */
+	bool HasLargePages() { return ram->HasLargePages(); }
+
+	/** True if the GPA range is guest RAM (mapped and backed by pMemory) */
+	bool IsRam(UINT64 gpa, UINT64 len)
+	{
+		const GpaRegion* r = regions.Find(gpa);
+		return r != nullptr && r->type == GpaRam && gpa + len <= r->end;
+	}
+
+	UINT64 MmioRead(UINT64 gpa, UINT8 size)
+	{
+		mem_counter++;
+		UINT64 value = 0;
+		DeviceMemory(gpa, false, size, (UINT8*)&value);
+		return size < 8 ? value & ((1ULL << (size * 8)) - 1) : value;
+	}
+
+	void MmioWrite(UINT64 gpa, UINT8 size, UINT64 value)
+	{
+		mem_counter++;
+		DeviceMemory(gpa, true, size, (UINT8*)&value);
+	}
+
+	/** Writes a register operand of the given size with the usual x86 merging rules */
+	static void SetGpr(WHV_REGISTER_VALUE* gprs, const MmioInstruction& ins, UINT8 size, UINT64 value)
+	{
+		UINT64& r = gprs[ins.reg].Reg64;
+		switch (size) {
+		case 1:
+			if (ins.regHigh8) {
+				r = (r & ~0xFF00ULL) | ((value & 0xFF) << 8);
+			}
+			else {
+				r = (r & ~0xFFULL) | (value & 0xFF);
+			}
+			break;
+		case 2:
+			r = (r & ~0xFFFFULL) | (value & 0xFFFF);
+			break;
+		case 4:
+			r = value & 0xFFFFFFFF;
+			break;
+		default:
+			r = value;
+			break;
+		}
+	}
+
+	static UINT64 GetGpr(const WHV_REGISTER_VALUE* gprs, const MmioInstruction& ins, UINT8 size)
+	{
+		UINT64 r = gprs[ins.reg].Reg64;
+		if (size == 1 && ins.regHigh8) {
+			r >>= 8;
+		}
+		return size < 8 ? r & ((1ULL << (size * 8)) - 1) : r;
+	}
+
+	/** RFLAGS after a logical operation (CF = OF = 0, SF, ZF and PF from the result) */
+	static UINT64 LogicFlags(UINT64 rflags, UINT64 result, UINT8 size)
+	{
+		rflags &= ~(UINT64)(0x1 | 0x4 | 0x40 | 0x80 | 0x800);
+		if (result == 0) {
+			rflags |= 0x40;
+		}
+		if ((result >> (size * 8 - 1)) & 1) {
+			rflags |= 0x80;
+		}
+		UINT8 p = (UINT8)result;
+		p ^= p >> 4;
+		p ^= p >> 2;
+		p ^= p >> 1;
+		if (!(p & 1)) {
+			rflags |= 0x4;
+		}
+		return rflags;
+	}
+
+	/**
+	 * Completes an MMIO exit with the in-process decoder (see MmioDecoder.h)
+	 * instead of the generic emulator. Registers are read and written with one
+	 * call each. Returns false to leave the exit to the emulator.
+	 */
+	bool HandleMmioFast(const WHV_RUN_VP_EXIT_CONTEXT& ctx)
+	{
+		const WHV_MEMORY_ACCESS_CONTEXT& ma = ctx.MemoryAccess;
+		if (ma.InstructionByteCount == 0 || ma.AccessInfo.AccessType == WHvMemoryAccessExecute) {
+			return false;
+		}
+
+		// GPRs 0-15, then RFLAGS, CR3, DS and ES
+		WHV_REGISTER_NAME names[20];
+		WHV_REGISTER_VALUE regs[20];
+		for (int i = 0; i < 16; i++) {
+			names[i] = (WHV_REGISTER_NAME)(WHvX64RegisterRax + i);
+		}
+		names[16] = WHvX64RegisterRflags;
+		names[17] = WHvX64RegisterCr3;
+		names[18] = WHvX64RegisterDs;
+		names[19] = WHvX64RegisterEs;
+		HRESULT hr = Registers().Get(names, 20, regs);
+		if (hr != S_OK) {
+			throw std::runtime_error("Error getting virtual registers");
+		}
+
+		bool longMode = ctx.VpContext.Cs.Long;
+		const MmioInstruction* pIns = mmioCache.Lookup(regs[17].Reg64, ctx.VpContext.Rip,
+			ma.InstructionBytes, ma.InstructionByteCount, longMode, ctx.VpContext.Cs.Default);
+		if (pIns == nullptr) {
+			return false;
+		}
+		const MmioInstruction& ins = *pIns;
+		bool isWrite = ma.AccessInfo.AccessType == WHvMemoryAccessWrite;
+		UINT64 gpa = ma.Gpa;
+		UINT64 rflags = regs[16].Reg64;
+		UINT8 size = ins.memSize;
+		UINT64 src = ins.useImm ? ins.imm : 0;
+		bool advance = true;
+
+		// Registers to write back: bit per GPR, plus RFLAGS
+		UINT32 written = 0;
+		bool flagsWritten = false;
+
+		switch (ins.op) {
+		case MmioLoad:
+		case MmioLoadZx:
+		case MmioLoadSx: {
+			if (isWrite) {
+				return false;
+			}
+			UINT64 value = MmioRead(gpa, size);
+			if (ins.op == MmioLoadSx) {
+				UINT64 sign = 1ULL << (size * 8 - 1);
+				value = (value ^ sign) - sign;
+			}
+			SetGpr(regs, ins, ins.op == MmioLoad ? size : ins.regSize, value);
+			written |= 1 << ins.reg;
+			break;
+		}
+		case MmioStore:
+		case MmioStoreImm:
+			if (!isWrite) {
+				return false;
+			}
+			MmioWrite(gpa, size, ins.op == MmioStore ? GetGpr(regs, ins, size) : src);
+			break;
+		case MmioAnd:
+		case MmioOr:
+		case MmioTest:
+		case MmioAndToReg:
+		case MmioOrToReg: {
+			if (isWrite) {
+				return false;  // The read comes first
+			}
+			if (!ins.useImm) {
+				src = GetGpr(regs, ins, size);
+			}
+			UINT64 value = MmioRead(gpa, size);
+			UINT64 result = (ins.op == MmioOr || ins.op == MmioOrToReg) ? (value | src) : (value & src);
+			if (ins.op == MmioAnd || ins.op == MmioOr) {
+				MmioWrite(gpa, size, result);
+			}
+			else if (ins.op != MmioTest) {
+				SetGpr(regs, ins, size, result);
+				written |= 1 << ins.reg;
+			}
+			rflags = LogicFlags(rflags, result, size);
+			flagsWritten = true;
+			break;
+		}
+		case MmioStos:
+		case MmioMovs: {
+			if ((rflags >> 10) & 1) {
+				return false;  // Backwards
+			}
+			UINT64 addrMask = ins.addrSize == 8 ? ~0ULL : ((1ULL << (ins.addrSize * 8)) - 1);
+			UINT64 count = ins.rep ? (regs[1].Reg64 & addrMask) : 1;
+			UINT64 rsi = regs[6].Reg64, rdi = regs[7].Reg64;
+			UINT64 done = 0;
+			if (ins.op == MmioStos) {
+				if (!isWrite) {
+					return false;
+				}
+				// All elements up to the end of the page go to the same device
+				UINT64 value = regs[0].Reg64 & (size < 8 ? ((1ULL << (size * 8)) - 1) : ~0ULL);
+				while (done < count && ((gpa & 0xFFF) + size) <= 4096) {
+					MmioWrite(gpa, size, value);
+					done++;
+					if (((gpa + size) & 0xFFF) == 0) {
+						break;
+					}
+					gpa += size;
+				}
+				if (done == 0) {
+					return false;
+				}
+			}
+			else if (count > 0) {
+				// One element, the other operand must be RAM
+				UINT64 otherIndex = isWrite ? rsi : rdi;
+				UINT64 base = longMode ? 0 : (isWrite ? regs[18].Segment.Base : regs[19].Segment.Base);
+				UINT64 gva = base + (otherIndex & addrMask);
+				WHV_TRANSLATE_GVA_RESULT res;
+				WHV_GUEST_PHYSICAL_ADDRESS other;
+				hr = backend->TranslateGva(current->index, gva,
+					isWrite ? WHvTranslateGvaFlagValidateRead : WHvTranslateGvaFlagValidateWrite, &res, &other);
+				if (hr != S_OK || res.ResultCode != WHvTranslateGvaResultSuccess || !IsRam(other, size)) {
+					return false;
+				}
+				UINT64 value = 0;
+				other = RamOffset(other);
+				if (isWrite) {
+					memcpy(&value, pMemory + other, size);
+					MmioWrite(gpa, size, value);
+				}
+				else {
+					value = MmioRead(gpa, size);
+					memcpy(pMemory + other, &value, size);
+					markdirty(other, size);
+				}
+				done = 1;
+			}
+
+			rdi = (rdi & ~addrMask) | ((rdi + done * size) & addrMask);
+			regs[7].Reg64 = rdi;
+			written |= 1 << 7;
+			if (ins.op == MmioMovs) {
+				rsi = (rsi & ~addrMask) | ((rsi + done * size) & addrMask);
+				regs[6].Reg64 = rsi;
+				written |= 1 << 6;
+			}
+			if (ins.rep) {
+				regs[1].Reg64 = (regs[1].Reg64 & ~addrMask) | (count - done);
+				written |= 1 << 1;
+				advance = count == done;
+			}
+			break;
+		}
+		case MmioLoadXmm:
+		case MmioStoreXmm: {
+			if (isWrite != (ins.op == MmioStoreXmm)) {
+				return false;
+			}
+			WHV_REGISTER_NAME xmmName = (WHV_REGISTER_NAME)(WHvX64RegisterXmm0 + ins.reg);
+			WHV_REGISTER_VALUE xmm;
+			if (isWrite) {
+				hr = Registers().Get(&xmmName, 1, &xmm);
+				if (hr != S_OK) {
+					throw std::runtime_error("Error getting virtual registers");
+				}
+				mem_counter++;
+				DeviceMemory(gpa, true, size, (UINT8*)&xmm.Reg128);
+			}
+			else {
+				// The loads zero the rest of the register
+				memset(&xmm, 0x0, sizeof(xmm));
+				mem_counter++;
+				DeviceMemory(gpa, false, size, (UINT8*)&xmm.Reg128);
+				hr = Registers().Set(&xmmName, 1, &xmm);
+				if (hr != S_OK) {
+					throw std::runtime_error("Error setting virtual registers");
+				}
+			}
+			break;
+		}
+		default:
+			return false;
+		}
+
+		mmio_fast_counter++;
+
+		WHV_REGISTER_NAME setNames[20];
+		WHV_REGISTER_VALUE setValues[20];
+		UINT32 n = 0;
+		for (int i = 0; i < 16; i++) {
+			if (written & (1 << i)) {
+				setNames[n] = names[i];
+				setValues[n++] = regs[i];
+			}
+		}
+		if (flagsWritten) {
+			setNames[n] = WHvX64RegisterRflags;
+			setValues[n++].Reg64 = rflags;
+		}
+		if (advance) {
+			setNames[n] = WHvX64RegisterRip;
+			setValues[n++].Reg64 = ctx.VpContext.Rip + ins.length;
+		}
+		if (n > 0) {
+			hr = Registers().Set(setNames, n, setValues);
+			if (hr != S_OK) {
+				throw std::runtime_error("Error setting virtual registers");
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Handles a plain IN/OUT without the instruction emulator: the exit context
+	 * already has the port, size, direction and RAX, so the only hypervisor call
+	 * left is one register set for RAX (reads) and RIP.
+	 */
+	void HandleSimpleIO(const WHV_RUN_VP_EXIT_CONTEXT& ctx)
+	{
+		const WHV_X64_IO_PORT_ACCESS_CONTEXT& io = ctx.IoPortAccess;
+		WHV_EMULATOR_IO_ACCESS_INFO access;
+		access.Direction = io.AccessInfo.IsWrite;
+		access.Port = io.PortNumber;
+		access.AccessSize = io.AccessInfo.AccessSize;
+		// Only the bytes accessed, as the emulator passes them
+		UINT8 size = (UINT8)io.AccessInfo.AccessSize;
+		access.Data = (UINT32)(io.Rax & (size == 1 ? 0xFF : size == 2 ? 0xFFFF : 0xFFFFFFFF));
+		HandleIO(&access);
+
+		WHV_REGISTER_NAME names[2] = { WHvX64RegisterRip, WHvX64RegisterRax };
+		WHV_REGISTER_VALUE values[2];
+		values[0].Reg64 = ctx.VpContext.Rip + ctx.VpContext.InstructionLength;
+		UINT32 n = 1;
+		if (!access.Direction) {
+			// IN AL/AX leave the rest of RAX alone, IN EAX zero extends
+			switch (access.AccessSize) {
+			case 1:
+				values[1].Reg64 = (io.Rax & ~0xFFULL) | (access.Data & 0xFF);
+				break;
+			case 2:
+				values[1].Reg64 = (io.Rax & ~0xFFFFULL) | (access.Data & 0xFFFF);
+				break;
+			default:
+				values[1].Reg64 = access.Data;
+				break;
+			}
+			n = 2;
+		}
+		HRESULT hr = Registers().Set(names, n, values);
+		if (hr != S_OK) {
+			throw std::runtime_error("Error setting virtual registers");
+		}
+	}
+
+	/**
+	 * Handles INS/OUTS (with or without REP) as a single transfer between the
+	 * port and a physically contiguous span of guest RAM, so a whole sector is
+	 * one device call instead of one per element. Only the part up to the first
+	 * discontiguity or non-RAM page, and at most MAX_STRING_IO_BYTES, is done
+	 * per exit; RCX is updated and RIP left alone for the rest, so the guest
+	 * restarts the instruction for it. Returns false to leave the instruction
+	 * to the generic emulator, e.g. for DF=1, segment overrides or natively
+	 * emulated ports.
+	 */
+	bool HandleStringIO(const WHV_RUN_VP_EXIT_CONTEXT& ctx)
+	{
+		const WHV_X64_IO_PORT_ACCESS_CONTEXT& io = ctx.IoPortAccess;
+		if ((ctx.VpContext.Rflags >> 10) & 1) {
+			return false;  // Backwards copies
+		}
+		if (native.HasHandler(io.PortNumber)) {
+			return false;
+		}
+
+		// Address size and segment from the prefixes
+		bool addrOverride = false;
+		for (int i = 0; i < io.InstructionByteCount; i++) {
+			UINT8 b = io.InstructionBytes[i];
+			if (b == 0x67) {
+				addrOverride = true;
+			}
+			else if (b == 0x26 || b == 0x2E || b == 0x36 || b == 0x64 || b == 0x65) {
+				return false;  // Only DS is handled for OUTS
+			}
+			else if (b != 0x66 && b != 0xF2 && b != 0xF3 && b != 0x3E &&
+				!(ctx.VpContext.Cs.Long && (b & 0xF0) == 0x40)) {
+				break;
+			}
+		}
+		UINT64 addrMask;
+		if (ctx.VpContext.Cs.Long) {
+			addrMask = addrOverride ? 0xFFFFFFFFULL : ~0ULL;
+		}
+		else if (ctx.VpContext.Cs.Default != addrOverride) {
+			addrMask = 0xFFFFFFFFULL;
+		}
+		else {
+			addrMask = 0xFFFFULL;
+		}
+
+		bool isWrite = io.AccessInfo.IsWrite;  // OUTS
+		UINT64 size = io.AccessInfo.AccessSize;
+		UINT64 count = io.AccessInfo.RepPrefix ? (io.Rcx & addrMask) : 1;
+		UINT64 index = isWrite ? io.Rsi : io.Rdi;
+
+		if (count > 0) {
+			const WHV_X64_SEGMENT_REGISTER& seg = isWrite ? io.Ds : io.Es;
+			UINT64 gva = (seg.Base + (index & addrMask)) & (ctx.VpContext.Cs.Long ? ~0ULL : 0xFFFFFFFFULL);
+			WHV_TRANSLATE_GVA_FLAGS flags = isWrite ? WHvTranslateGvaFlagValidateRead : WHvTranslateGvaFlagValidateWrite;
+
+			// Find the physically contiguous RAM span starting at the address
+			WHV_TRANSLATE_GVA_RESULT res;
+			WHV_GUEST_PHYSICAL_ADDRESS gpa;
+			HRESULT hr = backend->TranslateGva(current->index, gva, flags, &res, &gpa);
+			if (hr != S_OK || res.ResultCode != WHvTranslateGvaResultSuccess) {
+				return false;
+			}
+			UINT64 wanted = count < MAX_STRING_IO_BYTES / size ? count * size : MAX_STRING_IO_BYTES;
+			UINT64 span = 4096 - (gva & 0xFFF);
+			while (span < wanted) {
+				WHV_GUEST_PHYSICAL_ADDRESS next;
+				hr = backend->TranslateGva(current->index, gva + span, flags, &res, &next);
+				if (hr != S_OK || res.ResultCode != WHvTranslateGvaResultSuccess || next != gpa + span) {
+					break;
+				}
+				span += 4096;
+			}
+			if (span > wanted) {
+				span = wanted;
+			}
+			if (!a20 && span > 0x100000 - (gpa & 0xFFFFF)) {
+				span = 0x100000 - (gpa & 0xFFFFF);  // The next megabyte isn't contiguous in RAM
+			}
+			UINT64 done = span / size;
+			if (done == 0 || !IsRam(gpa, done * size)) {
+				return false;
+			}
+			gpa = RamOffset(gpa);
+			if (gpa + done * size > 0x100000000ULL) {
+				return false;  // The devices take 32-bit RAM offsets
+			}
+
+			if (!isWrite) {
+				markdirty(gpa, done * size);
+			}
+
+			stringio_counter++;
+			parambuf[0] = io.PortNumber;
+			parambuf[1] = (unsigned int)size;
+			parambuf[2] = isWrite ? 1 : 0;
+			parambuf[3] = (unsigned int)gpa;
+			parambuf[4] = (unsigned int)done;
+			devices->PortIoString();
+
+			count -= done;
+			index = (index & ~addrMask) | ((index + done * size) & addrMask);
+		}
+
+		WHV_REGISTER_NAME names[3];
+		WHV_REGISTER_VALUE values[3];
+		UINT32 n = 0;
+		names[n] = isWrite ? WHvX64RegisterRsi : WHvX64RegisterRdi;
+		values[n++].Reg64 = index;
+		if (io.AccessInfo.RepPrefix) {
+			names[n] = WHvX64RegisterRcx;
+			values[n++].Reg64 = (io.Rcx & ~addrMask) | count;
+		}
+		if (count == 0) {
+			names[n] = WHvX64RegisterRip;
+			values[n++].Reg64 = ctx.VpContext.Rip + ctx.VpContext.InstructionLength;
+		}
+		HRESULT hr = Registers().Set(names, n, values);
+		if (hr != S_OK) {
+			throw std::runtime_error("Error setting virtual registers");
+		}
+		return true;
+	}
+
+	HRESULT HandleIO(WHV_EMULATOR_IO_ACCESS_INFO * IoAccess)
+	{
+		if (native.HandleIO(IoAccess)) {
+			return S_OK;
+		}
+		if (IoAccess->Direction && !started && posted.IsPosted(IoAccess->Port)) {
+			posted.Post(IoAccess->Port, (UINT8)IoAccess->AccessSize, IoAccess->Data);
+			return S_OK;
+		}
+
+		io_counter++;
+		parambuf[0] = IoAccess->Port;
+		parambuf[1] = IoAccess->AccessSize;
+		parambuf[2] = IoAccess->Direction;
+		if (IoAccess->Direction) { // This is a write
+			parambuf[3] = IoAccess->Data;
+		}
+
+		devices->PortIo();
+
+		if (!IoAccess->Direction) {
+			// This is a read
+			IoAccess->Data = parambuf[0];
+		}
+		return S_OK;
+	}
+
+
+
+	void InternalHandle(WHV_EMULATOR_MEMORY_ACCESS_INFO * MemoryAccess) {
+		if (MemoryAccess->Direction) { // This is a write
+			if (MemoryAccess->AccessSize == 1) {
+				pMemory[MemoryAccess->GpaAddress] = *((unsigned char*)MemoryAccess->Data);
+			}
+			else if (MemoryAccess->AccessSize == 2) {
+				*((unsigned short*)(pMemory + MemoryAccess->GpaAddress)) = *((unsigned short*)MemoryAccess->Data);
+			}
+			else if (MemoryAccess->AccessSize == 4) {
+				*((unsigned int*)(pMemory + MemoryAccess->GpaAddress)) = *((unsigned int*)MemoryAccess->Data);
+			}
+		}
+		else {
+			if (MemoryAccess->AccessSize == 1) {
+				*((unsigned char*)MemoryAccess->Data) = pMemory[MemoryAccess->GpaAddress];
+			}
+			else if (MemoryAccess->AccessSize == 2) {
+				*((unsigned short*)MemoryAccess->Data) = *((unsigned short*)(pMemory + MemoryAccess->GpaAddress));
+			}
+			else if (MemoryAccess->AccessSize == 4) {
+				*((unsigned int*)MemoryAccess->Data) = *((unsigned int*)(pMemory + MemoryAccess->GpaAddress));
+			}
+		}
+	}
+
+	HRESULT HandleMemory(WHV_EMULATOR_MEMORY_ACCESS_INFO * MemoryAccess)
+	{
+		mem_counter++;
+		DeviceMemory(MemoryAccess->GpaAddress, MemoryAccess->Direction != 0, MemoryAccess->AccessSize,
+			MemoryAccess->Data);
+		return S_OK;
+	}
+
+	/**
+	 * An MMIO access of 1, 2, 4, 8 or 16 bytes for the devices. An 8 or 16 byte
+	 * access is one device call if the device takes that size (see
+	 * SetWideMemory), otherwise it's split into 4 byte accesses in address order
+	 */
+	void DeviceMemory(UINT64 gpa, bool write, UINT8 size, UINT8* data)
+	{
+		unsigned int* p = (unsigned int*)parambuf;
+
+		// A region with a handler of its own gets the offset in the region
+		unsigned int handler = 0;
+		UINT64 address = gpa;
+		const GpaRegion* region = regions.Find(gpa);
+		if (region != nullptr && region->type == GpaMmio && region->index != 0) {
+			handler = region->index;
+			address = gpa - region->start;
+		}
+
+		if (size > 4) {
+			if (!(handler < wideSizes.size() && (wideSizes[handler] & size))) {
+				for (UINT8 i = 0; i < size; i += 4) {
+					DeviceMemory(gpa + i, write, 4, data + i);
+				}
+				return;
+			}
+			mmioWideCounter++;
+		}
+		if (handler != 0) {
+			mmioHandlerCounter++;
+		}
+		p[0] = (unsigned int)address;
+
+		if (write) {
+			switch (size) {
+			case 1:
+				p[1] = *((unsigned char*)data);
+				break;
+			case 2:
+				p[1] = *((unsigned short*)data);
+				break;
+			case 4:
+				p[1] = *((unsigned int*)data);
+				break;
+			default:
+				memcpy(p + DeviceModel::WIDE_DATA_SLOT, data, size);
+				break;
+			}
+			devices->MemoryWrite(size, handler);
+		}
+		else {
+			devices->MemoryRead(size, handler);
+			switch (size) {
+			case 1:
+				*((unsigned char*)data) = (unsigned char)p[0];
+				break;
+			case 2:
+				*((unsigned short*)data) = (unsigned short)p[0];
+				break;
+			case 4:
+				*((unsigned int*)data) = (unsigned int)p[0];
+				break;
+			default:
+				memcpy(data, p + DeviceModel::WIDE_DATA_SLOT, size);
+				break;
+			}
+		}
+	}
+
+	/**
+	 * Selects whether a device handler (0 for the generic one) takes 8 and 16
+	 * byte MMIO accesses in one call
+	 */
+	void SetWideMemory(UINT32 handler, bool size8, bool size16)
+	{
+		RequireStopped();
+		if (handler >= wideSizes.size()) {
+			wideSizes.resize(handler + 1);
+		}
+		wideSizes[handler] = (size8 ? 8 : 0) | (size16 ? 16 : 0);
+	}
+
+	HRESULT HandleSetRegisters(const WHV_REGISTER_NAME * RegisterNames,
+		UINT32 RegisterCount,
+		const WHV_REGISTER_VALUE * RegisterValues) {
+		return Registers().Set(RegisterNames,
+			RegisterCount, RegisterValues);
+	}
+
+	HRESULT HandleGetRegisters(const WHV_REGISTER_NAME * RegisterNames,
+		UINT32 RegisterCount,
+		WHV_REGISTER_VALUE * RegisterValues) {
+		return Registers().Get(RegisterNames,
+			RegisterCount, RegisterValues);
+	}
+
+	HRESULT HandleTranslateRange(WHV_GUEST_VIRTUAL_ADDRESS GvaPage,
+		WHV_TRANSLATE_GVA_FLAGS TranslateFlags,
+		WHV_TRANSLATE_GVA_RESULT_CODE * TranslationResult,
+		WHV_GUEST_PHYSICAL_ADDRESS * GpaPage)
+	{
+		//WHvTranslateGva
+		WHV_TRANSLATE_GVA_RESULT res;
+		HRESULT hr = backend->TranslateGva(current->index, GvaPage, TranslateFlags, &res, GpaPage);
+		*TranslationResult = (WHV_TRANSLATE_GVA_RESULT_CODE)res.ResultCode;
+		return hr;
+	}
+
+	/** One operation of a remap() batch */
+	struct GpaOperation {
+		UINT64 addr;
+		UINT64 size;
+		bool map;  // Map RAM back, otherwise unmap it for MMIO
+		UINT32 handler;  // Unmap: device handler of the exact range, 0 for the generic one (see DeviceModel.h)
+	};
+
+	/**
+	 * Unmaps a range (whole pages) so its accesses exit as MMIO. With a
+	 * handler, the accesses to the range itself go to that handler with an
+	 * offset relative to addr
+	 */
+	void unmap(size_t addr, size_t sz, UINT32 handler = 0)
+	{
+		GpaOperation op = { addr, sz, false, handler };
+		remap(std::vector<GpaOperation>(1, op));
+	}
+
+	/**
+	 * Applies a batch of unmap and map-back operations, in order, e.g. for a
+	 * PCI BAR that moved. The registry is updated first; then the hypervisor
+	 * only gets the ranges whose state changed in the end, merged into as few
+	 * calls as possible. Only RAM can be mapped back. Returns the number of
+	 * hypervisor calls made
+	 */
+	unsigned int remap(const std::vector<GpaOperation>& ops)
+	{
+		RequireStopped();
+		GpaRegistry before = regions;
+		std::vector<std::pair<UINT64, UINT64>> touched;
+		for (const GpaOperation& op : ops) {
+			UINT64 start = op.addr & ~0xFFFULL;
+			UINT64 end = (op.addr + op.size + 0xFFF) & ~0xFFFULL;
+			if (op.map && end > m_sz) {
+				throw std::runtime_error("Only RAM can be mapped back");
+			}
+			for (const GpaRegion& piece : regions.Pieces(start, end)) {
+				if (op.map && piece.type == GpaMmio) {
+					regions.Set(piece.start, piece.end, GpaRam);
+				}
+				else if (!op.map && (piece.type == GpaRam || piece.type == GpaUnmapped)) {
+					regions.Set(piece.start, piece.end, GpaMmio);
+				}
+			}
+			if (!op.map && op.handler != 0) {
+				regions.Set(op.addr, op.addr + op.size, GpaMmio, op.handler);
+			}
+			touched.push_back(std::make_pair(start, end));
+		}
+
+		// What changed, as runs of the same change
+		std::sort(touched.begin(), touched.end());
+		std::vector<GpaOperation> changes;
+		UINT64 done = 0;
+		for (const std::pair<UINT64, UINT64>& range : touched) {
+			UINT64 start = std::max(range.first, done);
+			if (start >= range.second) {
+				continue;
+			}
+			done = range.second;
+			std::vector<UINT64> cuts;
+			for (const GpaRegion& piece : before.Pieces(start, range.second)) {
+				cuts.push_back(piece.start);
+			}
+			for (const GpaRegion& piece : regions.Pieces(start, range.second)) {
+				cuts.push_back(piece.start);
+			}
+			cuts.push_back(range.second);
+			std::sort(cuts.begin(), cuts.end());
+			cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+			for (size_t i = 0; i + 1 < cuts.size(); i++) {
+				bool wasRam = before.TypeAt(cuts[i]) == GpaRam;
+				bool isRam = regions.TypeAt(cuts[i]) == GpaRam;
+				if (wasRam == isRam) {
+					continue;
+				}
+				if (!changes.empty() && changes.back().map == isRam &&
+					changes.back().addr + changes.back().size == cuts[i]) {
+					changes.back().size += cuts[i + 1] - cuts[i];
+				}
+				else {
+					GpaOperation change = { cuts[i], cuts[i + 1] - cuts[i], isRam, 0 };
+					changes.push_back(change);
+				}
+			}
+		}
+
+		unsigned int calls = 0;
+		for (const GpaOperation& change : changes) {
+			HRESULT hr;
+			if (change.map) {
+				hr = MapRam(change.addr, change.addr + change.size, calls);
+			}
+			else {
+				hr = backend->UnmapGpaRange(change.addr, change.size);
+				calls++;
+			}
+			if (hr != S_OK) {
+				throw std::runtime_error(change.map ? "Couldn't map" : "Couldn't unmap");
+			}
+		}
+		return calls;
+	}
+
+	/** Maps RAM at [start, end), a megabyte at a time while A20 is off as the odd ones alias */
+	HRESULT MapRam(UINT64 start, UINT64 end, unsigned int& calls)
+	{
+		while (start < end) {
+			UINT64 next = a20 ? end : std::min(end, (start | 0xFFFFF) + 1);
+			HRESULT hr = backend->MapGpaRange(pMemory + RamOffset(start), start, next - start, ramFlags);
+			calls++;
+			if (hr != S_OK) {
+				return hr;
+			}
+			start = next;
+		}
+		return S_OK;
+	}
+
+	/** Type of the region of a GPA (GpaRegionType) */
+	GpaRegionType GetRegionType(UINT64 gpa) { return regions.TypeAt(gpa); }
+	size_t GetRegionCount() { return regions.Size(); }
+
+	/**
+	 * RAM region with dirty page tracking, e.g. a linear framebuffer. The guest
+	 * writes to it at native speed and JS sees it as an ArrayBuffer plus a
+	 * bitmap of the pages written since the last query. The hypervisor's dirty
+	 * page tracking is used where available; otherwise the region is mapped
+	 * read only and each page is made writable on its first write fault.
+	 */
+	class DirtyRegion
+	{
+	public:
+		UINT64 m_addr;
+		size_t m_sz;
+		bool hvTracked;  // Hypervisor dirty tracking, otherwise write protection
+		GuestMemory memory;
+		unsigned char* pMemory;
+		std::vector<UINT64> bitmap;  // Bit per page, valid after querydirty()
+		std::vector<UINT64> faulted;  // Pages written since the last query (write protection mode)
+
+		DirtyRegion(UINT64 addr, size_t sz) : m_addr(addr), m_sz(sz), hvTracked(false),
+			memory(sz, false), pMemory(memory.Get()),
+			bitmap((sz / 4096 + 63) / 64), faulted((sz / 4096 + 63) / 64)
+		{
+		}
+	};
+
+	std::vector<std::unique_ptr<DirtyRegion>> dirtyRegions;
+
+	/** Maps a dirty tracked RAM region (whole pages, not currently mapped). Returns its index */
+	unsigned int mapdirty(UINT64 addr, size_t sz)
+	{
+		if ((addr & 0xFFF) || (sz & 0xFFF) || sz == 0) {
+			throw std::runtime_error("Dirty tracked region must be page aligned");
+		}
+		RequireStopped();
+		std::unique_ptr<DirtyRegion> region = std::make_unique<DirtyRegion>(addr, sz);
+		HRESULT hr = backend->MapGpaRange(region->pMemory, addr, sz,
+			WHvMapGpaRangeFlagRead | WHvMapGpaRangeFlagWrite |
+			WHvMapGpaRangeFlagExecute | WHvMapGpaRangeFlagTrackDirtyPages);
+		if (hr == S_OK) {
+			region->hvTracked = true;
+		}
+		else {
+			hr = backend->MapGpaRange(region->pMemory, addr, sz,
+				WHvMapGpaRangeFlagRead | WHvMapGpaRangeFlagExecute);
+			if (hr != S_OK) {
+				throw std::runtime_error("Couldn't map dirty tracked region");
+			}
+		}
+		dirtyRegions.push_back(std::move(region));
+		unsigned int index = (unsigned int)(dirtyRegions.size() - 1);
+		regions.Set(addr, addr + sz, GpaDirty, index);
+		return index;
+	}
+
+	DirtyRegion* GetDirtyRegion(unsigned int index)
+	{
+		if (index >= dirtyRegions.size()) {
+			throw std::runtime_error("No such dirty tracked region");
+		}
+		return dirtyRegions[index].get();
+	}
+
+	/** Updates the region's bitmap with the pages written since the last call and returns their number */
+	unsigned int querydirty(unsigned int index)
+	{
+		DirtyRegion* region = GetDirtyRegion(index);
+		UINT64* bitmap = region->bitmap.data();
+		size_t words = region->bitmap.size();
+		std::lock_guard<std::mutex> lock(dirtyMutex);
+		if (region->hvTracked) {
+			HRESULT hr = backend->QueryGpaRangeDirtyBitmap(region->m_addr, region->m_sz,
+				bitmap, (UINT32)(words * sizeof(UINT64)));
+			if (hr != S_OK) {
+				throw std::runtime_error("Couldn't query dirty pages");
+			}
+		}
+		else {
+			// Collected by HandleDirtyFault. The pages are write protected again below
+			memcpy(bitmap, region->faulted.data(), words * sizeof(UINT64));
+			std::fill(region->faulted.begin(), region->faulted.end(), 0);
+		}
+
+		unsigned int count = 0;
+		for (size_t i = 0; i < words; i++) {
+			UINT64 bits = bitmap[i];
+			while (bits) {
+				count++;
+				if (!region->hvTracked) {
+					UINT64 offset = (i * 64 + CountTrailingZeros(bits)) * 4096;
+					HRESULT hr = backend->UnmapGpaRange(region->m_addr + offset, 4096);
+					if (hr == S_OK) {
+						hr = backend->MapGpaRange(region->pMemory + offset, region->m_addr + offset, 4096,
+							WHvMapGpaRangeFlagRead | WHvMapGpaRangeFlagExecute);
+					}
+					if (hr != S_OK) {
+						throw std::runtime_error("Couldn't write protect page");
+					}
+				}
+				bits &= bits - 1;
+			}
+		}
+		return count;
+	}
+
+	/** Write fault on a write protected dirty tracked page: record it and make the page writable */
+	bool HandleDirtyFault(const WHV_MEMORY_ACCESS_CONTEXT& access)
+	{
+		if (access.AccessInfo.AccessType != WHvMemoryAccessWrite || access.AccessInfo.GpaUnmapped) {
+			return false;
+		}
+		const GpaRegion* r = regions.Find(access.Gpa);
+		if (r == nullptr || r->type != GpaDirty) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(dirtyMutex);
+		DirtyRegion* region = dirtyRegions[r->index].get();
+		if (region->hvTracked) {
+			return false;
+		}
+		UINT64 page = (access.Gpa - region->m_addr) >> 12;
+		UINT64 offset = page * 4096;
+		region->faulted[page / 64] |= 1ULL << (page % 64);
+		HRESULT hr = backend->UnmapGpaRange(region->m_addr + offset, 4096);
+		if (hr == S_OK) {
+			hr = backend->MapGpaRange(region->pMemory + offset, region->m_addr + offset, 4096,
+				WHvMapGpaRangeFlagRead | WHvMapGpaRangeFlagWrite | WHvMapGpaRangeFlagExecute);
+		}
+		if (hr != S_OK) {
+			throw std::runtime_error("Couldn't unprotect page");
+		}
+		return true;
+	}
+
+	static unsigned int CountTrailingZeros(UINT64 v)
+	{
+		unsigned int n = 0;
+		while (!(v & 1)) {
+			v >>= 1;
+			n++;
+		}
+		return n;
+	}
+	/** Records a host side write to guest RAM (e.g. DMA from JS), which the hypervisor doesn't see. Any thread */
+	/** Records a host side write to guest RAM (e.g. DMA from JS), which the hypervisor doesn't see */
+	void markdirty(UINT64 gpa, UINT64 len)
+	{
+		if (len == 0 || gpa >= m_sz) {
+			return;
+		}
+		UINT64 last = (std::min(gpa + len, (UINT64)m_sz) - 1) / Checkpoint::PAGE_BYTES;
+		for (UINT64 page = gpa / Checkpoint::PAGE_BYTES; page <= last; page++) {
+			hostDirty[page / 64].fetch_or(1ULL << (page % 64), std::memory_order_relaxed);
+		}
+	}
+
+	/** ORs the pages of RAM the guest wrote since the last query into bitmap */
+	void QueryRamDirty(std::vector<UINT64>& bitmap)
+	{
+		// Query each RAM region separately, skipping the MMIO holes
+		std::vector<UINT64> bits;
+		for (const GpaRegion& piece : regions.Pieces(0, m_sz)) {
+			UINT64 start = piece.start;
+			UINT64 end = piece.end & ~0xFFFULL;
+			if (piece.type == GpaRam && end > start) {
+				UINT64 pages = (end - start) / Checkpoint::PAGE_BYTES;
+				bits.assign((pages + 63) / 64, 0);
+				HRESULT hr = backend->QueryGpaRangeDirtyBitmap(start, end - start,
+					bits.data(), (UINT32)(bits.size() * sizeof(UINT64)));
+				if (hr != S_OK) {
+					throw std::runtime_error("Couldn't query dirty pages");
+				}
+				for (UINT64 i = 0; i < pages; i++) {
+					if ((bits[i / 64] >> (i % 64)) & 1) {
+						UINT64 page = RamOffset(start + i * Checkpoint::PAGE_BYTES) / Checkpoint::PAGE_BYTES;
+						bitmap[page / 64] |= 1ULL << (page % 64);
+					}
+				}
+			}
+		}
+	}
+
+	/**
+	 * Writes a checkpoint of RAM, registers, MSRs, native device state and the
+	 * A20 gate. The first checkpoint (and every one if the hypervisor can't
+	 * track dirty pages) is full, the following ones only hold the pages
+	 * written since the previous one. The pages are copied here, so the cost
+	 * scales with the working set; the file is written by a background thread
+	 * while the guest runs on.
+	 */
+	void checkpoint(const std::string& path)
+	{
+		RequireStopped();
+		if (processors.size() > 1) {
+			throw std::runtime_error("Checkpoints only hold one processor");
+		}
+		waitcheckpoint();
+
+		std::unique_ptr<Checkpoint> c = std::make_unique<Checkpoint>();
+		const size_t page = Checkpoint::PAGE_BYTES;
+		std::vector<UINT64> dirty(hostDirty.size());
+		if (ramFlags & WHvMapGpaRangeFlagTrackDirtyPages) {
+			QueryRamDirty(dirty);  // Also resets the bits for a full checkpoint
+		}
+
+		c->header.memorySize = m_sz;
+		if (checkpointChainStarted && (ramFlags & WHvMapGpaRangeFlagTrackDirtyPages)) {
+			c->header.incremental = 1;
+			c->header.sequence = ++checkpointSequence;
+			c->header.chainId = checkpointChainId;
+			for (size_t i = 0; i < dirty.size(); i++) {
+				UINT64 bits = dirty[i] | hostDirty[i].exchange(0, std::memory_order_relaxed);
+				for (UINT64 b = 0; bits; b++, bits >>= 1) {
+					if (bits & 1) {
+						c->pages.push_back((UINT32)(i * 64 + b));
+					}
+				}
+			}
+			c->data.resize(c->pages.size() * page);
+			for (size_t i = 0; i < c->pages.size(); i++) {
+				memcpy(&c->data[i * page], pMemory + (size_t)c->pages[i] * page, page);
+			}
+		}
+		else {
+			checkpointSequence = 0;
+			checkpointChainId = NewCheckpointChainId();
+			c->header.chainId = checkpointChainId;
+			c->data.assign(pMemory, pMemory + m_sz);
+		}
+		c->header.pageCount = c->IsIncremental() ? c->pages.size() : m_sz / page;
+		if (!c->IsIncremental()) {
+			for (std::atomic<UINT64>& bits : hostDirty) {
+				bits.store(0, std::memory_order_relaxed);
+			}
+		}
+
+		std::vector<WHV_REGISTER_NAME> names = GetCheckpointRegisters();
+		c->registerNames.assign(names.begin(), names.end());
+		c->registers.resize(names.size());
+		HRESULT hr = Registers().Get(names.data(), (UINT32)names.size(), c->registers.data());
+		if (hr != S_OK) {
+			throw std::runtime_error("Couldn't get registers for checkpoint");
+		}
+		c->header.registerCount = (UINT32)names.size();
+		c->deviceState.assign(GetDeviceState(), GetDeviceState() + GetDeviceStateSize());
+		c->header.deviceStateSize = (UINT32)c->deviceState.size();
+		for (const std::pair<const UINT32, UINT64>& msr : processors[0]->msrs.GetValues()) {
+			CheckpointMsr m = { msr.first, 0, msr.second };
+			c->msrs.push_back(m);
+		}
+		c->header.msrCount = (UINT32)c->msrs.size();
+		c->header.a20 = a20 ? 1 : 0;
+		checkpointChainStarted = true;
+
+		checkpointWriter = std::thread([this, path](std::unique_ptr<Checkpoint> c) {
+			try {
+				c->Write(path);
+			}
+			catch (std::exception& ex) {
+				checkpointError = ex.what();
+			}
+		}, std::move(c));
+	}
+
+	/** Waits for the background write of the last checkpoint and reports its errors */
+	void waitcheckpoint()
+	{
+		if (checkpointWriter.joinable()) {
+			checkpointWriter.join();
+		}
+		if (!checkpointError.empty()) {
+			std::string error = checkpointError;
+			checkpointError.clear();
+			throw std::runtime_error(error);
+		}
+	}
+
+	/** Restores the machine to the last point of a checkpoint chain (full checkpoint first) */
+	void restorecheckpoint(const std::vector<std::string>& paths)
+	{
+		if (paths.empty()) {
+			throw std::runtime_error("No checkpoint to restore");
+		}
+		RequireStopped();
+		if (processors.size() > 1) {
+			throw std::runtime_error("Checkpoints only hold one processor");
+		}
+		waitcheckpoint();
+		Checkpoint c = Checkpoint::Read(paths[0]);
+		for (size_t i = 1; i < paths.size(); i++) {
+			c.Apply(Checkpoint::Read(paths[i]));
+		}
+		if (c.IsIncremental() || c.header.memorySize != m_sz) {
+			throw std::runtime_error("Checkpoint doesn't match the machine");
+		}
+		memcpy(pMemory, c.data.data(), m_sz);
+
+		std::vector<WHV_REGISTER_NAME> names(c.registerNames.size());
+		for (size_t i = 0; i < names.size(); i++) {
+			names[i] = (WHV_REGISTER_NAME)c.registerNames[i];
+		}
+		// Written at once so the control registers, EFER and segments are consistent
+		HRESULT hr = Registers().Set(names.data(), (UINT32)names.size(), c.registers.data());
+		if (hr == S_OK) {
+			hr = Registers().Flush();
+		}
+		if (hr != S_OK) {
+			throw std::runtime_error("Couldn't restore registers");
+		}
+		if (c.deviceState.size() == GetDeviceStateSize()) {
+			memcpy(GetDeviceState(), c.deviceState.data(), c.deviceState.size());
+		}
+		for (const CheckpointMsr& m : c.msrs) {
+			processors[0]->msrs.Set(m.index, m.value);
+		}
+		SetA20(c.header.a20 != 0);
+
+		// RAM was rewritten behind the hypervisor's back, so start a new chain
+		checkpointChainStarted = false;
+	}
+
+	/**
+	 * Writes a snapshot of the whole machine (see Snapshot.h): RAM, registers,
+	 * MSRs, the MMIO regions, native device state, the A20 gate and the JS
+	 * state put in the buffer of SetSnapshotStateSize(). A machine created
+	 * from it carries on from here. RAM isn't copied, so the file is written
+	 * before returning
+	 */
+	void snapshot(const std::string& path, bool compress)
+	{
+		RequireStopped();
+		if (processors.size() > 1) {
+			throw std::runtime_error("Snapshots only hold one processor");
+		}
+		Snapshot s;
+		std::vector<WHV_REGISTER_NAME> names = GetCheckpointRegisters();
+		s.registerNames.assign(names.begin(), names.end());
+		s.registers.resize(names.size());
+		HRESULT hr = Registers().Get(names.data(), (UINT32)names.size(), s.registers.data());
+		if (hr != S_OK) {
+			throw std::runtime_error("Couldn't get registers for snapshot");
+		}
+		for (const GpaRegion& r : regions.Pieces(0, MAX_GPA)) {
+			if (r.type != GpaUnmapped) {
+				SnapshotRegion region = { r.start, r.end, (UINT32)r.type, r.index };
+				s.regions.push_back(region);
+			}
+		}
+		for (const std::pair<const UINT32, UINT64>& msr : processors[0]->msrs.GetValues()) {
+			SnapshotMsr m = { msr.first, 0, msr.second };
+			s.msrs.push_back(m);
+		}
+		s.deviceState.assign(GetDeviceState(), GetDeviceState() + GetDeviceStateSize());
+		if (snapshotStateSize != 0) {
+			s.userState.assign(snapshotStateBuffers.back().get(), snapshotStateBuffers.back().get() + snapshotStateSize);
+		}
+		s.header.a20 = a20 ? 1 : 0;
+		s.header.clock = MachineClock::Now();
+		s.Write(path, pMemory, m_sz, compress);
+	}
+
+	/**
+	 * Buffer of the given size for the JS state of the next snapshot. Earlier
+	 * buffers stay allocated, as JS may still hold them
+	 */
+	unsigned char* SetSnapshotStateSize(size_t size)
+	{
+		if (snapshotStateBuffers.empty() || size > snapshotStateCapacity) {
+			snapshotStateBuffers.push_back(std::make_unique<unsigned char[]>(size));
+			snapshotStateCapacity = size;
+		}
+		snapshotStateSize = size;
+		return snapshotStateBuffers.back().get();
+	}
+
+	/** True if the machine was started from a snapshot, mapped: if its RAM is mapped from the file */
+	bool IsFromSnapshot() { return !startSnapshot.empty(); }
+	bool IsSnapshotMapped() { return snapshotMapped; }
+
+	/** The JS state of the snapshot the machine was started from */
+	std::vector<unsigned char>& GetRestoredState() { return restoredState; }
+
+	/** Restores what a snapshot holds besides RAM, at the end of the constructor */
+	void RestoreSnapshot(const Snapshot& s)
+	{
+		std::vector<WHV_REGISTER_NAME> names(s.registerNames.size());
+		for (size_t i = 0; i < names.size(); i++) {
+			names[i] = (WHV_REGISTER_NAME)s.registerNames[i];
+		}
+		HRESULT hr = Registers().Set(names.data(), (UINT32)names.size(), s.registers.data());
+		if (hr == S_OK) {
+			hr = Registers().Flush();
+		}
+		if (hr != S_OK) {
+			throw std::runtime_error("Couldn't restore registers");
+		}
+		for (const SnapshotMsr& m : s.msrs) {
+			processors[0]->msrs.Set(m.index, m.value);
+		}
+		if (s.deviceState.size() == GetDeviceStateSize()) {
+			memcpy(GetDeviceState(), s.deviceState.data(), s.deviceState.size());
+			native.SetEnabled(native.GetEnabled());
+			native.Rebase(s.header.clock, MachineClock::Now());
+		}
+
+		// MMIO goes to the generic handler until JS registers its handlers again, dirty regions are
+		// mapped by JS as well
+		std::vector<GpaOperation> ops;
+		for (const SnapshotRegion& r : s.regions) {
+			if (r.type == GpaMmio) {
+				GpaOperation op = { r.start, r.end - r.start, false, 0 };
+				ops.push_back(op);
+			}
+		}
+		if (!ops.empty()) {
+			remap(ops);
+		}
+		SetA20(s.header.a20 != 0);
+		restoredState = s.userState;
+	}
+
+	HRESULT memmap(unsigned char* mem,
+		size_t amount,
 		unsigned int a20,
 		unsigned int remap) {
 		if (remap) {
-			return S_OK;
+			// Only the odd megabytes change, as one batch of unmaps followed by one of maps
+			std::vector<std::pair<UINT64, UINT64>> ranges = OddMegabyteRanges(amount);
+			HRESULT hr = S_OK;
+			if (ramFlags & WHvMapGpaRangeFlagTrackDirtyPages) {
+				hr = SaveDirtyPages(ranges);  // The new mappings start out clean
+			}
+			for (size_t i = 0; i < ranges.size() && hr == S_OK; i++) {
+				hr = backend->UnmapGpaRange(ranges[i].first, ranges[i].second);
+			}
+			for (size_t i = 0; i < ranges.size() && hr == S_OK; i++) {
+				UINT64 offset = a20 ? ranges[i].first : ranges[i].first - 1024 * 1024;
+				hr = backend->MapGpaRange(mem + offset, ranges[i].first, ranges[i].second, ramFlags);
+			}
+			return hr;
+		}
+		if (a20) {
+			// All of RAM as one range, so the hypervisor can use large pages for it too
+			return backend->MapGpaRange(mem, 0, amount, ramFlags);
 		}
 		// Amount must be in whole megabyte
 		for (size_t i = 0; i < amount; i += 1024 * 1024) {
 			unsigned char* target = mem + i;
-			if (!a20) {
-				if ((i / (1024 * 1024)) % 2 == 1) {
-					// Odd MB without A20
-					target -= 1024 * 1024;
-				}
+			if ((i / (1024 * 1024)) % 2 == 1) {
+				// Odd MB without A20
+				target -= 1024 * 1024;
 			}
-			/*		if (remap) {
-									HRESULT hr = WHvUnmapGpaRange(partitionHandle, i,
-			   1024 * 1024); if (hr != S_OK) { return hr;
-									}
-							} */
 			HRESULT hr =
-				WHvMapGpaRange(partitionHandle, target, i, 1024 * 1024,
-					WHvMapGpaRangeFlagRead | WHvMapGpaRangeFlagWrite |
-					WHvMapGpaRangeFlagExecute);
+				backend->MapGpaRange(target, i, 1024 * 1024, ramFlags);
 			if (hr != S_OK) {
 				return hr;
 			}
@@ -719,17 +2415,154 @@ public:
 		return S_OK;
 	}
 
-	void SetJSObject(CefRefPtr<CefV8Value> pJsobj)
+	/** The RAM regions (start, length) in the odd megabytes, i.e. without MMIO holes, dirty regions and ROM */
+	std::vector<std::pair<UINT64, UINT64>> OddMegabyteRanges(UINT64 amount)
 	{
-		jsobj = pJsobj;
+		std::vector<std::pair<UINT64, UINT64>> ranges;
+		for (UINT64 mb = 1024 * 1024; mb < amount; mb += 2 * 1024 * 1024) {
+			for (const GpaRegion& piece : regions.Pieces(mb, std::min(mb + 1024 * 1024, amount))) {
+				if (piece.type == GpaRam) {
+					ranges.push_back(std::make_pair(piece.start, piece.end - piece.start));
+				}
+			}
+		}
+		return ranges;
 	}
 
-	unsigned char* GetParamBuf()
+	/** Moves the dirty bits of RAM ranges that are about to be remapped to hostDirty */
+	HRESULT SaveDirtyPages(const std::vector<std::pair<UINT64, UINT64>>& ranges)
+	{
+		std::vector<UINT64> bits;
+		for (const std::pair<UINT64, UINT64>& range : ranges) {
+			UINT64 pages = range.second / Checkpoint::PAGE_BYTES;
+			bits.assign((pages + 63) / 64, 0);
+			HRESULT hr = backend->QueryGpaRangeDirtyBitmap(range.first, range.second,
+				bits.data(), (UINT32)(bits.size() * sizeof(UINT64)));
+			if (hr != S_OK) {
+				return hr;
+			}
+			for (UINT64 i = 0; i < pages; i++) {
+				if ((bits[i / 64] >> (i % 64)) & 1) {
+					markdirty(RamOffset(range.first + i * Checkpoint::PAGE_BYTES), Checkpoint::PAGE_BYTES);
+				}
+			}
+		}
+		return S_OK;
+	}
+
+	/**
+	 * Opens or closes the A20 gate, as the JS side's port 0x92 and keyboard
+	 * controller output port do. While it's closed the odd megabytes show the
+	 * megabyte below them. Only those ranges are remapped; the unmap() holes,
+	 * dirty regions and the BIOS shadow are left alone
+	 */
+	void seta20(bool enabled)
+	{
+		if (started) {
+			AsyncExit command;
+			memset(&command, 0x0, sizeof(command));
+			command.type = AsyncSetA20;
+			command.value[0] = enabled ? 1 : 0;
+			exits.PostCommand(command);
+			timer.Kick();
+			return;
+		}
+		SetA20(enabled);
+	}
+
+	void SetA20(bool enabled)
+	{
+		if (enabled == a20) {
+			return;
+		}
+		HRESULT hr = memmap(pMemory, m_sz, enabled ? 1 : 0, 1);
+		if (hr != S_OK) {
+			throw std::runtime_error("Couldn't remap memory for A20");
+		}
+		a20 = enabled;
+		a20Counter++;
+	}
+
+	bool GetA20() { return a20; }
+	unsigned long long GetA20Counter() { return a20Counter; }
+	unsigned long long GetMmioHandlerCounter() { return mmioHandlerCounter; }
+	unsigned long long GetMmioWideCounter() { return mmioWideCounter; }
+
+	/** Native CPUID answers, see CpuidTable.h */
+	CpuidTable& GetCpuidTable() { return cpuid; }
+
+	/**
+	 * Starts recording the exits of the boot processor to a trace file (see
+	 * ExitTrace.h), which TraceReplay can replay without a hypervisor
+	 */
+	void StartTrace(const std::string& path)
 	{
-		return (unsigned char*)this->parambuf;
+		RequireStopped();
+		trace.Open(path, m_sz, native.GetEnabled());
 	}
 
+	void StopTrace()
+	{
+		RequireStopped();
+		trace.Close();
+	}
+
+	unsigned long long GetTraceCounter() { return trace.recordCounter; }
+
+	/** Name of a MachineCounter, as in "io_counter" */
+	static const char* CounterName(unsigned int counter);
+
+	/**
+	 * Copies the counters into the buffer JS reads them from as doubles,
+	 * indexed by MachineCounter. Call it on the JS thread, e.g. at the end of
+	 * run() and service()
+	 */
+	void PublishCounters()
+	{
+		double* c = counterBuffer;
+		c[CounterRunLoop] = (double)run_loop_counter;
+		c[CounterIo] = (double)io_counter;
+		c[CounterIrq] = (double)irq_counter;
+		c[CounterMem] = (double)mem_counter;
+		c[CounterIntHandle] = (double)inthandle_counter;
+		c[CounterMmioFast] = (double)mmio_fast_counter;
+		c[CounterStringIo] = (double)stringio_counter;
+		c[CounterPosted] = (double)GetPostedCounter();
+		c[CounterIrqCoalesced] = (double)GetIrqCoalescedCounter();
+		c[CounterApExit] = (double)GetApExitCounter();
+		c[CounterMmioHandler] = (double)mmioHandlerCounter;
+		c[CounterMmioWide] = (double)mmioWideCounter;
+		c[CounterCpuidNative] = (double)cpuidNativeCounter;
+		c[CounterMsrNative] = (double)msrNativeCounter;
+		c[CounterMsrUnknown] = (double)msrUnknownCounter;
+		c[CounterTrace] = (double)trace.recordCounter;
+		c[CounterA20] = (double)a20Counter;
+		c[CounterPreempt] = (double)GetPreemptCounter();
+		c[CounterAsyncRequest] = (double)exits.requestCounter;
+		c[CounterAsyncWait] = (double)exits.waitCounter;
+		c[CounterAsyncBatch] = (double)exits.batchCounter;
+	}
+
+	double* GetCounterBuffer() { return counterBuffer; }
+	size_t GetCounterBufferSize() { return sizeof(counterBuffer); }
 
-	IMPLEMENT_REFCOUNTING(CMachine);
+	/** Exit latencies and hotspots of the boot processor, see ExitStats.h */
+	ExitStats& GetStats() { return stats; }
+	unsigned long long GetCpuidNativeCounter() { return cpuidNativeCounter; }
+	unsigned long long GetMsrNativeCounter() { return msrNativeCounter; }
+	unsigned long long GetMsrUnknownCounter() { return msrUnknownCounter; }
+
+	/** Offset in RAM of a RAM GPA, taking the A20 gate into account */
+	UINT64 RamOffset(UINT64 gpa) { return a20 ? gpa : gpa & ~(1ULL << 20); }
+
+	unsigned char* GetParamBuf()
+	{
+		return (unsigned char*)this->jsParambuf;
+	}
+
+	unsigned char* GetPostBuf()
+	{
+		return (unsigned char*)this->jsParambuf + 4096;
+	}
 };
 
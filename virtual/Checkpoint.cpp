@@ -0,0 +1,127 @@
+#include "Checkpoint.h"
+
+#include <string.h>
+
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+
+static const char CHECKPOINT_MAGIC[8] = "V86CKPT";
+
+Checkpoint::Checkpoint()
+{
+	memset(&header, 0x0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.version = VERSION;
+}
+
+void Checkpoint::Write(const std::string& path) const
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out) {
+		throw std::runtime_error("Couldn't create checkpoint file");
+	}
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)registerNames.data(), registerNames.size() * sizeof(UINT32));
+	out.write((const char*)registers.data(), registers.size() * sizeof(WHV_REGISTER_VALUE));
+	out.write((const char*)deviceState.data(), deviceState.size());
+	out.write((const char*)msrs.data(), msrs.size() * sizeof(CheckpointMsr));
+	out.write((const char*)pages.data(), pages.size() * sizeof(UINT32));
+	out.write((const char*)data.data(), data.size());
+	if (!out) {
+		throw std::runtime_error("Couldn't write checkpoint file");
+	}
+}
+
+Checkpoint Checkpoint::Read(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		throw std::runtime_error("Couldn't open checkpoint file");
+	}
+	Checkpoint c;
+	in.read((char*)&c.header, sizeof(c.header));
+	if (!in || memcmp(c.header.magic, CHECKPOINT_MAGIC, sizeof(c.header.magic)) != 0) {
+		throw std::runtime_error("Not a checkpoint file");
+	}
+	if (c.header.version != VERSION) {
+		throw std::runtime_error("Unsupported checkpoint version");
+	}
+
+	c.registerNames.resize(c.header.registerCount);
+	c.registers.resize(c.header.registerCount);
+	c.deviceState.resize(c.header.deviceStateSize);
+	c.msrs.resize(c.header.msrCount);
+	if (c.header.incremental) {
+		c.pages.resize(c.header.pageCount);
+	}
+	else if (c.header.pageCount * PAGE_BYTES != c.header.memorySize) {
+		throw std::runtime_error("Corrupt checkpoint file");
+	}
+	c.data.resize(c.header.pageCount * PAGE_BYTES);
+
+	in.read((char*)c.registerNames.data(), c.registerNames.size() * sizeof(UINT32));
+	in.read((char*)c.registers.data(), c.registers.size() * sizeof(WHV_REGISTER_VALUE));
+	in.read((char*)c.deviceState.data(), c.deviceState.size());
+	in.read((char*)c.msrs.data(), c.msrs.size() * sizeof(CheckpointMsr));
+	in.read((char*)c.pages.data(), c.pages.size() * sizeof(UINT32));
+	in.read((char*)c.data.data(), c.data.size());
+	if (!in) {
+		throw std::runtime_error("Truncated checkpoint file");
+	}
+	return c;
+}
+
+void Checkpoint::Apply(const Checkpoint& next)
+{
+	if (IsIncremental()) {
+		throw std::runtime_error("Checkpoints must be applied to a full checkpoint");
+	}
+	if (!next.IsIncremental() || next.header.chainId != header.chainId ||
+		next.header.sequence != header.sequence + 1 || next.header.memorySize != header.memorySize) {
+		throw std::runtime_error("Checkpoint isn't the next one of the chain");
+	}
+	for (size_t i = 0; i < next.pages.size(); i++) {
+		size_t offset = (size_t)next.pages[i] * PAGE_BYTES;
+		if (offset + PAGE_BYTES > data.size()) {
+			throw std::runtime_error("Corrupt checkpoint file");
+		}
+		memcpy(&data[offset], &next.data[i * PAGE_BYTES], PAGE_BYTES);
+	}
+	registerNames = next.registerNames;
+	registers = next.registers;
+	deviceState = next.deviceState;
+	msrs = next.msrs;
+	header.sequence = next.header.sequence;
+	header.registerCount = next.header.registerCount;
+	header.deviceStateSize = next.header.deviceStateSize;
+	header.msrCount = next.header.msrCount;
+	header.a20 = next.header.a20;
+}
+
+UINT64 NewCheckpointChainId()
+{
+	std::random_device random;
+	UINT64 id = ((UINT64)random() << 32) | random();
+	return id ^ (UINT64)std::chrono::system_clock::now().time_since_epoch().count();
+}
+
+std::vector<WHV_REGISTER_NAME> GetCheckpointRegisters()
+{
+	std::vector<WHV_REGISTER_NAME> names;
+	for (UINT32 r = WHvX64RegisterRax; r <= WHvX64RegisterDr7; r++) {
+		names.push_back((WHV_REGISTER_NAME)r);
+	}
+	for (UINT32 r = WHvX64RegisterXmm0; r <= WHvX64RegisterXmmControlStatus; r++) {
+		names.push_back((WHV_REGISTER_NAME)r);
+	}
+	WHV_REGISTER_NAME msrs[] = {
+		WHvX64RegisterTsc, WHvX64RegisterEfer, WHvX64RegisterKernelGsBase, WHvX64RegisterApicBase,
+		WHvX64RegisterPat, WHvX64RegisterSysenterCs, WHvX64RegisterSysenterEip, WHvX64RegisterSysenterEsp,
+		WHvX64RegisterStar, WHvX64RegisterLstar, WHvX64RegisterCstar, WHvX64RegisterSfmask,
+		WHvX64RegisterMsrMtrrDefType, WHvX64RegisterTscAux,
+		WHvRegisterPendingInterruption, WHvRegisterInterruptState, WHvX64RegisterDeliverabilityNotifications };
+	names.insert(names.end(), msrs, msrs + sizeof(msrs) / sizeof(msrs[0]));
+	return names;
+}
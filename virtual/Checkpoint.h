@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "WinHvCompat.h"
+
+/**
+ * Guest RAM and vCPU state checkpoints.
+ *
+ * A chain starts with a full checkpoint holding all of RAM. Each following
+ * checkpoint only holds the pages written since the previous one, so any
+ * point of the chain is rebuilt by applying the incremental checkpoints in
+ * order on top of the full one (see CheckpointRestore.cpp). All checkpoints
+ * of a chain carry its identifier, so one of another chain is rejected.
+ *
+ * File layout: CheckpointHeader, register names (UINT32 each), register
+ * values, native device state, MSRs, page numbers (UINT32 each, incremental
+ * checkpoints only) and finally the page contents.
+ */
+
+struct CheckpointHeader {
+	char magic[8];           // "V86CKPT"
+	UINT32 version;
+	UINT32 incremental;      // 0 = full checkpoint
+	UINT64 sequence;         // Position in the chain, 0 for the full checkpoint
+	UINT64 chainId;          // Picked by the full checkpoint, copied into the incremental ones
+	UINT64 memorySize;
+	UINT64 pageCount;        // Pages stored
+	UINT32 registerCount;
+	UINT32 deviceStateSize;
+	UINT32 msrCount;         // MSRs of the processor's MsrStore
+	UINT32 a20;              // A20 gate open
+};
+
+/** An MSR of the processor's MsrStore */
+struct CheckpointMsr {
+	UINT32 index;
+	UINT32 reserved;
+	UINT64 value;
+};
+
+class Checkpoint {
+public:
+	static const UINT32 VERSION = 4;
+	static const size_t PAGE_BYTES = 4096;
+
+	CheckpointHeader header;
+	std::vector<UINT32> registerNames;
+	std::vector<WHV_REGISTER_VALUE> registers;
+	std::vector<unsigned char> deviceState;
+	std::vector<CheckpointMsr> msrs;
+	std::vector<UINT32> pages;         // Page numbers, incremental checkpoints only
+	std::vector<unsigned char> data;   // Page contents, in the order of pages
+
+	Checkpoint();
+
+	bool IsIncremental() const { return header.incremental != 0; }
+
+	void Write(const std::string& path) const;
+	static Checkpoint Read(const std::string& path);
+
+	/** Applies the next incremental checkpoint of the chain to this full one */
+	void Apply(const Checkpoint& next);
+};
+
+/** A new chain identifier for a full checkpoint, random and mixed with the clock */
+UINT64 NewCheckpointChainId();
+
+/** The registers saved in a checkpoint */
+std::vector<WHV_REGISTER_NAME> GetCheckpointRegisters();
@@ -0,0 +1,39 @@
+// Rebuilds a full checkpoint from a checkpoint chain, e.g.
+//
+//   cefvirtual_restore out.ckpt base.ckpt 1.ckpt 2.ckpt
+//
+// gives the state of 2.ckpt as a single full checkpoint. Passing a prefix of
+// the chain gives any earlier point.
+
+#include <stdio.h>
+
+#include <exception>
+
+#include "Checkpoint.h"
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <output> <full checkpoint> [incremental checkpoints...]\n", argv[0]);
+		return 1;
+	}
+	try {
+		Checkpoint c = Checkpoint::Read(argv[2]);
+		if (c.IsIncremental()) {
+			fprintf(stderr, "%s isn't a full checkpoint\n", argv[2]);
+			return 1;
+		}
+		for (int i = 3; i < argc; i++) {
+			c.Apply(Checkpoint::Read(argv[i]));
+		}
+		c.Write(argv[1]);
+		printf("Restored point %llu of the chain (%llu MB of RAM) to %s\n",
+			(unsigned long long)c.header.sequence,
+			(unsigned long long)(c.header.memorySize >> 20), argv[1]);
+	}
+	catch (std::exception& ex) {
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+	return 0;
+}
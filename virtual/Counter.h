@@ -0,0 +1,20 @@
+#pragma once
+
+#include <atomic>
+
+/**
+ * Statistics counter that may be read on another thread than the one
+ * counting, e.g. by JS in service() while the processor thread runs. It's a
+ * relaxed atomic: readers see a recent value and counting stays cheap.
+ */
+class Counter {
+private:
+	std::atomic<unsigned long long> value;
+
+public:
+	Counter() : value(0) {}
+
+	void operator++(int) { value.fetch_add(1, std::memory_order_relaxed); }
+	void operator=(unsigned long long v) { value.store(v, std::memory_order_relaxed); }
+	operator unsigned long long() const { return value.load(std::memory_order_relaxed); }
+};
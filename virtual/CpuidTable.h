@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string.h>
+
+#include <mutex>
+#include <unordered_map>
+
+#include "WinHvCompat.h"
+
+enum CpuidFlags {
+	CpuidAnySubleaf = 1,  // The entry answers the leaf whatever ECX is
+	CpuidDynamic = 2      // Always ask the device model (JS), e.g. for values that change at run time
+};
+
+/**
+ * CPUID results answered natively, by leaf and subleaf (ECX), so a CPUID exit
+ * doesn't need a call into the device model. JS fills the table once at
+ * start and can change it later; leaves that aren't in it, or that are marked
+ * dynamic, still go to the device model. Lookups come from all the processor
+ * threads, so the table is guarded by a mutex.
+ */
+class CpuidTable {
+private:
+	static const UINT32 ANY_SUBLEAF = 0xFFFFFFFF;
+
+	struct Entry {
+		UINT32 values[4];  // EAX, EBX, ECX, EDX
+		UINT32 flags;
+	};
+
+	std::unordered_map<UINT64, Entry> entries;  // By leaf << 32 | subleaf
+	std::mutex mutex;
+
+	static UINT64 Key(UINT32 leaf, UINT32 subleaf) { return (UINT64)leaf << 32 | subleaf; }
+
+public:
+	/** Adds or replaces the entry of a leaf (and subleaf unless flags has CpuidAnySubleaf) */
+	void Set(UINT32 leaf, UINT32 subleaf, const UINT32 values[4], UINT32 flags)
+	{
+		Entry e;
+		memcpy(e.values, values, sizeof(e.values));
+		e.flags = flags;
+		std::lock_guard<std::mutex> lock(mutex);
+		entries[Key(leaf, (flags & CpuidAnySubleaf) ? ANY_SUBLEAF : subleaf)] = e;
+	}
+
+	void Clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		entries.clear();
+	}
+
+	/** Fills out (EAX, EBX, ECX, EDX) and returns true if the leaf is answered natively */
+	bool Lookup(UINT32 leaf, UINT32 subleaf, UINT32 out[4])
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = entries.find(Key(leaf, subleaf));
+		if (it == entries.end()) {
+			it = entries.find(Key(leaf, ANY_SUBLEAF));
+			if (it == entries.end()) {
+				return false;
+			}
+		}
+		if (it->second.flags & CpuidDynamic) {
+			return false;
+		}
+		memcpy(out, it->second.values, sizeof(it->second.values));
+		return true;
+	}
+
+	size_t Size()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return entries.size();
+	}
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+/**
+ * The device side of the machine - in production the v86 JavaScript code.
+ *
+ * CMachine calls into this whenever an exit needs a device. As on the JS side,
+ * parameters and results are exchanged through the machine's parameter buffer
+ * rather than as arguments:
+ *
+ *  PortIo:      in [0] port, [1] size, [2] direction (1 = write), [3] data
+ *               out [0] data (reads)
+ *  PortIoString: in [0] port, [1] size, [2] direction (1 = OUTS), [3] GPA,
+ *               [4] count - transfers count elements between the port and
+ *               guest memory at GPA
+ *  MemoryRead:  in [0] GPA, out [0] data
+ *  MemoryWrite: in [0] GPA, [1] data
+ *
+ * 8 and 16 byte memory accesses (only for devices that asked for them, see
+ * CMachine::SetWideMemory) have their data in the 64-bit slots from
+ * WIDE_DATA_SLOT (byte 16) instead.
+ *
+ * For MMIO regions that were given a handler (see CMachine::unmap) the memory
+ * calls carry its number, and [0] is the offset in the region instead of the
+ * GPA. Handler 0 is the generic one.
+ *
+ * PortWrites hands over a batch of posted port writes, which are in the
+ * posted write buffer instead (see PostedWrites.h).
+ */
+class DeviceModel {
+public:
+	static const unsigned int WIDE_DATA_SLOT = 4;
+
+	virtual ~DeviceModel() {}
+
+	virtual void PortIo() = 0;
+
+	/** A whole INS/OUTS (REP) transfer */
+	virtual void PortIoString() = 0;
+
+	/** The first count entries of the posted write buffer, in guest order */
+	virtual void PortWrites(unsigned int count) = 0;
+
+	/** MMIO accesses of 1, 2, 4, 8 or 16 bytes */
+	virtual void MemoryRead(unsigned int size, unsigned int handler) = 0;
+	virtual void MemoryWrite(unsigned int size, unsigned int handler) = 0;
+
+	/** in/out are EAX, EBX, ECX, EDX */
+	virtual void Cpuid(const unsigned int in[4], unsigned int out[4]) = 0;
+
+	/** IRQ line change from a native device while the PIC is emulated by JS */
+	virtual void Irq(unsigned int line, bool level) = 0;
+
+	/**
+	 * RDMSR/WRMSR of an MSR that isn't handled natively (see MsrStore.h).
+	 * value is the value written, or receives the value read. Returns false
+	 * if the device model doesn't know the MSR either
+	 */
+	virtual bool Msr(unsigned int index, bool write, unsigned long long* value) = 0;
+};
@@ -0,0 +1,203 @@
+// Microbenchmarks of the exit dispatch paths of CMachine, run against the
+// MockBackend and a StubDeviceModel so they need neither a hypervisor nor
+// JS, e.g.
+//
+//   cefvirtual_bench [results.json] [filter]
+//
+// Each benchmark scripts a fixed number of exits of one kind, runs them a
+// few times to warm up and then samples the time per exit. The results go
+// to the JSON file (cefvirtual_bench.json by default) so runs can be
+// compared, and a summary to stderr. Only benchmarks whose name contains
+// the filter are run.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "CMachine.h"
+#include "MachineClock.h"
+#include "MockBackend.h"
+#include "StubDeviceModel.h"
+
+static const unsigned int EXITS = 1000;    // Exits per sample
+static const unsigned int WARMUP = 5;      // Samples thrown away
+static const unsigned int SAMPLES = 31;
+
+struct BenchResult {
+	std::string name;
+	double min;
+	double median;
+	double mean;
+	double stddev;
+	double p90;
+	double max;
+};
+
+/** A machine with a looping script, so every run() replays the exits and stops at the halt */
+struct Bench {
+	MockBackend* backend;
+	StubDeviceModel devices;
+	std::unique_ptr<CMachine> machine;
+
+	Bench()
+	{
+		auto b = std::make_unique<MockBackend>(true);
+		backend = b.get();
+		machine = std::make_unique<CMachine>(16 * 1024 * 1024, std::move(b), &devices);
+		devices.SetParamBuf(machine->GetParamBuf());
+	}
+};
+
+/** Samples ns per exit of run(): the script is set up by setup, each sample does prepare() then run() */
+static BenchResult Measure(const char* name, const std::function<void(Bench&)>& setup,
+	const std::function<void(Bench&)>& prepare = nullptr)
+{
+	Bench bench;
+	setup(bench);
+	bench.backend->AddHalt();
+
+	std::vector<double> samples;
+	for (unsigned int i = 0; i < WARMUP + SAMPLES; i++) {
+		if (prepare) {
+			prepare(bench);
+		}
+		UINT64 start = MachineClock::Now();
+		bench.machine->run(MachineClock::Now() + 1000000000ULL);
+		UINT64 elapsed = MachineClock::Now() - start;
+		if (i >= WARMUP) {
+			samples.push_back((double)elapsed / EXITS);
+		}
+	}
+
+	std::sort(samples.begin(), samples.end());
+	BenchResult r;
+	r.name = name;
+	r.min = samples.front();
+	r.max = samples.back();
+	r.median = samples[samples.size() / 2];
+	r.p90 = samples[samples.size() * 9 / 10];
+	double sum = 0;
+	for (double s : samples) {
+		sum += s;
+	}
+	r.mean = sum / samples.size();
+	double squares = 0;
+	for (double s : samples) {
+		squares += (s - r.mean) * (s - r.mean);
+	}
+	r.stddev = std::sqrt(squares / (samples.size() - 1));
+	return r;
+}
+
+/** Adds EXITS copies of an exit to the script */
+static std::function<void(Bench&)> Repeat(const std::function<void(MockBackend*)>& add,
+	const std::function<void(Bench&)>& configure = nullptr)
+{
+	return [add, configure](Bench& b) {
+		if (configure) {
+			configure(b);
+		}
+		for (unsigned int i = 0; i < EXITS; i++) {
+			add(b.backend);
+		}
+	};
+}
+
+int main(int argc, char* argv[])
+{
+	std::string output = argc > 1 ? argv[1] : "cefvirtual_bench.json";
+	std::string filter = argc > 2 ? argv[2] : "";
+
+	static const UINT8 MOV_LOAD[] = { 0x8B, 0x07 };   // mov ax, [bx]
+	static const UINT8 MOV_STORE[] = { 0x89, 0x07 };  // mov [bx], ax
+
+	struct Entry {
+		const char* name;
+		std::function<void(Bench&)> setup;
+		std::function<void(Bench&)> prepare;
+	};
+	std::vector<Entry> entries = {
+		{ "io_read", Repeat([](MockBackend* m) { m->AddIo(0x3F8, 1, false); }), nullptr },
+		{ "io_write", Repeat([](MockBackend* m) { m->AddIo(0x3F8, 1, true, 0x41); }), nullptr },
+		{ "io_write_posted", Repeat([](MockBackend* m) { m->AddIo(0x3F8, 1, true, 0x41); },
+			[](Bench& b) { b.machine->SetPostedPorts(0x3F8, 1, true); }), nullptr },
+		{ "io_native", Repeat([](MockBackend* m) { m->AddIo(0x21, 1, false); },
+			[](Bench& b) { b.machine->SetNativeDevices(NativePic); }), nullptr },
+		{ "io_string", Repeat([](MockBackend* m) { m->AddStringIo(0x1F0, 2, false, false); }), nullptr },
+		{ "mmio_read4", Repeat([](MockBackend* m) { m->AddMmio(0xFED00000, 4, false); }), nullptr },
+		{ "mmio_write4", Repeat([](MockBackend* m) { m->AddMmio(0xFED00000, 4, true, 1); }), nullptr },
+		{ "mmio_read8_split", Repeat([](MockBackend* m) { m->AddMmio(0xFED00000, 8, false); }), nullptr },
+		{ "mmio_read8_wide", Repeat([](MockBackend* m) { m->AddMmio(0xFED00000, 8, false); },
+			[](Bench& b) { b.machine->SetWideMemory(0, true, false); }), nullptr },
+		{ "mmio_decoded_read", Repeat([](MockBackend* m) { m->AddMmioInstruction(0xFED00000, false, MOV_LOAD, 2); }), nullptr },
+		{ "mmio_decoded_write", Repeat([](MockBackend* m) { m->AddMmioInstruction(0xFED00000, true, MOV_STORE, 2); }), nullptr },
+		{ "cpuid_devices", Repeat([](MockBackend* m) { m->AddCpuid(1); }), nullptr },
+		{ "cpuid_native", Repeat([](MockBackend* m) { m->AddCpuid(1); },
+			[](Bench& b) {
+				UINT32 values[4] = { 0x663, 0, 0, 0 };
+				b.machine->GetCpuidTable().Set(1, 0, values, CpuidAnySubleaf);
+			}), nullptr },
+		{ "msr_register", Repeat([](MockBackend* m) { m->AddMsr(0x174, false); }), nullptr },
+		{ "msr_store", Repeat([](MockBackend* m) { m->AddMsr(0x1A0, false); },
+			[](Bench& b) { b.machine->setmsr(0x1A0, 1); }), nullptr },
+		{ "msr_devices", Repeat([](MockBackend* m) { m->AddMsr(0x999, false); }), nullptr },
+		{ "irq_inject", Repeat([](MockBackend* m) { m->AddIo(0x80, 1, true); },
+			[](Bench& b) {
+				WHV_REGISTER_NAME name = WHvX64RegisterRflags;
+				WHV_REGISTER_VALUE value;
+				memset(&value, 0x0, sizeof(value));
+				value.Reg64 = 0x202;
+				b.machine->HandleSetRegisters(&name, 1, &value);
+				b.machine->SetNativeDevices(NativePost);
+			}),
+			// One interrupt per exit, each taken on the next entry
+			[](Bench& b) {
+				for (unsigned int i = 0; i < EXITS; i++) {
+					b.machine->irq(0x20);
+				}
+			} },
+		{ "stats_io_read", Repeat([](MockBackend* m) { m->AddIo(0x3F8, 1, false); },
+			[](Bench& b) { b.machine->GetStats().Enable(true); }), nullptr },
+	};
+
+	std::vector<BenchResult> results;
+	try {
+		for (const Entry& e : entries) {
+			if (strstr(e.name, filter.c_str()) == nullptr) {
+				continue;
+			}
+			results.push_back(Measure(e.name, e.setup, e.prepare));
+			const BenchResult& r = results.back();
+			fprintf(stderr, "%-20s median %8.1f ns  mean %8.1f ns  stddev %6.1f  min %8.1f  p90 %8.1f\n",
+				r.name.c_str(), r.median, r.mean, r.stddev, r.min, r.p90);
+		}
+	}
+	catch (std::exception& ex) {
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+
+	FILE* f = fopen(output.c_str(), "w");
+	if (f == nullptr) {
+		fprintf(stderr, "Couldn't create %s\n", output.c_str());
+		return 1;
+	}
+	fprintf(f, "{\n  \"exits_per_sample\": %u,\n  \"warmup\": %u,\n  \"samples\": %u,\n  \"unit\": \"ns_per_exit\",\n"
+		"  \"benchmarks\": [\n", EXITS, WARMUP, SAMPLES);
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchResult& r = results[i];
+		fprintf(f, "    { \"name\": \"%s\", \"min\": %.2f, \"median\": %.2f, \"mean\": %.2f, \"stddev\": %.2f, "
+			"\"p90\": %.2f, \"max\": %.2f, \"exits_per_second\": %.0f }%s\n", r.name.c_str(), r.min, r.median,
+			r.mean, r.stddev, r.p90, r.max, 1e9 / r.median, i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	fclose(f);
+	return 0;
+}
@@ -0,0 +1,201 @@
+#include "ExitStats.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+static const char* REASON_NAMES[STAT_REASONS] = {
+	"io", "stringio", "mmio", "cpuid", "msr", "halt", "interruptwindow", "canceled", "initsipi", "other"
+};
+
+static const char* PHASE_NAMES[STAT_PHASES] = { "hypervisor", "emulation", "devices" };
+
+ExitStats::ExitStats() : enabled(false), buffer(new double[SIZE])
+{
+	Reset();
+}
+
+const char* ExitStats::ReasonName(ExitStatReason reason)
+{
+	return reason < STAT_REASONS ? REASON_NAMES[reason] : "unknown";
+}
+
+ExitStatReason ExitStats::ReasonOf(const WHV_RUN_VP_EXIT_CONTEXT& ctx)
+{
+	switch (ctx.ExitReason) {
+	case WHvRunVpExitReasonX64IoPortAccess:
+		return ctx.IoPortAccess.AccessInfo.StringOp ? StatStringIo : StatIo;
+	case WHvRunVpExitReasonMemoryAccess:
+		return StatMmio;
+	case WHvRunVpExitReasonX64Cpuid:
+		return StatCpuid;
+	case WHvRunVpExitReasonX64MsrAccess:
+		return StatMsr;
+	case WHvRunVpExitReasonX64Halt:
+		return StatHalt;
+	case WHvRunVpExitReasonX64InterruptWindow:
+		return StatInterruptWindow;
+	case WHvRunVpExitReasonCanceled:
+		return StatCanceled;
+	case WHvRunVpExitReasonX64ApicInitSipiTrap:
+		return StatInitSipi;
+	default:
+		return StatOther;
+	}
+}
+
+void ExitStats::Add(ExitStatReason reason, ExitStatPhase phase, UINT64 ns)
+{
+	double* h = buffer.get() + HISTOGRAMS + (reason * STAT_PHASES + phase) * HISTOGRAM_SIZE;
+	unsigned int bucket = 0;
+	while (bucket < BUCKETS - 1 && (ns >> (bucket + 1)) != 0) {
+		bucket++;
+	}
+	h[0]++;
+	h[1] += (double)ns;
+	h[2 + bucket]++;
+}
+
+void ExitStats::RecordExit(const WHV_RUN_VP_EXIT_CONTEXT& ctx, UINT64 hypervisorTime, UINT64 handleTime, UINT64 deviceTime)
+{
+	ExitStatReason reason = ReasonOf(ctx);
+	UINT64 emulationTime = handleTime > deviceTime ? handleTime - deviceTime : 0;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	buffer[6] += (double)deviceTime;
+	buffer[7]++;
+	Add(reason, StatHypervisor, hypervisorTime);
+	Add(reason, StatEmulation, emulationTime);
+	if (deviceTime != 0) {
+		Add(reason, StatDevices, deviceTime);
+	}
+
+	Hotspot* spot = nullptr;
+	if (reason == StatIo || reason == StatStringIo) {
+		spot = &ports[ctx.IoPortAccess.PortNumber];
+	}
+	else if (reason == StatMmio) {
+		auto it = addresses.find(ctx.MemoryAccess.Gpa);
+		if (it != addresses.end()) {
+			spot = &it->second;
+		}
+		else if (addresses.size() < MAX_ADDRESSES) {
+			spot = &addresses[ctx.MemoryAccess.Gpa];
+		}
+	}
+	if (spot != nullptr) {
+		spot->count++;
+		spot->ns += hypervisorTime + handleTime;
+	}
+}
+
+void ExitStats::RecordSlice(UINT64 sliceTime, UINT64 guestTime)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	buffer[3]++;
+	buffer[4] += (double)sliceTime;
+	buffer[5] += (double)guestTime;
+	unsigned int bucket = sliceTime == 0 ? 0 : (unsigned int)(guestTime * 10 / sliceTime);
+	buffer[UTILIZATION + std::min(bucket, 9u)]++;
+}
+
+void ExitStats::Publish()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	// The busiest first, by total time
+	auto publish = [](double* out, std::vector<std::pair<UINT64, Hotspot>>& spots) {
+		std::sort(spots.begin(), spots.end(), [](const std::pair<UINT64, Hotspot>& a, const std::pair<UINT64, Hotspot>& b) {
+			return a.second.ns != b.second.ns ? a.second.ns > b.second.ns : a.second.count > b.second.count;
+		});
+		for (size_t i = 0; i < TOP_ENTRIES; i++) {
+			bool used = i < spots.size();
+			out[i * 3] = used ? (double)spots[i].first : 0;
+			out[i * 3 + 1] = used ? (double)spots[i].second.count : 0;
+			out[i * 3 + 2] = used ? (double)spots[i].second.ns : 0;
+		}
+	};
+
+	std::vector<std::pair<UINT64, Hotspot>>& spots = sorted;
+	spots.clear();
+	for (auto& p : ports) {
+		spots.push_back(std::make_pair((UINT64)p.first, p.second));
+	}
+	publish(buffer.get() + PORTS, spots);
+	spots.clear();
+	for (auto& a : addresses) {
+		spots.push_back(a);
+	}
+	publish(buffer.get() + ADDRESSES, spots);
+}
+
+void ExitStats::Reset()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	memset(buffer.get(), 0, SIZE * sizeof(double));
+	buffer[0] = STAT_REASONS;
+	buffer[1] = BUCKETS;
+	buffer[2] = TOP_ENTRIES;
+	ports.clear();
+	addresses.clear();
+}
+
+void ExitStats::Dump(const std::string& path)
+{
+	Publish();
+	std::ofstream out(path);
+	if (!out) {
+		throw std::runtime_error("Couldn't create stats file");
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	const double* b = buffer.get();
+	out << "slices " << (UINT64)b[3] << " slice_ns " << (UINT64)b[4] << " guest_ns " << (UINT64)b[5]
+		<< " device_ns " << (UINT64)b[6] << " exits " << (UINT64)b[7] << "\n";
+	out << "utilization";
+	for (unsigned int i = 0; i < 10; i++) {
+		out << " " << i * 10 << "%:" << (UINT64)b[UTILIZATION + i];
+	}
+	out << "\n\n";
+
+	out << "reason phase count total_ns mean_ns p50_ns p99_ns\n";
+	for (unsigned int r = 0; r < STAT_REASONS; r++) {
+		for (unsigned int p = 0; p < STAT_PHASES; p++) {
+			const double* h = b + HISTOGRAMS + (r * STAT_PHASES + p) * HISTOGRAM_SIZE;
+			if (h[0] == 0) {
+				continue;
+			}
+			// Percentiles as the upper bound of the bucket they fall in
+			UINT64 p50 = 0, p99 = 0;
+			double seen = 0;
+			for (unsigned int i = 0; i < BUCKETS; i++) {
+				seen += h[2 + i];
+				UINT64 bound = 2ULL << i;
+				if (p50 == 0 && seen >= h[0] * 0.5) {
+					p50 = bound;
+				}
+				if (p99 == 0 && seen >= h[0] * 0.99) {
+					p99 = bound;
+				}
+			}
+			out << ReasonName((ExitStatReason)r) << " " << PHASE_NAMES[p] << " " << (UINT64)h[0] << " " << (UINT64)h[1] << " "
+				<< (UINT64)(h[1] / h[0]) << " " << p50 << " " << p99 << "\n";
+		}
+	}
+
+	out << "\nport count total_ns\n";
+	out << std::hex;
+	for (unsigned int i = 0; i < TOP_ENTRIES && b[PORTS + i * 3 + 1] != 0; i++) {
+		out << "0x" << (UINT64)b[PORTS + i * 3] << std::dec << " " << (UINT64)b[PORTS + i * 3 + 1] << " "
+			<< (UINT64)b[PORTS + i * 3 + 2] << std::hex << "\n";
+	}
+	out << std::dec << "\ngpa count total_ns\n" << std::hex;
+	for (unsigned int i = 0; i < TOP_ENTRIES && b[ADDRESSES + i * 3 + 1] != 0; i++) {
+		out << "0x" << (UINT64)b[ADDRESSES + i * 3] << std::dec << " " << (UINT64)b[ADDRESSES + i * 3 + 1] << " "
+			<< (UINT64)b[ADDRESSES + i * 3 + 2] << std::hex << "\n";
+	}
+	if (!out) {
+		throw std::runtime_error("Couldn't write stats file");
+	}
+}
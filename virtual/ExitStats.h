@@ -0,0 +1,196 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "DeviceModel.h"
+#include "MachineClock.h"
+#include "WinHvCompat.h"
+
+enum ExitStatReason {
+	StatIo,
+	StatStringIo,
+	StatMmio,
+	StatCpuid,
+	StatMsr,
+	StatHalt,
+	StatInterruptWindow,
+	StatCanceled,
+	StatInitSipi,
+	StatOther,
+	STAT_REASONS
+};
+
+enum ExitStatPhase {
+	StatHypervisor,  // In RunVirtualProcessor, i.e. the guest running plus the exit itself
+	StatEmulation,   // Handling the exit in C++ (decoding, emulator, registers)
+	StatDevices,     // In the device model, i.e. the JS callbacks (or waiting for them after start())
+	STAT_PHASES
+};
+
+/**
+ * Where the time of a machine goes, collected while enabled (it costs a few
+ * clock reads per exit):
+ *
+ *  - a latency histogram for each exit reason and phase, with log2 buckets
+ *    of nanoseconds (bucket i is [2^i, 2^(i+1)) ns)
+ *  - the busiest I/O ports and MMIO addresses by count and total time
+ *  - how much of each run() slice the guest actually ran
+ *
+ * Times are MachineClock (steady clock, read from the TSC where the host has
+ * an invariant one). Everything is kept in a buffer of doubles shared with
+ * JS as a Float64Array; the top tables are refreshed by Publish(). Layout,
+ * in doubles:
+ *
+ *  [0] STAT_REASONS  [1] BUCKETS  [2] TOP_ENTRIES  [3] run() slices
+ *  [4] slice ns  [5] guest ns  [6] device ns  [7] exits
+ *  [UTILIZATION] 10 buckets of slices by guest share (0-10%, ..., 90-100%)
+ *  [HISTOGRAMS] per reason, then phase: count, total ns, BUCKETS buckets
+ *  [PORTS] TOP_ENTRIES of port, count, total ns (busiest first)
+ *  [ADDRESSES] TOP_ENTRIES of GPA, count, total ns
+ */
+class ExitStats {
+public:
+	static const unsigned int BUCKETS = 32;
+	static const unsigned int TOP_ENTRIES = 16;
+	static const size_t UTILIZATION = 8;
+	static const size_t HISTOGRAMS = 32;
+	static const size_t HISTOGRAM_SIZE = 2 + BUCKETS;
+	static const size_t PORTS = HISTOGRAMS + STAT_REASONS * STAT_PHASES * HISTOGRAM_SIZE;
+	static const size_t ADDRESSES = PORTS + TOP_ENTRIES * 3;
+	static const size_t SIZE = ADDRESSES + TOP_ENTRIES * 3;
+
+private:
+	struct Hotspot {
+		UINT64 count = 0;
+		UINT64 ns = 0;
+	};
+
+	static const size_t MAX_ADDRESSES = 4096;
+
+	std::atomic<bool> enabled;  // Changed by JS, also while the processor thread runs
+	std::unique_ptr<double[]> buffer;
+	std::mutex mutex;  // The hotspots, as Publish() may come from another thread than the exits
+	std::unordered_map<UINT16, Hotspot> ports;
+	std::unordered_map<UINT64, Hotspot> addresses;
+	std::vector<std::pair<UINT64, Hotspot>> sorted;  // Kept for Publish(), so it doesn't allocate each time
+
+	void Add(ExitStatReason reason, ExitStatPhase phase, UINT64 ns);
+
+public:
+	UINT64 deviceNs = 0;  // Time in the device model, see TimedDeviceModel
+
+	ExitStats();
+
+	bool IsEnabled() const { return enabled; }
+	void Enable(bool enable) { enabled = enable; }
+
+	/** MachineClock time, or 0 while disabled */
+	UINT64 Now() const { return enabled ? MachineClock::Now() : 0; }
+
+	static ExitStatReason ReasonOf(const WHV_RUN_VP_EXIT_CONTEXT& ctx);
+
+	/** Name of the reason in Dump() and the tools, e.g. "stringio" */
+	static const char* ReasonName(ExitStatReason reason);
+
+	/** Records an exit: time in the hypervisor and handling it, of which deviceTime was in the devices */
+	void RecordExit(const WHV_RUN_VP_EXIT_CONTEXT& ctx, UINT64 hypervisorTime, UINT64 handleTime, UINT64 deviceTime);
+
+	/** Records a run() slice of which guestTime was spent in the guest */
+	void RecordSlice(UINT64 sliceTime, UINT64 guestTime);
+
+	/** Refreshes the top tables in the buffer */
+	void Publish();
+
+	void Reset();
+
+	/** Writes a readable report */
+	void Dump(const std::string& path);
+
+	double* GetBuffer() { return buffer.get(); }
+	size_t GetBufferSize() { return SIZE * sizeof(double); }
+};
+
+/**
+ * Sits in front of the machine's device model and adds the time spent in it
+ * to ExitStats::deviceNs while the stats are enabled.
+ */
+class TimedDeviceModel : public DeviceModel {
+private:
+	DeviceModel* target;
+	ExitStats* stats;
+
+	/** Adds the time from start on to the device time */
+	void Done(UINT64 start)
+	{
+		if (start != 0) {
+			stats->deviceNs += MachineClock::Now() - start;
+		}
+	}
+
+public:
+	TimedDeviceModel(DeviceModel* target, ExitStats* stats) : target(target), stats(stats) {}
+
+	void SetTarget(DeviceModel* t) { target = t; }
+
+	void PortIo() override
+	{
+		UINT64 start = stats->Now();
+		target->PortIo();
+		Done(start);
+	}
+
+	void PortIoString() override
+	{
+		UINT64 start = stats->Now();
+		target->PortIoString();
+		Done(start);
+	}
+
+	void PortWrites(unsigned int count) override
+	{
+		UINT64 start = stats->Now();
+		target->PortWrites(count);
+		Done(start);
+	}
+
+	void MemoryRead(unsigned int size, unsigned int handler) override
+	{
+		UINT64 start = stats->Now();
+		target->MemoryRead(size, handler);
+		Done(start);
+	}
+
+	void MemoryWrite(unsigned int size, unsigned int handler) override
+	{
+		UINT64 start = stats->Now();
+		target->MemoryWrite(size, handler);
+		Done(start);
+	}
+
+	void Cpuid(const unsigned int in[4], unsigned int out[4]) override
+	{
+		UINT64 start = stats->Now();
+		target->Cpuid(in, out);
+		Done(start);
+	}
+
+	void Irq(unsigned int line, bool level) override
+	{
+		UINT64 start = stats->Now();
+		target->Irq(line, level);
+		Done(start);
+	}
+
+	bool Msr(unsigned int index, bool write, unsigned long long* value) override
+	{
+		UINT64 start = stats->Now();
+		bool handled = target->Msr(index, write, value);
+		Done(start);
+		return handled;
+	}
+};
@@ -0,0 +1,243 @@
+#include "ExitTrace.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "ExitStats.h"
+
+ExitTrace::~ExitTrace()
+{
+	try {
+		Close();
+	}
+	catch (std::exception&) {
+	}
+}
+
+void ExitTrace::Open(const std::string& path, UINT64 memorySize, UINT32 nativeDevices)
+{
+	Close();
+	out.open(path, std::ios::binary | std::ios::trunc);
+	if (!out) {
+		throw std::runtime_error("Couldn't create trace file");
+	}
+	TraceHeader header;
+	memset(&header, 0x0, sizeof(header));
+	memcpy(header.magic, "V86TRACE", 8);
+	header.version = VERSION;
+	header.recordSize = sizeof(TraceRecord);
+	header.memorySize = memorySize;
+	header.nativeDevices = nativeDevices;
+	out.write((const char*)&header, sizeof(header));
+	buffer.reserve(BUFFERED);
+	recordCounter = 0;
+	recording = true;
+}
+
+void ExitTrace::Flush()
+{
+	out.write((const char*)buffer.data(), buffer.size() * sizeof(TraceRecord));
+	buffer.clear();
+	if (!out) {
+		recording = false;
+		throw std::runtime_error("Couldn't write trace file");
+	}
+}
+
+void ExitTrace::Close()
+{
+	if (!recording) {
+		return;
+	}
+	recording = false;
+	Flush();
+	out.close();
+}
+
+void ExitTrace::AddExit(const WHV_RUN_VP_EXIT_CONTEXT& ctx, UINT64 hypervisorNs, UINT64 handleNs, const UINT64* result)
+{
+	TraceRecord r;
+	memset(&r, 0x0, sizeof(r));
+	r.type = TraceExit;
+	r.reason = (UINT8)ExitStats::ReasonOf(ctx);
+	r.hypervisorNs = (UINT32)std::min(hypervisorNs, (UINT64)0xFFFFFFFF);
+	r.handleNs = (UINT32)std::min(handleNs, (UINT64)0xFFFFFFFF);
+
+	switch (ctx.ExitReason) {
+	case WHvRunVpExitReasonX64IoPortAccess:
+		r.address = ctx.IoPortAccess.PortNumber;
+		r.size = (UINT8)ctx.IoPortAccess.AccessInfo.AccessSize;
+		r.flags = (ctx.IoPortAccess.AccessInfo.IsWrite ? TraceWrite : 0) |
+			(ctx.IoPortAccess.AccessInfo.StringOp ? TraceString : 0) | (ctx.IoPortAccess.AccessInfo.RepPrefix ? TraceRep : 0);
+		r.data[0] = ctx.IoPortAccess.Rax;
+		break;
+	case WHvRunVpExitReasonMemoryAccess:
+		r.address = ctx.MemoryAccess.Gpa;
+		r.flags = (ctx.MemoryAccess.AccessInfo.AccessType == WHvMemoryAccessWrite ? TraceWrite : 0) |
+			(ctx.MemoryAccess.AccessInfo.GpaUnmapped ? 0 : TraceFault);
+		break;
+	case WHvRunVpExitReasonX64Cpuid:
+		r.address = (UINT32)ctx.CpuidAccess.Rax;
+		r.extra = (UINT32)ctx.CpuidAccess.Rcx;
+		if (result != nullptr) {
+			r.data[0] = (result[0] & 0xFFFFFFFF) | result[1] << 32;
+			r.data[1] = (result[2] & 0xFFFFFFFF) | result[3] << 32;
+		}
+		break;
+	case WHvRunVpExitReasonX64MsrAccess:
+		r.address = ctx.MsrAccess.MsrNumber;
+		if (ctx.MsrAccess.AccessInfo.IsWrite) {
+			r.flags = TraceWrite;
+			r.data[0] = ctx.MsrAccess.Rdx << 32 | (ctx.MsrAccess.Rax & 0xFFFFFFFF);
+		}
+		else if (result != nullptr) {
+			r.data[0] = result[3] << 32 | (result[0] & 0xFFFFFFFF);
+		}
+		break;
+	default:
+		break;
+	}
+	Add(r);
+}
+
+void ExitTrace::AddInject(UINT32 vector)
+{
+	TraceRecord r;
+	memset(&r, 0x0, sizeof(r));
+	r.type = TraceInject;
+	r.address = vector;
+	Add(r);
+}
+
+std::vector<TraceRecord> ExitTrace::Read(const std::string& path, TraceHeader* header)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		throw std::runtime_error("Couldn't open trace file");
+	}
+	in.read((char*)header, sizeof(*header));
+	if (!in || memcmp(header->magic, "V86TRACE", 8) != 0) {
+		throw std::runtime_error("Not a trace file");
+	}
+	if (header->version != VERSION || header->recordSize != sizeof(TraceRecord)) {
+		throw std::runtime_error("Unsupported trace version");
+	}
+
+	std::vector<TraceRecord> records;
+	TraceRecord r;
+	while (in.read((char*)&r, sizeof(r))) {
+		records.push_back(r);
+	}
+	if (in.gcount() != 0) {
+		throw std::runtime_error("Truncated trace file");
+	}
+	return records;
+}
+
+void TraceDeviceModel::PortIo()
+{
+	if (!trace->IsRecording()) {
+		target->PortIo();
+		return;
+	}
+	TraceRecord r = Make(TracePortIo);
+	r.address = (*params)[0];
+	r.size = (UINT8)(*params)[1];
+	r.flags = (*params)[2] ? TraceWrite : 0;
+	r.data[0] = (*params)[3];
+	target->PortIo();
+	if (!(r.flags & TraceWrite)) {
+		r.data[0] = (*params)[0];
+	}
+	trace->Add(r);
+}
+
+void TraceDeviceModel::PortIoString()
+{
+	if (trace->IsRecording()) {
+		TraceRecord r = Make(TracePortIoString);
+		r.address = (*params)[0];
+		r.size = (UINT8)(*params)[1];
+		r.flags = TraceString | ((*params)[2] ? TraceWrite : 0);
+		r.data[0] = (*params)[3];
+		r.extra = (*params)[4];
+		trace->Add(r);
+	}
+	target->PortIoString();
+}
+
+void TraceDeviceModel::PortWrites(unsigned int count)
+{
+	if (trace->IsRecording()) {
+		TraceRecord r = Make(TracePortWrites);
+		r.extra = count;
+		trace->Add(r);
+	}
+	target->PortWrites(count);
+}
+
+void TraceDeviceModel::MemoryRead(unsigned int size, unsigned int handler)
+{
+	if (!trace->IsRecording()) {
+		target->MemoryRead(size, handler);
+		return;
+	}
+	TraceRecord r = Make(TraceMemoryRead);
+	r.address = (*params)[0];
+	r.size = (UINT8)size;
+	r.extra = handler;
+	target->MemoryRead(size, handler);
+	MemoryData(r, size);
+	trace->Add(r);
+}
+
+void TraceDeviceModel::MemoryWrite(unsigned int size, unsigned int handler)
+{
+	if (trace->IsRecording()) {
+		TraceRecord r = Make(TraceMemoryWrite);
+		r.address = (*params)[0];
+		r.size = (UINT8)size;
+		r.flags = TraceWrite;
+		r.extra = handler;
+		MemoryData(r, size);
+		trace->Add(r);
+	}
+	target->MemoryWrite(size, handler);
+}
+
+void TraceDeviceModel::Cpuid(const unsigned int in[4], unsigned int out[4])
+{
+	target->Cpuid(in, out);
+	if (trace->IsRecording()) {
+		TraceRecord r = Make(TraceCpuid);
+		r.address = in[0];
+		r.extra = in[2];
+		r.data[0] = out[0] | (UINT64)out[1] << 32;
+		r.data[1] = out[2] | (UINT64)out[3] << 32;
+		trace->Add(r);
+	}
+}
+
+void TraceDeviceModel::Irq(unsigned int line, bool level)
+{
+	if (trace->IsRecording()) {
+		TraceRecord r = Make(TraceIrq);
+		r.address = line;
+		r.flags = level ? TraceLevel : 0;
+		trace->Add(r);
+	}
+	target->Irq(line, level);
+}
+
+bool TraceDeviceModel::Msr(unsigned int index, bool write, unsigned long long* value)
+{
+	bool handled = target->Msr(index, write, value);
+	if (trace->IsRecording()) {
+		TraceRecord r = Make(TraceMsr);
+		r.address = index;
+		r.flags = (write ? TraceWrite : 0) | (handled ? TraceHandled : 0);
+		r.data[0] = *value;
+		trace->Add(r);
+	}
+	return handled;
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <string.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "Counter.h"
+#include "DeviceModel.h"
+#include "WinHvCompat.h"
+
+/**
+ * Binary trace of the exits of the boot processor, so a slow run can be
+ * replayed and measured elsewhere (see TraceReplay.cpp).
+ *
+ * File layout: TraceHeader, then TraceRecords in the order things happened.
+ * The device calls made while handling an exit come before its TraceExit
+ * record, so an exit owns the records between the previous exit and itself.
+ */
+
+enum TraceRecordType {
+	TraceExit,          // reason (ExitStatReason), address: port, GPA, CPUID leaf or MSR index;
+	                    // extra: CPUID subleaf; data: value written, or the CPUID/MSR result
+	TracePortIo,        // address: port; data: value written or read
+	TracePortIoString,  // address: port; extra: count; data[0]: GPA
+	TracePortWrites,    // extra: count of posted writes handed over
+	TraceMemoryRead,    // address: GPA or region offset; extra: handler; data: value read
+	TraceMemoryWrite,   // address: GPA or region offset; extra: handler; data: value written
+	TraceCpuid,         // address: leaf; extra: subleaf; data: EAX, EBX, ECX, EDX
+	TraceMsr,           // address: index; data[0]: value written or read
+	TraceIrq,           // address: line (flags TraceLevel)
+	TraceInject         // address: vector injected into the guest
+};
+
+enum TraceFlags {
+	TraceWrite = 1,
+	TraceString = 2,
+	TraceRep = 4,
+	TraceHandled = 8,  // The device model knew the MSR
+	TraceLevel = 16,
+	TraceFault = 32    // Write to a write protected (dirty tracked) page rather than MMIO
+};
+
+struct TraceRecord {
+	UINT8 type;            // TraceRecordType
+	UINT8 reason;          // ExitStatReason of exits
+	UINT8 size;            // Access size in bytes
+	UINT8 flags;           // TraceFlags
+	UINT32 extra;
+	UINT32 hypervisorNs;   // Exits: time in the hypervisor
+	UINT32 handleNs;       // Exits: time handling the exit, device calls included
+	UINT64 address;
+	UINT64 data[2];
+};
+
+struct TraceHeader {
+	char magic[8];         // "V86TRACE"
+	UINT32 version;
+	UINT32 recordSize;
+	UINT64 memorySize;
+	UINT32 nativeDevices;  // NativeDeviceId mask of the recording machine
+	UINT32 reserved;
+};
+
+class ExitTrace {
+private:
+	static const size_t BUFFERED = 4096;
+
+	std::ofstream out;
+	bool recording = false;
+	std::vector<TraceRecord> buffer;
+
+	void Flush();
+
+public:
+	static const UINT32 VERSION = 1;
+
+	Counter recordCounter;
+
+	~ExitTrace();
+
+	/** Starts a trace file, replacing one being written */
+	void Open(const std::string& path, UINT64 memorySize, UINT32 nativeDevices);
+	void Close();
+	bool IsRecording() const { return recording; }
+
+	void Add(const TraceRecord& record)
+	{
+		buffer.push_back(record);
+		recordCounter++;
+		if (buffer.size() == BUFFERED) {
+			Flush();
+		}
+	}
+
+	/** An exit, result (if any) are RAX, RBX, RCX and RDX after it was handled */
+	void AddExit(const WHV_RUN_VP_EXIT_CONTEXT& ctx, UINT64 hypervisorNs, UINT64 handleNs, const UINT64* result);
+
+	void AddInject(UINT32 vector);
+
+	static std::vector<TraceRecord> Read(const std::string& path, TraceHeader* header);
+};
+
+/**
+ * Sits in front of the machine's device model and adds a record of every
+ * device call and what it returned to the trace while it's recording.
+ * params is where the machine keeps its current parameter buffer.
+ */
+class TraceDeviceModel : public DeviceModel {
+private:
+	DeviceModel* target;
+	ExitTrace* trace;
+	unsigned int* const* params;
+
+	static TraceRecord Make(TraceRecordType type)
+	{
+		TraceRecord r;
+		memset(&r, 0x0, sizeof(r));
+		r.type = (UINT8)type;
+		return r;
+	}
+
+	/** Data of a memory access, from the 32-bit slot or the wide ones */
+	void MemoryData(TraceRecord& r, unsigned int size)
+	{
+		if (size > 4) {
+			memcpy(r.data, *params + WIDE_DATA_SLOT, size);
+		}
+		else {
+			r.data[0] = (*params)[r.type == TraceMemoryWrite ? 1 : 0];
+		}
+	}
+
+public:
+	TraceDeviceModel(DeviceModel* target, ExitTrace* trace, unsigned int* const* params)
+		: target(target), trace(trace), params(params) {}
+
+	void SetTarget(DeviceModel* t) { target = t; }
+
+	void PortIo() override;
+	void PortIoString() override;
+	void PortWrites(unsigned int count) override;
+	void MemoryRead(unsigned int size, unsigned int handler) override;
+	void MemoryWrite(unsigned int size, unsigned int handler) override;
+	void Cpuid(const unsigned int in[4], unsigned int out[4]) override;
+	void Irq(unsigned int line, bool level) override;
+	bool Msr(unsigned int index, bool write, unsigned long long* value) override;
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <iterator>
+#include <map>
+#include <vector>
+
+#include "WinHvCompat.h"
+
+enum GpaRegionType {
+	GpaUnmapped,  // Not a region (gaps between regions)
+	GpaRam,       // Guest RAM, at the same offset in the machine's memory (A20 aside)
+	GpaMmio,      // Unmapped so accesses exit to the devices, index is the handler, see CMachine::unmap
+	GpaRom,       // Other host memory mapped into the guest, e.g. the BIOS shadow
+	GpaDirty      // Dirty tracked region, index is its mapdirty() number
+};
+
+struct GpaRegion {
+	UINT64 start;
+	UINT64 end;  // Exclusive
+	GpaRegionType type;
+	UINT32 index;
+};
+
+/**
+ * The guest physical address space as non-overlapping regions. They're kept
+ * in a balanced tree by start address, so finding the region of an address
+ * is O(log n). Setting a range splits the regions it overlaps, and RAM and
+ * MMIO regions are merged with equal neighbours, so the regions are always
+ * the largest ranges that can be mapped in one hypervisor call.
+ */
+class GpaRegistry {
+private:
+	std::map<UINT64, GpaRegion> regions;  // By start
+
+	/** Makes start a region boundary, if it's inside a region */
+	void Split(UINT64 start)
+	{
+		auto it = regions.upper_bound(start);
+		if (it == regions.begin()) {
+			return;
+		}
+		--it;
+		GpaRegion& r = it->second;
+		if (r.start < start && start < r.end) {
+			GpaRegion tail = r;
+			tail.start = start;
+			r.end = start;
+			regions[start] = tail;
+		}
+	}
+
+	static bool Mergeable(const GpaRegion& a, const GpaRegion& b)
+	{
+		return a.end == b.start && a.type == b.type && a.index == b.index && (a.type == GpaRam || a.type == GpaMmio);
+	}
+
+public:
+	/** Makes [start, end) a region of the given type, replacing what was there */
+	void Set(UINT64 start, UINT64 end, GpaRegionType type, UINT32 index = 0)
+	{
+		Clear(start, end);
+		if (type == GpaUnmapped) {
+			return;
+		}
+		GpaRegion r = { start, end, type, index };
+		auto it = regions.emplace(start, r).first;
+
+		auto next = std::next(it);
+		if (next != regions.end() && Mergeable(it->second, next->second)) {
+			it->second.end = next->second.end;
+			regions.erase(next);
+		}
+		if (it != regions.begin()) {
+			auto prev = std::prev(it);
+			if (Mergeable(prev->second, it->second)) {
+				prev->second.end = it->second.end;
+				regions.erase(it);
+			}
+		}
+	}
+
+	/** Removes [start, end) from the regions */
+	void Clear(UINT64 start, UINT64 end)
+	{
+		Split(start);
+		Split(end);
+		regions.erase(regions.lower_bound(start), regions.lower_bound(end));
+	}
+
+	/** The region holding gpa, or nullptr if it isn't in one */
+	const GpaRegion* Find(UINT64 gpa) const
+	{
+		auto it = regions.upper_bound(gpa);
+		if (it == regions.begin()) {
+			return nullptr;
+		}
+		--it;
+		return gpa < it->second.end ? &it->second : nullptr;
+	}
+
+	GpaRegionType TypeAt(UINT64 gpa) const
+	{
+		const GpaRegion* r = Find(gpa);
+		return r != nullptr ? r->type : GpaUnmapped;
+	}
+
+	/** [start, end) cut into pieces along the region boundaries, gaps included as GpaUnmapped */
+	std::vector<GpaRegion> Pieces(UINT64 start, UINT64 end) const
+	{
+		std::vector<GpaRegion> pieces;
+		auto it = regions.upper_bound(start);
+		if (it != regions.begin() && std::prev(it)->second.end > start) {
+			--it;
+		}
+		UINT64 pos = start;
+		for (; it != regions.end() && pos < end; ++it) {
+			const GpaRegion& r = it->second;
+			if (r.start >= end) {
+				break;
+			}
+			if (r.start > pos) {
+				GpaRegion gap = { pos, r.start, GpaUnmapped, 0 };
+				pieces.push_back(gap);
+				pos = r.start;
+			}
+			GpaRegion piece = r;
+			piece.start = pos;
+			piece.end = r.end < end ? r.end : end;
+			pieces.push_back(piece);
+			pos = piece.end;
+		}
+		if (pos < end) {
+			GpaRegion gap = { pos, end, GpaUnmapped, 0 };
+			pieces.push_back(gap);
+		}
+		return pieces;
+	}
+
+	size_t Size() const { return regions.size(); }
+};
@@ -0,0 +1,215 @@
+#include "GuestMemory.h"
+
+#include <stdint.h>
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+/** Large pages need SeLockMemoryPrivilege, which is granted to the account but off by default */
+static void EnableLockMemoryPrivilege()
+{
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+		return;
+	}
+	TOKEN_PRIVILEGES privileges;
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	if (LookupPrivilegeValueW(NULL, L"SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)) {
+		AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL);
+	}
+	CloseHandle(token);
+}
+
+#ifndef MEM_RESERVE_PLACEHOLDER
+#define MEM_RESERVE_PLACEHOLDER 0x00040000
+#define MEM_REPLACE_PLACEHOLDER 0x00004000
+#define MEM_PRESERVE_PLACEHOLDER 0x00000002
+#endif
+
+// Placeholder functions of Windows 10 1803 and later, looked up so older hosts still start
+typedef PVOID(WINAPI* VirtualAlloc2Function)(HANDLE, PVOID, SIZE_T, ULONG, ULONG, PVOID, ULONG);
+typedef PVOID(WINAPI* MapViewOfFile3Function)(HANDLE, HANDLE, PVOID, ULONG64, SIZE_T, ULONG, ULONG, PVOID, ULONG);
+
+static void ReleasePiece(const std::pair<unsigned char*, bool>& piece)
+{
+	if (piece.second) {
+		UnmapViewOfFile(piece.first);
+	}
+	else {
+		VirtualFree(piece.first, 0, MEM_RELEASE);
+	}
+}
+#endif
+
+GuestMemory::GuestMemory(size_t size, bool wantLargePages)
+	: size(size)
+{
+#ifdef _WIN32
+	if (wantLargePages) {
+		EnableLockMemoryPrivilege();
+		SIZE_T minimum = GetLargePageMinimum();
+		if (minimum != 0) {
+			reservationSize = (size + minimum - 1) / minimum * minimum;
+			reservation = (unsigned char*)VirtualAlloc(NULL, reservationSize,
+				MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			largePages = reservation != NULL;
+		}
+	}
+	if (reservation == NULL) {
+		// Committed pages are zero filled on first access, so nothing is touched here
+		reservationSize = size;
+		reservation = (unsigned char*)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+	if (reservation == NULL) {
+		throw std::runtime_error("Couldn't allocate guest memory");
+	}
+	base = reservation;
+#else
+	// Reserve an extra large page so RAM can start on a large page boundary
+	reservationSize = size + (wantLargePages ? LARGE_PAGE_BYTES : 0);
+	void* p = mmap(NULL, reservationSize, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		throw std::runtime_error("Couldn't allocate guest memory");
+	}
+	reservation = (unsigned char*)p;
+	base = reservation;
+	if (wantLargePages) {
+		base = (unsigned char*)(((uintptr_t)reservation + LARGE_PAGE_BYTES - 1) & ~(uintptr_t)(LARGE_PAGE_BYTES - 1));
+#ifdef MADV_HUGEPAGE
+		largePages = madvise(base, size, MADV_HUGEPAGE) == 0;
+#endif
+	}
+#endif
+}
+
+GuestMemory::~GuestMemory()
+{
+#ifdef _WIN32
+	if (pieces.empty()) {
+		VirtualFree(reservation, 0, MEM_RELEASE);
+	}
+	for (const std::pair<unsigned char*, bool>& piece : pieces) {
+		ReleasePiece(piece);
+	}
+#else
+	munmap(reservation, reservationSize);
+#endif
+}
+
+bool GuestMemory::MapFile(const std::string& path, unsigned long long fileOffset,
+	const std::vector<std::pair<size_t, size_t>>& ranges)
+{
+	if (ranges.empty()) {
+		return true;
+	}
+	if (largePages) {
+		return false;
+	}
+#ifdef _WIN32
+	// A view can't replace part of an allocation, so RAM becomes a placeholder
+	// that is split up into the views and committed memory for the gaps
+	HMODULE kernel = GetModuleHandleW(L"kernelbase.dll");
+	VirtualAlloc2Function virtualAlloc2 = kernel != NULL ?
+		(VirtualAlloc2Function)GetProcAddress(kernel, "VirtualAlloc2") : NULL;
+	MapViewOfFile3Function mapViewOfFile3 = kernel != NULL ?
+		(MapViewOfFile3Function)GetProcAddress(kernel, "MapViewOfFile3") : NULL;
+	if (virtualAlloc2 == NULL || mapViewOfFile3 == NULL) {
+		return false;
+	}
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	HANDLE section = CreateFileMappingW(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file);
+	if (section == NULL) {
+		return false;
+	}
+
+	size_t total = (size + 0xFFFF) & ~(size_t)0xFFFF;
+	unsigned char* p = (unsigned char*)virtualAlloc2(NULL, NULL, total, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER,
+		PAGE_NOACCESS, NULL, 0);
+	bool ok = p != NULL;
+	size_t pos = 0;
+	unsigned long long filePos = fileOffset;
+	std::vector<std::pair<unsigned char*, bool>> mapped;
+	// Replaces [pos, end) of the placeholder, splitting it off first unless it's the rest
+	auto replace = [&](size_t end, bool view) {
+		if (!ok || end == pos) {
+			return;
+		}
+		unsigned char* at = p + pos;
+		if (end < total && !VirtualFree(at, end - pos, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER)) {
+			ok = false;
+			return;
+		}
+		if (view) {
+			ok = mapViewOfFile3(section, GetCurrentProcess(), at, filePos, end - pos, MEM_REPLACE_PLACEHOLDER,
+				PAGE_WRITECOPY, NULL, 0) != NULL;
+			filePos += end - pos;
+		}
+		else {
+			ok = virtualAlloc2(NULL, at, end - pos, MEM_RESERVE | MEM_COMMIT | MEM_REPLACE_PLACEHOLDER,
+				PAGE_READWRITE, NULL, 0) != NULL;
+		}
+		if (ok) {
+			mapped.push_back(std::make_pair(at, view));
+		}
+		else {
+			VirtualFree(at, 0, MEM_RELEASE);
+		}
+		pos = end;
+	};
+	for (const std::pair<size_t, size_t>& range : ranges) {
+		replace(range.first, false);
+		replace(range.first + range.second, true);
+	}
+	replace(total, false);
+	CloseHandle(section);
+
+	if (!ok) {
+		for (const std::pair<unsigned char*, bool>& piece : mapped) {
+			ReleasePiece(piece);
+		}
+		if (p != NULL && pos < total) {
+			VirtualFree(p + pos, 0, MEM_RELEASE);
+		}
+		return false;
+	}
+	VirtualFree(reservation, 0, MEM_RELEASE);
+	reservation = p;
+	reservationSize = total;
+	base = p;
+	pieces = mapped;
+	return true;
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	bool ok = true;
+	unsigned long long filePos = fileOffset;
+	for (const std::pair<size_t, size_t>& range : ranges) {
+		void* p = mmap(base + range.first, range.second, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+			fd, (off_t)filePos);
+		if (p == MAP_FAILED) {
+			ok = false;
+			break;
+		}
+		filePos += range.second;
+	}
+	close(fd);
+	return ok;
+#endif
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Guest RAM. The whole size is allocated up front but isn't touched, so the
+ * host only backs a page with physical memory when the guest (or JS) first
+ * uses it: demand-zero committed pages on Windows, an anonymous mapping
+ * elsewhere. Startup no longer zero-fills all of RAM and a mostly idle guest
+ * stays small.
+ *
+ * With large pages requested, 2 MiB pages are used if the host allows it,
+ * otherwise normal pages. On Windows that needs SeLockMemoryPrivilege and the
+ * pages are backed immediately; elsewhere the mapping is 2 MiB aligned and
+ * marked for transparent huge pages.
+ */
+class GuestMemory {
+private:
+	unsigned char* reservation = nullptr;  // Start of the host allocation
+	size_t reservationSize = 0;
+	unsigned char* base = nullptr;         // Guest physical address 0
+	size_t size;
+	bool largePages = false;
+	std::vector<std::pair<unsigned char*, bool>> pieces;  // Windows, after MapFile(): start and if it's a file view
+
+public:
+	static const size_t LARGE_PAGE_BYTES = 2 * 1024 * 1024;
+
+	GuestMemory(size_t size, bool wantLargePages);
+	~GuestMemory();
+
+	GuestMemory(const GuestMemory&) = delete;
+	GuestMemory& operator=(const GuestMemory&) = delete;
+
+	unsigned char* Get() { return base; }
+	size_t Size() { return size; }
+
+	/** True if RAM is in large pages (for transparent huge pages: if they were asked for) */
+	bool HasLargePages() { return largePages; }
+
+	/**
+	 * Maps ranges of RAM (offset, length; 64 KiB aligned) copy-on-write to a
+	 * file, in which they lie back to back from fileOffset, so their pages are
+	 * read when first touched and only written ones are copied. Must be done
+	 * before RAM is used, Get() may change. Returns false where the host can't
+	 * (large pages, Windows before version 1803), RAM may then already hold
+	 * some of the ranges
+	 */
+	bool MapFile(const std::string& path, unsigned long long fileOffset,
+		const std::vector<std::pair<size_t, size_t>>& ranges);
+};
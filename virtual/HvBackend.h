@@ -0,0 +1,99 @@
+#pragma once
+
+#include "WinHvCompat.h"
+
+// Instruction emulator callbacks. They are implemented in CMachine.cpp and the
+// context passed to them is always the CMachine the emulation is done for.
+
+HRESULT GetVirtualRegisters(VOID* Context,
+	const WHV_REGISTER_NAME* RegisterNames,
+	unsigned int RegisterCount,
+	WHV_REGISTER_VALUE* RegisterValues);
+
+HRESULT IoPortCallback(VOID* Context, WHV_EMULATOR_IO_ACCESS_INFO* IoAccess);
+
+HRESULT SetVirtualRegisters(VOID* Context,
+	const WHV_REGISTER_NAME* RegisterNames,
+	UINT32 RegisterCount,
+	const WHV_REGISTER_VALUE* RegisterValues);
+
+HRESULT MemoryCallback(VOID* Context,
+	WHV_EMULATOR_MEMORY_ACCESS_INFO* MemoryAccess);
+
+HRESULT TranslateRange(
+	VOID* Context,
+	WHV_GUEST_VIRTUAL_ADDRESS GvaPage,
+	WHV_TRANSLATE_GVA_FLAGS TranslateFlags,
+	WHV_TRANSLATE_GVA_RESULT_CODE* TranslationResult,
+	WHV_GUEST_PHYSICAL_ADDRESS*
+	GpaPage  // NOTE: This pointer _must_ be 4K page aligned
+);
+
+/**
+ * Hypervisor backend used by CMachine.
+ *
+ * Wraps the partition, virtual processor, register, GPA mapping and
+ * instruction emulator calls of the Windows Hypervisor Platform. The methods
+ * mirror the WHv* functions of the same name, minus the partition/emulator
+ * handles which the backend owns. WhpBackend is the real implementation,
+ * MockBackend replays a scripted sequence of exits so the machine can be run
+ * without a hypervisor.
+ */
+class HvBackend {
+public:
+	virtual ~HvBackend() {}
+
+	virtual HRESULT SetPartitionProperty(WHV_PARTITION_PROPERTY_CODE PropertyCode,
+		const VOID* PropertyBuffer,
+		UINT32 PropertyBufferSizeInBytes) = 0;
+
+	virtual HRESULT SetupPartition() = 0;
+
+	virtual HRESULT MapGpaRange(VOID* SourceAddress,
+		WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+		UINT64 SizeInBytes,
+		WHV_MAP_GPA_RANGE_FLAGS Flags) = 0;
+
+	virtual HRESULT UnmapGpaRange(WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+		UINT64 SizeInBytes) = 0;
+
+	/** Returns and clears the dirty page bits of a range mapped with WHvMapGpaRangeFlagTrackDirtyPages */
+	virtual HRESULT QueryGpaRangeDirtyBitmap(WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+		UINT64 RangeSizeInBytes,
+		UINT64* Bitmap,
+		UINT32 BitmapSizeInBytes) = 0;
+
+	virtual HRESULT CreateVirtualProcessor(UINT32 VpIndex) = 0;
+
+	virtual HRESULT GetVirtualProcessorRegisters(UINT32 VpIndex,
+		const WHV_REGISTER_NAME* RegisterNames,
+		UINT32 RegisterCount,
+		WHV_REGISTER_VALUE* RegisterValues) = 0;
+
+	virtual HRESULT SetVirtualProcessorRegisters(UINT32 VpIndex,
+		const WHV_REGISTER_NAME* RegisterNames,
+		UINT32 RegisterCount,
+		const WHV_REGISTER_VALUE* RegisterValues) = 0;
+
+	virtual HRESULT RunVirtualProcessor(UINT32 VpIndex,
+		WHV_RUN_VP_EXIT_CONTEXT* ExitContext) = 0;
+
+	/** May be called from any thread */
+	virtual HRESULT CancelRunVirtualProcessor(UINT32 VpIndex) = 0;
+
+	virtual HRESULT TranslateGva(UINT32 VpIndex,
+		WHV_GUEST_VIRTUAL_ADDRESS Gva,
+		WHV_TRANSLATE_GVA_FLAGS TranslateFlags,
+		WHV_TRANSLATE_GVA_RESULT* TranslationResult,
+		WHV_GUEST_PHYSICAL_ADDRESS* Gpa) = 0;
+
+	virtual HRESULT EmulatorTryIoEmulation(VOID* Context,
+		const WHV_VP_EXIT_CONTEXT* VpContext,
+		const WHV_X64_IO_PORT_ACCESS_CONTEXT* IoInstructionContext,
+		WHV_EMULATOR_STATUS* EmulatorReturnStatus) = 0;
+
+	virtual HRESULT EmulatorTryMmioEmulation(VOID* Context,
+		const WHV_VP_EXIT_CONTEXT* VpContext,
+		const WHV_MEMORY_ACCESS_CONTEXT* MmioInstructionContext,
+		WHV_EMULATOR_STATUS* EmulatorReturnStatus) = 0;
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string.h>
+
+#include "Counter.h"
+#include "WinHvCompat.h"
+
+/**
+ * Interrupts waiting to be injected into the guest.
+ *
+ * Requests are kept in priority order (higher first, FIFO among equal
+ * priorities). A vector that is already waiting with the same trigger mode
+ * is merged with the new request: the guest would only see one interrupt
+ * for an edge, and a level that is still asserted is raised again by the
+ * device model after the acknowledge. So there's at most one entry per
+ * vector and trigger mode, and the queue can't fill up.
+ */
+struct IrqRequest {
+	UINT8 vector;
+	UINT8 priority;
+	UINT8 level;  // Level triggered
+	UINT8 pad;
+};
+
+class IrqQueue {
+private:
+	static const UINT32 MAX_ENTRIES = 2 * 256;  // Each vector edge and level triggered
+
+	IrqRequest entries[MAX_ENTRIES];
+	UINT32 count = 0;
+	UINT64 waiting[2][4] = {};  // Bitmaps of the vectors in entries, edge then level triggered
+
+	bool IsWaiting(UINT8 vector, bool level) const { return (waiting[level ? 1 : 0][vector >> 6] >> (vector & 63)) & 1; }
+
+public:
+	Counter queuedCounter;
+	Counter coalescedCounter;
+
+	/** Queues an interrupt. Returns false if it was merged with one already waiting */
+	bool Push(UINT8 vector, UINT8 priority, bool level)
+	{
+		if (IsWaiting(vector, level)) {
+			coalescedCounter++;
+			return false;
+		}
+		UINT32 pos = count;
+		while (pos > 0 && entries[pos - 1].priority < priority) {
+			entries[pos] = entries[pos - 1];
+			pos--;
+		}
+		entries[pos].vector = vector;
+		entries[pos].priority = priority;
+		entries[pos].level = level ? 1 : 0;
+		entries[pos].pad = 0;
+		count++;
+		waiting[level ? 1 : 0][vector >> 6] |= 1ULL << (vector & 63);
+		queuedCounter++;
+		return true;
+	}
+
+	bool Empty() const { return count == 0; }
+	UINT32 Size() const { return count; }
+
+	/** Removes and returns the vector of the highest priority interrupt */
+	UINT8 Pop()
+	{
+		IrqRequest first = entries[0];
+		count--;
+		for (UINT32 i = 0; i < count; i++) {
+			entries[i] = entries[i + 1];
+		}
+		waiting[first.level][first.vector >> 6] &= ~(1ULL << (first.vector & 63));
+		return first.vector;
+	}
+
+	void Clear()
+	{
+		count = 0;
+		memset(waiting, 0x0, sizeof(waiting));
+	}
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <chrono>
+
+#include "WinHvCompat.h"
+
+/**
+ * Monotonic, high resolution machine clock in nanoseconds, used for run()
+ * deadlines and the native device timers. steady_clock is backed by
+ * QueryPerformanceCounter on Windows and CLOCK_MONOTONIC on Linux, both of
+ * which read the invariant TSC where the host has one.
+ */
+class MachineClock {
+public:
+	static UINT64 Now()
+	{
+		static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	/** Deadline the given (fractional) number of milliseconds from now */
+	static UINT64 After(double milliseconds)
+	{
+		if (milliseconds < 0) {
+			milliseconds = 0;
+		}
+		return Now() + (UINT64)(milliseconds * 1000000.0);
+	}
+};
@@ -0,0 +1,367 @@
+#include "MmioDecoder.h"
+
+/** Length of the ModRM byte and what follows it (SIB, displacement), or 0 if the operand is a register */
+static UINT32 ModRmLength(const UINT8* p, UINT32 remaining, UINT8 addrSize)
+{
+	if (remaining < 1) {
+		return 0;
+	}
+	UINT8 modrm = p[0];
+	UINT8 mod = modrm >> 6;
+	UINT8 rm = modrm & 7;
+	if (mod == 3) {
+		return 0;
+	}
+	UINT32 len = 1;
+	if (addrSize == 2) {
+		if (mod == 0 && rm == 6) {
+			len += 2;
+		}
+		else if (mod == 1) {
+			len += 1;
+		}
+		else if (mod == 2) {
+			len += 2;
+		}
+	}
+	else {
+		if (rm == 4) {
+			if (remaining < 2) {
+				return 0;
+			}
+			len++;
+			if (mod == 0 && (p[1] & 7) == 5) {
+				len += 4;
+			}
+		}
+		else if (mod == 0 && rm == 5) {
+			len += 4;
+		}
+		if (mod == 1) {
+			len += 1;
+		}
+		else if (mod == 2) {
+			len += 4;
+		}
+	}
+	return len <= remaining ? len : 0;
+}
+
+static UINT64 ReadImm(const UINT8* p, UINT8 size)
+{
+	UINT64 v = 0;
+	for (UINT8 i = 0; i < size; i++) {
+		v |= (UINT64)p[i] << (i * 8);
+	}
+	return v;
+}
+
+static UINT64 SignExtend(UINT64 v, UINT8 fromSize, UINT8 toSize)
+{
+	if (fromSize < 8) {
+		UINT64 sign = 1ULL << (fromSize * 8 - 1);
+		v = (v ^ sign) - sign;
+	}
+	return toSize < 8 ? v & ((1ULL << (toSize * 8)) - 1) : v;
+}
+
+bool DecodeMmioInstruction(const UINT8* bytes, UINT32 count, bool longMode, bool default32,
+	MmioInstruction* out)
+{
+	memset(out, 0x0, sizeof(*out));
+
+	// Prefixes
+	bool opOverride = false, addrOverride = false, rep = false, segOverride = false;
+	UINT8 rex = 0;
+	UINT32 i = 0;
+	for (; i < count; i++) {
+		UINT8 b = bytes[i];
+		if (b == 0x66) {
+			opOverride = true;
+		}
+		else if (b == 0x67) {
+			addrOverride = true;
+		}
+		else if (b == 0xF3) {
+			rep = true;
+		}
+		else if (b == 0xF2) {
+			return false;
+		}
+		else if (b == 0xF0 || b == 0x3E) {
+			// LOCK, DS
+		}
+		else if (b == 0x26 || b == 0x2E || b == 0x36 || b == 0x64 || b == 0x65) {
+			segOverride = true;
+		}
+		else {
+			break;
+		}
+	}
+	if (longMode && i < count && (bytes[i] & 0xF0) == 0x40) {
+		rex = bytes[i++];
+	}
+	if (i >= count) {
+		return false;
+	}
+
+	UINT8 opSize;
+	if (rex & 8) {
+		opSize = 8;
+	}
+	else if (longMode || default32) {
+		opSize = opOverride ? 2 : 4;
+	}
+	else {
+		opSize = opOverride ? 4 : 2;
+	}
+	UINT8 addrSize;
+	if (longMode) {
+		addrSize = addrOverride ? 4 : 8;
+	}
+	else if (default32) {
+		addrSize = addrOverride ? 2 : 4;
+	}
+	else {
+		addrSize = addrOverride ? 4 : 2;
+	}
+	out->addrSize = addrSize;
+
+	UINT8 opcode = bytes[i++];
+	bool twoByte = false;
+	if (opcode == 0x0F) {
+		if (i >= count) {
+			return false;
+		}
+		twoByte = true;
+		opcode = bytes[i++];
+	}
+
+	// The string and moffs forms have no ModRM byte
+	if (!twoByte) {
+		switch (opcode) {
+		case 0xAA:
+		case 0xAB:
+		case 0xA4:
+		case 0xA5:
+			if (opcode == 0xA4 || opcode == 0xA5) {
+				if (segOverride) {
+					return false;
+				}
+				out->op = MmioMovs;
+			}
+			else {
+				out->op = MmioStos;
+			}
+			out->memSize = (opcode & 1) ? opSize : 1;
+			out->regSize = out->memSize;
+			out->rep = rep ? 1 : 0;
+			out->length = (UINT8)i;
+			return true;
+		case 0xA0:
+		case 0xA1:
+		case 0xA2:
+		case 0xA3:
+			if (i + addrSize > count) {
+				return false;
+			}
+			out->op = (opcode & 2) ? MmioStore : MmioLoad;
+			out->memSize = (opcode & 1) ? opSize : 1;
+			out->regSize = out->memSize;
+			out->reg = 0;
+			out->length = (UINT8)(i + addrSize);
+			return true;
+		}
+	}
+	if (rep && !twoByte) {
+		return false;
+	}
+
+	UINT32 modrmLen = ModRmLength(bytes + i, count - i, addrSize);
+	if (modrmLen == 0) {
+		return false;  // Register operand or truncated
+	}
+	UINT8 modrm = bytes[i];
+	UINT8 regField = ((modrm >> 3) & 7) | ((rex & 4) ? 8 : 0);
+	UINT8 subop = (modrm >> 3) & 7;
+	UINT32 immPos = i + modrmLen;
+	UINT8 immSize = 0;
+
+	out->reg = regField;
+	if (twoByte) {
+		switch (opcode) {
+		case 0xB6:
+		case 0xB7:
+		case 0xBE:
+		case 0xBF:
+			if (rep) {
+				return false;
+			}
+			out->op = (opcode & 8) ? MmioLoadSx : MmioLoadZx;
+			out->memSize = (opcode & 1) ? 2 : 1;
+			out->regSize = opSize;
+			break;
+		case 0x10:
+		case 0x11:
+			// MOVUPS/MOVUPD, or MOVSS with F3
+			out->op = (opcode & 1) ? MmioStoreXmm : MmioLoadXmm;
+			out->memSize = rep ? 4 : 16;
+			break;
+		case 0x28:
+		case 0x29:
+			// MOVAPS/MOVAPD
+			if (rep) {
+				return false;
+			}
+			out->op = (opcode & 1) ? MmioStoreXmm : MmioLoadXmm;
+			out->memSize = 16;
+			break;
+		case 0x6F:
+		case 0x7F:
+			// MOVDQA with 66, MOVDQU with F3 (without either it's an MMX register)
+			if (!opOverride && !rep) {
+				return false;
+			}
+			out->op = opcode == 0x7F ? MmioStoreXmm : MmioLoadXmm;
+			out->memSize = 16;
+			break;
+		case 0x7E:
+			// MOVQ xmm, m64
+			if (!rep || opOverride) {
+				return false;
+			}
+			out->op = MmioLoadXmm;
+			out->memSize = 8;
+			break;
+		case 0xD6:
+			// MOVQ m64, xmm
+			if (!opOverride || rep) {
+				return false;
+			}
+			out->op = MmioStoreXmm;
+			out->memSize = 8;
+			break;
+		default:
+			return false;
+		}
+		if (out->op == MmioLoadXmm || out->op == MmioStoreXmm) {
+			out->regSize = 16;
+		}
+	}
+	else {
+		UINT8 wide = opcode & 1;
+		UINT8 size = wide ? opSize : 1;
+		out->memSize = size;
+		out->regSize = size;
+		switch (opcode) {
+		case 0x88:
+		case 0x89:
+			out->op = MmioStore;
+			break;
+		case 0x8A:
+		case 0x8B:
+			out->op = MmioLoad;
+			break;
+		case 0x20:
+		case 0x21:
+			out->op = MmioAnd;
+			break;
+		case 0x22:
+		case 0x23:
+			out->op = MmioAndToReg;
+			break;
+		case 0x08:
+		case 0x09:
+			out->op = MmioOr;
+			break;
+		case 0x0A:
+		case 0x0B:
+			out->op = MmioOrToReg;
+			break;
+		case 0x84:
+		case 0x85:
+			out->op = MmioTest;
+			break;
+		case 0xC6:
+		case 0xC7:
+			if (subop != 0) {
+				return false;
+			}
+			out->op = MmioStoreImm;
+			immSize = size == 8 ? 4 : size;
+			break;
+		case 0xF6:
+		case 0xF7:
+			if (subop != 0) {
+				return false;
+			}
+			out->op = MmioTest;
+			immSize = size == 8 ? 4 : size;
+			break;
+		case 0x80:
+		case 0x81:
+		case 0x83:
+			if (subop == 1) {
+				out->op = MmioOr;
+			}
+			else if (subop == 4) {
+				out->op = MmioAnd;
+			}
+			else {
+				return false;
+			}
+			if (opcode == 0x83) {
+				out->memSize = opSize;
+				out->regSize = opSize;
+				immSize = 1;
+			}
+			else {
+				immSize = size == 8 ? 4 : size;
+			}
+			break;
+		default:
+			return false;
+		}
+	}
+
+	if (immSize) {
+		if (immPos + immSize > count) {
+			return false;
+		}
+		out->useImm = 1;
+		out->imm = SignExtend(ReadImm(bytes + immPos, immSize), immSize, out->memSize);
+	}
+	else if (out->regSize == 1 && !rex && regField >= 4 && regField < 8) {
+		// AH, CH, DH, BH
+		out->reg = regField - 4;
+		out->regHigh8 = 1;
+	}
+	out->length = (UINT8)(immPos + immSize);
+	return true;
+}
+
+const MmioInstruction* MmioDecodeCache::Lookup(UINT64 cr3, UINT64 rip, const UINT8* bytes, UINT32 count,
+	bool longMode, bool default32)
+{
+	Key key;
+	memset(&key, 0x0, sizeof(key));
+	key.cr3 = cr3;
+	key.rip = rip;
+	key.count = (UINT8)(count > sizeof(key.bytes) ? sizeof(key.bytes) : count);
+	memcpy(key.bytes, bytes, key.count);
+	key.mode = (longMode ? 2 : 0) | (default32 ? 1 : 0);
+
+	auto it = entries.find(key);
+	if (it != entries.end()) {
+		hits++;
+		return it->second.valid ? &it->second.instruction : nullptr;
+	}
+
+	misses++;
+	if (entries.size() >= MAX_ENTRIES) {
+		entries.clear();
+	}
+	Entry& entry = entries[key];
+	entry.valid = DecodeMmioInstruction(key.bytes, key.count, longMode, default32, &entry.instruction);
+	return entry.valid ? &entry.instruction : nullptr;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <string.h>
+
+#include <unordered_map>
+
+#include "WinHvCompat.h"
+
+/**
+ * Decoder for the instruction forms guest drivers use for MMIO, so the common
+ * MMIO exits can be completed without the generic instruction emulator:
+ *
+ *  MOV r/m,r  MOV r,r/m  MOV r/m,imm  MOV AL/eAX,moffs  MOV moffs,AL/eAX
+ *  MOVZX/MOVSX r,r/m8 and r,r/m16
+ *  AND/OR r/m,r  AND/OR r,r/m  AND/OR r/m,imm  TEST r/m,r  TEST r/m,imm
+ *  STOS and MOVS, with or without REP
+ *  MOVUPS/MOVUPD/MOVAPS/MOVAPD/MOVDQA/MOVDQU, MOVQ and MOVSS with an XMM register
+ *
+ * Only forms with a memory operand are decoded. Anything else (and anything
+ * with prefixes that change the meaning, like REPNE or segment overrides on
+ * MOVS) is reported as undecodable and left to the emulator.
+ */
+
+enum MmioOp {
+	MmioLoad,       // reg = [mem]
+	MmioStore,      // [mem] = reg
+	MmioStoreImm,   // [mem] = imm
+	MmioLoadZx,     // reg = zero extended [mem]
+	MmioLoadSx,     // reg = sign extended [mem]
+	MmioAnd,        // [mem] &= reg/imm
+	MmioOr,         // [mem] |= reg/imm
+	MmioAndToReg,   // reg &= [mem]
+	MmioOrToReg,    // reg |= [mem]
+	MmioTest,       // flags of [mem] & reg/imm
+	MmioStos,       // [ES:rDI] = rAX
+	MmioMovs,       // [ES:rDI] = [seg:rSI]
+	MmioLoadXmm,    // xmm = zero extended [mem]
+	MmioStoreXmm    // [mem] = low memSize bytes of xmm
+};
+
+struct MmioInstruction {
+	UINT8 op;           // MmioOp
+	UINT8 length;       // Instruction length in bytes
+	UINT8 memSize;      // Size of the memory access (1, 2, 4, 8 or 16)
+	UINT8 regSize;      // Size of the register operand
+	UINT8 reg;          // GPR index (WHvX64RegisterRax + reg), XMM index for the XMM forms
+	UINT8 regHigh8;     // reg is AH, CH, DH or BH
+	UINT8 useImm;       // Source is imm instead of reg
+	UINT8 rep;          // REP prefix (STOS/MOVS)
+	UINT8 addrSize;     // Address size (STOS/MOVS index and count registers)
+	UINT8 pad[7];
+	UINT64 imm;         // Sign extended to memSize
+};
+
+/** Decodes the instruction. Returns false if it's not one of the handled forms */
+bool DecodeMmioInstruction(const UINT8* bytes, UINT32 count, bool longMode, bool default32,
+	MmioInstruction* out);
+
+/**
+ * Decoded instructions by (CR3, RIP, mode, instruction bytes), so repeated
+ * exits from the same instruction skip decoding. Undecodable instructions are
+ * cached as well, so they go to the emulator right away.
+ */
+class MmioDecodeCache {
+private:
+	struct Key {
+		UINT64 cr3;
+		UINT64 rip;
+		UINT8 bytes[16];
+		UINT8 count;
+		UINT8 mode;
+
+		bool operator==(const Key& other) const
+		{
+			return cr3 == other.cr3 && rip == other.rip && count == other.count &&
+				mode == other.mode && memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+		}
+	};
+
+	struct KeyHash {
+		size_t operator()(const Key& k) const
+		{
+			UINT64 h = k.rip * 0x9E3779B97F4A7C15ULL ^ k.cr3;
+			UINT64 b[2];
+			memcpy(b, k.bytes, sizeof(b));
+			h ^= (b[0] + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2));
+			h ^= (b[1] + k.count + k.mode + (h << 6) + (h >> 2));
+			return (size_t)h;
+		}
+	};
+
+	struct Entry {
+		bool valid;
+		MmioInstruction instruction;
+	};
+
+	static const size_t MAX_ENTRIES = 4096;
+	std::unordered_map<Key, Entry, KeyHash> entries;
+
+public:
+	UINT64 hits = 0;
+	UINT64 misses = 0;
+
+	/** Returns the decoded instruction, or nullptr if it must be emulated */
+	const MmioInstruction* Lookup(UINT64 cr3, UINT64 rip, const UINT8* bytes, UINT32 count,
+		bool longMode, bool default32);
+
+	void Clear() { entries.clear(); }
+};
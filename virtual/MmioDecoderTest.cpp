@@ -0,0 +1,263 @@
+// Unit tests of DecodeMmioInstruction, e.g.
+//
+//   cefvirtual_decoder_test
+//
+// Each case decodes a fixed instruction in one processor mode and checks the
+// fields of the result, or that the instruction is left to the emulator.
+// Failures are listed on stderr and the exit code is 1 if there were any.
+
+#include <stdio.h>
+
+#include <initializer_list>
+#include <vector>
+
+#include "MmioDecoder.h"
+
+enum TestMode {
+	Real,    // 16-bit operands and addresses
+	Prot,    // 32-bit operands and addresses
+	Long     // 64-bit mode
+};
+
+/** The expected result, reg and regHigh8 are only checked without an immediate */
+struct Expected {
+	UINT8 op;
+	UINT8 length;
+	UINT8 memSize;
+	UINT8 regSize;
+	UINT8 reg;
+	UINT8 regHigh8;
+	UINT8 useImm;
+	UINT64 imm;
+	UINT8 rep;
+	UINT8 addrSize;
+};
+
+static unsigned int failures = 0;
+static unsigned int tests = 0;
+
+static void Check(const char* name, const char* field, UINT64 got, UINT64 expected)
+{
+	if (got != expected) {
+		fprintf(stderr, "%s: %s is 0x%llx, expected 0x%llx\n", name, field,
+			(unsigned long long)got, (unsigned long long)expected);
+		failures++;
+	}
+}
+
+static bool Decode(TestMode mode, const std::vector<UINT8>& bytes, MmioInstruction* out)
+{
+	return DecodeMmioInstruction(bytes.data(), (UINT32)bytes.size(), mode == Long, mode == Prot, out);
+}
+
+/** Decodes the bytes and compares the result with e */
+static void Accept(const char* name, TestMode mode, std::initializer_list<UINT8> bytes, const Expected& e)
+{
+	tests++;
+	MmioInstruction d;
+	if (!Decode(mode, bytes, &d)) {
+		fprintf(stderr, "%s: not decoded\n", name);
+		failures++;
+		return;
+	}
+	unsigned int before = failures;
+	Check(name, "op", d.op, e.op);
+	Check(name, "length", d.length, e.length);
+	Check(name, "memSize", d.memSize, e.memSize);
+	Check(name, "regSize", d.regSize, e.regSize);
+	Check(name, "useImm", d.useImm, e.useImm);
+	if (e.useImm) {
+		Check(name, "imm", d.imm, e.imm);
+	}
+	else {
+		Check(name, "reg", d.reg, e.reg);
+		Check(name, "regHigh8", d.regHigh8, e.regHigh8);
+	}
+	Check(name, "rep", d.rep, e.rep);
+	Check(name, "addrSize", d.addrSize, e.addrSize);
+
+	// Every prefix of the instruction is truncated and must be rejected
+	std::vector<UINT8> all(bytes);
+	for (size_t n = 0; n < all.size() && failures == before; n++) {
+		std::vector<UINT8> part(all.begin(), all.begin() + n);
+		if (Decode(mode, part, &d)) {
+			fprintf(stderr, "%s: decoded from the first %u bytes\n", name, (unsigned int)n);
+			failures++;
+		}
+	}
+}
+
+/** Checks that the bytes are left to the emulator */
+static void Reject(const char* name, TestMode mode, std::initializer_list<UINT8> bytes)
+{
+	tests++;
+	MmioInstruction d;
+	if (Decode(mode, bytes, &d)) {
+		fprintf(stderr, "%s: decoded, expected to be rejected\n", name);
+		failures++;
+	}
+}
+
+static void TestModRm()
+{
+	// Expected: op, length, memSize, regSize, reg, regHigh8, useImm, imm, rep, addrSize
+	Accept("mov [eax],ecx", Prot, {0x89, 0x08}, {MmioStore, 2, 4, 4, 1, 0, 0, 0, 0, 4});
+	Accept("mov cl,[ebx]", Prot, {0x8A, 0x0B}, {MmioLoad, 2, 1, 1, 1, 0, 0, 0, 0, 4});
+	Accept("mov [ebp+8],ah", Prot, {0x88, 0x65, 0x08}, {MmioStore, 3, 1, 1, 0, 1, 0, 0, 0, 4});
+	Accept("mov eax,[disp32]", Prot, {0x8B, 0x05, 0x00, 0x00, 0xC0, 0xFE}, {MmioLoad, 6, 4, 4, 0, 0, 0, 0, 0, 4});
+	Accept("mov [esp],edx", Prot, {0x89, 0x14, 0x24}, {MmioStore, 3, 4, 4, 2, 0, 0, 0, 0, 4});
+	Accept("mov [esp+ecx*4+16],edx", Prot, {0x89, 0x54, 0x8C, 0x10}, {MmioStore, 4, 4, 4, 2, 0, 0, 0, 0, 4});
+	Accept("mov [ecx*4+disp32],edx", Prot, {0x89, 0x14, 0x8D, 0x00, 0x10, 0x00, 0x00},
+		{MmioStore, 7, 4, 4, 2, 0, 0, 0, 0, 4});
+	Accept("mov esi,[edi+disp32]", Prot, {0x8B, 0xB7, 0x00, 0x01, 0x00, 0x00}, {MmioLoad, 6, 4, 4, 6, 0, 0, 0, 0, 4});
+	Accept("mov [eax],cx", Prot, {0x66, 0x89, 0x08}, {MmioStore, 3, 2, 2, 1, 0, 0, 0, 0, 4});
+
+	// REX
+	Accept("mov [rsp],rcx", Long, {0x48, 0x89, 0x0C, 0x24}, {MmioStore, 4, 8, 8, 1, 0, 0, 0, 0, 8});
+	Accept("mov eax,[rip+disp32]", Long, {0x8B, 0x05, 0x10, 0x00, 0x00, 0x00}, {MmioLoad, 6, 4, 4, 0, 0, 0, 0, 0, 8});
+	Accept("mov r8d,[rbp+disp32]", Long, {0x44, 0x8B, 0x85, 0x00, 0x02, 0x00, 0x00},
+		{MmioLoad, 7, 4, 4, 8, 0, 0, 0, 0, 8});
+	Accept("mov [rbp+8],spl", Long, {0x40, 0x88, 0x65, 0x08}, {MmioStore, 4, 1, 1, 4, 0, 0, 0, 0, 8});
+	Accept("mov [rbp+8],ah", Long, {0x88, 0x65, 0x08}, {MmioStore, 3, 1, 1, 0, 1, 0, 0, 0, 8});
+	Accept("mov [r9],r15", Long, {0x4D, 0x89, 0x39}, {MmioStore, 3, 8, 8, 15, 0, 0, 0, 0, 8});
+	Accept("mov [eax],ecx (67)", Long, {0x67, 0x89, 0x08}, {MmioStore, 3, 4, 4, 1, 0, 0, 0, 0, 4});
+	Accept("mov ax,[rbx] (66)", Long, {0x66, 0x8B, 0x03}, {MmioLoad, 3, 2, 2, 0, 0, 0, 0, 0, 8});
+	Accept("lock or [rax],ecx", Long, {0xF0, 0x09, 0x08}, {MmioOr, 3, 4, 4, 1, 0, 0, 0, 0, 8});
+	Accept("and ecx,[rax]", Long, {0x23, 0x08}, {MmioAndToReg, 2, 4, 4, 1, 0, 0, 0, 0, 8});
+	Accept("or cl,[rax]", Long, {0x0A, 0x08}, {MmioOrToReg, 2, 1, 1, 1, 0, 0, 0, 0, 8});
+	Accept("test [rax],edx", Long, {0x85, 0x10}, {MmioTest, 2, 4, 4, 2, 0, 0, 0, 0, 8});
+
+	// MOVZX/MOVSX
+	Accept("movzx ecx,byte [eax]", Prot, {0x0F, 0xB6, 0x08}, {MmioLoadZx, 3, 1, 4, 1, 0, 0, 0, 0, 4});
+	Accept("movsx rcx,word [rax]", Long, {0x48, 0x0F, 0xBF, 0x08}, {MmioLoadSx, 4, 2, 8, 1, 0, 0, 0, 0, 8});
+}
+
+static void TestAddress16()
+{
+	Accept("mov ax,[bx+si]", Real, {0x8B, 0x00}, {MmioLoad, 2, 2, 2, 0, 0, 0, 0, 0, 2});
+	Accept("mov ax,[bx+2]", Real, {0x8B, 0x47, 0x02}, {MmioLoad, 3, 2, 2, 0, 0, 0, 0, 0, 2});
+	Accept("mov ax,[disp16]", Real, {0x8B, 0x06, 0x34, 0x12}, {MmioLoad, 4, 2, 2, 0, 0, 0, 0, 0, 2});
+	Accept("mov [bp+disp16],dl", Real, {0x88, 0x96, 0x00, 0x10}, {MmioStore, 4, 1, 1, 2, 0, 0, 0, 0, 2});
+	Accept("mov eax,[bx] (66)", Real, {0x66, 0x8B, 0x07}, {MmioLoad, 3, 4, 4, 0, 0, 0, 0, 0, 2});
+	Accept("mov ax,[esp] (67)", Real, {0x67, 0x8B, 0x04, 0x24}, {MmioLoad, 4, 2, 2, 0, 0, 0, 0, 0, 4});
+	Accept("mov eax,[bx+2] (67)", Prot, {0x67, 0x8B, 0x47, 0x02}, {MmioLoad, 4, 4, 4, 0, 0, 0, 0, 0, 2});
+}
+
+static void TestImmediate()
+{
+	Accept("mov byte [eax],0x80", Prot, {0xC6, 0x00, 0x80}, {MmioStoreImm, 3, 1, 1, 0, 0, 1, 0x80, 0, 4});
+	Accept("mov word [bx],0x8001", Real, {0xC7, 0x07, 0x01, 0x80}, {MmioStoreImm, 4, 2, 2, 0, 0, 1, 0x8001, 0, 2});
+	Accept("mov dword [rip+disp32],imm32", Long, {0xC7, 0x05, 0x00, 0x01, 0x00, 0x00, 0x78, 0x56, 0x34, 0x12},
+		{MmioStoreImm, 10, 4, 4, 0, 0, 1, 0x12345678, 0, 8});
+	Accept("mov qword [rax],-1", Long, {0x48, 0xC7, 0x00, 0xFF, 0xFF, 0xFF, 0xFF},
+		{MmioStoreImm, 7, 8, 8, 0, 0, 1, 0xFFFFFFFFFFFFFFFFULL, 0, 8});
+	Accept("mov qword [rax],0x7fffffff", Long, {0x48, 0xC7, 0x00, 0xFF, 0xFF, 0xFF, 0x7F},
+		{MmioStoreImm, 7, 8, 8, 0, 0, 1, 0x7FFFFFFF, 0, 8});
+	Accept("and dword [eax],-16", Prot, {0x83, 0x20, 0xF0}, {MmioAnd, 3, 4, 4, 0, 0, 1, 0xFFFFFFF0, 0, 4});
+	Accept("or word [eax],-128", Prot, {0x66, 0x83, 0x08, 0x80}, {MmioOr, 4, 2, 2, 0, 0, 1, 0xFF80, 0, 4});
+	Accept("or qword [rax],-2", Long, {0x48, 0x83, 0x08, 0xFE}, {MmioOr, 4, 8, 8, 0, 0, 1, 0xFFFFFFFFFFFFFFFEULL, 0, 8});
+	Accept("and byte [eax],0xfe", Prot, {0x80, 0x20, 0xFE}, {MmioAnd, 3, 1, 1, 0, 0, 1, 0xFE, 0, 4});
+	Accept("or dword [eax+8],imm32", Prot, {0x81, 0x48, 0x08, 0x00, 0x00, 0x00, 0x80},
+		{MmioOr, 7, 4, 4, 0, 0, 1, 0x80000000, 0, 4});
+	Accept("test byte [eax],0x80", Prot, {0xF6, 0x00, 0x80}, {MmioTest, 3, 1, 1, 0, 0, 1, 0x80, 0, 4});
+	Accept("test dword [eax],1", Prot, {0xF7, 0x00, 0x01, 0x00, 0x00, 0x00}, {MmioTest, 6, 4, 4, 0, 0, 1, 1, 0, 4});
+}
+
+static void TestMoffs()
+{
+	Accept("mov eax,[moffs32]", Prot, {0xA1, 0x00, 0x00, 0xC0, 0xFE}, {MmioLoad, 5, 4, 4, 0, 0, 0, 0, 0, 4});
+	Accept("mov [moffs32],al", Prot, {0xA2, 0x00, 0x00, 0xC0, 0xFE}, {MmioStore, 5, 1, 1, 0, 0, 0, 0, 0, 4});
+	Accept("mov [moffs16],ax", Real, {0xA3, 0x00, 0x10}, {MmioStore, 3, 2, 2, 0, 0, 0, 0, 0, 2});
+	Accept("mov eax,[moffs64]", Long, {0xA1, 0x00, 0x00, 0xC0, 0xFE, 0x00, 0x00, 0x00, 0x00},
+		{MmioLoad, 9, 4, 4, 0, 0, 0, 0, 0, 8});
+	Accept("mov rax,[moffs32] (67)", Long, {0x67, 0x48, 0xA1, 0x00, 0x00, 0xC0, 0xFE},
+		{MmioLoad, 7, 8, 8, 0, 0, 0, 0, 0, 4});
+}
+
+static void TestString()
+{
+	Accept("stosb", Prot, {0xAA}, {MmioStos, 1, 1, 1, 0, 0, 0, 0, 0, 4});
+	Accept("rep stosd", Prot, {0xF3, 0xAB}, {MmioStos, 2, 4, 4, 0, 0, 0, 0, 1, 4});
+	Accept("rep stosq", Long, {0xF3, 0x48, 0xAB}, {MmioStos, 3, 8, 8, 0, 0, 0, 0, 1, 8});
+	Accept("rep movsw", Real, {0xF3, 0xA5}, {MmioMovs, 2, 2, 2, 0, 0, 0, 0, 1, 2});
+	Accept("rep movsd (67)", Long, {0x67, 0xF3, 0xA5}, {MmioMovs, 3, 4, 4, 0, 0, 0, 0, 1, 4});
+	Accept("ds movsb", Prot, {0x3E, 0xA4}, {MmioMovs, 2, 1, 1, 0, 0, 0, 0, 0, 4});
+	Accept("es stosb", Prot, {0x26, 0xAA}, {MmioStos, 2, 1, 1, 0, 0, 0, 0, 0, 4});
+}
+
+static void TestXmm()
+{
+	Accept("movups xmm1,[rax]", Long, {0x0F, 0x10, 0x08}, {MmioLoadXmm, 3, 16, 16, 1, 0, 0, 0, 0, 8});
+	Accept("movss [rax],xmm2", Long, {0xF3, 0x0F, 0x11, 0x10}, {MmioStoreXmm, 4, 4, 16, 2, 0, 0, 0, 0, 8});
+	Accept("movaps [rax],xmm9", Long, {0x44, 0x0F, 0x29, 0x08}, {MmioStoreXmm, 4, 16, 16, 9, 0, 0, 0, 0, 8});
+	Accept("movdqa xmm0,[rax]", Long, {0x66, 0x0F, 0x6F, 0x00}, {MmioLoadXmm, 4, 16, 16, 0, 0, 0, 0, 0, 8});
+	Accept("movdqu [rax],xmm3", Long, {0xF3, 0x0F, 0x7F, 0x18}, {MmioStoreXmm, 4, 16, 16, 3, 0, 0, 0, 0, 8});
+	Accept("movq xmm1,[rax]", Long, {0xF3, 0x0F, 0x7E, 0x08}, {MmioLoadXmm, 4, 8, 16, 1, 0, 0, 0, 0, 8});
+	Accept("movq [rax],xmm1", Long, {0x66, 0x0F, 0xD6, 0x08}, {MmioStoreXmm, 4, 8, 16, 1, 0, 0, 0, 0, 8});
+}
+
+static void TestRejected()
+{
+	// REPNE
+	Reject("repne movsd", Prot, {0xF2, 0xA5});
+	Reject("repne stosb", Prot, {0xF2, 0xAA});
+	Reject("repne mov [eax],ecx", Prot, {0xF2, 0x89, 0x08});
+
+	// MOVS reads from the overridden segment
+	Reject("es movsb", Prot, {0x26, 0xA4});
+	Reject("cs rep movsd", Prot, {0x2E, 0xF3, 0xA5});
+	Reject("fs movsq", Long, {0x64, 0x48, 0xA5});
+	Reject("gs movsw", Real, {0x65, 0xA5});
+
+	// Register operands
+	Reject("mov eax,ecx", Prot, {0x89, 0xC8});
+	Reject("mov ecx,eax", Prot, {0x8B, 0xC8});
+	Reject("mov eax,imm32", Prot, {0xC7, 0xC0, 0x01, 0x00, 0x00, 0x00});
+	Reject("and eax,-16", Prot, {0x83, 0xE0, 0xF0});
+	Reject("movzx ecx,al", Prot, {0x0F, 0xB6, 0xC8});
+	Reject("movdqa xmm0,xmm1", Long, {0x66, 0x0F, 0x6F, 0xC1});
+
+	// Truncated
+	Reject("empty", Prot, {});
+	Reject("prefixes only", Long, {0x66, 0x67, 0xF3});
+	Reject("rex only", Long, {0x48});
+	Reject("0f only", Prot, {0x0F});
+	Reject("no modrm", Prot, {0x89});
+	Reject("no sib", Prot, {0x89, 0x04});
+	Reject("short disp8", Prot, {0x89, 0x48});
+	Reject("short disp32", Long, {0x8B, 0x80, 0x00, 0x10, 0x00});
+	Reject("short sib disp32", Prot, {0x89, 0x14, 0x8D, 0x00, 0x10});
+	Reject("short disp16", Real, {0x8B, 0x06, 0x34});
+	Reject("short imm32", Prot, {0xC7, 0x00, 0x01, 0x02});
+	Reject("short imm8", Prot, {0x83, 0x20});
+	Reject("short moffs32", Prot, {0xA1, 0x00, 0x00, 0xC0});
+	Reject("short moffs64", Long, {0xA1, 0x00, 0x00, 0xC0, 0xFE});
+
+	// Other forms
+	Reject("add [eax],ecx", Prot, {0x01, 0x08});
+	Reject("xor dword [eax],1", Prot, {0x83, 0x30, 0x01});
+	Reject("not dword [eax]", Prot, {0xF7, 0x10});
+	Reject("mov [eax],imm (c7 /1)", Prot, {0xC7, 0x08, 0x00, 0x00, 0x00, 0x00});
+	Reject("rep mov [eax],ecx", Prot, {0xF3, 0x89, 0x08});
+	Reject("rep movzx", Prot, {0xF3, 0x0F, 0xB6, 0x08});
+	Reject("movq mm0,[eax]", Prot, {0x0F, 0x6F, 0x00});
+	Reject("movd xmm0,[eax]", Prot, {0x66, 0x0F, 0x7E, 0x00});
+	Reject("movaps with f3", Long, {0xF3, 0x0F, 0x28, 0x00});
+}
+
+int main()
+{
+	TestModRm();
+	TestAddress16();
+	TestImmediate();
+	TestMoffs();
+	TestString();
+	TestXmm();
+	TestRejected();
+	if (failures) {
+		fprintf(stderr, "%u failures in %u tests\n", failures, tests);
+		return 1;
+	}
+	printf("%u tests passed\n", tests);
+	return 0;
+}
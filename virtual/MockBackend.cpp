@@ -0,0 +1,411 @@
+#include "MockBackend.h"
+
+#include <string.h>
+
+MockBackend::Processor::Processor() : cancelRequested(false)
+{
+	WHV_REGISTER_VALUE v;
+	memset(&v, 0x0, sizeof(v));
+	v.Reg64 = 0x202;  // Interrupts enabled
+	registers[WHvX64RegisterRflags] = v;
+}
+
+UINT64 MockBackend::Processor::Reg(WHV_REGISTER_NAME name)
+{
+	auto it = registers.find(name);
+	return it == registers.end() ? 0 : it->second.Reg64;
+}
+
+MockBackend::MockBackend(bool loop) : loop(loop), exitCounter(0), injectedCounter(0), lastInjectedVector(0)
+{
+	GetProcessor(0);
+}
+
+/** Processors are created on first use, which must be before any of them runs */
+MockBackend::Processor& MockBackend::GetProcessor(UINT32 index)
+{
+	while (processors.size() <= index) {
+		processors.push_back(std::make_unique<Processor>());
+	}
+	return *processors[index];
+}
+
+void MockBackend::SelectProcessor(UINT32 index)
+{
+	GetProcessor(index);
+	selected = index;
+}
+
+void MockBackend::Add(const MockExit& exit)
+{
+	GetProcessor(selected).script.push_back(exit);
+}
+
+MockExit MockBackend::MakeExit(WHV_RUN_VP_EXIT_REASON reason, UINT8 instructionLength)
+{
+	MockExit exit;
+	memset(&exit, 0x0, sizeof(exit));
+	exit.ctx.ExitReason = reason;
+	exit.ctx.VpContext.InstructionLength = instructionLength;
+	return exit;
+}
+
+void MockBackend::AddIo(UINT16 port, UINT8 size, bool isWrite, UINT32 value)
+{
+	MockExit exit = MakeExit(WHvRunVpExitReasonX64IoPortAccess, 1);
+	exit.ctx.IoPortAccess.PortNumber = port;
+	exit.ctx.IoPortAccess.AccessInfo.IsWrite = isWrite ? 1 : 0;
+	exit.ctx.IoPortAccess.AccessInfo.AccessSize = size;
+	exit.ctx.IoPortAccess.Rax = value;
+	Add(exit);
+}
+
+void MockBackend::AddStringIo(UINT16 port, UINT8 size, bool isWrite, bool rep)
+{
+	MockExit exit = MakeExit(WHvRunVpExitReasonX64IoPortAccess, 0);
+	UINT8* bytes = exit.ctx.IoPortAccess.InstructionBytes;
+	UINT8 n = 0;
+	if (rep) {
+		bytes[n++] = 0xF3;
+	}
+	if (size == 2) {
+		bytes[n++] = 0x66;
+	}
+	bytes[n++] = (isWrite ? 0x6E : 0x6C) | (size > 1 ? 1 : 0);
+	exit.ctx.IoPortAccess.InstructionByteCount = n;
+	exit.ctx.VpContext.InstructionLength = n;
+	exit.ctx.IoPortAccess.PortNumber = port;
+	exit.ctx.IoPortAccess.AccessInfo.IsWrite = isWrite ? 1 : 0;
+	exit.ctx.IoPortAccess.AccessInfo.AccessSize = size;
+	exit.ctx.IoPortAccess.AccessInfo.StringOp = 1;
+	exit.ctx.IoPortAccess.AccessInfo.RepPrefix = rep ? 1 : 0;
+	Add(exit);
+}
+
+void MockBackend::AddMmio(UINT64 gpa, UINT8 size, bool isWrite, UINT64 value)
+{
+	MockExit exit = MakeExit(WHvRunVpExitReasonMemoryAccess, 3);
+	exit.ctx.MemoryAccess.Gpa = gpa;
+	exit.ctx.MemoryAccess.AccessInfo.AccessType = isWrite ? WHvMemoryAccessWrite : WHvMemoryAccessRead;
+	exit.ctx.MemoryAccess.AccessInfo.GpaUnmapped = 1;
+	exit.accessSize = size;
+	exit.data = value;
+	Add(exit);
+}
+
+void MockBackend::AddMmioInstruction(UINT64 gpa, bool isWrite, const UINT8* bytes, UINT8 count)
+{
+	MockExit exit = MakeExit(WHvRunVpExitReasonMemoryAccess, 0);
+	exit.ctx.MemoryAccess.Gpa = gpa;
+	exit.ctx.MemoryAccess.AccessInfo.AccessType = isWrite ? WHvMemoryAccessWrite : WHvMemoryAccessRead;
+	exit.ctx.MemoryAccess.AccessInfo.GpaUnmapped = 1;
+	exit.ctx.MemoryAccess.InstructionByteCount = count;
+	memcpy(exit.ctx.MemoryAccess.InstructionBytes, bytes, count);
+	Add(exit);
+}
+
+void MockBackend::AddWriteFault(UINT64 gpa)
+{
+	MockExit exit = MakeExit(WHvRunVpExitReasonMemoryAccess, 3);
+	exit.ctx.MemoryAccess.Gpa = gpa;
+	exit.ctx.MemoryAccess.AccessInfo.AccessType = WHvMemoryAccessWrite;
+	Add(exit);
+}
+
+void MockBackend::AddCpuid(UINT32 leaf, UINT32 subleaf)
+{
+	MockExit exit = MakeExit(WHvRunVpExitReasonX64Cpuid, 2);
+	exit.ctx.CpuidAccess.Rax = leaf;
+	exit.ctx.CpuidAccess.Rcx = subleaf;
+	Add(exit);
+}
+
+void MockBackend::AddMsr(UINT32 index, bool isWrite, UINT64 value)
+{
+	MockExit exit = MakeExit(WHvRunVpExitReasonX64MsrAccess, 2);
+	exit.ctx.MsrAccess.AccessInfo.IsWrite = isWrite ? 1 : 0;
+	exit.ctx.MsrAccess.MsrNumber = index;
+	exit.ctx.MsrAccess.Rax = value & 0xFFFFFFFF;
+	exit.ctx.MsrAccess.Rdx = value >> 32;
+	Add(exit);
+}
+
+void MockBackend::AddHalt()
+{
+	Add(MakeExit(WHvRunVpExitReasonX64Halt, 1));
+}
+
+void MockBackend::AddCanceled()
+{
+	Add(MakeExit(WHvRunVpExitReasonCanceled, 0));
+}
+
+void MockBackend::AddInterruptWindow()
+{
+	Add(MakeExit(WHvRunVpExitReasonX64InterruptWindow, 0));
+}
+
+void MockBackend::AddInitSipi(UINT64 icr)
+{
+	MockExit exit = MakeExit(WHvRunVpExitReasonX64ApicInitSipiTrap, 0);
+	exit.ctx.ApicInitSipi.ApicIcr = icr;
+	Add(exit);
+}
+
+HRESULT MockBackend::SetPartitionProperty(WHV_PARTITION_PROPERTY_CODE PropertyCode,
+	const VOID* PropertyBuffer,
+	UINT32 PropertyBufferSizeInBytes)
+{
+	return S_OK;
+}
+
+HRESULT MockBackend::SetupPartition()
+{
+	return S_OK;
+}
+
+HRESULT MockBackend::MapGpaRange(VOID* SourceAddress,
+	WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+	UINT64 SizeInBytes,
+	WHV_MAP_GPA_RANGE_FLAGS Flags)
+{
+	if ((Flags & WHvMapGpaRangeFlagTrackDirtyPages) && !dirtyTrackingSupported) {
+		return E_NOTIMPL;
+	}
+	mapCounter++;
+	return S_OK;
+}
+
+HRESULT MockBackend::UnmapGpaRange(WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+	UINT64 SizeInBytes)
+{
+	unmapCounter++;
+	return S_OK;
+}
+
+HRESULT MockBackend::QueryGpaRangeDirtyBitmap(WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+	UINT64 RangeSizeInBytes,
+	UINT64* Bitmap,
+	UINT32 BitmapSizeInBytes)
+{
+	if (!dirtyTrackingSupported) {
+		return E_NOTIMPL;
+	}
+	UINT64 first = GuestAddress >> 12;
+	UINT64 pages = RangeSizeInBytes >> 12;
+	if (BitmapSizeInBytes < (pages + 63) / 64 * 8) {
+		return E_INVALIDARG;
+	}
+	std::lock_guard<std::mutex> lock(dirtyMutex);
+	memset(Bitmap, 0x0, BitmapSizeInBytes);
+	auto it = dirtyPages.lower_bound(first);
+	while (it != dirtyPages.end() && *it < first + pages) {
+		UINT64 page = *it - first;
+		Bitmap[page / 64] |= 1ULL << (page % 64);
+		it = dirtyPages.erase(it);
+	}
+	return S_OK;
+}
+
+HRESULT MockBackend::CreateVirtualProcessor(UINT32 VpIndex)
+{
+	GetProcessor(VpIndex);
+	return S_OK;
+}
+
+HRESULT MockBackend::GetVirtualProcessorRegisters(UINT32 VpIndex,
+	const WHV_REGISTER_NAME* RegisterNames,
+	UINT32 RegisterCount,
+	WHV_REGISTER_VALUE* RegisterValues)
+{
+	Processor& vp = GetProcessor(VpIndex);
+	for (UINT32 i = 0; i < RegisterCount; i++) {
+		auto it = vp.registers.find(RegisterNames[i]);
+		if (it == vp.registers.end()) {
+			memset(&RegisterValues[i], 0x0, sizeof(WHV_REGISTER_VALUE));
+		}
+		else {
+			RegisterValues[i] = it->second;
+		}
+	}
+	return S_OK;
+}
+
+HRESULT MockBackend::SetVirtualProcessorRegisters(UINT32 VpIndex,
+	const WHV_REGISTER_NAME* RegisterNames,
+	UINT32 RegisterCount,
+	const WHV_REGISTER_VALUE* RegisterValues)
+{
+	Processor& vp = GetProcessor(VpIndex);
+	for (UINT32 i = 0; i < RegisterCount; i++) {
+		vp.registers[RegisterNames[i]] = RegisterValues[i];
+	}
+	return S_OK;
+}
+
+HRESULT MockBackend::RunVirtualProcessor(UINT32 VpIndex,
+	WHV_RUN_VP_EXIT_CONTEXT* ExitContext)
+{
+	Processor& vp = GetProcessor(VpIndex);
+	exitCounter++;
+
+	// A pending interruption is taken by the "guest" right away
+	WHV_REGISTER_VALUE& pending = vp.registers[WHvRegisterPendingInterruption];
+	if (pending.PendingInterruption.InterruptionPending) {
+		injectedCounter++;
+		lastInjectedVector = pending.PendingInterruption.InterruptionVector;
+		pending.PendingInterruption.InterruptionPending = 0;
+	}
+
+	MockExit exit;
+	WHV_REGISTER_VALUE& notifications = vp.registers[WHvX64RegisterDeliverabilityNotifications];
+	if (notifications.DeliverabilityNotifications.InterruptNotification) {
+		notifications.DeliverabilityNotifications.InterruptNotification = 0;
+		exit = MakeExit(WHvRunVpExitReasonX64InterruptWindow, 0);
+		vp.current = nullptr;
+	}
+	else if (vp.cancelRequested.exchange(false)) {
+		exit = MakeExit(WHvRunVpExitReasonCanceled, 0);
+		vp.current = nullptr;
+	}
+	else {
+		if (vp.position == vp.script.size() && loop) {
+			vp.position = 0;
+		}
+		if (vp.position == vp.script.size()) {
+			exit = MakeExit(WHvRunVpExitReasonX64Halt, 1);
+			vp.current = nullptr;
+		}
+		else {
+			vp.current = &vp.script[vp.position++];
+			exit = *vp.current;
+		}
+	}
+
+	exit.ctx.VpContext.Rip = vp.Reg(WHvX64RegisterRip);
+	exit.ctx.VpContext.Rflags = vp.Reg(WHvX64RegisterRflags);
+	exit.ctx.VpContext.Cs = vp.registers[WHvX64RegisterCs].Segment;
+	exit.ctx.VpContext.Reserved2 = VpIndex;  // Lets the emulator calls find the processor
+	if (exit.ctx.ExitReason == WHvRunVpExitReasonX64IoPortAccess) {
+		// The scripted RAX is what the guest had at the exit
+		vp.registers[WHvX64RegisterRax].Reg64 = exit.ctx.IoPortAccess.Rax;
+		exit.ctx.IoPortAccess.Rcx = vp.Reg(WHvX64RegisterRcx);
+		exit.ctx.IoPortAccess.Rsi = vp.Reg(WHvX64RegisterRsi);
+		exit.ctx.IoPortAccess.Rdi = vp.Reg(WHvX64RegisterRdi);
+		exit.ctx.IoPortAccess.Ds = vp.registers[WHvX64RegisterDs].Segment;
+		exit.ctx.IoPortAccess.Es = vp.registers[WHvX64RegisterEs].Segment;
+	}
+	if (exit.ctx.ExitReason == WHvRunVpExitReasonX64Halt) {
+		vp.registers[WHvX64RegisterRip].Reg64 += exit.ctx.VpContext.InstructionLength;
+	}
+	*ExitContext = exit.ctx;
+	return S_OK;
+}
+
+HRESULT MockBackend::CancelRunVirtualProcessor(UINT32 VpIndex)
+{
+	GetProcessor(VpIndex).cancelRequested = true;
+	return S_OK;
+}
+
+HRESULT MockBackend::TranslateGva(UINT32 VpIndex,
+	WHV_GUEST_VIRTUAL_ADDRESS Gva,
+	WHV_TRANSLATE_GVA_FLAGS TranslateFlags,
+	WHV_TRANSLATE_GVA_RESULT* TranslationResult,
+	WHV_GUEST_PHYSICAL_ADDRESS* Gpa)
+{
+	// Identity mapped
+	*Gpa = Gva;
+	TranslationResult->ResultCode = WHvTranslateGvaResultSuccess;
+	TranslationResult->Reserved = 0;
+	return S_OK;
+}
+
+HRESULT MockBackend::EmulatorTryIoEmulation(VOID* Context,
+	const WHV_VP_EXIT_CONTEXT* VpContext,
+	const WHV_X64_IO_PORT_ACCESS_CONTEXT* IoInstructionContext,
+	WHV_EMULATOR_STATUS* EmulatorReturnStatus)
+{
+	EmulatorReturnStatus->AsUINT32 = 0;
+	if (IoInstructionContext->AccessInfo.StringOp) {
+		EmulatorReturnStatus->InternalEmulationFailure = 1;
+		return S_OK;
+	}
+
+	WHV_EMULATOR_IO_ACCESS_INFO io;
+	io.Direction = IoInstructionContext->AccessInfo.IsWrite;
+	io.Port = IoInstructionContext->PortNumber;
+	io.AccessSize = IoInstructionContext->AccessInfo.AccessSize;
+	io.Data = (UINT32)IoInstructionContext->Rax;
+
+	HRESULT hr = IoPortCallback(Context, &io);
+	if (hr != S_OK) {
+		EmulatorReturnStatus->IoPortCallbackFailed = 1;
+		return S_OK;
+	}
+
+	WHV_REGISTER_NAME names[2] = { WHvX64RegisterRax, WHvX64RegisterRip };
+	WHV_REGISTER_VALUE values[2];
+	hr = GetVirtualRegisters(Context, names, 2, values);
+	if (hr != S_OK) {
+		EmulatorReturnStatus->GetVirtualProcessorRegistersCallbackFailed = 1;
+		return S_OK;
+	}
+	if (!io.Direction) {
+		UINT64 mask = io.AccessSize == 4 ? 0xFFFFFFFFULL : ((1ULL << (io.AccessSize * 8)) - 1);
+		values[0].Reg64 = (values[0].Reg64 & ~mask) | (io.Data & mask);
+	}
+	values[1].Reg64 = VpContext->Rip + VpContext->InstructionLength;
+	hr = SetVirtualRegisters(Context, names, 2, values);
+	if (hr != S_OK) {
+		EmulatorReturnStatus->SetVirtualProcessorRegistersCallbackFailed = 1;
+		return S_OK;
+	}
+
+	EmulatorReturnStatus->EmulationSuccessful = 1;
+	return S_OK;
+}
+
+HRESULT MockBackend::EmulatorTryMmioEmulation(VOID* Context,
+	const WHV_VP_EXIT_CONTEXT* VpContext,
+	const WHV_MEMORY_ACCESS_CONTEXT* MmioInstructionContext,
+	WHV_EMULATOR_STATUS* EmulatorReturnStatus)
+{
+	EmulatorReturnStatus->AsUINT32 = 0;
+	const MockExit* current = GetProcessor(VpContext->Reserved2).current;
+	if (current == nullptr) {
+		EmulatorReturnStatus->InternalEmulationFailure = 1;
+		return S_OK;
+	}
+
+	WHV_EMULATOR_MEMORY_ACCESS_INFO mem;
+	memset(&mem, 0x0, sizeof(mem));
+	mem.GpaAddress = MmioInstructionContext->Gpa;
+	mem.Direction = MmioInstructionContext->AccessInfo.AccessType == WHvMemoryAccessWrite ? 1 : 0;
+	mem.AccessSize = current->accessSize;
+	if (mem.Direction) {
+		memcpy(mem.Data, &current->data, sizeof(mem.Data));
+	}
+
+	HRESULT hr = MemoryCallback(Context, &mem);
+	if (hr != S_OK) {
+		EmulatorReturnStatus->MemoryCallbackFailed = 1;
+		return S_OK;
+	}
+	if (!mem.Direction) {
+		lastMmioRead = 0;
+		memcpy(&lastMmioRead, mem.Data, mem.AccessSize);
+	}
+
+	WHV_REGISTER_NAME name = WHvX64RegisterRip;
+	WHV_REGISTER_VALUE value;
+	value.Reg64 = VpContext->Rip + VpContext->InstructionLength;
+	hr = SetVirtualRegisters(Context, &name, 1, &value);
+	if (hr != S_OK) {
+		EmulatorReturnStatus->SetVirtualProcessorRegistersCallbackFailed = 1;
+		return S_OK;
+	}
+
+	EmulatorReturnStatus->EmulationSuccessful = 1;
+	return S_OK;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "HvBackend.h"
+
+/** One scripted exit of the MockBackend */
+struct MockExit {
+	WHV_RUN_VP_EXIT_CONTEXT ctx;
+	UINT8 accessSize;  // MMIO access size (the exit context doesn't carry it)
+	UINT64 data;       // MMIO write data
+};
+
+/**
+ * HvBackend which doesn't run a guest but replays a scripted sequence of
+ * exits. The instruction emulator calls are emulated by calling the regular
+ * emulator callbacks with the access described by the current exit, so the
+ * whole dispatch path of CMachine is exercised. Used to run and benchmark
+ * CMachine on machines without a hypervisor.
+ *
+ * Interrupt injection is modelled loosely: a pending interruption is consumed
+ * on the next run and a requested interrupt notification produces an
+ * interrupt window exit.
+ *
+ * Each virtual processor has its own script and registers, and different
+ * processors may be run from different threads. The Add* functions add to
+ * the script of the processor chosen with SelectProcessor (0 by default).
+ */
+class MockBackend : public HvBackend {
+private:
+	struct Processor {
+		std::vector<MockExit> script;
+		size_t position = 0;
+		const MockExit* current = nullptr;
+		std::unordered_map<UINT32, WHV_REGISTER_VALUE> registers;
+		std::atomic<bool> cancelRequested;
+
+		Processor();
+		UINT64 Reg(WHV_REGISTER_NAME name);
+	};
+
+	std::vector<std::unique_ptr<Processor>> processors;
+	UINT32 selected = 0;
+	bool loop;
+
+	std::mutex dirtyMutex;
+	std::set<UINT64> dirtyPages;
+
+	void Add(const MockExit& exit);
+	MockExit MakeExit(WHV_RUN_VP_EXIT_REASON reason, UINT8 instructionLength);
+	Processor& GetProcessor(UINT32 index);
+
+public:
+	// Statistics, useful for verifying a run
+	std::atomic<UINT64> exitCounter;
+	std::atomic<UINT64> injectedCounter;
+	std::atomic<UINT32> lastInjectedVector;
+	UINT64 lastMmioRead = 0;
+	UINT64 mapCounter = 0;
+	UINT64 unmapCounter = 0;
+
+	/** Clear to act like a host without dirty page tracking */
+	bool dirtyTrackingSupported = true;
+
+	/** If loop is set the script restarts when exhausted, otherwise the VP halts */
+	MockBackend(bool loop = false);
+
+	void AddIo(UINT16 port, UINT8 size, bool isWrite, UINT32 value = 0);
+	/** INS/OUTS (REP if rep is set) using the current RCX, RSI, RDI, DS and ES */
+	void AddStringIo(UINT16 port, UINT8 size, bool isWrite, bool rep);
+	void AddMmio(UINT64 gpa, UINT8 size, bool isWrite, UINT64 value = 0);
+	/** MMIO access by the given instruction, for the in-process decoder */
+	void AddMmioInstruction(UINT64 gpa, bool isWrite, const UINT8* bytes, UINT8 count);
+	/** Write to a mapped but write protected page */
+	void AddWriteFault(UINT64 gpa);
+	void AddCpuid(UINT32 leaf, UINT32 subleaf = 0);
+	/** RDMSR (value ignored) or WRMSR */
+	void AddMsr(UINT32 index, bool isWrite, UINT64 value = 0);
+	void AddHalt();
+	void AddCanceled();
+	void AddInterruptWindow();
+	/** INIT or SIPI sent by writing the APIC ICR */
+	void AddInitSipi(UINT64 icr);
+
+	/** Selects the processor the Add* functions add to */
+	void SelectProcessor(UINT32 index);
+
+	/** Marks the page as written by the "guest" */
+	void MarkDirty(UINT64 gpa)
+	{
+		std::lock_guard<std::mutex> lock(dirtyMutex);
+		dirtyPages.insert(gpa >> 12);
+	}
+
+	void Rewind() { GetProcessor(selected).position = 0; }
+	size_t ScriptLength() { return GetProcessor(selected).script.size(); }
+	/** Exits of the script run so far (since the last rewind) */
+	size_t ScriptPosition() { return GetProcessor(selected).position; }
+
+	/** Register value of a processor, as the "guest" sees it */
+	UINT64 GetRegister(UINT32 index, WHV_REGISTER_NAME name) { return GetProcessor(index).Reg(name); }
+
+	HRESULT SetPartitionProperty(WHV_PARTITION_PROPERTY_CODE PropertyCode,
+		const VOID* PropertyBuffer,
+		UINT32 PropertyBufferSizeInBytes) override;
+
+	HRESULT SetupPartition() override;
+
+	HRESULT MapGpaRange(VOID* SourceAddress,
+		WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+		UINT64 SizeInBytes,
+		WHV_MAP_GPA_RANGE_FLAGS Flags) override;
+
+	HRESULT UnmapGpaRange(WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+		UINT64 SizeInBytes) override;
+
+	HRESULT QueryGpaRangeDirtyBitmap(WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+		UINT64 RangeSizeInBytes,
+		UINT64* Bitmap,
+		UINT32 BitmapSizeInBytes) override;
+
+	HRESULT CreateVirtualProcessor(UINT32 VpIndex) override;
+
+	HRESULT GetVirtualProcessorRegisters(UINT32 VpIndex,
+		const WHV_REGISTER_NAME* RegisterNames,
+		UINT32 RegisterCount,
+		WHV_REGISTER_VALUE* RegisterValues) override;
+
+	HRESULT SetVirtualProcessorRegisters(UINT32 VpIndex,
+		const WHV_REGISTER_NAME* RegisterNames,
+		UINT32 RegisterCount,
+		const WHV_REGISTER_VALUE* RegisterValues) override;
+
+	HRESULT RunVirtualProcessor(UINT32 VpIndex,
+		WHV_RUN_VP_EXIT_CONTEXT* ExitContext) override;
+
+	HRESULT CancelRunVirtualProcessor(UINT32 VpIndex) override;
+
+	HRESULT TranslateGva(UINT32 VpIndex,
+		WHV_GUEST_VIRTUAL_ADDRESS Gva,
+		WHV_TRANSLATE_GVA_FLAGS TranslateFlags,
+		WHV_TRANSLATE_GVA_RESULT* TranslationResult,
+		WHV_GUEST_PHYSICAL_ADDRESS* Gpa) override;
+
+	HRESULT EmulatorTryIoEmulation(VOID* Context,
+		const WHV_VP_EXIT_CONTEXT* VpContext,
+		const WHV_X64_IO_PORT_ACCESS_CONTEXT* IoInstructionContext,
+		WHV_EMULATOR_STATUS* EmulatorReturnStatus) override;
+
+	HRESULT EmulatorTryMmioEmulation(VOID* Context,
+		const WHV_VP_EXIT_CONTEXT* VpContext,
+		const WHV_MEMORY_ACCESS_CONTEXT* MmioInstructionContext,
+		WHV_EMULATOR_STATUS* EmulatorReturnStatus) override;
+};
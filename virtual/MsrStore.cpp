@@ -0,0 +1,77 @@
+#include "MsrStore.h"
+
+bool MsrStore::RegisterOf(UINT32 index, WHV_REGISTER_NAME* name)
+{
+	switch (index) {
+	case 0x10:
+		*name = WHvX64RegisterTsc;
+		return true;
+	case 0x1B:
+		*name = WHvX64RegisterApicBase;
+		return true;
+	case 0xFE:
+		*name = WHvX64RegisterMsrMtrrCap;
+		return true;
+	case 0x174:
+		*name = WHvX64RegisterSysenterCs;
+		return true;
+	case 0x175:
+		*name = WHvX64RegisterSysenterEsp;
+		return true;
+	case 0x176:
+		*name = WHvX64RegisterSysenterEip;
+		return true;
+	case 0x250:
+		*name = WHvX64RegisterMsrMtrrFix64k00000;
+		return true;
+	case 0x258:
+	case 0x259:
+		// Fix16k80000, Fix16kA0000
+		*name = (WHV_REGISTER_NAME)(WHvX64RegisterMsrMtrrFix64k00000 + 1 + (index - 0x258));
+		return true;
+	case 0x277:
+		*name = WHvX64RegisterPat;
+		return true;
+	case 0x2FF:
+		*name = WHvX64RegisterMsrMtrrDefType;
+		return true;
+	case 0xC0000080:
+		*name = WHvX64RegisterEfer;
+		return true;
+	case 0xC0000081:
+		*name = WHvX64RegisterStar;
+		return true;
+	case 0xC0000082:
+		*name = WHvX64RegisterLstar;
+		return true;
+	case 0xC0000083:
+		*name = WHvX64RegisterCstar;
+		return true;
+	case 0xC0000084:
+		*name = WHvX64RegisterSfmask;
+		return true;
+	case 0xC0000102:
+		*name = WHvX64RegisterKernelGsBase;
+		return true;
+	case 0xC0000103:
+		*name = WHvX64RegisterTscAux;
+		return true;
+	}
+	if (index >= 0x200 && index < 0x220) {
+		// Variable range MTRRs: base and mask pairs
+		UINT32 n = (index - 0x200) / 2;
+		*name = (WHV_REGISTER_NAME)(((index & 1) ? WHvX64RegisterMsrMtrrPhysMask0 : WHvX64RegisterMsrMtrrPhysBase0) + n);
+		return true;
+	}
+	if (index >= 0x268 && index < 0x270) {
+		// Fix4kC0000 to Fix4kF8000
+		*name = (WHV_REGISTER_NAME)(WHvX64RegisterMsrMtrrFix64k00000 + 3 + (index - 0x268));
+		return true;
+	}
+	return false;
+}
+
+bool MsrStore::IsReadOnly(UINT32 index)
+{
+	return index == 0xFE;  // MTRRcap
+}
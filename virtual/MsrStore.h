@@ -0,0 +1,46 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "WinHvCompat.h"
+
+/**
+ * MSRs of a virtual processor that are answered in C++ when the hypervisor
+ * exits for them, so RDMSR/WRMSR don't need the JS side.
+ *
+ * The MSRs the hypervisor keeps as registers (TSC, APIC base, PAT, SYSENTER,
+ * the SYSCALL ones, the MTRRs, ...) are read and written through those
+ * registers, so they stay consistent with the guest and with checkpoints;
+ * RegisterOf() gives the register. Any other MSR can be given a value here,
+ * which the guest then reads and writes like memory. Whatever isn't covered
+ * goes to the device model (see DeviceModel::Msr).
+ */
+class MsrStore {
+private:
+	std::unordered_map<UINT32, UINT64> values;
+
+public:
+	/** The hypervisor register of an MSR, false if it has none */
+	static bool RegisterOf(UINT32 index, WHV_REGISTER_NAME* name);
+
+	/** True for MSRs that can't be written, writes are dropped */
+	static bool IsReadOnly(UINT32 index);
+
+	/** Adds an MSR to the store, or sets its value */
+	void Set(UINT32 index, UINT64 value) { values[index] = value; }
+
+	/** Gets an MSR of the store. Returns false if it isn't in it */
+	bool Get(UINT32 index, UINT64* value) const
+	{
+		auto it = values.find(index);
+		if (it == values.end()) {
+			return false;
+		}
+		*value = it->second;
+		return true;
+	}
+
+	bool Contains(UINT32 index) const { return values.count(index) != 0; }
+
+	const std::unordered_map<UINT32, UINT64>& GetValues() const { return values; }
+};
@@ -0,0 +1,637 @@
+#include "NativeDevices.h"
+
+static const UINT64 PIT_FREQUENCY = 1193182;
+static const UINT64 NS_PER_SECOND = 1000000000ULL;
+
+static UINT32 AllOnes(UINT8 size)
+{
+	return size >= 4 ? 0xFFFFFFFF : ((1U << (size * 8)) - 1);
+}
+
+// POST port
+
+bool PostPort::Read(UINT16 port, UINT8 size, UINT32* value)
+{
+	*value = AllOnes(size);
+	return true;
+}
+
+bool PostPort::Write(UINT16 port, UINT8 size, UINT32 value)
+{
+	state->post_code = value;
+	return true;
+}
+
+// PIC
+
+Pic::Pic(NativeDeviceState* state) : chips(state->pic)
+{
+}
+
+int Pic::GetPriority(const PicState& chip, UINT8 mask)
+{
+	if (mask == 0) {
+		return 8;
+	}
+	int priority = 0;
+	while ((mask & (1 << priority)) == 0) {
+		priority++;
+	}
+	return priority;
+}
+
+int Pic::GetIrq(const PicState& chip)
+{
+	int priority = GetPriority(chip, chip.irr & ~chip.imr);
+	if (priority == 8) {
+		return -1;
+	}
+	// Only interrupt if it has higher priority than the one in service
+	if (priority < GetPriority(chip, chip.isr)) {
+		return priority;
+	}
+	return -1;
+}
+
+void Pic::SetChipIrq(PicState& chip, int irq, bool level)
+{
+	UINT8 mask = 1 << irq;
+	if (chip.elcr & mask) {
+		// Level triggered
+		if (level) {
+			chip.irr |= mask;
+			chip.line_level |= mask;
+		}
+		else {
+			chip.irr &= ~mask;
+			chip.line_level &= ~mask;
+		}
+	}
+	else {
+		// Edge triggered
+		if (level) {
+			if ((chip.line_level & mask) == 0) {
+				chip.irr |= mask;
+			}
+			chip.line_level |= mask;
+		}
+		else {
+			chip.line_level &= ~mask;
+		}
+	}
+}
+
+void Pic::Update()
+{
+	// The slave output is connected to IRQ2 of the master
+	SetChipIrq(chips[0], 2, GetIrq(chips[1]) >= 0);
+}
+
+int Pic::AcknowledgeChip(PicState& chip, int irq)
+{
+	UINT8 mask = 1 << irq;
+	if (!chip.auto_eoi) {
+		chip.isr |= mask;
+	}
+	if (!(chip.elcr & mask)) {
+		chip.irr &= ~mask;
+	}
+	return irq;
+}
+
+void Pic::SetIrq(unsigned int line, bool level)
+{
+	if (line >= 16) {
+		return;
+	}
+	SetChipIrq(chips[line >> 3], line & 7, level);
+	Update();
+}
+
+bool Pic::HasInterrupt()
+{
+	return GetIrq(chips[0]) >= 0;
+}
+
+UINT8 Pic::Acknowledge()
+{
+	UINT8 vector;
+	int irq = GetIrq(chips[0]);
+	if (irq >= 0) {
+		AcknowledgeChip(chips[0], irq);
+		if (irq == 2) {
+			int irq2 = GetIrq(chips[1]);
+			if (irq2 >= 0) {
+				AcknowledgeChip(chips[1], irq2);
+			}
+			else {
+				irq2 = 7;  // Spurious
+			}
+			vector = chips[1].irq_base + irq2;
+		}
+		else {
+			vector = chips[0].irq_base + irq;
+		}
+	}
+	else {
+		vector = chips[0].irq_base + 7;  // Spurious
+	}
+	Update();
+	return vector;
+}
+
+void Pic::WriteCommand(PicState& chip, UINT8 val)
+{
+	if (val & 0x10) {
+		// ICW1
+		chip.irr = 0;
+		chip.imr = 0;
+		chip.isr = 0;
+		chip.read_isr = 0;
+		chip.poll = 0;
+		chip.auto_eoi = 0;
+		chip.init_state = 1;
+		chip.icw4_needed = val & 1;
+		chip.single = (val >> 1) & 1;
+	}
+	else if (val & 0x08) {
+		// OCW3
+		if (val & 0x04) {
+			chip.poll = 1;
+		}
+		if (val & 0x02) {
+			chip.read_isr = val & 1;
+		}
+	}
+	else {
+		// OCW2. Priority rotation isn't supported, so the rotating forms
+		// behave like the plain EOIs.
+		switch (val >> 5) {
+		case 1:
+		case 5: {
+			int priority = GetPriority(chip, chip.isr);
+			if (priority != 8) {
+				chip.isr &= ~(1 << priority);
+			}
+			break;
+		}
+		case 3:
+		case 7:
+			chip.isr &= ~(1 << (val & 7));
+			break;
+		}
+	}
+}
+
+void Pic::WriteData(PicState& chip, UINT8 val)
+{
+	switch (chip.init_state) {
+	case 0:
+		chip.imr = val;
+		break;
+	case 1:
+		chip.irq_base = val & 0xF8;
+		if (chip.single) {
+			chip.init_state = chip.icw4_needed ? 3 : 0;
+		}
+		else {
+			chip.init_state = 2;
+		}
+		break;
+	case 2:
+		chip.init_state = chip.icw4_needed ? 3 : 0;
+		break;
+	case 3:
+		chip.auto_eoi = (val >> 1) & 1;
+		chip.init_state = 0;
+		break;
+	}
+}
+
+UINT8 Pic::PollRead(PicState& chip)
+{
+	int irq = GetIrq(chip);
+	if (irq < 0) {
+		return 0;
+	}
+	AcknowledgeChip(chip, irq);
+	return 0x80 | irq;
+}
+
+bool Pic::Read(UINT16 port, UINT8 size, UINT32* value)
+{
+	if (size != 1) {
+		return false;
+	}
+	if (port == 0x4D0 || port == 0x4D1) {
+		*value = chips[port & 1].elcr;
+		return true;
+	}
+	PicState& chip = chips[port >> 7];
+	if (chip.poll) {
+		chip.poll = 0;
+		*value = PollRead(chip);
+		Update();
+	}
+	else if (port & 1) {
+		*value = chip.imr;
+	}
+	else {
+		*value = chip.read_isr ? chip.isr : chip.irr;
+	}
+	return true;
+}
+
+bool Pic::Write(UINT16 port, UINT8 size, UINT32 value)
+{
+	if (size != 1) {
+		return false;
+	}
+	if (port == 0x4D0 || port == 0x4D1) {
+		// IRQ 0, 1, 2, 8 and 13 are always edge triggered
+		chips[port & 1].elcr = (UINT8)value & (port == 0x4D0 ? 0xF8 : 0xDE);
+		return true;
+	}
+	PicState& chip = chips[port >> 7];
+	if (port & 1) {
+		WriteData(chip, (UINT8)value);
+	}
+	else {
+		WriteCommand(chip, (UINT8)value);
+	}
+	Update();
+	return true;
+}
+
+// PIT
+
+Pit::Pit(NativeDeviceState* state, NativeDevices* owner) : state(&state->pit), owner(owner)
+{
+	this->state->channel[0].gate = 1;
+	this->state->channel[1].gate = 1;
+}
+
+UINT64 Pit::Period(const PitChannel& ch)
+{
+	UINT64 count = ch.count ? ch.count : 0x10000;
+	return count * NS_PER_SECOND / PIT_FREQUENCY;
+}
+
+UINT64 Pit::Ticks(const PitChannel& ch, UINT64 now)
+{
+	if (!ch.gate || now < ch.load_time) {
+		return 0;
+	}
+	UINT64 d = now - ch.load_time;
+	return (d / NS_PER_SECOND) * PIT_FREQUENCY + (d % NS_PER_SECOND) * PIT_FREQUENCY / NS_PER_SECOND;
+}
+
+UINT16 Pit::Counter(const PitChannel& ch, UINT64 now)
+{
+	UINT64 count = ch.count ? ch.count : 0x10000;
+	UINT64 ticks = Ticks(ch, now);
+	switch (ch.mode) {
+	case 2:
+		return (UINT16)(count - (ticks % count));
+	case 3:
+		// Counts down by two, twice per period
+		return (UINT16)((count - ((ticks * 2) % count)) & 0xFFFE);
+	default:
+		return (UINT16)((count - ticks) & 0xFFFF);
+	}
+}
+
+bool Pit::Output(const PitChannel& ch, UINT64 now)
+{
+	UINT64 count = ch.count ? ch.count : 0x10000;
+	UINT64 ticks = Ticks(ch, now);
+	switch (ch.mode) {
+	case 0:
+	case 1:
+		return ticks >= count;
+	case 2:
+		return (ticks % count) != count - 1;
+	case 3:
+		return (ticks % count) < (count + 1) / 2;
+	default:
+		return ticks != count;
+	}
+}
+
+void Pit::Load(int c, UINT64 now)
+{
+	PitChannel& ch = state->channel[c];
+	ch.load_time = now;
+	ch.next_irq = c == 0 ? now + Period(ch) : 0;
+}
+
+UINT64 Pit::Service(UINT64 now)
+{
+	PitChannel& ch = state->channel[0];
+	if (ch.next_irq == 0) {
+		return 0;
+	}
+	if (now >= ch.next_irq) {
+		owner->SetIrq(0, false);
+		owner->SetIrq(0, true);
+
+		if (ch.mode == 2 || ch.mode == 3) {
+			UINT64 period = Period(ch);
+			ch.next_irq += period;
+			if (ch.next_irq <= now) {
+				// Missed ticks are coalesced
+				ch.next_irq = now + period;
+			}
+		}
+		else {
+			ch.next_irq = 0;
+		}
+	}
+	return ch.next_irq;
+}
+
+bool Pit::Read(UINT16 port, UINT8 size, UINT32* value)
+{
+	if (size != 1) {
+		return false;
+	}
+	UINT64 now = owner->Now();
+	if (port == 0x61) {
+		state->refresh ^= 1;
+		*value = (state->port61 & 0x0F) | (state->refresh << 4) |
+			(Output(state->channel[2], now) ? 0x20 : 0);
+		return true;
+	}
+	if (port == 0x43) {
+		*value = 0xFF;  // Write only
+		return true;
+	}
+
+	PitChannel& ch = state->channel[port & 3];
+	UINT16 counter = ch.latched ? ch.latch : Counter(ch, now);
+	if (ch.rw_mode == 1) {
+		*value = counter & 0xFF;
+		ch.latched = 0;
+	}
+	else if (ch.rw_mode == 2) {
+		*value = counter >> 8;
+		ch.latched = 0;
+	}
+	else {
+		if (!ch.read_msb) {
+			*value = counter & 0xFF;
+			if (ch.latched) {
+				ch.latch = counter;
+			}
+		}
+		else {
+			*value = counter >> 8;
+			ch.latched = 0;
+		}
+		ch.read_msb ^= 1;
+	}
+	return true;
+}
+
+bool Pit::Write(UINT16 port, UINT8 size, UINT32 value)
+{
+	if (size != 1) {
+		return false;
+	}
+	UINT64 now = owner->Now();
+	UINT8 val = (UINT8)value;
+	if (port == 0x61) {
+		PitChannel& ch2 = state->channel[2];
+		UINT8 gate = val & 1;
+		if (gate && !ch2.gate) {
+			Load(2, now);
+		}
+		ch2.gate = gate;
+		state->port61 = val & 0x0F;
+		return true;
+	}
+
+	if (port == 0x43) {
+		int c = val >> 6;
+		if (c == 3) {
+			// Read-back command; only the count latch is supported
+			if (!(val & 0x20)) {
+				for (int i = 0; i < 3; i++) {
+					if (val & (2 << i)) {
+						state->channel[i].latch = Counter(state->channel[i], now);
+						state->channel[i].latched = 1;
+						state->channel[i].read_msb = 0;
+					}
+				}
+			}
+			return true;
+		}
+		PitChannel& ch = state->channel[c];
+		UINT8 rw = (val >> 4) & 3;
+		if (rw == 0) {
+			ch.latch = Counter(ch, now);
+			ch.latched = 1;
+			ch.read_msb = 0;
+		}
+		else {
+			ch.mode = (val >> 1) & 7;
+			if (ch.mode > 5) {
+				ch.mode -= 4;
+			}
+			ch.rw_mode = rw;
+			ch.write_msb = 0;
+			ch.read_msb = 0;
+			ch.latched = 0;
+		}
+		return true;
+	}
+
+	int c = port & 3;
+	PitChannel& ch = state->channel[c];
+	if (ch.rw_mode == 1) {
+		ch.count = val;
+		Load(c, now);
+	}
+	else if (ch.rw_mode == 2) {
+		ch.count = val << 8;
+		Load(c, now);
+	}
+	else if (!ch.write_msb) {
+		ch.count = (ch.count & 0xFF00) | val;
+		ch.write_msb = 1;
+	}
+	else {
+		ch.count = (ch.count & 0x00FF) | (val << 8);
+		ch.write_msb = 0;
+		Load(c, now);
+	}
+	return true;
+}
+
+// CMOS
+
+bool Cmos::Read(UINT16 port, UINT8 size, UINT32* value)
+{
+	if (size != 1) {
+		return false;
+	}
+	if (port == 0x70) {
+		*value = 0xFF;  // Write only
+		return true;
+	}
+	*value = state->ram[state->index];
+	if (state->index == 0x0C) {
+		// Reading register C acknowledges the RTC interrupt
+		state->ram[0x0C] = 0;
+		owner->SetIrq(8, false);
+	}
+	return true;
+}
+
+bool Cmos::Write(UINT16 port, UINT8 size, UINT32 value)
+{
+	if (size != 1) {
+		return false;
+	}
+	if (port == 0x70) {
+		state->index = value & 0x7F;
+		state->nmi_disabled = (value >> 7) & 1;
+		return true;
+	}
+	switch (state->index) {
+	case 0x0A:
+	case 0x0B:
+		// Reprograms the RTC timer - left to JS, which also stores the value
+		return false;
+	case 0x0C:
+	case 0x0D:
+		// Read only
+		return true;
+	}
+	state->ram[state->index] = (UINT8)value;
+	return true;
+}
+
+// PCI configuration space
+
+bool PciConfig::TargetPresent()
+{
+	UINT32 bus = (state->address >> 16) & 0xFF;
+	UINT32 dev = (state->address >> 11) & 0x1F;
+	UINT32 bit = bus * 32 + dev;
+	return (state->present[bit >> 3] >> (bit & 7)) & 1;
+}
+
+bool PciConfig::Read(UINT16 port, UINT8 size, UINT32* value)
+{
+	if (port < 0xCFC) {
+		if (port != 0xCF8 || size != 4) {
+			return false;
+		}
+		*value = state->address;
+		return true;
+	}
+	if ((state->address & 0x80000000) && TargetPresent()) {
+		return false;
+	}
+	*value = AllOnes(size);
+	return true;
+}
+
+bool PciConfig::Write(UINT16 port, UINT8 size, UINT32 value)
+{
+	if (port < 0xCFC) {
+		if (port != 0xCF8 || size != 4) {
+			return false;
+		}
+		state->address = value & 0x80FFFFFC;
+		return true;
+	}
+	if ((state->address & 0x80000000) && TargetPresent()) {
+		return false;
+	}
+	return true;
+}
+
+// i8042
+
+bool I8042Status::Read(UINT16 port, UINT8 size, UINT32* value)
+{
+	if (size != 1) {
+		return false;
+	}
+	*value = state->status;
+	return true;
+}
+
+bool I8042Status::Write(UINT16 port, UINT8 size, UINT32 value)
+{
+	return false;
+}
+
+// Container
+
+NativeDevices::NativeDevices(DeviceModel* devices)
+	: state(new NativeDeviceState()), devices(devices),
+	post(state.get()), pic(state.get()), pit(state.get(), this), cmos(state.get(), this),
+	pci(state.get()), i8042(state.get())
+{
+}
+
+void NativeDevices::SetEnabled(UINT32 mask)
+{
+	struct Range {
+		UINT32 id;
+		UINT16 first;
+		unsigned int count;
+		PortHandler* handler;
+	};
+	Range ranges[] = {
+		{ NativePost, 0x80, 1, &post },
+		{ NativePic, 0x20, 2, &pic },
+		{ NativePic, 0xA0, 2, &pic },
+		{ NativePic, 0x4D0, 2, &pic },
+		{ NativePit, 0x40, 4, &pit },
+		{ NativePit, 0x61, 1, &pit },
+		{ NativeCmos, 0x70, 2, &cmos },
+		{ NativePci, 0xCF8, 8, &pci },
+		{ NativeI8042, 0x64, 1, &i8042 },
+	};
+	for (const Range& r : ranges) {
+		if (mask & r.id) {
+			ports.Register(r.first, r.count, r.handler);
+		}
+		else {
+			ports.Unregister(r.first, r.count);
+		}
+	}
+	state->enabled = mask;
+}
+
+void NativeDevices::Rebase(UINT64 then, UINT64 now)
+{
+	// Same distance from now as they were from then, 0 (no IRQ due) stays
+	auto move = [then, now](UINT64 t) -> UINT64 {
+		if (t == 0) {
+			return 0;
+		}
+		if (t >= then) {
+			return now + (t - then);
+		}
+		return now > then - t ? now - (then - t) : 1;
+	};
+	for (PitChannel& ch : state->pit.channel) {
+		ch.load_time = move(ch.load_time);
+		ch.next_irq = move(ch.next_irq);
+	}
+}
+
+void NativeDevices::SetIrq(unsigned int line, bool level)
+{
+	if (IsEnabled(NativePic)) {
+		pic.SetIrq(line, level);
+	}
+	else {
+		devices->Irq(line, level);
+	}
+}
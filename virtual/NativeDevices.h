@@ -0,0 +1,263 @@
+#pragma once
+
+#include <memory>
+
+#include "DeviceModel.h"
+#include "MachineClock.h"
+#include "PortTable.h"
+
+/*
+ * Native models of the legacy devices that cause most port I/O exits.
+ *
+ * Each device is off by default and, when enabled through
+ * NativeDevices::SetEnabled(), owns its ports in the PortTable so accesses
+ * never reach the JS side. The device state lives in a NativeDeviceState
+ * which is exposed to JS as the "devstate" ArrayBuffer, so v86 can read (and
+ * where noted, update) it and stay consistent with the native models.
+ *
+ * A native device may decline an access (e.g. PCI config cycles for devices
+ * that exist, or the i8042 data port). Those go to the JS handler as usual,
+ * which must then take the register state it needs (CMOS index, PCI address)
+ * from devstate.
+ */
+
+enum NativeDeviceId {
+	NativePost = 1 << 0,   // 0x80 POST / delay port
+	NativePic = 1 << 1,    // 0x20-0x21, 0xA0-0xA1, ELCR 0x4D0-0x4D1
+	NativePit = 1 << 2,    // 0x40-0x43, 0x61
+	NativeCmos = 1 << 3,   // 0x70-0x71
+	NativePci = 1 << 4,    // 0xCF8-0xCFF
+	NativeI8042 = 1 << 5   // 0x64 status reads
+};
+
+struct PicState {
+	UINT8 irr;
+	UINT8 imr;
+	UINT8 isr;
+	UINT8 irq_base;
+	UINT8 elcr;          // Level triggered lines (set by JS)
+	UINT8 read_isr;
+	UINT8 init_state;    // Next expected ICW (0 = initialized)
+	UINT8 icw4_needed;
+	UINT8 single;
+	UINT8 auto_eoi;
+	UINT8 poll;
+	UINT8 line_level;    // Current input line levels
+};
+
+struct PitChannel {
+	UINT32 count;        // Reload value, 0 means 0x10000
+	UINT8 mode;
+	UINT8 rw_mode;       // 1 = LSB, 2 = MSB, 3 = LSB then MSB
+	UINT8 write_msb;     // Next write is the MSB
+	UINT8 read_msb;      // Next read is the MSB
+	UINT8 latched;
+	UINT8 gate;
+	UINT16 latch;
+	UINT64 load_time;    // ns (machine clock) when the count was loaded
+	UINT64 next_irq;     // ns of the next IRQ0 (channel 0 only)
+};
+
+struct PitState {
+	PitChannel channel[3];
+	UINT8 port61;        // Speaker data / ch2 gate bits of port 0x61
+	UINT8 refresh;
+	UINT8 pad[6];
+};
+
+struct CmosState {
+	UINT8 index;
+	UINT8 nmi_disabled;
+	UINT8 pad[2];
+	UINT8 ram[128];      // Time registers are kept up to date by JS
+};
+
+struct PciState {
+	UINT32 address;      // 0xCF8 address latch
+	UINT8 present[1024]; // Bit per bus/device (bus * 32 + device), set by JS
+};
+
+struct I8042State {
+	UINT8 status;        // Status register, kept up to date by JS
+	UINT8 pad[3];
+};
+
+/** Layout of the "devstate" ArrayBuffer */
+struct NativeDeviceState {
+	UINT32 enabled;      // NativeDeviceId mask
+	UINT32 post_code;
+	UINT32 native_io_counter;
+	UINT32 pad;
+	PicState pic[2];
+	PitState pit;
+	CmosState cmos;
+	PciState pci;
+	I8042State i8042;
+};
+
+class NativeDevices;
+
+class PostPort : public PortHandler {
+private:
+	NativeDeviceState* state;
+
+public:
+	PostPort(NativeDeviceState* state) : state(state) {}
+	bool Read(UINT16 port, UINT8 size, UINT32* value) override;
+	bool Write(UINT16 port, UINT8 size, UINT32 value) override;
+};
+
+/** Master/slave 8259A pair */
+class Pic : public PortHandler {
+private:
+	PicState* chips;
+
+	int GetPriority(const PicState& chip, UINT8 mask);
+	int GetIrq(const PicState& chip);
+	void SetChipIrq(PicState& chip, int irq, bool level);
+	int AcknowledgeChip(PicState& chip, int irq);
+	void Update();
+	void WriteCommand(PicState& chip, UINT8 val);
+	void WriteData(PicState& chip, UINT8 val);
+	UINT8 PollRead(PicState& chip);
+
+public:
+	Pic(NativeDeviceState* state);
+
+	void SetIrq(unsigned int line, bool level);
+	bool HasInterrupt();
+	/** Acknowledges the highest priority interrupt and returns its vector */
+	UINT8 Acknowledge();
+
+	bool Read(UINT16 port, UINT8 size, UINT32* value) override;
+	bool Write(UINT16 port, UINT8 size, UINT32 value) override;
+};
+
+/** 8254 interval timer, including port 0x61 */
+class Pit : public PortHandler {
+private:
+	PitState* state;
+	NativeDevices* owner;
+
+	UINT64 Period(const PitChannel& ch);
+	UINT64 Ticks(const PitChannel& ch, UINT64 now);
+	UINT16 Counter(const PitChannel& ch, UINT64 now);
+	bool Output(const PitChannel& ch, UINT64 now);
+	void Load(int c, UINT64 now);
+
+public:
+	Pit(NativeDeviceState* state, NativeDevices* owner);
+
+	/** Raises IRQ0 if channel 0 expired. Returns the time of the next expiry (0 = none) */
+	UINT64 Service(UINT64 now);
+
+	bool Read(UINT16 port, UINT8 size, UINT32* value) override;
+	bool Write(UINT16 port, UINT8 size, UINT32 value) override;
+};
+
+class Cmos : public PortHandler {
+private:
+	CmosState* state;
+	NativeDevices* owner;
+
+public:
+	Cmos(NativeDeviceState* state, NativeDevices* owner) : state(&state->cmos), owner(owner) {}
+	bool Read(UINT16 port, UINT8 size, UINT32* value) override;
+	bool Write(UINT16 port, UINT8 size, UINT32 value) override;
+};
+
+/** PCI configuration mechanism #1. Config cycles to absent devices are completed natively */
+class PciConfig : public PortHandler {
+private:
+	PciState* state;
+
+	bool TargetPresent();
+
+public:
+	PciConfig(NativeDeviceState* state) : state(&state->pci) {}
+	bool Read(UINT16 port, UINT8 size, UINT32* value) override;
+	bool Write(UINT16 port, UINT8 size, UINT32 value) override;
+};
+
+/** i8042 status register reads; everything else goes to JS */
+class I8042Status : public PortHandler {
+private:
+	I8042State* state;
+
+public:
+	I8042Status(NativeDeviceState* state) : state(&state->i8042) {}
+	bool Read(UINT16 port, UINT8 size, UINT32* value) override;
+	bool Write(UINT16 port, UINT8 size, UINT32 value) override;
+};
+
+/** Owns the native device models, their shared state and the port table */
+class NativeDevices {
+private:
+	std::unique_ptr<NativeDeviceState> state;
+	DeviceModel* devices;
+	PortTable ports;
+
+	PostPort post;
+	Pic pic;
+	Pit pit;
+	Cmos cmos;
+	PciConfig pci;
+	I8042Status i8042;
+
+public:
+	NativeDevices(DeviceModel* devices);
+
+	/** Changes where IRQs for the JS PIC go, e.g. to the exit ring while the machine is started */
+	void SetDeviceModel(DeviceModel* target) { devices = target; }
+
+	/** Enables the given NativeDeviceId mask and disables the rest */
+	void SetEnabled(UINT32 mask);
+	UINT32 GetEnabled() { return state->enabled; }
+
+	/** Moves the timestamps of a state taken at then (machine clock of another process) to now */
+	void Rebase(UINT64 then, UINT64 now);
+	bool IsEnabled(NativeDeviceId id) { return (state->enabled & id) != 0; }
+
+	bool HasHandler(UINT16 port) const { return ports.Lookup(port) != nullptr; }
+
+	/** Handles the access natively if a native device owns the port */
+	bool HandleIO(WHV_EMULATOR_IO_ACCESS_INFO* IoAccess)
+	{
+		PortHandler* handler = ports.Lookup(IoAccess->Port);
+		if (handler == nullptr) {
+			return false;
+		}
+		bool handled;
+		if (IoAccess->Direction) {
+			handled = handler->Write(IoAccess->Port, (UINT8)IoAccess->AccessSize, IoAccess->Data);
+		}
+		else {
+			handled = handler->Read(IoAccess->Port, (UINT8)IoAccess->AccessSize, &IoAccess->Data);
+		}
+		if (handled) {
+			state->native_io_counter++;
+		}
+		return handled;
+	}
+
+	/** Routes an IRQ line to the native PIC, or to JS if the PIC isn't native */
+	void SetIrq(unsigned int line, bool level);
+
+	bool HasInterrupt() { return IsEnabled(NativePic) && pic.HasInterrupt(); }
+	UINT8 AcknowledgeInterrupt() { return pic.Acknowledge(); }
+
+	/** Time on the native device clock (ns) */
+	UINT64 Now() { return MachineClock::Now(); }
+
+	/** Runs time based device work (PIT IRQ0). Returns the time of the next device event, 0 if none */
+	UINT64 Service()
+	{
+		if (IsEnabled(NativePit)) {
+			return pit.Service(Now());
+		}
+		return 0;
+	}
+
+	unsigned char* GetStateBuffer() { return (unsigned char*)state.get(); }
+	size_t GetStateSize() { return sizeof(NativeDeviceState); }
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string.h>
+
+#include <stdexcept>
+#include <vector>
+
+#include "WinHvCompat.h"
+
+/** Native (C++) handler for a range of I/O ports */
+class PortHandler {
+public:
+	virtual ~PortHandler() {}
+
+	/** Return false to leave the access to the JS side */
+	virtual bool Read(UINT16 port, UINT8 size, UINT32* value) = 0;
+	virtual bool Write(UINT16 port, UINT8 size, UINT32 value) = 0;
+};
+
+/**
+ * Port dispatch table. Maps each of the 64K ports to the native handler that
+ * owns it, if any. Ports without a handler are forwarded to the JS side.
+ */
+class PortTable {
+private:
+	unsigned char index[0x10000];
+	std::vector<PortHandler*> handlers;
+
+public:
+	PortTable()
+	{
+		memset(index, 0x0, sizeof(index));
+		handlers.push_back(nullptr);  // Index 0 = no native handler
+	}
+
+	void Register(UINT16 first, unsigned int count, PortHandler* handler)
+	{
+		size_t i = 1;
+		while (i < handlers.size() && handlers[i] != handler) {
+			i++;
+		}
+		if (i == handlers.size()) {
+			if (i > 0xFF) {
+				throw std::runtime_error("Too many port handlers");
+			}
+			handlers.push_back(handler);
+		}
+		for (unsigned int p = first; p < first + count && p < 0x10000; p++) {
+			index[p] = (unsigned char)i;
+		}
+	}
+
+	void Unregister(UINT16 first, unsigned int count)
+	{
+		for (unsigned int p = first; p < first + count && p < 0x10000; p++) {
+			index[p] = 0;
+		}
+	}
+
+	PortHandler* Lookup(UINT16 port) const
+	{
+		return handlers[index[port]];
+	}
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <string.h>
+
+#include "Counter.h"
+#include "DeviceModel.h"
+#include "WinHvCompat.h"
+
+/** One queued port write, as seen by JS in the "postbuf" ArrayBuffer */
+struct PostedWrite {
+	UINT16 port;
+	UINT8 size;
+	UINT8 pad;
+	UINT32 value;
+};
+
+/**
+ * Posted port writes. Writes to ports selected with SetPosted() don't need a
+ * synchronous answer, so instead of a V8 call per write they're queued in a
+ * buffer shared with JS and handed over in one PortWrites() call.
+ *
+ * This sits in front of the real DeviceModel and drains the queue before
+ * passing on any other device call. Everything JS sees therefore stays in
+ * guest order; in particular a read never overtakes a queued write. CMachine
+ * also flushes on HLT and at the end of run().
+ *
+ * Buffer layout: [0] number of queued writes, [1] capacity, then the
+ * PostedWrite entries from byte 16.
+ */
+class PostedWrites : public DeviceModel {
+private:
+	DeviceModel* target;
+	UINT32* header;
+	PostedWrite* entries;
+	UINT32 capacity;
+	unsigned char posted[0x10000 / 8];
+
+public:
+	Counter postedCounter;
+	Counter flushCounter;
+
+	PostedWrites(DeviceModel* target, unsigned char* buf, size_t size)
+		: target(target), header((UINT32*)buf), entries((PostedWrite*)(buf + 16)),
+		capacity((UINT32)((size - 16) / sizeof(PostedWrite)))
+	{
+		memset(posted, 0x0, sizeof(posted));
+		header[0] = 0;
+		header[1] = capacity;
+	}
+
+	/** Selects whether writes to the port range are posted */
+	void SetPosted(UINT16 first, unsigned int count, bool enable)
+	{
+		for (unsigned int p = first; p < first + count && p < 0x10000; p++) {
+			if (enable) {
+				posted[p >> 3] |= 1 << (p & 7);
+			}
+			else {
+				posted[p >> 3] &= ~(1 << (p & 7));
+			}
+		}
+	}
+
+	bool IsPosted(UINT16 port) const { return (posted[port >> 3] >> (port & 7)) & 1; }
+
+	void Post(UINT16 port, UINT8 size, UINT32 value)
+	{
+		if (header[0] == capacity) {
+			Flush();
+		}
+		PostedWrite& w = entries[header[0]++];
+		w.port = port;
+		w.size = size;
+		w.pad = 0;
+		w.value = value;
+		postedCounter++;
+	}
+
+	void Flush()
+	{
+		if (header[0] != 0) {
+			flushCounter++;
+			target->PortWrites(header[0]);
+			header[0] = 0;
+		}
+	}
+
+	// DeviceModel methods, each draining the queue first:
+	void PortIo() override
+	{
+		Flush();
+		target->PortIo();
+	}
+
+	void PortIoString() override
+	{
+		Flush();
+		target->PortIoString();
+	}
+
+	void PortWrites(unsigned int count) override
+	{
+		Flush();
+	}
+
+	void MemoryRead(unsigned int size, unsigned int handler) override
+	{
+		Flush();
+		target->MemoryRead(size, handler);
+	}
+
+	void MemoryWrite(unsigned int size, unsigned int handler) override
+	{
+		Flush();
+		target->MemoryWrite(size, handler);
+	}
+
+	void Cpuid(const unsigned int in[4], unsigned int out[4]) override
+	{
+		Flush();
+		target->Cpuid(in, out);
+	}
+
+	void Irq(unsigned int line, bool level) override
+	{
+		Flush();
+		target->Irq(line, level);
+	}
+
+	bool Msr(unsigned int index, bool write, unsigned long long* value) override
+	{
+		Flush();
+		return target->Msr(index, write, value);
+	}
+};
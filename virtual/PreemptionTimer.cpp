@@ -0,0 +1,171 @@
+#include "PreemptionTimer.h"
+
+#include <stdexcept>
+
+#include "MachineClock.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+#else
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+PreemptionTimer::PreemptionTimer(HvBackend* backend)
+	: backend(backend), stopping(false)
+{
+#ifdef _WIN32
+	// High resolution timers need Windows 10 1803, older versions get the default resolution
+	timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (timer == NULL) {
+		timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+	}
+	wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+	if (timer == NULL || wake == NULL) {
+		throw std::runtime_error("Couldn't create the preemption timer");
+	}
+#else
+	timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (timerFd < 0 || wakeFd < 0) {
+		throw std::runtime_error("Couldn't create the preemption timer");
+	}
+#endif
+	thread = std::thread(&PreemptionTimer::ThreadFunction, this);
+}
+
+PreemptionTimer::~PreemptionTimer()
+{
+	stopping = true;
+#ifdef _WIN32
+	SetEvent(wake);
+	thread.join();
+	CloseHandle(timer);
+	CloseHandle(wake);
+#else
+	UINT64 one = 1;
+	if (write(wakeFd, &one, sizeof(one)) < 0) {
+		// Can only fail if the counter overflows, the thread is woken either way
+	}
+	thread.join();
+	close(timerFd);
+	close(wakeFd);
+#endif
+}
+
+/** Sets the host timer to the deadline, or stops it for 0. Called with the mutex held */
+void PreemptionTimer::Program(UINT64 deadline)
+{
+	programmed = deadline;
+	UINT64 delay = 0;
+	if (deadline != 0) {
+		UINT64 now = MachineClock::Now();
+		delay = deadline > now ? deadline - now : 0;
+	}
+#ifdef _WIN32
+	if (deadline == 0) {
+		CancelWaitableTimer(timer);
+		return;
+	}
+	LARGE_INTEGER due;
+	due.QuadPart = -(LONGLONG)(delay / 100 + 1);  // Relative, in 100 ns units
+	SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE);
+#else
+	struct itimerspec spec = {};
+	if (deadline != 0) {
+		if (delay == 0) {
+			delay = 1;  // A zero it_value would stop the timer
+		}
+		spec.it_value.tv_sec = (time_t)(delay / 1000000000);
+		spec.it_value.tv_nsec = (long)(delay % 1000000000);
+	}
+	timerfd_settime(timerFd, 0, &spec, NULL);
+#endif
+}
+
+void PreemptionTimer::ThreadFunction()
+{
+	while (!stopping) {
+#ifdef _WIN32
+		HANDLE handles[2] = { wake, timer };
+		DWORD result = WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+		if (result != WAIT_OBJECT_0 + 1) {
+			continue;
+		}
+#else
+		struct pollfd fds[2];
+		fds[0].fd = wakeFd;
+		fds[0].events = POLLIN;
+		fds[1].fd = timerFd;
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, -1) <= 0 || !(fds[1].revents & POLLIN)) {
+			continue;
+		}
+		UINT64 expirations;
+		if (read(timerFd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+			continue;  // Reprogrammed after it fired
+		}
+#endif
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (programmed == 0) {
+			continue;
+		}
+		if (MachineClock::Now() < programmed) {
+			// Fired early, or for a deadline that has since been moved
+			Program(programmed);
+			continue;
+		}
+		programmed = 0;
+		if (inGuest) {
+			backend->CancelRunVirtualProcessor(0x0);
+			cancelCounter++;
+		}
+	}
+}
+
+bool PreemptionTimer::Arm(UINT64 deadline)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (kickPending) {
+		kickPending = false;
+		return false;
+	}
+	inGuest = true;
+	if (deadline != programmed) {
+		Program(deadline);
+	}
+	return true;
+}
+
+void PreemptionTimer::Disarm()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	inGuest = false;
+}
+
+void PreemptionTimer::Stop()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	inGuest = false;
+	if (programmed != 0) {
+		Program(0);
+	}
+}
+
+void PreemptionTimer::Kick()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (inGuest) {
+		backend->CancelRunVirtualProcessor(0x0);
+	}
+	else {
+		kickPending = true;
+	}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "Counter.h"
+#include "HvBackend.h"
+
+/**
+ * One-shot timer that takes the virtual processor out of the guest when a
+ * deadline passes.
+ *
+ * Arm() is called right before entering the guest and Disarm() right after
+ * the exit. The host timer (a high resolution waitable timer on Windows, a
+ * timerfd elsewhere) is only reprogrammed when the deadline changes, so the
+ * usual exit/enter round trip costs no system call, and the virtual
+ * processor is only canceled if it's still in the guest when the deadline
+ * passes. Deadlines are MachineClock times (ns).
+ */
+class PreemptionTimer {
+private:
+	HvBackend* backend;
+
+	std::mutex mutex;       // Orders cancels against Disarm()
+	bool inGuest = false;
+	bool kickPending = false;  // Kick() came while out of the guest
+	UINT64 programmed = 0;  // Deadline the host timer is set to, 0 if it isn't set
+	std::atomic<bool> stopping;
+	std::thread thread;
+
+#ifdef _WIN32
+	void* timer = nullptr;  // Waitable timer
+	void* wake = nullptr;   // Event used to stop the thread
+#else
+	int timerFd = -1;
+	int wakeFd = -1;        // eventfd used to stop the thread
+#endif
+
+	void Program(UINT64 deadline);
+	void ThreadFunction();
+
+public:
+	/** Cancels done because a deadline passed */
+	Counter cancelCounter;
+
+	explicit PreemptionTimer(HvBackend* backend);
+	~PreemptionTimer();
+
+	PreemptionTimer(const PreemptionTimer&) = delete;
+	PreemptionTimer& operator=(const PreemptionTimer&) = delete;
+
+	/**
+	 * The virtual processor is about to enter the guest and must leave it at
+	 * the deadline. Returns false instead if Kick() was called since the last
+	 * exit; the caller must not enter but go around its loop again
+	 */
+	bool Arm(UINT64 deadline);
+
+	/** The virtual processor has left the guest */
+	void Disarm();
+
+	/** Stops the host timer, e.g. when run() returns */
+	void Stop();
+
+	/** Takes the virtual processor out of the guest now, or keeps it from entering, e.g. for a new interrupt */
+	void Kick();
+};
@@ -0,0 +1,172 @@
+#include "RegisterCache.h"
+
+#include <string.h>
+
+// Registers the exit context doesn't carry, and the hypervisor doesn't
+// change while running, stay valid across exits
+static const UINT64 STICKY_SLOTS = 1ULL << 36;  // DeliverabilityNotifications
+
+static const UINT32 BATCH = 64;
+
+/** Reads registers from the virtual processor into out[index[i]] and caches them */
+HRESULT RegisterCache::Read(const WHV_REGISTER_NAME* names, const UINT32* index, UINT32 count,
+	WHV_REGISTER_VALUE* out)
+{
+	WHV_REGISTER_VALUE read[BATCH];
+	HRESULT hr = backend->GetVirtualProcessorRegisters(vpIndex, names, count, read);
+	if (hr != S_OK) {
+		return hr;
+	}
+	for (UINT32 i = 0; i < count; i++) {
+		out[index[i]] = read[i];
+		if (Slot(names[i]) >= 0) {
+			Fill(names[i], read[i]);
+		}
+	}
+	return S_OK;
+}
+
+HRESULT RegisterCache::Get(const WHV_REGISTER_NAME* names, UINT32 count, WHV_REGISTER_VALUE* out)
+{
+	// Misses are read in batches and then filled in
+	WHV_REGISTER_NAME missNames[BATCH];
+	UINT32 missIndex[BATCH];
+	UINT32 misses = 0;
+
+	for (UINT32 i = 0; i < count; i++) {
+		int slot = Slot(names[i]);
+		if (slot >= 0 && ((valid >> slot) & 1)) {
+			out[i] = values[slot];
+			hitCounter++;
+			continue;
+		}
+		missCounter++;
+		missNames[misses] = names[i];
+		missIndex[misses] = i;
+		misses++;
+		if (misses == BATCH) {
+			HRESULT hr = Read(missNames, missIndex, misses, out);
+			if (hr != S_OK) {
+				return hr;
+			}
+			misses = 0;
+		}
+	}
+	if (misses > 0) {
+		return Read(missNames, missIndex, misses, out);
+	}
+	return S_OK;
+}
+
+HRESULT RegisterCache::Set(const WHV_REGISTER_NAME* names, UINT32 count, const WHV_REGISTER_VALUE* in)
+{
+	// Registers that aren't cached are written right away, in batches
+	WHV_REGISTER_NAME throughNames[BATCH];
+	WHV_REGISTER_VALUE throughValues[BATCH];
+	UINT32 through = 0;
+
+	for (UINT32 i = 0; i < count; i++) {
+		int slot = Slot(names[i]);
+		if (slot >= 0) {
+			values[slot] = in[i];
+			valid |= 1ULL << slot;
+			dirty |= 1ULL << slot;
+			continue;
+		}
+		throughNames[through] = names[i];
+		throughValues[through] = in[i];
+		through++;
+		if (through == BATCH) {
+			HRESULT hr = backend->SetVirtualProcessorRegisters(vpIndex, throughNames, through, throughValues);
+			if (hr != S_OK) {
+				return hr;
+			}
+			through = 0;
+		}
+	}
+	if (through > 0) {
+		return backend->SetVirtualProcessorRegisters(vpIndex, throughNames, through, throughValues);
+	}
+	return S_OK;
+}
+
+HRESULT RegisterCache::Flush()
+{
+	if (dirty == 0) {
+		return S_OK;
+	}
+	WHV_REGISTER_NAME names[SLOTS];
+	WHV_REGISTER_VALUE out[SLOTS];
+	UINT32 n = 0;
+	for (UINT32 slot = 0; slot < SLOTS; slot++) {
+		if ((dirty >> slot) & 1) {
+			switch (slot) {
+			case 33:
+				names[n] = WHvX64RegisterEfer;
+				break;
+			case 34:
+				names[n] = WHvRegisterPendingInterruption;
+				break;
+			case 35:
+				names[n] = WHvRegisterInterruptState;
+				break;
+			case 36:
+				names[n] = WHvX64RegisterDeliverabilityNotifications;
+				break;
+			default:
+				names[n] = (WHV_REGISTER_NAME)slot;
+				break;
+			}
+			out[n++] = values[slot];
+		}
+	}
+	flushCounter++;
+	HRESULT hr = backend->SetVirtualProcessorRegisters(vpIndex, names, n, out);
+	if (hr == S_OK) {
+		dirty = 0;
+	}
+	return hr;
+}
+
+void RegisterCache::OnExit(const WHV_RUN_VP_EXIT_CONTEXT& ctx)
+{
+	valid &= STICKY_SLOTS;
+	dirty = 0;
+
+	const WHV_VP_EXIT_CONTEXT& vp = ctx.VpContext;
+	if (!vp.ExecutionState.InterruptionPending) {
+		WHV_REGISTER_VALUE none;
+		memset(&none, 0x0, sizeof(none));
+		Fill(WHvRegisterPendingInterruption, none);
+	}
+
+	if (ctx.ExitReason == WHvRunVpExitReasonX64InterruptWindow) {
+		// Taking the window exit clears the request
+		values[36].DeliverabilityNotifications.InterruptNotification = 0;
+	}
+	if (ctx.ExitReason == WHvRunVpExitReasonX64Halt) {
+		// Whether RIP is at or after the HLT is up to the hypervisor, so read it when needed
+		return;
+	}
+
+	Fill64(WHvX64RegisterRip, vp.Rip);
+	Fill64(WHvX64RegisterRflags, vp.Rflags);
+	WHV_REGISTER_VALUE cs;
+	memset(&cs, 0x0, sizeof(cs));
+	cs.Segment = vp.Cs;
+	Fill(WHvX64RegisterCs, cs);
+
+	if (ctx.ExitReason == WHvRunVpExitReasonX64IoPortAccess) {
+		const WHV_X64_IO_PORT_ACCESS_CONTEXT& io = ctx.IoPortAccess;
+		Fill64(WHvX64RegisterRax, io.Rax);
+		Fill64(WHvX64RegisterRcx, io.Rcx);
+		Fill64(WHvX64RegisterRsi, io.Rsi);
+		Fill64(WHvX64RegisterRdi, io.Rdi);
+		WHV_REGISTER_VALUE seg;
+		memset(&seg, 0x0, sizeof(seg));
+		seg.Segment = io.Ds;
+		Fill(WHvX64RegisterDs, seg);
+		seg.Segment = io.Es;
+		Fill(WHvX64RegisterEs, seg);
+	}
+}
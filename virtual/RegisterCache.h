@@ -0,0 +1,87 @@
+#pragma once
+
+#include <string.h>
+
+#include "HvBackend.h"
+
+/**
+ * Shadow copy of a virtual processor's frequently used registers.
+ *
+ * After an exit the cache is refilled from the exit context (RIP, RFLAGS,
+ * CS, the pending interruption state and, for port I/O exits, the string
+ * I/O registers), so reading those costs no hypervisor call. Writes only
+ * update the shadow copy and mark the register dirty; Flush() writes all
+ * dirty registers in one call and must be done before the virtual
+ * processor runs again.
+ *
+ * Cached registers: the GPRs, RIP, RFLAGS, segment and descriptor table
+ * registers, CR0-CR8, EFER and the interrupt registers. Anything else
+ * (XMM, debug registers, other MSRs) is passed straight through.
+ */
+class RegisterCache {
+private:
+	static const UINT32 SLOTS = 37;
+
+	HvBackend* backend;
+	UINT32 vpIndex;
+
+	WHV_REGISTER_VALUE values[SLOTS];
+	UINT64 valid = 0;
+	UINT64 dirty = 0;
+
+	/** Slot of a register, or -1 if it isn't cached */
+	static int Slot(WHV_REGISTER_NAME name)
+	{
+		if ((UINT32)name <= WHvX64RegisterCr8) {
+			return (int)name;
+		}
+		switch (name) {
+		case WHvX64RegisterEfer:
+			return 33;
+		case WHvRegisterPendingInterruption:
+			return 34;
+		case WHvRegisterInterruptState:
+			return 35;
+		case WHvX64RegisterDeliverabilityNotifications:
+			return 36;
+		default:
+			return -1;
+		}
+	}
+
+	void Fill(WHV_REGISTER_NAME name, const WHV_REGISTER_VALUE& value)
+	{
+		int slot = Slot(name);
+		values[slot] = value;
+		valid |= 1ULL << slot;
+	}
+
+	void Fill64(WHV_REGISTER_NAME name, UINT64 value)
+	{
+		WHV_REGISTER_VALUE v;
+		memset(&v, 0x0, sizeof(v));
+		v.Reg64 = value;
+		Fill(name, v);
+	}
+
+	HRESULT Read(const WHV_REGISTER_NAME* names, const UINT32* index, UINT32 count, WHV_REGISTER_VALUE* out);
+
+public:
+	UINT64 hitCounter = 0;
+	UINT64 missCounter = 0;
+	UINT64 flushCounter = 0;
+
+	RegisterCache(HvBackend* backend, UINT32 vpIndex) : backend(backend), vpIndex(vpIndex) {}
+
+	HRESULT Get(const WHV_REGISTER_NAME* names, UINT32 count, WHV_REGISTER_VALUE* out);
+	HRESULT Set(const WHV_REGISTER_NAME* names, UINT32 count, const WHV_REGISTER_VALUE* in);
+
+	/** Writes the dirty registers to the virtual processor */
+	HRESULT Flush();
+
+	/** Updates the cache after the virtual processor ran */
+	void OnExit(const WHV_RUN_VP_EXIT_CONTEXT& ctx);
+
+	/** Drops the cached values, e.g. after the registers were changed behind the cache's back */
+	void Invalidate() { valid = dirty; }
+};
@@ -0,0 +1,328 @@
+#include "Snapshot.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+static const char SNAPSHOT_MAGIC[8] = "V86SNAP";
+static const size_t CHUNK_WORDS = Snapshot::CHUNK_BYTES / sizeof(UINT32);
+
+/** Operations of the chunk encoding, in the top 2 bits of a UINT16 tag with count - 1 below */
+enum RleOperation {
+	RleZero = 0,     // count zero words
+	RleRepeat = 1,   // count times the word that follows
+	RleLiteral = 2   // count words that follow
+};
+
+static bool IsZero(const unsigned char* p, size_t size)
+{
+	const UINT64* words = (const UINT64*)p;
+	for (size_t i = 0; i < size / sizeof(UINT64); i++) {
+		if (words[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void PutTag(unsigned char* out, size_t& length, RleOperation op, size_t count)
+{
+	UINT16 tag = (UINT16)(op << 14 | (count - 1));
+	memcpy(out + length, &tag, sizeof(tag));
+	length += sizeof(tag);
+}
+
+/** Encodes a chunk into out (CHUNK_BYTES). Returns the length, or CHUNK_BYTES if it doesn't get smaller */
+static size_t Encode(const UINT32* words, unsigned char* out)
+{
+	size_t length = 0;
+	size_t i = 0;
+	while (i < CHUNK_WORDS) {
+		size_t run = 1;
+		while (i + run < CHUNK_WORDS && words[i + run] == words[i]) {
+			run++;
+		}
+		if (run > 1 || words[i] == 0) {
+			if (length + sizeof(UINT16) + sizeof(UINT32) >= Snapshot::CHUNK_BYTES) {
+				return Snapshot::CHUNK_BYTES;
+			}
+			PutTag(out, length, words[i] == 0 ? RleZero : RleRepeat, run);
+			if (words[i] != 0) {
+				memcpy(out + length, &words[i], sizeof(UINT32));
+				length += sizeof(UINT32);
+			}
+			i += run;
+			continue;
+		}
+
+		// Literal words up to the next zero or run
+		size_t count = 1;
+		while (i + count < CHUNK_WORDS && words[i + count] != 0 &&
+			!(i + count + 1 < CHUNK_WORDS && words[i + count + 1] == words[i + count])) {
+			count++;
+		}
+		if (length + sizeof(UINT16) + count * sizeof(UINT32) >= Snapshot::CHUNK_BYTES) {
+			return Snapshot::CHUNK_BYTES;
+		}
+		PutTag(out, length, RleLiteral, count);
+		memcpy(out + length, &words[i], count * sizeof(UINT32));
+		length += count * sizeof(UINT32);
+		i += count;
+	}
+	return length;
+}
+
+/** Decodes a chunk into words, which must be zero as zero runs are skipped */
+static void Decode(const unsigned char* in, size_t length, UINT32* words)
+{
+	size_t pos = 0;
+	size_t i = 0;
+	while (pos < length) {
+		UINT16 tag;
+		if (pos + sizeof(tag) > length) {
+			throw std::runtime_error("Corrupt snapshot file");
+		}
+		memcpy(&tag, in + pos, sizeof(tag));
+		pos += sizeof(tag);
+		size_t count = (tag & 0x3FFF) + 1;
+		if (i + count > CHUNK_WORDS) {
+			throw std::runtime_error("Corrupt snapshot file");
+		}
+		switch (tag >> 14) {
+		case RleZero:
+			break;
+		case RleRepeat: {
+			UINT32 word;
+			if (pos + sizeof(word) > length) {
+				throw std::runtime_error("Corrupt snapshot file");
+			}
+			memcpy(&word, in + pos, sizeof(word));
+			pos += sizeof(word);
+			for (size_t j = 0; j < count; j++) {
+				words[i + j] = word;
+			}
+			break;
+		}
+		case RleLiteral:
+			if (pos + count * sizeof(UINT32) > length) {
+				throw std::runtime_error("Corrupt snapshot file");
+			}
+			memcpy(&words[i], in + pos, count * sizeof(UINT32));
+			pos += count * sizeof(UINT32);
+			break;
+		default:
+			throw std::runtime_error("Corrupt snapshot file");
+		}
+		i += count;
+	}
+}
+
+Snapshot::Snapshot()
+{
+	memset(&header, 0x0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = VERSION;
+}
+
+void Snapshot::Write(const std::string& path, const unsigned char* memory, size_t size, bool compress)
+{
+	// The last chunk may be partial, it's stored zero padded
+	std::vector<unsigned char> last(CHUNK_BYTES);
+	auto chunkAt = [&](size_t chunk) -> const unsigned char* {
+		size_t offset = chunk * CHUNK_BYTES;
+		if (offset + CHUNK_BYTES <= size) {
+			return memory + offset;
+		}
+		memset(last.data(), 0, CHUNK_BYTES);
+		memcpy(last.data(), memory + offset, size - offset);
+		return last.data();
+	};
+
+	chunks.clear();
+	for (size_t c = 0; c < (size + CHUNK_BYTES - 1) / CHUNK_BYTES; c++) {
+		if (!IsZero(chunkAt(c), CHUNK_BYTES)) {
+			chunks.push_back((UINT32)c);
+		}
+	}
+
+	header.flags = compress ? SnapshotCompressed : 0;
+	header.memorySize = size;
+	header.chunkCount = chunks.size();
+	header.registerCount = (UINT32)registerNames.size();
+	header.regionCount = (UINT32)regions.size();
+	header.msrCount = (UINT32)msrs.size();
+	header.deviceStateSize = (UINT32)deviceState.size();
+	header.userStateSize = userState.size();
+	UINT64 metadata = sizeof(header) + registerNames.size() * sizeof(UINT32) +
+		registers.size() * sizeof(WHV_REGISTER_VALUE) + regions.size() * sizeof(SnapshotRegion) +
+		msrs.size() * sizeof(SnapshotMsr) + deviceState.size() + userState.size() + chunks.size() * sizeof(UINT32);
+	header.dataOffset = (metadata + CHUNK_BYTES - 1) / CHUNK_BYTES * CHUNK_BYTES;
+
+	// Written next to the file and renamed over it, so a snapshot RAM is
+	// mapped from (under whatever name) is never changed in place
+	std::string temporary = path + ".tmp";
+	std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+	if (!out) {
+		throw std::runtime_error("Couldn't create snapshot file");
+	}
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)registerNames.data(), registerNames.size() * sizeof(UINT32));
+	out.write((const char*)registers.data(), registers.size() * sizeof(WHV_REGISTER_VALUE));
+	out.write((const char*)regions.data(), regions.size() * sizeof(SnapshotRegion));
+	out.write((const char*)msrs.data(), msrs.size() * sizeof(SnapshotMsr));
+	out.write((const char*)deviceState.data(), deviceState.size());
+	out.write((const char*)userState.data(), userState.size());
+	out.write((const char*)chunks.data(), chunks.size() * sizeof(UINT32));
+	std::vector<char> padding((size_t)(header.dataOffset - metadata));
+	out.write(padding.data(), padding.size());
+
+	std::vector<unsigned char> encoded(CHUNK_BYTES);
+	for (UINT32 c : chunks) {
+		const unsigned char* data = chunkAt(c);
+		if (compress) {
+			UINT32 length = (UINT32)Encode((const UINT32*)data, encoded.data());
+			out.write((const char*)&length, sizeof(length));
+			out.write((const char*)(length == CHUNK_BYTES ? data : encoded.data()), length);
+		}
+		else {
+			out.write((const char*)data, CHUNK_BYTES);
+		}
+	}
+	out.close();
+	if (!out) {
+		remove(temporary.c_str());
+		throw std::runtime_error("Couldn't write snapshot file");
+	}
+#ifdef _WIN32
+	bool replaced = MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	bool replaced = rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+	if (!replaced) {
+		remove(temporary.c_str());
+		throw std::runtime_error("Couldn't replace snapshot file, is RAM mapped from it?");
+	}
+}
+
+Snapshot Snapshot::Read(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		throw std::runtime_error("Couldn't open snapshot file");
+	}
+	Snapshot s;
+	in.read((char*)&s.header, sizeof(s.header));
+	if (!in || memcmp(s.header.magic, SNAPSHOT_MAGIC, sizeof(s.header.magic)) != 0) {
+		throw std::runtime_error("Not a snapshot file");
+	}
+	if (s.header.version != VERSION) {
+		throw std::runtime_error("Unsupported snapshot version");
+	}
+	UINT64 chunkCount = (s.header.memorySize + CHUNK_BYTES - 1) / CHUNK_BYTES;
+	if (s.header.chunkCount > chunkCount || s.header.dataOffset % CHUNK_BYTES != 0) {
+		throw std::runtime_error("Corrupt snapshot file");
+	}
+
+	s.registerNames.resize(s.header.registerCount);
+	s.registers.resize(s.header.registerCount);
+	s.regions.resize(s.header.regionCount);
+	s.msrs.resize(s.header.msrCount);
+	s.deviceState.resize(s.header.deviceStateSize);
+	s.userState.resize((size_t)s.header.userStateSize);
+	s.chunks.resize((size_t)s.header.chunkCount);
+
+	in.read((char*)s.registerNames.data(), s.registerNames.size() * sizeof(UINT32));
+	in.read((char*)s.registers.data(), s.registers.size() * sizeof(WHV_REGISTER_VALUE));
+	in.read((char*)s.regions.data(), s.regions.size() * sizeof(SnapshotRegion));
+	in.read((char*)s.msrs.data(), s.msrs.size() * sizeof(SnapshotMsr));
+	in.read((char*)s.deviceState.data(), s.deviceState.size());
+	in.read((char*)s.userState.data(), s.userState.size());
+	in.read((char*)s.chunks.data(), s.chunks.size() * sizeof(UINT32));
+	if (!in) {
+		throw std::runtime_error("Truncated snapshot file");
+	}
+	for (size_t i = 0; i < s.chunks.size(); i++) {
+		if (s.chunks[i] >= chunkCount || (i > 0 && s.chunks[i] <= s.chunks[i - 1])) {
+			throw std::runtime_error("Corrupt snapshot file");
+		}
+	}
+	return s;
+}
+
+bool Snapshot::LoadMemory(const std::string& path, GuestMemory& memory) const
+{
+	size_t size = memory.Size();
+	if (header.memorySize != size) {
+		throw std::runtime_error("Snapshot doesn't match the memory size");
+	}
+
+	// Runs of whole chunks are mapped, they're back to back in the file
+	bool mapped = false;
+	if (!IsCompressed()) {
+		std::vector<std::pair<size_t, size_t>> ranges;
+		for (UINT32 c : chunks) {
+			size_t offset = (size_t)c * CHUNK_BYTES;
+			if (offset + CHUNK_BYTES > size) {
+				break;
+			}
+			if (!ranges.empty() && ranges.back().first + ranges.back().second == offset) {
+				ranges.back().second += CHUNK_BYTES;
+			}
+			else {
+				ranges.push_back(std::make_pair(offset, CHUNK_BYTES));
+			}
+		}
+		mapped = memory.MapFile(path, header.dataOffset, ranges);
+	}
+
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		throw std::runtime_error("Couldn't open snapshot file");
+	}
+	in.seekg(header.dataOffset);
+	unsigned char* base = memory.Get();
+	std::vector<unsigned char> encoded(CHUNK_BYTES);
+	std::vector<unsigned char> last(CHUNK_BYTES);  // A partial last chunk, before it's copied to RAM
+	for (size_t i = 0; i < chunks.size() && in; i++) {
+		size_t offset = (size_t)chunks[i] * CHUNK_BYTES;
+		bool partial = offset + CHUNK_BYTES > size;
+		unsigned char* target = partial ? last.data() : base + offset;
+		if (!IsCompressed()) {
+			if (mapped && !partial) {
+				continue;
+			}
+			in.seekg(header.dataOffset + i * CHUNK_BYTES);
+			in.read((char*)target, CHUNK_BYTES);
+		}
+		else {
+			UINT32 length = 0;
+			in.read((char*)&length, sizeof(length));
+			if (length > CHUNK_BYTES) {
+				throw std::runtime_error("Corrupt snapshot file");
+			}
+			if (length == CHUNK_BYTES) {
+				in.read((char*)target, CHUNK_BYTES);
+			}
+			else {
+				in.read((char*)encoded.data(), length);
+				if (in) {
+					Decode(encoded.data(), length, (UINT32*)target);
+				}
+			}
+		}
+		if (partial) {
+			memcpy(base + offset, last.data(), size - offset);
+		}
+	}
+	if (!in) {
+		throw std::runtime_error("Truncated snapshot file");
+	}
+	return mapped;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "GuestMemory.h"
+#include "WinHvCompat.h"
+
+/**
+ * Whole machine snapshots, to start a machine where another one was (e.g.
+ * at the shell prompt) instead of booting it.
+ *
+ * RAM is stored in CHUNK_BYTES chunks and all-zero chunks are left out. A
+ * plain snapshot keeps the chunks as they are, at CHUNK_BYTES aligned file
+ * offsets, so a machine started from it maps the file copy-on-write and
+ * only the pages the guest touches are ever read. A compressed one holds
+ * each chunk run length encoded (zero runs, repeated and literal 32-bit
+ * words) and is decompressed into RAM chunk by chunk.
+ *
+ * File layout: SnapshotHeader, register names (UINT32 each), register
+ * values, regions, MSR store values, native device state, JS state, chunk
+ * numbers (UINT32 each) and at dataOffset the chunk data. Compressed chunks
+ * are a UINT32 length followed by the encoded bytes; a length of
+ * CHUNK_BYTES means the chunk is stored as is.
+ */
+
+enum SnapshotFlags {
+	SnapshotCompressed = 1
+};
+
+struct SnapshotHeader {
+	char magic[8];           // "V86SNAP"
+	UINT32 version;
+	UINT32 flags;            // SnapshotFlags
+	UINT64 memorySize;
+	UINT64 chunkCount;       // Chunks stored, the others are all zero
+	UINT64 dataOffset;       // File offset of the chunk data, CHUNK_BYTES aligned
+	UINT32 registerCount;
+	UINT32 regionCount;
+	UINT32 msrCount;
+	UINT32 deviceStateSize;
+	UINT64 userStateSize;    // Opaque state of the JS side
+	UINT32 a20;              // A20 gate open
+	UINT32 reserved;
+	UINT64 clock;            // MachineClock time it was taken, for the native device timestamps
+};
+
+/** A region of the guest physical address space, see GpaRegion */
+struct SnapshotRegion {
+	UINT64 start;
+	UINT64 end;
+	UINT32 type;             // GpaRegionType
+	UINT32 index;
+};
+
+/** An MSR of the processor's MsrStore */
+struct SnapshotMsr {
+	UINT32 index;
+	UINT32 reserved;
+	UINT64 value;
+};
+
+class Snapshot {
+public:
+	static const UINT32 VERSION = 1;
+	static const size_t CHUNK_BYTES = 65536;  // Also the Windows mapping granularity
+
+	SnapshotHeader header;
+	std::vector<UINT32> registerNames;
+	std::vector<WHV_REGISTER_VALUE> registers;
+	std::vector<SnapshotRegion> regions;
+	std::vector<SnapshotMsr> msrs;
+	std::vector<unsigned char> deviceState;
+	std::vector<unsigned char> userState;
+	std::vector<UINT32> chunks;  // Chunk numbers of the chunks stored, ascending
+
+	Snapshot();
+
+	bool IsCompressed() const { return (header.flags & SnapshotCompressed) != 0; }
+
+	/**
+	 * Writes the snapshot with the given RAM, streaming it chunk by chunk to a
+	 * temporary file that then replaces path
+	 */
+	void Write(const std::string& path, const unsigned char* memory, size_t size, bool compress);
+
+	/** Reads everything but RAM */
+	static Snapshot Read(const std::string& path);
+
+	/**
+	 * Loads RAM (which must be untouched) from the snapshot file: mapped where
+	 * the host allows it, otherwise read or decompressed. Returns true if it
+	 * was mapped, the file must then stay unchanged while the memory lives
+	 */
+	bool LoadMemory(const std::string& path, GuestMemory& memory) const;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <new>
+
+#include "WinHvCompat.h"
+
+/**
+ * Lock-free ring of fixed size entries between one producer thread and one
+ * consumer thread, in a buffer supplied by the caller (so it can be shared,
+ * e.g. with JS as an ArrayBuffer).
+ *
+ * The producer only writes head and the consumer only tail, each on a cache
+ * line of its own. Both are free running counters, head - tail entries are
+ * in the ring.
+ *
+ * Layout: [0] head, [1] capacity, [16] tail (UINT32 units), entries from
+ * byte HEADER_BYTES.
+ */
+template <typename T>
+class SpscRing {
+private:
+	std::atomic<UINT32>* head;
+	std::atomic<UINT32>* tail;
+	T* entries;
+	UINT32 capacity;
+
+public:
+	static const size_t HEADER_BYTES = 128;
+
+	/** Buffer size for a ring of capacity entries (a power of two) */
+	static size_t Bytes(UINT32 capacity) { return HEADER_BYTES + capacity * sizeof(T); }
+
+	SpscRing(unsigned char* buf, UINT32 capacity)
+		: head(new (buf) std::atomic<UINT32>(0)), tail(new (buf + 64) std::atomic<UINT32>(0)),
+		entries((T*)(buf + HEADER_BYTES)), capacity(capacity)
+	{
+		((UINT32*)buf)[1] = capacity;
+	}
+
+	/** Producer side. Returns false if the ring is full */
+	bool TryPush(const T& entry)
+	{
+		UINT32 h = head->load(std::memory_order_relaxed);
+		if (h - tail->load(std::memory_order_acquire) == capacity) {
+			return false;
+		}
+		entries[h & (capacity - 1)] = entry;
+		head->store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	/** Consumer side. Returns false if the ring is empty */
+	bool TryPop(T& entry)
+	{
+		UINT32 t = tail->load(std::memory_order_relaxed);
+		if (head->load(std::memory_order_acquire) == t) {
+			return false;
+		}
+		entry = entries[t & (capacity - 1)];
+		tail->store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	/** Either side, e.g. to decide whether to sleep */
+	bool Empty() const { return head->load(std::memory_order_acquire) == tail->load(std::memory_order_acquire); }
+
+	/** Drops the entries. Only while neither side uses the ring */
+	void Clear()
+	{
+		head->store(0);
+		tail->store(0);
+	}
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "DeviceModel.h"
+
+/**
+ * DeviceModel without devices: port and MMIO reads return all ones, writes
+ * are dropped, CPUID returns zeros, MSRs are unknown and IRQs from native
+ * devices are only counted. Together with MockBackend this lets CMachine run without V8,
+ * e.g. to measure the per-exit dispatch overhead.
+ */
+class StubDeviceModel : public DeviceModel {
+private:
+	unsigned int* parambuf = nullptr;
+
+public:
+	unsigned long long portCounter = 0;
+	unsigned long long portWritesCounter = 0;
+	unsigned long long portStringCounter = 0;
+	unsigned long long memoryCounter = 0;
+	unsigned long long cpuidCounter = 0;
+	unsigned long long irqCounter = 0;
+	unsigned long long msrCounter = 0;
+
+	void SetParamBuf(unsigned char* buf) { parambuf = (unsigned int*)buf; }
+
+	void PortIo() override
+	{
+		portCounter++;
+		if (!parambuf[2]) {
+			parambuf[0] = 0xFFFFFFFF;
+		}
+	}
+
+	void PortIoString() override
+	{
+		portStringCounter++;
+	}
+
+	void PortWrites(unsigned int count) override
+	{
+		portWritesCounter += count;
+	}
+
+	void MemoryRead(unsigned int size, unsigned int handler) override
+	{
+		memoryCounter++;
+		parambuf[0] = 0xFFFFFFFF;
+	}
+
+	void MemoryWrite(unsigned int size, unsigned int handler) override
+	{
+		memoryCounter++;
+	}
+
+	void Cpuid(const unsigned int in[4], unsigned int out[4]) override
+	{
+		cpuidCounter++;
+		out[0] = out[1] = out[2] = out[3] = 0;
+	}
+
+	void Irq(unsigned int line, bool level) override
+	{
+		irqCounter++;
+	}
+
+	bool Msr(unsigned int index, bool write, unsigned long long* value) override
+	{
+		msrCounter++;
+		return false;
+	}
+};
@@ -0,0 +1,338 @@
+// Replays an exit trace (see ExitTrace.h, recorded with "starttrace") through
+// the exit dispatch of CMachine without a hypervisor or JS, e.g.
+//
+//   cefvirtual_replay boot.trace [repeat]
+//
+// The exits are scripted into a MockBackend and the device calls are answered
+// with what the devices returned in the trace, so a slow run becomes a
+// repeatable benchmark of the C++ side. Prints the exit rate and the handling
+// latencies per exit reason, next to the ones recorded.
+//
+// The replay is approximate where the trace doesn't hold enough: string I/O
+// moves a single element, MMIO goes through the instruction emulator rather
+// than the in-process decoder, dirty page faults, INIT/SIPI and the exits of
+// application processors are left out, and interrupts are queued at the next
+// device call (or halt) after the point they were injected.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <vector>
+
+#include "CMachine.h"
+#include "ExitStats.h"
+#include "ExitTrace.h"
+#include "MachineClock.h"
+#include "MockBackend.h"
+
+/** Answers device calls with the values of the trace, from the records of the exit being replayed */
+class ReplayDeviceModel : public DeviceModel {
+private:
+	struct Range {
+		size_t begin;
+		size_t end;  // One past the exit record
+	};
+
+	const std::vector<TraceRecord>& records;
+	std::vector<Range> exits;  // Records of each scripted exit, those of left out exits go to the next one
+	MockBackend* backend;
+	CMachine* machine = nullptr;
+	unsigned int* params = nullptr;
+	size_t cursor = 0;
+
+	/** The next record of the type in the current exit, queueing the interrupts passed on the way */
+	const TraceRecord* Next(TraceRecordType type)
+	{
+		size_t exit = backend->ScriptPosition() - 1;
+		if (exit >= exits.size()) {
+			return nullptr;
+		}
+		cursor = std::max(cursor, exits[exit].begin);
+		for (; cursor < exits[exit].end; cursor++) {
+			const TraceRecord& r = records[cursor];
+			if (r.type == TraceInject) {
+				machine->irq((unsigned int)r.address);
+			}
+			else if (r.type == type) {
+				return &records[cursor++];
+			}
+		}
+		return nullptr;
+	}
+
+	/** The exit record of the current exit */
+	const TraceRecord* Exit()
+	{
+		size_t exit = backend->ScriptPosition() - 1;
+		return exit < exits.size() ? &records[exits[exit].end - 1] : nullptr;
+	}
+
+public:
+	unsigned long long missCounter = 0;  // Reads without a record to answer them
+
+	ReplayDeviceModel(const std::vector<TraceRecord>& records, MockBackend* backend)
+		: records(records), backend(backend) {}
+
+	void SetMachine(CMachine* m)
+	{
+		machine = m;
+		params = (unsigned int*)m->GetParamBuf();
+	}
+
+	/** Scripts the exits of the trace into the backend */
+	void Script()
+	{
+		size_t first = 0;
+		for (size_t i = 0; i < records.size(); i++) {
+			const TraceRecord& r = records[i];
+			if (r.type != TraceExit) {
+				continue;
+			}
+			bool write = (r.flags & TraceWrite) != 0;
+			bool scripted = true;
+			switch (r.reason) {
+			case StatIo:
+				backend->AddIo((UINT16)r.address, r.size, write, (UINT32)r.data[0]);
+				break;
+			case StatStringIo:
+				backend->AddStringIo((UINT16)r.address, r.size, write, false);
+				break;
+			case StatMmio:
+				if (r.flags & TraceFault) {
+					scripted = false;
+				}
+				else {
+					// Size and written value are only known from the device call
+					UINT8 size = 4;
+					UINT64 value = 0;
+					for (size_t j = first; j < i; j++) {
+						if (records[j].type == TraceMemoryRead || records[j].type == TraceMemoryWrite) {
+							size = records[j].size;
+							value = records[j].data[0];
+							break;
+						}
+					}
+					backend->AddMmio(r.address, std::min(size, (UINT8)8), write, value);
+				}
+				break;
+			case StatCpuid:
+				backend->AddCpuid((UINT32)r.address, r.extra);
+				break;
+			case StatMsr:
+				backend->AddMsr((UINT32)r.address, write, r.data[0]);
+				break;
+			case StatHalt:
+				backend->AddHalt();
+				break;
+			default:
+				// Interrupt windows and cancellations come from the replay itself
+				scripted = false;
+				break;
+			}
+			if (scripted) {
+				Range range = { first, i + 1 };
+				exits.push_back(range);
+				first = i + 1;
+			}
+		}
+	}
+
+	size_t GetExitCount() { return exits.size(); }
+
+	/** Queues the interrupts injected before the current exit that no device call has passed yet */
+	void CatchUp()
+	{
+		size_t exit = backend->ScriptPosition();
+		if (exit == 0 || exit > exits.size()) {
+			return;
+		}
+		for (; cursor < exits[exit - 1].end; cursor++) {
+			if (records[cursor].type == TraceInject) {
+				machine->irq((unsigned int)records[cursor].address);
+			}
+		}
+	}
+
+	void Rewind() { cursor = 0; }
+
+	void PortIo() override
+	{
+		// Writes posted by the recording machine have no record
+		const TraceRecord* r = Next(TracePortIo);
+		if (!params[2]) {
+			if (r == nullptr) {
+				missCounter++;
+			}
+			params[0] = r != nullptr ? (unsigned int)r->data[0] : 0xFFFFFFFF;
+		}
+	}
+
+	void PortIoString() override
+	{
+		Next(TracePortIoString);
+	}
+
+	void PortWrites(unsigned int count) override
+	{
+		Next(TracePortWrites);
+	}
+
+	void MemoryRead(unsigned int size, unsigned int handler) override
+	{
+		const TraceRecord* r = Next(TraceMemoryRead);
+		if (r == nullptr) {
+			missCounter++;
+			params[0] = 0xFFFFFFFF;
+			return;
+		}
+		if (size > 4) {
+			memcpy(params + WIDE_DATA_SLOT, r->data, size);
+		}
+		else {
+			params[0] = (unsigned int)r->data[0];
+		}
+	}
+
+	void MemoryWrite(unsigned int size, unsigned int handler) override
+	{
+		Next(TraceMemoryWrite);
+	}
+
+	void Cpuid(const unsigned int in[4], unsigned int out[4]) override
+	{
+		// The exit has the result even when the recording machine answered from its table
+		const TraceRecord* r = Exit();
+		if (r == nullptr || r->reason != StatCpuid) {
+			missCounter++;
+			out[0] = out[1] = out[2] = out[3] = 0;
+			return;
+		}
+		out[0] = (unsigned int)r->data[0];
+		out[1] = (unsigned int)(r->data[0] >> 32);
+		out[2] = (unsigned int)r->data[1];
+		out[3] = (unsigned int)(r->data[1] >> 32);
+	}
+
+	void Irq(unsigned int line, bool level) override {}
+
+	bool Msr(unsigned int index, bool write, unsigned long long* value) override
+	{
+		const TraceRecord* r = Exit();
+		if (r == nullptr || r->reason != StatMsr) {
+			missCounter += write ? 0 : 1;
+			return false;
+		}
+		if (!write) {
+			*value = r->data[0];
+		}
+		return true;
+	}
+};
+
+/** Bucket bound (ns) under which the fraction q of a stats histogram lies */
+static UINT64 Percentile(const double* histogram, double q)
+{
+	double seen = 0;
+	for (unsigned int i = 0; i < ExitStats::BUCKETS; i++) {
+		seen += histogram[2 + i];
+		if (seen > 0 && seen >= histogram[0] * q) {
+			return 2ULL << i;
+		}
+	}
+	return 0;
+}
+
+/** Exact percentile of recorded latencies, which are sorted */
+static UINT64 Percentile(const std::vector<UINT32>& sorted, double q)
+{
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t i = (size_t)(q * (sorted.size() - 1));
+	return sorted[i];
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <trace> [repeat]\n", argv[0]);
+		return 1;
+	}
+	try {
+		TraceHeader header;
+		std::vector<TraceRecord> records = ExitTrace::Read(argv[1], &header);
+		int repeat = argc > 2 ? atoi(argv[2]) : 1;
+		if (repeat < 1) {
+			repeat = 1;
+		}
+
+		// Recorded handling latencies, by reason
+		std::vector<UINT32> recorded[STAT_REASONS];
+		for (const TraceRecord& r : records) {
+			if (r.type == TraceExit && r.reason < STAT_REASONS) {
+				recorded[r.reason].push_back(r.handleNs);
+			}
+		}
+		for (auto& v : recorded) {
+			std::sort(v.begin(), v.end());
+		}
+
+		auto backend = std::make_unique<MockBackend>(false);
+		MockBackend* mock = backend.get();
+		ReplayDeviceModel devices(records, mock);
+		devices.Script();
+
+		CMachine machine((size_t)header.memorySize, std::move(backend), &devices);
+		devices.SetMachine(&machine);
+		machine.SetNativeDevices(header.nativeDevices);
+		WHV_REGISTER_NAME name = WHvX64RegisterRflags;
+		WHV_REGISTER_VALUE value;
+		memset(&value, 0x0, sizeof(value));
+		value.Reg64 = 0x202;  // Interrupts enabled, so injected ones are taken
+		machine.HandleSetRegisters(&name, 1, &value);
+
+		ExitStats& stats = machine.GetStats();
+		stats.Enable(true);
+		UINT64 start = MachineClock::Now();
+		for (int i = 0; i < repeat; i++) {
+			mock->Rewind();
+			devices.Rewind();
+			while (mock->ScriptPosition() < mock->ScriptLength()) {
+				machine.run(MachineClock::Now() + 1000000000ULL);
+				devices.CatchUp();
+			}
+		}
+		UINT64 elapsed = MachineClock::Now() - start;
+
+		const double* b = stats.GetBuffer();
+		double exits = b[7];
+		printf("%s: %llu records, %llu exits replayed %d times, %llu MB of RAM\n", argv[1],
+			(unsigned long long)records.size(), (unsigned long long)devices.GetExitCount(), repeat,
+			(unsigned long long)(header.memorySize >> 20));
+		printf("%.0f exits in %.3f s: %.0f exits/s (%llu reads without a recorded answer)\n\n", exits,
+			elapsed / 1e9, elapsed != 0 ? exits * 1e9 / elapsed : 0.0, devices.missCounter);
+
+		printf("%-16s %10s %12s %12s %12s %12s %12s\n", "reason", "exits", "rec p50", "rec p99", "rec p99.9",
+			"replay p50", "replay p99");
+		for (unsigned int r = 0; r < STAT_REASONS; r++) {
+			// Replayed handling is the C++ side only, the device answers come from the trace
+			const double* h = b + ExitStats::HISTOGRAMS + (r * STAT_PHASES + StatEmulation) * ExitStats::HISTOGRAM_SIZE;
+			if (h[0] == 0 && recorded[r].empty()) {
+				continue;
+			}
+			printf("%-16s %10.0f %12llu %12llu %12llu %12llu %12llu\n", ExitStats::ReasonName((ExitStatReason)r), h[0],
+				(unsigned long long)Percentile(recorded[r], 0.5), (unsigned long long)Percentile(recorded[r], 0.99),
+				(unsigned long long)Percentile(recorded[r], 0.999),
+				(unsigned long long)Percentile(h, 0.5), (unsigned long long)Percentile(h, 0.99));
+		}
+		printf("\nLatencies in ns, recorded ones exact, replayed ones as the upper bound of their log2 bucket\n");
+	}
+	catch (std::exception& ex) {
+		fprintf(stderr, "Error: %s\n", ex.what());
+		return 1;
+	}
+	return 0;
+}
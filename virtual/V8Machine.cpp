@@ -0,0 +1,231 @@
+#include "V8Machine.h"
+
+#include "WhpBackend.h"
+
+V8Machine::V8Machine(size_t sz, CefRefPtr<CefV8Value> cpu, CefRefPtr<CefV8Value> mw1, CefRefPtr<CefV8Value> mw2, CefRefPtr<CefV8Value> mw4, CefRefPtr<CefV8Value> mr1, CefRefPtr<CefV8Value> mr2, CefRefPtr<CefV8Value> mr4, UINT32 processorCount, bool largePages, const std::string& snapshotPath)
+	: mr1(mr1), mr2(mr2), mr4(mr4), mw1(mw1), mw2(mw2), mw4(mw4), jscpu(cpu)
+{
+	machine = std::make_unique<CMachine>(sz, std::make_unique<WhpBackend>(), this, processorCount, largePages,
+		snapshotPath);
+}
+
+CefRefPtr<CefV8Value> V8Machine::run(double milliseconds)
+{
+	machine->RequireStopped();
+	unsigned int val = machine->run(MachineClock::After(milliseconds));
+	machine->PublishCounters();
+	return CefV8Value::CreateUInt(val);
+}
+
+CefRefPtr<CefV8Value> V8Machine::service(double milliseconds)
+{
+	unsigned int val = machine->service(MachineClock::After(milliseconds));
+	machine->PublishCounters();
+	return CefV8Value::CreateUInt(val);
+}
+
+UINT32 V8Machine::RegisterMmioHandler(CefRefPtr<CefV8Value> handler)
+{
+	for (size_t i = 0; i < mmioHandlers.size(); i++) {
+		if (mmioHandlers[i].object->IsSame(handler)) {
+			return (UINT32)(i + 1);
+		}
+	}
+	MmioHandler h;
+	h.object = handler;
+	h.read = handler->GetValue("read");
+	h.write = handler->GetValue("write");
+	if (!h.read->IsFunction() || !h.write->IsFunction()) {
+		throw std::runtime_error("MMIO handler needs read and write functions");
+	}
+	// readwide(offset, size) and writewide(offset, size) take 8 and 16 byte accesses, data in the 64-bit slots
+	h.readWide = handler->GetValue("readwide");
+	h.writeWide = handler->GetValue("writewide");
+	bool wide = h.readWide->IsFunction() && h.writeWide->IsFunction();
+	mmioHandlers.push_back(h);
+	UINT32 index = (UINT32)mmioHandlers.size();
+	machine->SetWideMemory(index, wide, wide);
+	return index;
+}
+
+/** True if a JS value given for an optional function is one */
+static bool IsFunction(CefRefPtr<CefV8Value> value)
+{
+	return value.get() != NULL && value->IsFunction();
+}
+
+void V8Machine::SetWideMemory(CefRefPtr<CefV8Value> mr8, CefRefPtr<CefV8Value> mw8,
+	CefRefPtr<CefV8Value> mr16, CefRefPtr<CefV8Value> mw16)
+{
+	bool size8 = IsFunction(mr8) && IsFunction(mw8);
+	bool size16 = IsFunction(mr16) && IsFunction(mw16);
+	machine->SetWideMemory(0, size8, size16);
+	this->mr8 = mr8;
+	this->mw8 = mw8;
+	this->mr16 = mr16;
+	this->mw16 = mw16;
+}
+
+void V8Machine::SetCpuid(CefRefPtr<CefV8Value> entries, bool replace)
+{
+	CpuidTable& table = machine->GetCpuidTable();
+	if (replace) {
+		table.Clear();
+	}
+	for (int i = 0; i < entries->GetArrayLength(); i++) {
+		CefRefPtr<CefV8Value> entry = entries->GetValue(i);
+		if (entry->GetArrayLength() < 6) {
+			throw std::runtime_error("CPUID entry needs leaf, subleaf and four registers");
+		}
+		UINT32 values[4];
+		for (int r = 0; r < 4; r++) {
+			values[r] = entry->GetValue(2 + r)->GetUIntValue();
+		}
+		UINT32 flags = entry->GetArrayLength() > 6 ? entry->GetValue(6)->GetUIntValue() : 0;
+		table.Set(entry->GetValue(0)->GetUIntValue(), entry->GetValue(1)->GetUIntValue(), values, flags);
+	}
+}
+
+void V8Machine::PortIo()
+{
+	CefV8ValueList list;
+	getIOCallback()->ExecuteFunction(jsobj, list);
+}
+
+void V8Machine::PortIoString()
+{
+	CefV8ValueList list;
+	CefRefPtr<CefV8Value> cb = jsobj->GetValue("iostringcallback");
+	cb->ExecuteFunction(jsobj, list);
+}
+
+void V8Machine::PortWrites(unsigned int count)
+{
+	CefV8ValueList list;
+	list.push_back(CefV8Value::CreateUInt(count));
+	CefRefPtr<CefV8Value> cb = jsobj->GetValue("postcallback");
+	cb->ExecuteFunction(jsobj, list);
+}
+
+void V8Machine::MemoryRead(unsigned int size, unsigned int handler)
+{
+	if (handler != 0) {
+		unsigned int* p = (unsigned int*)machine->GetParamBuf();
+		CefV8ValueList list;
+		list.push_back(CefV8Value::CreateUInt(p[0]));
+		list.push_back(CefV8Value::CreateUInt(size));
+		const MmioHandler& h = mmioHandlers[handler - 1];
+		if (size > 4) {
+			h.readWide->ExecuteFunction(h.object, list);
+		}
+		else {
+			p[0] = h.read->ExecuteFunction(h.object, list)->GetUIntValue();
+		}
+		return;
+	}
+	switch (size) {
+	case 1:
+		mr1->ExecuteFunction(jscpu, empty_arg_list);
+		break;
+	case 2:
+		mr2->ExecuteFunction(jscpu, empty_arg_list);
+		break;
+	case 4:
+		mr4->ExecuteFunction(jscpu, empty_arg_list);
+		break;
+	case 8:
+		mr8->ExecuteFunction(jscpu, empty_arg_list);
+		break;
+	case 16:
+		mr16->ExecuteFunction(jscpu, empty_arg_list);
+		break;
+	}
+}
+
+void V8Machine::MemoryWrite(unsigned int size, unsigned int handler)
+{
+	if (handler != 0) {
+		unsigned int* p = (unsigned int*)machine->GetParamBuf();
+		CefV8ValueList list;
+		list.push_back(CefV8Value::CreateUInt(p[0]));
+		list.push_back(CefV8Value::CreateUInt(size));
+		const MmioHandler& h = mmioHandlers[handler - 1];
+		if (size > 4) {
+			h.writeWide->ExecuteFunction(h.object, list);
+		}
+		else {
+			list.push_back(CefV8Value::CreateUInt(p[1]));
+			h.write->ExecuteFunction(h.object, list);
+		}
+		return;
+	}
+	switch (size) {
+	case 1:
+		mw1->ExecuteFunction(jscpu, empty_arg_list);
+		break;
+	case 2:
+		mw2->ExecuteFunction(jscpu, empty_arg_list);
+		break;
+	case 4:
+		mw4->ExecuteFunction(jscpu, empty_arg_list);
+		break;
+	case 8:
+		mw8->ExecuteFunction(jscpu, empty_arg_list);
+		break;
+	case 16:
+		mw16->ExecuteFunction(jscpu, empty_arg_list);
+		break;
+	}
+}
+
+void V8Machine::Cpuid(const unsigned int in[4], unsigned int out[4])
+{
+	CefV8ValueList list;
+	list.push_back(CefV8Value::CreateUInt(in[0]));
+	list.push_back(CefV8Value::CreateUInt(in[1]));
+	list.push_back(CefV8Value::CreateUInt(in[2]));
+	list.push_back(CefV8Value::CreateUInt(in[3]));
+	CefRefPtr<CefV8Value> cb = jsobj->GetValue("cpuid");
+	CefRefPtr<CefV8Value> retval = cb->ExecuteFunction(jsobj, list);
+
+	for (int i = 0; i < 4; i++) {
+		out[i] = retval->GetValue(i)->GetUIntValue();
+	}
+}
+
+void V8Machine::Irq(unsigned int line, bool level)
+{
+	CefV8ValueList list;
+	list.push_back(CefV8Value::CreateUInt(line));
+	list.push_back(CefV8Value::CreateBool(level));
+	CefRefPtr<CefV8Value> cb = jsobj->GetValue("irqcallback");
+	cb->ExecuteFunction(jsobj, list);
+}
+
+bool V8Machine::Msr(unsigned int index, bool write, unsigned long long* value)
+{
+	// Optional: msrcallback(index, write, low, high) returns [low, high] for reads, true for handled writes
+	CefRefPtr<CefV8Value> cb = jsobj->GetValue("msrcallback");
+	if (cb.get() == NULL || !cb->IsFunction()) {
+		return false;
+	}
+	CefV8ValueList list;
+	list.push_back(CefV8Value::CreateUInt(index));
+	list.push_back(CefV8Value::CreateBool(write));
+	list.push_back(CefV8Value::CreateUInt((UINT32)*value));
+	list.push_back(CefV8Value::CreateUInt((UINT32)(*value >> 32)));
+	CefRefPtr<CefV8Value> retval = cb->ExecuteFunction(jsobj, list);
+	if (retval.get() == NULL || retval->IsUndefined() || retval->IsNull()) {
+		return false;
+	}
+	if (write) {
+		return retval->GetBoolValue();
+	}
+	if (retval->IsArray()) {
+		*value = (unsigned long long)retval->GetValue(1)->GetUIntValue() << 32 | retval->GetValue(0)->GetUIntValue();
+	}
+	else {
+		*value = retval->GetUIntValue();
+	}
+	return true;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "CMachine.h"
+#include "include/cef_app.h"
+#include "include/cef_base.h"
+#include "include/cef_v8.h"
+
+/**
+ * Binds a CMachine to the v86 JavaScript side. This is the user data of the
+ * machine object returned by StartMachine and the DeviceModel the machine
+ * calls into on exits.
+ */
+class V8Machine : public CefBaseRefCounted, public DeviceModel {
+private:
+	std::unique_ptr<CMachine> machine;
+
+	CefRefPtr<CefV8Value> jsobj;
+	CefRefPtr<CefV8Value> mw1, mw2, mw4, mr1, mr2, mr4, jscpu;
+	CefRefPtr<CefV8Value> mw8, mw16, mr8, mr16;  // Optional, see SetWideMemory
+	CefRefPtr<CefV8Value> ioCallback;
+	CefV8ValueList empty_arg_list;
+
+	/** A device's own MMIO functions, see RegisterMmioHandler */
+	struct MmioHandler {
+		CefRefPtr<CefV8Value> object, read, write;
+		CefRefPtr<CefV8Value> readWide, writeWide;  // Optional
+	};
+	std::vector<MmioHandler> mmioHandlers;  // Handler n at n - 1
+
+	CefRefPtr<CefV8Value> getIOCallback()
+	{
+		if (ioCallback.get() == NULL) {
+			ioCallback = jsobj->GetValue("iocallback");
+		}
+		return ioCallback;
+	}
+
+public:
+	V8Machine(size_t sz, CefRefPtr<CefV8Value> cpu, CefRefPtr<CefV8Value> mw1, CefRefPtr<CefV8Value> mw2, CefRefPtr<CefV8Value> mw4, CefRefPtr<CefV8Value> mr1, CefRefPtr<CefV8Value> mr2, CefRefPtr<CefV8Value> mr4, UINT32 processorCount = 1, bool largePages = false, const std::string& snapshotPath = std::string());
+
+	CMachine* getMachine() { return machine.get(); }
+
+	void SetJSObject(CefRefPtr<CefV8Value> pJsobj)
+	{
+		jsobj = pJsobj;
+	}
+
+	/** Runs the machine for up to the given time (ms) and publishes the counters on the JS object */
+	CefRefPtr<CefV8Value> run(double milliseconds);
+
+	/** Answers the device calls of a started machine for up to the given time (ms), see CMachine::start */
+	CefRefPtr<CefV8Value> service(double milliseconds);
+
+	/**
+	 * Returns the handler number for a JS object with read(offset, size) and
+	 * write(offset, size, value) functions, to pass to CMachine::unmap. The
+	 * same object always gets the same number
+	 */
+	UINT32 RegisterMmioHandler(CefRefPtr<CefV8Value> handler);
+
+	/**
+	 * Sets the generic functions for 8 and 16 byte MMIO accesses, called like
+	 * mr1 and friends with the data in the 64-bit parameter slots (see
+	 * DeviceModel.h). Without them such accesses are split into 4 byte ones
+	 */
+	void SetWideMemory(CefRefPtr<CefV8Value> mr8, CefRefPtr<CefV8Value> mw8,
+		CefRefPtr<CefV8Value> mr16, CefRefPtr<CefV8Value> mw16);
+
+	/**
+	 * Adds CPUID table entries given as [leaf, subleaf, eax, ebx, ecx, edx,
+	 * flags] arrays (flags optional, see CpuidFlags), or replaces the table
+	 */
+	void SetCpuid(CefRefPtr<CefV8Value> entries, bool replace);
+
+	// DeviceModel methods:
+	void PortIo() override;
+	void PortIoString() override;
+	void PortWrites(unsigned int count) override;
+	void MemoryRead(unsigned int size, unsigned int handler) override;
+	void MemoryWrite(unsigned int size, unsigned int handler) override;
+	void Cpuid(const unsigned int in[4], unsigned int out[4]) override;
+	void Irq(unsigned int line, bool level) override;
+	bool Msr(unsigned int index, bool write, unsigned long long* value) override;
+
+	IMPLEMENT_REFCOUNTING(V8Machine);
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+#include "Counter.h"
+#include "MsrStore.h"
+#include "RegisterCache.h"
+
+enum VirtualProcessorState {
+	VpWaitForSipi,  // Application processor not started yet (or INIT received)
+	VpRunning,
+	VpStopped       // Failed, see CMachine's SMP error
+};
+
+/**
+ * Per virtual processor state of an SMP machine. The bootstrap processor
+ * (index 0) runs in CMachine::run() on the caller's thread, or on the
+ * processor thread after CMachine::start(); each application processor has a
+ * thread of its own. Exits of an application processor that need the devices
+ * are handed to the bootstrap processor's thread (see
+ * CMachine::ServiceProcessors), so device calls take the same path for all
+ * processors: direct callbacks from run(), or the exit ring once started.
+ *
+ * The fields below the registers are guarded by CMachine's SMP mutex.
+ */
+struct VirtualProcessor {
+	UINT32 index;
+	RegisterCache registers;
+	MsrStore msrs;
+	std::thread thread;
+	std::atomic<bool> exited;
+
+	VirtualProcessorState state;
+	bool initPending = false;  // INIT received while running
+	bool exitPending = false;  // exit is waiting to be handled on the device thread
+	WHV_RUN_VP_EXIT_CONTEXT exit;
+	Counter exitCounter;  // Read by JS
+
+	VirtualProcessor(HvBackend* backend, UINT32 index)
+		: index(index), registers(backend, index), exited(false),
+		state(index == 0 ? VpRunning : VpWaitForSipi)
+	{
+		memset(&exit, 0x0, sizeof(exit));
+	}
+};
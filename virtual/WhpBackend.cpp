@@ -0,0 +1,132 @@
+#include "WhpBackend.h"
+
+#include <stdexcept>
+
+WhpBackend::WhpBackend()
+{
+	// Initialize the instruction emulator and callbacks
+	WHV_EMULATOR_CALLBACKS callbacks;
+	memset(&callbacks, 0x0, sizeof(callbacks));
+	callbacks.Size = sizeof(callbacks);
+	callbacks.WHvEmulatorGetVirtualProcessorRegisters = &GetVirtualRegisters;
+	callbacks.WHvEmulatorIoPortCallback = &IoPortCallback;
+	callbacks.WHvEmulatorMemoryCallback = &MemoryCallback;
+	callbacks.WHvEmulatorSetVirtualProcessorRegisters = &SetVirtualRegisters;
+	callbacks.WHvEmulatorTranslateGvaPage = &TranslateRange;
+
+	HRESULT hr = WHvEmulatorCreateEmulator(&callbacks, &emulatorHandle);
+	if (hr != S_OK) {
+		throw std::runtime_error("Couldn't create emulator!");
+	}
+
+	hr = WHvCreatePartition(&partitionHandle);
+	if (hr != S_OK) {
+		WHvEmulatorDestroyEmulator(emulatorHandle);
+		throw std::runtime_error("Couldn't create partition!");
+	}
+}
+
+WhpBackend::~WhpBackend()
+{
+	WHvDeletePartition(partitionHandle);
+	WHvEmulatorDestroyEmulator(emulatorHandle);
+}
+
+HRESULT WhpBackend::SetPartitionProperty(WHV_PARTITION_PROPERTY_CODE PropertyCode,
+	const VOID* PropertyBuffer,
+	UINT32 PropertyBufferSizeInBytes)
+{
+	return WHvSetPartitionProperty(partitionHandle, PropertyCode, PropertyBuffer,
+		PropertyBufferSizeInBytes);
+}
+
+HRESULT WhpBackend::SetupPartition()
+{
+	return WHvSetupPartition(partitionHandle);
+}
+
+HRESULT WhpBackend::MapGpaRange(VOID* SourceAddress,
+	WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+	UINT64 SizeInBytes,
+	WHV_MAP_GPA_RANGE_FLAGS Flags)
+{
+	return WHvMapGpaRange(partitionHandle, SourceAddress, GuestAddress, SizeInBytes, Flags);
+}
+
+HRESULT WhpBackend::UnmapGpaRange(WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+	UINT64 SizeInBytes)
+{
+	return WHvUnmapGpaRange(partitionHandle, GuestAddress, SizeInBytes);
+}
+
+HRESULT WhpBackend::QueryGpaRangeDirtyBitmap(WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+	UINT64 RangeSizeInBytes,
+	UINT64* Bitmap,
+	UINT32 BitmapSizeInBytes)
+{
+	return WHvQueryGpaRangeDirtyBitmap(partitionHandle, GuestAddress, RangeSizeInBytes,
+		Bitmap, BitmapSizeInBytes);
+}
+
+HRESULT WhpBackend::CreateVirtualProcessor(UINT32 VpIndex)
+{
+	return WHvCreateVirtualProcessor(partitionHandle, VpIndex, 0);
+}
+
+HRESULT WhpBackend::GetVirtualProcessorRegisters(UINT32 VpIndex,
+	const WHV_REGISTER_NAME* RegisterNames,
+	UINT32 RegisterCount,
+	WHV_REGISTER_VALUE* RegisterValues)
+{
+	return WHvGetVirtualProcessorRegisters(partitionHandle, VpIndex, RegisterNames,
+		RegisterCount, RegisterValues);
+}
+
+HRESULT WhpBackend::SetVirtualProcessorRegisters(UINT32 VpIndex,
+	const WHV_REGISTER_NAME* RegisterNames,
+	UINT32 RegisterCount,
+	const WHV_REGISTER_VALUE* RegisterValues)
+{
+	return WHvSetVirtualProcessorRegisters(partitionHandle, VpIndex, RegisterNames,
+		RegisterCount, RegisterValues);
+}
+
+HRESULT WhpBackend::RunVirtualProcessor(UINT32 VpIndex,
+	WHV_RUN_VP_EXIT_CONTEXT* ExitContext)
+{
+	return WHvRunVirtualProcessor(partitionHandle, VpIndex, ExitContext,
+		sizeof(WHV_RUN_VP_EXIT_CONTEXT));
+}
+
+HRESULT WhpBackend::CancelRunVirtualProcessor(UINT32 VpIndex)
+{
+	return WHvCancelRunVirtualProcessor(partitionHandle, VpIndex, 0);
+}
+
+HRESULT WhpBackend::TranslateGva(UINT32 VpIndex,
+	WHV_GUEST_VIRTUAL_ADDRESS Gva,
+	WHV_TRANSLATE_GVA_FLAGS TranslateFlags,
+	WHV_TRANSLATE_GVA_RESULT* TranslationResult,
+	WHV_GUEST_PHYSICAL_ADDRESS* Gpa)
+{
+	return WHvTranslateGva(partitionHandle, VpIndex, Gva, TranslateFlags,
+		TranslationResult, Gpa);
+}
+
+HRESULT WhpBackend::EmulatorTryIoEmulation(VOID* Context,
+	const WHV_VP_EXIT_CONTEXT* VpContext,
+	const WHV_X64_IO_PORT_ACCESS_CONTEXT* IoInstructionContext,
+	WHV_EMULATOR_STATUS* EmulatorReturnStatus)
+{
+	return WHvEmulatorTryIoEmulation(emulatorHandle, Context, VpContext,
+		IoInstructionContext, EmulatorReturnStatus);
+}
+
+HRESULT WhpBackend::EmulatorTryMmioEmulation(VOID* Context,
+	const WHV_VP_EXIT_CONTEXT* VpContext,
+	const WHV_MEMORY_ACCESS_CONTEXT* MmioInstructionContext,
+	WHV_EMULATOR_STATUS* EmulatorReturnStatus)
+{
+	return WHvEmulatorTryMmioEmulation(emulatorHandle, Context, VpContext,
+		MmioInstructionContext, EmulatorReturnStatus);
+}
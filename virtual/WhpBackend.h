@@ -0,0 +1,66 @@
+#pragma once
+
+#include "HvBackend.h"
+
+/** HvBackend on top of the Windows Hypervisor Platform API */
+class WhpBackend : public HvBackend {
+private:
+	WHV_PARTITION_HANDLE partitionHandle;
+	WHV_EMULATOR_HANDLE emulatorHandle;
+
+public:
+	WhpBackend();
+	virtual ~WhpBackend();
+
+	HRESULT SetPartitionProperty(WHV_PARTITION_PROPERTY_CODE PropertyCode,
+		const VOID* PropertyBuffer,
+		UINT32 PropertyBufferSizeInBytes) override;
+
+	HRESULT SetupPartition() override;
+
+	HRESULT MapGpaRange(VOID* SourceAddress,
+		WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+		UINT64 SizeInBytes,
+		WHV_MAP_GPA_RANGE_FLAGS Flags) override;
+
+	HRESULT UnmapGpaRange(WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+		UINT64 SizeInBytes) override;
+
+	HRESULT QueryGpaRangeDirtyBitmap(WHV_GUEST_PHYSICAL_ADDRESS GuestAddress,
+		UINT64 RangeSizeInBytes,
+		UINT64* Bitmap,
+		UINT32 BitmapSizeInBytes) override;
+
+	HRESULT CreateVirtualProcessor(UINT32 VpIndex) override;
+
+	HRESULT GetVirtualProcessorRegisters(UINT32 VpIndex,
+		const WHV_REGISTER_NAME* RegisterNames,
+		UINT32 RegisterCount,
+		WHV_REGISTER_VALUE* RegisterValues) override;
+
+	HRESULT SetVirtualProcessorRegisters(UINT32 VpIndex,
+		const WHV_REGISTER_NAME* RegisterNames,
+		UINT32 RegisterCount,
+		const WHV_REGISTER_VALUE* RegisterValues) override;
+
+	HRESULT RunVirtualProcessor(UINT32 VpIndex,
+		WHV_RUN_VP_EXIT_CONTEXT* ExitContext) override;
+
+	HRESULT CancelRunVirtualProcessor(UINT32 VpIndex) override;
+
+	HRESULT TranslateGva(UINT32 VpIndex,
+		WHV_GUEST_VIRTUAL_ADDRESS Gva,
+		WHV_TRANSLATE_GVA_FLAGS TranslateFlags,
+		WHV_TRANSLATE_GVA_RESULT* TranslationResult,
+		WHV_GUEST_PHYSICAL_ADDRESS* Gpa) override;
+
+	HRESULT EmulatorTryIoEmulation(VOID* Context,
+		const WHV_VP_EXIT_CONTEXT* VpContext,
+		const WHV_X64_IO_PORT_ACCESS_CONTEXT* IoInstructionContext,
+		WHV_EMULATOR_STATUS* EmulatorReturnStatus) override;
+
+	HRESULT EmulatorTryMmioEmulation(VOID* Context,
+		const WHV_VP_EXIT_CONTEXT* VpContext,
+		const WHV_MEMORY_ACCESS_CONTEXT* MmioInstructionContext,
+		WHV_EMULATOR_STATUS* EmulatorReturnStatus) override;
+};
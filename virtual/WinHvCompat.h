@@ -0,0 +1,506 @@
+#pragma once
+
+// Windows Hypervisor Platform types.
+//
+// On Windows this simply pulls in the SDK headers. Elsewhere it provides the
+// subset of the WinHvPlatformDefs.h / WinHvEmulation.h type definitions used
+// by CMachine, with the same names and layout, so that the machine core and
+// the mock backend build on machines without the Hypervisor Platform (e.g.
+// for benchmarking the exit dispatch code on Linux). Only types are defined
+// here - the WHv* functions themselves are only ever called by WhpBackend.
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <WinHvEmulation.h>
+#include <WinHvPlatform.h>
+
+#else
+
+#include <stdint.h>
+
+typedef void VOID;
+typedef int BOOL;
+typedef void* HANDLE;
+typedef int32_t HRESULT;
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef unsigned int UINT32;
+typedef unsigned long long UINT64;
+typedef unsigned long DWORD;
+
+#define S_OK ((HRESULT)0)
+#define E_NOTIMPL ((HRESULT)0x80004001L)
+#define E_FAIL ((HRESULT)0x80004005L)
+#define E_INVALIDARG ((HRESULT)0x80070057L)
+#define E_OUTOFMEMORY ((HRESULT)0x8007000EL)
+
+#define WHV_ALIGNED(x) __attribute__((aligned(x)))
+
+typedef VOID* WHV_PARTITION_HANDLE;
+typedef VOID* WHV_EMULATOR_HANDLE;
+typedef UINT64 WHV_GUEST_PHYSICAL_ADDRESS;
+typedef UINT64 WHV_GUEST_VIRTUAL_ADDRESS;
+
+typedef enum WHV_PARTITION_PROPERTY_CODE {
+	WHvPartitionPropertyCodeExtendedVmExits = 0x00000001,
+	WHvPartitionPropertyCodeExceptionExitBitmap = 0x00000002,
+	WHvPartitionPropertyCodeSeparateSecurityDomain = 0x00000003,
+	WHvPartitionPropertyCodeProcessorFeatures = 0x00001001,
+	WHvPartitionPropertyCodeProcessorClFlushSize = 0x00001002,
+	WHvPartitionPropertyCodeCpuidExitList = 0x00001003,
+	WHvPartitionPropertyCodeCpuidResultList = 0x00001004,
+	WHvPartitionPropertyCodeLocalApicEmulationMode = 0x00001005,
+	WHvPartitionPropertyCodeProcessorXsaveFeatures = 0x00001006,
+	WHvPartitionPropertyCodeProcessorClockFrequency = 0x00001007,
+	WHvPartitionPropertyCodeInterruptClockFrequency = 0x00001008,
+	WHvPartitionPropertyCodeApicRemoteReadSupport = 0x00001009,
+	WHvPartitionPropertyCodeProcessorCount = 0x00001fff
+} WHV_PARTITION_PROPERTY_CODE;
+
+typedef union WHV_EXTENDED_VM_EXITS {
+	struct {
+		UINT64 X64CpuidExit : 1;
+		UINT64 X64MsrExit : 1;
+		UINT64 ExceptionExit : 1;
+		UINT64 X64RdtscExit : 1;
+		UINT64 X64ApicSmiExitTrap : 1;
+		UINT64 HypercallExit : 1;
+		UINT64 X64ApicInitSipiExitTrap : 1;
+		UINT64 Reserved : 57;
+	};
+	UINT64 AsUINT64;
+} WHV_EXTENDED_VM_EXITS;
+
+typedef enum WHV_X64_LOCAL_APIC_EMULATION_MODE {
+	WHvX64LocalApicEmulationModeNone,
+	WHvX64LocalApicEmulationModeXApic
+} WHV_X64_LOCAL_APIC_EMULATION_MODE;
+
+typedef union WHV_PARTITION_PROPERTY {
+	WHV_EXTENDED_VM_EXITS ExtendedVmExits;
+	UINT64 ExceptionExitBitmap;
+	BOOL SeparateSecurityDomain;
+	UINT32 ProcessorClFlushSize;
+	UINT32 CpuidExitList[1];
+	WHV_X64_LOCAL_APIC_EMULATION_MODE LocalApicEmulationMode;
+	UINT64 ProcessorClockFrequency;
+	UINT64 InterruptClockFrequency;
+	UINT32 ProcessorCount;
+	UINT64 Padding[8];
+} WHV_PARTITION_PROPERTY;
+
+typedef enum WHV_MAP_GPA_RANGE_FLAGS {
+	WHvMapGpaRangeFlagNone = 0x00000000,
+	WHvMapGpaRangeFlagRead = 0x00000001,
+	WHvMapGpaRangeFlagWrite = 0x00000002,
+	WHvMapGpaRangeFlagExecute = 0x00000004,
+	WHvMapGpaRangeFlagTrackDirtyPages = 0x00000008
+} WHV_MAP_GPA_RANGE_FLAGS;
+
+inline WHV_MAP_GPA_RANGE_FLAGS operator|(WHV_MAP_GPA_RANGE_FLAGS a, WHV_MAP_GPA_RANGE_FLAGS b)
+{
+	return (WHV_MAP_GPA_RANGE_FLAGS)((UINT32)a | (UINT32)b);
+}
+
+typedef enum WHV_TRANSLATE_GVA_FLAGS {
+	WHvTranslateGvaFlagNone = 0x00000000,
+	WHvTranslateGvaFlagValidateRead = 0x00000001,
+	WHvTranslateGvaFlagValidateWrite = 0x00000002,
+	WHvTranslateGvaFlagValidateExecute = 0x00000004,
+	WHvTranslateGvaFlagPrivilegeExempt = 0x00000008,
+	WHvTranslateGvaFlagSetPageTableBits = 0x00000010
+} WHV_TRANSLATE_GVA_FLAGS;
+
+typedef enum WHV_TRANSLATE_GVA_RESULT_CODE {
+	WHvTranslateGvaResultSuccess = 0,
+	WHvTranslateGvaResultPageNotPresent = 1,
+	WHvTranslateGvaResultPrivilegeViolation = 2,
+	WHvTranslateGvaResultInvalidPageTableFlags = 3,
+	WHvTranslateGvaResultGpaUnmapped = 4,
+	WHvTranslateGvaResultGpaNoReadAccess = 5,
+	WHvTranslateGvaResultGpaNoWriteAccess = 6,
+	WHvTranslateGvaResultGpaIllegalOverlayAccess = 7,
+	WHvTranslateGvaResultIntercept = 8
+} WHV_TRANSLATE_GVA_RESULT_CODE;
+
+typedef struct WHV_TRANSLATE_GVA_RESULT {
+	WHV_TRANSLATE_GVA_RESULT_CODE ResultCode;
+	UINT32 Reserved;
+} WHV_TRANSLATE_GVA_RESULT;
+
+typedef enum WHV_REGISTER_NAME {
+	// X64 General purpose registers
+	WHvX64RegisterRax = 0x00000000,
+	WHvX64RegisterRcx = 0x00000001,
+	WHvX64RegisterRdx = 0x00000002,
+	WHvX64RegisterRbx = 0x00000003,
+	WHvX64RegisterRsp = 0x00000004,
+	WHvX64RegisterRbp = 0x00000005,
+	WHvX64RegisterRsi = 0x00000006,
+	WHvX64RegisterRdi = 0x00000007,
+	WHvX64RegisterR8 = 0x00000008,
+	WHvX64RegisterR9 = 0x00000009,
+	WHvX64RegisterR10 = 0x0000000A,
+	WHvX64RegisterR11 = 0x0000000B,
+	WHvX64RegisterR12 = 0x0000000C,
+	WHvX64RegisterR13 = 0x0000000D,
+	WHvX64RegisterR14 = 0x0000000E,
+	WHvX64RegisterR15 = 0x0000000F,
+	WHvX64RegisterRip = 0x00000010,
+	WHvX64RegisterRflags = 0x00000011,
+
+	// X64 Segment registers
+	WHvX64RegisterEs = 0x00000012,
+	WHvX64RegisterCs = 0x00000013,
+	WHvX64RegisterSs = 0x00000014,
+	WHvX64RegisterDs = 0x00000015,
+	WHvX64RegisterFs = 0x00000016,
+	WHvX64RegisterGs = 0x00000017,
+	WHvX64RegisterLdtr = 0x00000018,
+	WHvX64RegisterTr = 0x00000019,
+
+	// X64 Table registers
+	WHvX64RegisterIdtr = 0x0000001A,
+	WHvX64RegisterGdtr = 0x0000001B,
+
+	// X64 Control Registers
+	WHvX64RegisterCr0 = 0x0000001C,
+	WHvX64RegisterCr2 = 0x0000001D,
+	WHvX64RegisterCr3 = 0x0000001E,
+	WHvX64RegisterCr4 = 0x0000001F,
+	WHvX64RegisterCr8 = 0x00000020,
+
+	// X64 Debug Registers
+	WHvX64RegisterDr0 = 0x00000021,
+	WHvX64RegisterDr1 = 0x00000022,
+	WHvX64RegisterDr2 = 0x00000023,
+	WHvX64RegisterDr3 = 0x00000024,
+	WHvX64RegisterDr6 = 0x00000025,
+	WHvX64RegisterDr7 = 0x00000026,
+
+	// X64 Extended Control Registers
+	WHvX64RegisterXCr0 = 0x00000027,
+
+	// X64 Floating Point and Vector Registers
+	WHvX64RegisterXmm0 = 0x00001000,
+	WHvX64RegisterXmm15 = 0x0000100F,
+	WHvX64RegisterFpMmx0 = 0x00001010,
+	WHvX64RegisterFpMmx7 = 0x00001017,
+	WHvX64RegisterFpControlStatus = 0x00001018,
+	WHvX64RegisterXmmControlStatus = 0x00001019,
+
+	// X64 MSRs
+	WHvX64RegisterTsc = 0x00002000,
+	WHvX64RegisterEfer = 0x00002001,
+	WHvX64RegisterKernelGsBase = 0x00002002,
+	WHvX64RegisterApicBase = 0x00002003,
+	WHvX64RegisterPat = 0x00002004,
+	WHvX64RegisterSysenterCs = 0x00002005,
+	WHvX64RegisterSysenterEip = 0x00002006,
+	WHvX64RegisterSysenterEsp = 0x00002007,
+	WHvX64RegisterStar = 0x00002008,
+	WHvX64RegisterLstar = 0x00002009,
+	WHvX64RegisterCstar = 0x0000200A,
+	WHvX64RegisterSfmask = 0x0000200B,
+	WHvX64RegisterMsrMtrrCap = 0x0000200D,
+	WHvX64RegisterMsrMtrrDefType = 0x0000200E,
+	WHvX64RegisterMsrMtrrPhysBase0 = 0x00002010,
+	WHvX64RegisterMsrMtrrPhysMask0 = 0x00002040,
+	WHvX64RegisterMsrMtrrFix64k00000 = 0x00002070,
+	WHvX64RegisterTscAux = 0x0000207D,
+
+	// Interrupt / Event Registers
+	WHvRegisterPendingInterruption = 0x80000000,
+	WHvRegisterInterruptState = 0x80000001,
+	WHvRegisterPendingEvent = 0x80000002,
+	WHvX64RegisterDeliverabilityNotifications = 0x80000004,
+	WHvRegisterInternalActivityState = 0x80000005
+} WHV_REGISTER_NAME;
+
+typedef union WHV_ALIGNED(16) WHV_UINT128 {
+	struct {
+		UINT64 Low64;
+		UINT64 High64;
+	};
+	UINT32 Dword[4];
+} WHV_UINT128;
+
+typedef struct WHV_X64_SEGMENT_REGISTER {
+	UINT64 Base;
+	UINT32 Limit;
+	UINT16 Selector;
+	union {
+		struct {
+			UINT16 SegmentType : 4;
+			UINT16 NonSystemSegment : 1;
+			UINT16 DescriptorPrivilegeLevel : 2;
+			UINT16 Present : 1;
+			UINT16 Reserved : 4;
+			UINT16 Available : 1;
+			UINT16 Long : 1;
+			UINT16 Default : 1;
+			UINT16 Granularity : 1;
+		};
+		UINT16 Attributes;
+	};
+} WHV_X64_SEGMENT_REGISTER;
+
+typedef struct WHV_X64_TABLE_REGISTER {
+	UINT16 Pad[3];
+	UINT16 Limit;
+	UINT64 Base;
+} WHV_X64_TABLE_REGISTER;
+
+typedef union WHV_X64_INTERRUPT_STATE_REGISTER {
+	struct {
+		UINT64 InterruptShadow : 1;
+		UINT64 NmiMasked : 1;
+		UINT64 Reserved : 62;
+	};
+	UINT64 AsUINT64;
+} WHV_X64_INTERRUPT_STATE_REGISTER;
+
+typedef enum WHV_X64_PENDING_INTERRUPTION_TYPE {
+	WHvX64PendingInterrupt = 0,
+	WHvX64PendingNmi = 2,
+	WHvX64PendingException = 3
+} WHV_X64_PENDING_INTERRUPTION_TYPE;
+
+typedef union WHV_X64_PENDING_INTERRUPTION_REGISTER {
+	struct {
+		UINT32 InterruptionPending : 1;
+		UINT32 InterruptionType : 3;
+		UINT32 DeliverErrorCode : 1;
+		UINT32 InstructionLength : 4;
+		UINT32 NestedEvent : 1;
+		UINT32 Reserved : 6;
+		UINT32 InterruptionVector : 16;
+		UINT32 ErrorCode;
+	};
+	UINT64 AsUINT64;
+} WHV_X64_PENDING_INTERRUPTION_REGISTER;
+
+typedef union WHV_X64_DELIVERABILITY_NOTIFICATIONS_REGISTER {
+	struct {
+		UINT64 NmiNotification : 1;
+		UINT64 InterruptNotification : 1;
+		UINT64 InterruptPriority : 4;
+		UINT64 Reserved : 58;
+	};
+	UINT64 AsUINT64;
+} WHV_X64_DELIVERABILITY_NOTIFICATIONS_REGISTER;
+
+typedef union WHV_ALIGNED(16) WHV_REGISTER_VALUE {
+	WHV_UINT128 Reg128;
+	UINT64 Reg64;
+	UINT32 Reg32;
+	UINT16 Reg16;
+	UINT8 Reg8;
+	WHV_X64_SEGMENT_REGISTER Segment;
+	WHV_X64_TABLE_REGISTER Table;
+	WHV_X64_INTERRUPT_STATE_REGISTER InterruptState;
+	WHV_X64_PENDING_INTERRUPTION_REGISTER PendingInterruption;
+	WHV_X64_DELIVERABILITY_NOTIFICATIONS_REGISTER DeliverabilityNotifications;
+} WHV_REGISTER_VALUE;
+
+typedef enum WHV_RUN_VP_EXIT_REASON {
+	WHvRunVpExitReasonNone = 0x00000000,
+
+	// Standard exits caused by operations of the virtual processor
+	WHvRunVpExitReasonMemoryAccess = 0x00000001,
+	WHvRunVpExitReasonX64IoPortAccess = 0x00000002,
+	WHvRunVpExitReasonUnrecoverableException = 0x00000004,
+	WHvRunVpExitReasonInvalidVpRegisterValue = 0x00000005,
+	WHvRunVpExitReasonUnsupportedFeature = 0x00000006,
+	WHvRunVpExitReasonX64InterruptWindow = 0x00000007,
+	WHvRunVpExitReasonX64Halt = 0x00000008,
+	WHvRunVpExitReasonX64ApicEoi = 0x00000009,
+
+	// Additional exits that can be configured through partition properties
+	WHvRunVpExitReasonX64MsrAccess = 0x00001000,
+	WHvRunVpExitReasonX64Cpuid = 0x00001001,
+	WHvRunVpExitReasonException = 0x00001002,
+	WHvRunVpExitReasonX64Rdtsc = 0x00001003,
+	WHvRunVpExitReasonX64ApicSmiTrap = 0x00001004,
+	WHvRunVpExitReasonHypercall = 0x00001005,
+	WHvRunVpExitReasonX64ApicInitSipiTrap = 0x00001006,
+
+	// Exits caused by the host
+	WHvRunVpExitReasonCanceled = 0x00002001
+} WHV_RUN_VP_EXIT_REASON;
+
+typedef union WHV_X64_VP_EXECUTION_STATE {
+	struct {
+		UINT16 Cpl : 2;
+		UINT16 Cr0Pe : 1;
+		UINT16 Cr0Am : 1;
+		UINT16 EferLma : 1;
+		UINT16 DebugActive : 1;
+		UINT16 InterruptionPending : 1;
+		UINT16 Reserved0 : 5;
+		UINT16 InterruptShadow : 1;
+		UINT16 Reserved1 : 3;
+	};
+	UINT16 AsUINT16;
+} WHV_X64_VP_EXECUTION_STATE;
+
+typedef struct WHV_VP_EXIT_CONTEXT {
+	WHV_X64_VP_EXECUTION_STATE ExecutionState;
+	UINT8 InstructionLength : 4;
+	UINT8 Cr8 : 4;
+	UINT8 Reserved;
+	UINT32 Reserved2;
+	WHV_X64_SEGMENT_REGISTER Cs;
+	UINT64 Rip;
+	UINT64 Rflags;
+} WHV_VP_EXIT_CONTEXT;
+
+typedef enum WHV_MEMORY_ACCESS_TYPE {
+	WHvMemoryAccessRead = 0,
+	WHvMemoryAccessWrite = 1,
+	WHvMemoryAccessExecute = 2
+} WHV_MEMORY_ACCESS_TYPE;
+
+typedef union WHV_MEMORY_ACCESS_INFO {
+	struct {
+		UINT32 AccessType : 2;
+		UINT32 GpaUnmapped : 1;
+		UINT32 GvaValid : 1;
+		UINT32 Reserved : 28;
+	};
+	UINT32 AsUINT32;
+} WHV_MEMORY_ACCESS_INFO;
+
+typedef struct WHV_MEMORY_ACCESS_CONTEXT {
+	UINT8 InstructionByteCount;
+	UINT8 Reserved[3];
+	UINT8 InstructionBytes[16];
+	WHV_MEMORY_ACCESS_INFO AccessInfo;
+	WHV_GUEST_PHYSICAL_ADDRESS Gpa;
+	WHV_GUEST_VIRTUAL_ADDRESS Gva;
+} WHV_MEMORY_ACCESS_CONTEXT;
+
+typedef union WHV_X64_IO_PORT_ACCESS_INFO {
+	struct {
+		UINT32 IsWrite : 1;
+		UINT32 AccessSize : 3;
+		UINT32 StringOp : 1;
+		UINT32 RepPrefix : 1;
+		UINT32 Reserved : 26;
+	};
+	UINT32 AsUINT32;
+} WHV_X64_IO_PORT_ACCESS_INFO;
+
+typedef struct WHV_X64_IO_PORT_ACCESS_CONTEXT {
+	UINT8 InstructionByteCount;
+	UINT8 Reserved[3];
+	UINT8 InstructionBytes[16];
+	WHV_X64_IO_PORT_ACCESS_INFO AccessInfo;
+	UINT16 PortNumber;
+	UINT16 Reserved2[3];
+	UINT64 Rax;
+	UINT64 Rcx;
+	UINT64 Rsi;
+	UINT64 Rdi;
+	WHV_X64_SEGMENT_REGISTER Ds;
+	WHV_X64_SEGMENT_REGISTER Es;
+} WHV_X64_IO_PORT_ACCESS_CONTEXT;
+
+typedef union WHV_X64_MSR_ACCESS_INFO {
+	struct {
+		UINT32 IsWrite : 1;
+		UINT32 Reserved : 31;
+	};
+	UINT32 AsUINT32;
+} WHV_X64_MSR_ACCESS_INFO;
+
+typedef struct WHV_X64_MSR_ACCESS_CONTEXT {
+	WHV_X64_MSR_ACCESS_INFO AccessInfo;
+	UINT32 MsrNumber;
+	UINT64 Rax;
+	UINT64 Rdx;
+} WHV_X64_MSR_ACCESS_CONTEXT;
+
+typedef struct WHV_X64_CPUID_ACCESS_CONTEXT {
+	UINT64 Rax;
+	UINT64 Rcx;
+	UINT64 Rdx;
+	UINT64 Rbx;
+	UINT64 DefaultResultRax;
+	UINT64 DefaultResultRcx;
+	UINT64 DefaultResultRdx;
+	UINT64 DefaultResultRbx;
+} WHV_X64_CPUID_ACCESS_CONTEXT;
+
+typedef struct WHV_X64_INTERRUPTION_DELIVERABLE_CONTEXT {
+	WHV_X64_PENDING_INTERRUPTION_TYPE DeliverableType;
+} WHV_X64_INTERRUPTION_DELIVERABLE_CONTEXT;
+
+typedef struct WHV_X64_APIC_EOI_CONTEXT {
+	UINT32 InterruptVector;
+} WHV_X64_APIC_EOI_CONTEXT;
+
+typedef enum WHV_RUN_VP_CANCEL_REASON {
+	WhvRunVpCancelReasonUser = 0
+} WHV_RUN_VP_CANCEL_REASON;
+
+typedef struct WHV_RUN_VP_CANCELED_CONTEXT {
+	WHV_RUN_VP_CANCEL_REASON CancelReason;
+} WHV_RUN_VP_CANCELED_CONTEXT;
+
+typedef struct WHV_X64_APIC_INIT_SIPI_CONTEXT {
+	UINT64 ApicIcr;
+} WHV_X64_APIC_INIT_SIPI_CONTEXT;
+
+typedef struct WHV_RUN_VP_EXIT_CONTEXT {
+	WHV_RUN_VP_EXIT_REASON ExitReason;
+	UINT32 Reserved;
+	WHV_VP_EXIT_CONTEXT VpContext;
+
+	union {
+		WHV_MEMORY_ACCESS_CONTEXT MemoryAccess;
+		WHV_X64_IO_PORT_ACCESS_CONTEXT IoPortAccess;
+		WHV_X64_MSR_ACCESS_CONTEXT MsrAccess;
+		WHV_X64_CPUID_ACCESS_CONTEXT CpuidAccess;
+		WHV_X64_INTERRUPTION_DELIVERABLE_CONTEXT InterruptWindow;
+		WHV_X64_APIC_EOI_CONTEXT ApicEoi;
+		WHV_X64_APIC_INIT_SIPI_CONTEXT ApicInitSipi;
+		WHV_RUN_VP_CANCELED_CONTEXT CancelReason;
+	};
+} WHV_RUN_VP_EXIT_CONTEXT;
+
+// Instruction emulator (WinHvEmulation.h)
+
+typedef struct WHV_EMULATOR_IO_ACCESS_INFO {
+	UINT8 Direction;
+	UINT16 Port;
+	UINT16 AccessSize;
+	UINT32 Data;
+} WHV_EMULATOR_IO_ACCESS_INFO;
+
+typedef struct WHV_EMULATOR_MEMORY_ACCESS_INFO {
+	WHV_GUEST_PHYSICAL_ADDRESS GpaAddress;
+	UINT8 Direction;
+	UINT8 AccessSize;
+	UINT8 Data[8];
+} WHV_EMULATOR_MEMORY_ACCESS_INFO;
+
+typedef union WHV_EMULATOR_STATUS {
+	struct {
+		UINT32 EmulationSuccessful : 1;
+		UINT32 InternalEmulationFailure : 1;
+		UINT32 IoPortCallbackFailed : 1;
+		UINT32 MemoryCallbackFailed : 1;
+		UINT32 TranslateGvaPageCallbackFailed : 1;
+		UINT32 TranslateGvaPageCallbackGpaIsNotAligned : 1;
+		UINT32 GetVirtualProcessorRegistersCallbackFailed : 1;
+		UINT32 SetVirtualProcessorRegistersCallbackFailed : 1;
+		UINT32 InterruptCausedIntercept : 1;
+		UINT32 GuestCannotBeFaulted : 1;
+		UINT32 Reserved : 22;
+	};
+	UINT32 AsUINT32;
+} WHV_EMULATOR_STATUS;
+
+#endif
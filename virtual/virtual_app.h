@@ -5,7 +5,7 @@
 #ifndef CEF_TESTS_CEFVIRTUAL_VIRTUAL_APP_H_
 #define CEF_TESTS_CEFVIRTUAL_VIRTUAL_APP_H_
 
-#include "CMachine.h"
+#include "V8Machine.h"
 #include "include/cef_app.h"
 
 // Implement application-level callbacks for the browser process.
@@ -28,7 +28,7 @@ public:
 		return this;
 	}
 
-#define GETMACHINE(x) ((CMachine*)x->GetUserData().get())
+#define GETMACHINE(x) ((V8Machine*)x->GetUserData().get())
 
 	virtual bool Execute(const CefString& name,
 		CefRefPtr<CefV8Value> object,
@@ -37,17 +37,182 @@ public:
 		CefString& exception) OVERRIDE {
 		try {
 			if (name == "run") {
-				retval = GETMACHINE(object)->run();
+				// Optional argument: time until the next timer event of the JS side (ms)
+				double milliseconds = CMachine::DEFAULT_SLICE_NS / 1000000.0;
+				if (arguments.size() > 0 && (arguments[0]->IsDouble() || arguments[0]->IsInt() || arguments[0]->IsUInt())) {
+					milliseconds = arguments[0]->GetDoubleValue();
+				}
+				retval = GETMACHINE(object)->run(milliseconds);
+				return true;
+			}
+			else if (name == "start") {
+				// Optional argument: time slice of the processor thread (ms)
+				UINT64 slice = CMachine::DEFAULT_SLICE_NS;
+				if (arguments.size() > 0 && (arguments[0]->IsDouble() || arguments[0]->IsInt() || arguments[0]->IsUInt())) {
+					slice = (UINT64)(arguments[0]->GetDoubleValue() * 1000000.0);
+				}
+				GETMACHINE(object)->getMachine()->start(slice);
+				return true;
+			}
+			else if (name == "service") {
+				double milliseconds = 0;
+				if (arguments.size() > 0 && (arguments[0]->IsDouble() || arguments[0]->IsInt() || arguments[0]->IsUInt())) {
+					milliseconds = arguments[0]->GetDoubleValue();
+				}
+				retval = GETMACHINE(object)->service(milliseconds);
+				return true;
+			}
+			else if (name == "stop") {
+				GETMACHINE(object)->getMachine()->stop();
 				return true;
 			}
 			else if (name == "irq") {
-				GETMACHINE(object)->irq(arguments[0]->GetUIntValue());
+				// Optional arguments: priority (higher first) and level triggered
+				unsigned int priority = arguments.size() > 1 ? arguments[1]->GetUIntValue() : 0;
+				bool level = arguments.size() > 2 && arguments[2]->GetBoolValue();
+				GETMACHINE(object)->getMachine()->irq(arguments[0]->GetUIntValue(), priority, level);
 				return true;
 			}
 			else if (name == "unmap") {
 				size_t addr = arguments[0]->GetUIntValue();
 				size_t sz = arguments[1]->GetUIntValue();
-				GETMACHINE(object)->unmap(addr, sz);
+				// Optional: handler object of the region's device
+				UINT32 handler = 0;
+				if (arguments.size() > 2 && arguments[2]->IsObject()) {
+					handler = GETMACHINE(object)->RegisterMmioHandler(arguments[2]);
+				}
+				GETMACHINE(object)->getMachine()->unmap(addr, sz, handler);
+				return true;
+			}
+			else if (name == "remap") {
+				// Array of [address, size, map, optional handler object] operations
+				std::vector<CMachine::GpaOperation> ops;
+				CefRefPtr<CefV8Value> list = arguments[0];
+				for (int i = 0; i < list->GetArrayLength(); i++) {
+					CefRefPtr<CefV8Value> entry = list->GetValue(i);
+					CMachine::GpaOperation op;
+					op.addr = entry->GetValue(0)->GetUIntValue();
+					op.size = entry->GetValue(1)->GetUIntValue();
+					op.map = entry->GetValue(2)->GetBoolValue();
+					op.handler = 0;
+					if (entry->GetArrayLength() > 3 && entry->GetValue(3)->IsObject()) {
+						op.handler = GETMACHINE(object)->RegisterMmioHandler(entry->GetValue(3));
+					}
+					ops.push_back(op);
+				}
+				retval = CefV8Value::CreateUInt(GETMACHINE(object)->getMachine()->remap(ops));
+				return true;
+			}
+			else if (name == "mapdirty") {
+				CMachine* machine = GETMACHINE(object)->getMachine();
+				unsigned int index = machine->mapdirty(arguments[0]->GetUIntValue(), arguments[1]->GetUIntValue());
+				CMachine::DirtyRegion* region = machine->GetDirtyRegion(index);
+
+				CefRefPtr<CefV8Value> obj = CefV8Value::CreateObject(NULL, NULL);
+				obj->SetValue("index", CefV8Value::CreateUInt(index), V8_PROPERTY_ATTRIBUTE_NONE);
+				obj->SetValue("memory", CefV8Value::CreateArrayBuffer(region->pMemory, region->m_sz, this),
+					V8_PROPERTY_ATTRIBUTE_NONE);
+				obj->SetValue("dirty", CefV8Value::CreateArrayBuffer(region->bitmap.data(),
+					region->bitmap.size() * sizeof(UINT64), this), V8_PROPERTY_ATTRIBUTE_NONE);
+				retval = obj;
+				return true;
+			}
+			else if (name == "querydirty") {
+				retval = CefV8Value::CreateUInt(GETMACHINE(object)->getMachine()->querydirty(arguments[0]->GetUIntValue()));
+				return true;
+			}
+			else if (name == "checkpoint") {
+				GETMACHINE(object)->getMachine()->checkpoint(arguments[0]->GetStringValue().ToString());
+				return true;
+			}
+			else if (name == "waitcheckpoint") {
+				GETMACHINE(object)->getMachine()->waitcheckpoint();
+				return true;
+			}
+			else if (name == "restorecheckpoint") {
+				std::vector<std::string> paths;
+				for (int i = 0; i < arguments[0]->GetArrayLength(); i++) {
+					paths.push_back(arguments[0]->GetValue(i)->GetStringValue().ToString());
+				}
+				GETMACHINE(object)->getMachine()->restorecheckpoint(paths);
+				return true;
+			}
+			else if (name == "markdirty") {
+				GETMACHINE(object)->getMachine()->markdirty(arguments[0]->GetUIntValue(), arguments[1]->GetUIntValue());
+				return true;
+			}
+			else if (name == "setnative") {
+				GETMACHINE(object)->getMachine()->SetNativeDevices(arguments[0]->GetUIntValue());
+				return true;
+			}
+			else if (name == "setposted") {
+				GETMACHINE(object)->getMachine()->SetPostedPorts(arguments[0]->GetUIntValue(),
+					arguments[1]->GetUIntValue(), arguments[2]->GetBoolValue());
+				return true;
+			}
+			else if (name == "setirq") {
+				GETMACHINE(object)->getMachine()->SetIrq(arguments[0]->GetUIntValue(), arguments[1]->GetBoolValue());
+				return true;
+			}
+			else if (name == "setwidemmio") {
+				// mr8, mw8, mr16, mw16; null for sizes that are split into 4 byte accesses
+				CefRefPtr<CefV8Value> functions[4];
+				for (size_t i = 0; i < 4 && i < arguments.size(); i++) {
+					functions[i] = arguments[i];
+				}
+				GETMACHINE(object)->SetWideMemory(functions[0], functions[1], functions[2], functions[3]);
+				return true;
+			}
+			else if (name == "setcpuid") {
+				// Entries, optional: replace the whole table
+				bool replace = arguments.size() > 1 && arguments[1]->GetBoolValue();
+				GETMACHINE(object)->SetCpuid(arguments[0], replace);
+				return true;
+			}
+			else if (name == "setmsr") {
+				// index, low, high
+				UINT64 value = (UINT64)arguments[2]->GetUIntValue() << 32 | arguments[1]->GetUIntValue();
+				GETMACHINE(object)->getMachine()->setmsr(arguments[0]->GetUIntValue(), value);
+				return true;
+			}
+			else if (name == "setstats") {
+				// enable, optional: reset
+				ExitStats& stats = GETMACHINE(object)->getMachine()->GetStats();
+				if (arguments.size() > 1 && arguments[1]->GetBoolValue()) {
+					stats.Reset();
+				}
+				stats.Enable(arguments[0]->GetBoolValue());
+				return true;
+			}
+			else if (name == "publishstats") {
+				GETMACHINE(object)->getMachine()->GetStats().Publish();
+				return true;
+			}
+			else if (name == "dumpstats") {
+				GETMACHINE(object)->getMachine()->GetStats().Dump(arguments[0]->GetStringValue().ToString());
+				return true;
+			}
+			else if (name == "starttrace") {
+				GETMACHINE(object)->getMachine()->StartTrace(arguments[0]->GetStringValue().ToString());
+				return true;
+			}
+			else if (name == "stoptrace") {
+				GETMACHINE(object)->getMachine()->StopTrace();
+				return true;
+			}
+			else if (name == "snapshot") {
+				bool compress = arguments.size() > 1 && arguments[1]->GetBoolValue();
+				GETMACHINE(object)->getMachine()->snapshot(arguments[0]->GetStringValue().ToString(), compress);
+				return true;
+			}
+			else if (name == "snapshotstate") {
+				size_t size = arguments[0]->GetUIntValue();
+				unsigned char* buffer = GETMACHINE(object)->getMachine()->SetSnapshotStateSize(size);
+				retval = CefV8Value::CreateArrayBuffer(buffer, size, this);
+				return true;
+			}
+			else if (name == "seta20") {
+				GETMACHINE(object)->getMachine()->seta20(arguments[0]->GetBoolValue());
 				return true;
 			}
 			else if (name == "StartMachine") {
@@ -59,11 +224,21 @@ public:
 				CefRefPtr<CefV8Value> mr1 = arguments[5];
 				CefRefPtr<CefV8Value> mr2 = arguments[6];
 				CefRefPtr<CefV8Value> mr4 = arguments[7];
+				// Optional: number of virtual processors
+				uint32 processorCount = arguments.size() > 8 ? arguments[8]->GetUIntValue() : 1;
+				// Optional: RAM in large pages
+				bool largePages = arguments.size() > 9 && arguments[9]->GetBoolValue();
+				// Optional: snapshot file to start from
+				std::string snapshotPath;
+				if (arguments.size() > 11 && arguments[11]->IsString()) {
+					snapshotPath = arguments[11]->GetStringValue().ToString();
+				}
 
 				// std::shared_ptr<CMachine> machine = std::make_shared<CMachine>(sz,
 				// cpu, mw1, mw2, mw4, mr1, mr2, mr4);
-				CefRefPtr<CMachine> pMachine = CefRefPtr<CMachine>(
-					new CMachine(memorySize, cpu, mw1, mw2, mw4, mr1, mr2, mr4));
+				CefRefPtr<V8Machine> pMachine = CefRefPtr<V8Machine>(
+					new V8Machine(memorySize, cpu, mw1, mw2, mw4, mr1, mr2, mr4, processorCount, largePages,
+						snapshotPath));
 
 				// Create return object containing refernece to memory, callback
 				// functions etc.
@@ -72,9 +247,25 @@ public:
 				obj->SetUserData(pMachine);
 				pMachine->SetJSObject(obj);
 
+				// Optional: CPUID table, see setcpuid
+				if (arguments.size() > 10 && arguments[10]->IsArray()) {
+					pMachine->SetCpuid(arguments[10], true);
+				}
+
 				CefRefPtr<CefV8Value> memory = CefV8Value::CreateArrayBuffer(
-					pMachine->getMemory(), memorySize, this);
+					pMachine->getMachine()->getMemory(), memorySize, this);
 				obj->SetValue("memory", memory, V8_PROPERTY_ATTRIBUTE_NONE);
+				obj->SetValue("largepages", CefV8Value::CreateBool(pMachine->getMachine()->HasLargePages()),
+					V8_PROPERTY_ATTRIBUTE_NONE);
+				if (pMachine->getMachine()->IsFromSnapshot()) {
+					std::vector<unsigned char>& state = pMachine->getMachine()->GetRestoredState();
+					if (!state.empty()) {
+						obj->SetValue("restoredstate", CefV8Value::CreateArrayBuffer(state.data(), state.size(), this),
+							V8_PROPERTY_ATTRIBUTE_NONE);
+					}
+					obj->SetValue("snapshotmapped", CefV8Value::CreateBool(pMachine->getMachine()->IsSnapshotMapped()),
+						V8_PROPERTY_ATTRIBUTE_NONE);
+				}
 
 				CefRefPtr<CefV8Value> func_run =
 					CefV8Value::CreateFunction("run", this);
@@ -88,9 +279,135 @@ public:
 					CefV8Value::CreateFunction("unmap", this);
 				obj->SetValue("unmap", func_unmap, V8_PROPERTY_ATTRIBUTE_NONE);
 
+				CefRefPtr<CefV8Value> func_remap =
+					CefV8Value::CreateFunction("remap", this);
+				obj->SetValue("remap", func_remap, V8_PROPERTY_ATTRIBUTE_NONE);
+
 				CefRefPtr<CefV8Value> parambuf =
-					CefV8Value::CreateArrayBuffer(pMachine->GetParamBuf(), 4096, this);
+					CefV8Value::CreateArrayBuffer(pMachine->getMachine()->GetParamBuf(), 4096, this);
 				obj->SetValue("parambuf", parambuf, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_mapdirty =
+					CefV8Value::CreateFunction("mapdirty", this);
+				obj->SetValue("mapdirty", func_mapdirty, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_querydirty =
+					CefV8Value::CreateFunction("querydirty", this);
+				obj->SetValue("querydirty", func_querydirty, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_checkpoint =
+					CefV8Value::CreateFunction("checkpoint", this);
+				obj->SetValue("checkpoint", func_checkpoint, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_waitcheckpoint =
+					CefV8Value::CreateFunction("waitcheckpoint", this);
+				obj->SetValue("waitcheckpoint", func_waitcheckpoint, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_restorecheckpoint =
+					CefV8Value::CreateFunction("restorecheckpoint", this);
+				obj->SetValue("restorecheckpoint", func_restorecheckpoint, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_markdirty =
+					CefV8Value::CreateFunction("markdirty", this);
+				obj->SetValue("markdirty", func_markdirty, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_setnative =
+					CefV8Value::CreateFunction("setnative", this);
+				obj->SetValue("setnative", func_setnative, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_setposted =
+					CefV8Value::CreateFunction("setposted", this);
+				obj->SetValue("setposted", func_setposted, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> postbuf =
+					CefV8Value::CreateArrayBuffer(pMachine->getMachine()->GetPostBuf(), 4096, this);
+				obj->SetValue("postbuf", postbuf, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_setirq =
+					CefV8Value::CreateFunction("setirq", this);
+				obj->SetValue("setirq", func_setirq, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_setwidemmio =
+					CefV8Value::CreateFunction("setwidemmio", this);
+				obj->SetValue("setwidemmio", func_setwidemmio, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_setcpuid =
+					CefV8Value::CreateFunction("setcpuid", this);
+				obj->SetValue("setcpuid", func_setcpuid, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_setmsr =
+					CefV8Value::CreateFunction("setmsr", this);
+				obj->SetValue("setmsr", func_setmsr, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_setstats =
+					CefV8Value::CreateFunction("setstats", this);
+				obj->SetValue("setstats", func_setstats, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_publishstats =
+					CefV8Value::CreateFunction("publishstats", this);
+				obj->SetValue("publishstats", func_publishstats, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_dumpstats =
+					CefV8Value::CreateFunction("dumpstats", this);
+				obj->SetValue("dumpstats", func_dumpstats, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> stats =
+					CefV8Value::CreateArrayBuffer(pMachine->getMachine()->GetStats().GetBuffer(),
+						pMachine->getMachine()->GetStats().GetBufferSize(), this);
+				obj->SetValue("stats", stats, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				// Counters as doubles, updated in place by run() and service(), and their names
+				CefRefPtr<CefV8Value> counters =
+					CefV8Value::CreateArrayBuffer(pMachine->getMachine()->GetCounterBuffer(),
+						pMachine->getMachine()->GetCounterBufferSize(), this);
+				obj->SetValue("counters", counters, V8_PROPERTY_ATTRIBUTE_NONE);
+				CefRefPtr<CefV8Value> counterNames = CefV8Value::CreateArray(MACHINE_COUNTERS);
+				for (int i = 0; i < MACHINE_COUNTERS; i++) {
+					counterNames->SetValue(i, CefV8Value::CreateString(CMachine::CounterName(i)));
+				}
+				obj->SetValue("counternames", counterNames, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_starttrace =
+					CefV8Value::CreateFunction("starttrace", this);
+				obj->SetValue("starttrace", func_starttrace, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_stoptrace =
+					CefV8Value::CreateFunction("stoptrace", this);
+				obj->SetValue("stoptrace", func_stoptrace, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_snapshot =
+					CefV8Value::CreateFunction("snapshot", this);
+				obj->SetValue("snapshot", func_snapshot, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_snapshotstate =
+					CefV8Value::CreateFunction("snapshotstate", this);
+				obj->SetValue("snapshotstate", func_snapshotstate, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_seta20 =
+					CefV8Value::CreateFunction("seta20", this);
+				obj->SetValue("seta20", func_seta20, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> devstate =
+					CefV8Value::CreateArrayBuffer(pMachine->getMachine()->GetDeviceState(),
+						pMachine->getMachine()->GetDeviceStateSize(), this);
+				obj->SetValue("devstate", devstate, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_start =
+					CefV8Value::CreateFunction("start", this);
+				obj->SetValue("start", func_start, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_service =
+					CefV8Value::CreateFunction("service", this);
+				obj->SetValue("service", func_service, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> func_stop =
+					CefV8Value::CreateFunction("stop", this);
+				obj->SetValue("stop", func_stop, V8_PROPERTY_ATTRIBUTE_NONE);
+
+				CefRefPtr<CefV8Value> exitring =
+					CefV8Value::CreateArrayBuffer(pMachine->getMachine()->GetExitRing(),
+						pMachine->getMachine()->GetExitRingSize(), this);
+				obj->SetValue("exitring", exitring, V8_PROPERTY_ATTRIBUTE_NONE);
 				retval = obj;
 
 				return true;